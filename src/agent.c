@@ -0,0 +1,1242 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file agent.c
+ * Routines to stream the scans of a context to a collector.
+ *
+ * While a scan goes on, the aggregated paths are compared now and then
+ * with what was last sent, and the changes are queued as a DELTA. A
+ * thread of its own sends the queue to the collector, connecting again
+ * when the connection is lost, and releases what the collector
+ * acknowledges. When the collector is slower than the scan, deltas
+ * are put off and the changes add up into the next one, so the queue
+ * stays short. A collector that lost what it was sent, as when it
+ * was restarted, is sent the whole scan again by the sending thread,
+ * from the counters last sent. See agent.h for the protocol.
+ *
+ * \ingroup agent
+ * \{
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "walk.h"
+#include "agent.h"
+
+#define AGENT_INTERVAL  1000   /**< Milliseconds between deltas of a scan **/
+#define AGENT_CHECK     4096   /**< Entries between looking at the clock **/
+#define AGENT_QUEUE     8      /**< Messages queued before deltas are put off **/
+#define AGENT_POLL      100    /**< Milliseconds to wait for acknowledgements **/
+#define AGENT_RETRY     8      /**< Most seconds between connecting **/
+#define AGENT_TIMEOUT   30     /**< Seconds a collector may stall **/
+#define AGENT_LINGER    10     /**< Seconds to deliver what is left **/
+
+/**
+ * A growing byte buffer.
+ **/
+struct obuf {
+	uint8_t *p;            /**< The bytes **/
+	size_t len;            /**< Bytes used **/
+	size_t size;           /**< Bytes allocated **/
+	int error;             /**< There was no memory for some bytes **/
+};
+
+/**
+ * A message not yet acknowledged.
+ **/
+struct msg {
+	uint64_t seq;          /**< Its sequence number **/
+	size_t len;            /**< Length of the frame **/
+	uint8_t *p;            /**< The frame **/
+	struct msg *next;      /**< The next message **/
+};
+
+/**
+ * Streaming state of a context.
+ **/
+struct agent {
+	char *name;            /**< Name of the agent **/
+	char *where;           /**< The collector, as given **/
+	uint64_t instance;     /**< Tells this run of the agent from others **/
+	struct sockaddr_storage addr;/**< The collector **/
+	socklen_t alen;        /**< Length of addr **/
+	int verbose;           /**< Report connections **/
+
+	/* Of the thread aggregating */
+	uint64_t entries;      /**< Entries observed **/
+	uint64_t next;         /**< When the next delta is due, ms **/
+
+	/* Under slock, taken before lock */
+	pthread_mutex_t slock; /**< Protects what was sent **/
+	struct pinfo *sent;    /**< Counters sent, in path order **/
+	size_t nsent;          /**< Number of them **/
+	char *root;            /**< Path of the scan, NULL before one **/
+	time_t scantime;       /**< When it started **/
+	int ended;             /**< It finished **/
+	time_t duration;       /**< How long it took **/
+	int failed;            /**< It failed **/
+	int lost;              /**< A message of it was lost **/
+
+	/* Under lock */
+	pthread_mutex_t lock;  /**< Protects the queue and flags **/
+	pthread_cond_t cond;   /**< Signals a change of them **/
+	uint64_t seq;          /**< Last message queued **/
+	uint64_t acked;        /**< Last message acknowledged **/
+	struct msg *head;      /**< Messages not acknowledged **/
+	struct msg *tail;      /**< The last of them **/
+	struct msg *unsent;    /**< First not sent on this connection **/
+	size_t queued;         /**< Number of messages **/
+	int stop;              /**< Stop once all is acknowledged **/
+	int abandon;           /**< Stop now **/
+	int done;              /**< The sending thread stopped **/
+	pthread_t tid;         /**< The sending thread **/
+
+	/* Of the sending thread */
+	uint8_t rbuf[64];      /**< Received bytes **/
+	size_t rlen;           /**< Number of them **/
+};
+
+/**
+ * A delta being encoded.
+ **/
+struct delta {
+	struct agent *a;       /**< The agent **/
+	struct pinfo *sent;    /**< Counters now sent **/
+	size_t nsent;          /**< Number of them **/
+	size_t i;              /**< Next of the counters last sent **/
+	size_t n;              /**< Nodes encoded **/
+	char *prev;            /**< Path of the last node encoded **/
+	size_t psize;          /**< Bytes allocated for prev **/
+	struct obuf head;      /**< The count of nodes, then them **/
+	struct obuf body;      /**< The nodes **/
+	int error;             /**< There was no memory for a path **/
+};
+
+/* Internal functions */
+static void       flush(struct tdu_ctx *, int);
+static int        diff(const struct pinfo *, void *);
+static void       encode(struct delta *, const struct pinfo *,
+			 const struct pinfo *);
+static void       keep(struct delta *, const struct pinfo *, char *);
+static void       resend(struct agent *);
+static int32_t    queue_delta(struct delta *);
+static void       sent_free(struct agent *);
+static int32_t    queue(struct agent *, int, const struct obuf *);
+static void       queue_scan(struct agent *);
+static void       queue_end(struct agent *);
+static void       release(struct agent *, uint64_t);
+static void      *sender(void *);
+static int        dial(struct agent *);
+static int        acks(struct agent *, int, int);
+static int        frame(struct agent *, int *, uint64_t *);
+static int        send_all(int, const void *, size_t);
+static uint64_t   now_ms(void);
+static uint8_t   *room(struct obuf *, size_t);
+static void       bytes(struct obuf *, const void *, size_t);
+static void       varint(struct obuf *, uint64_t);
+static void       string(struct obuf *, const char *);
+
+/**
+ * Stream every following scan of a context to a collector.
+ *
+ * Nothing is sent until a scan starts, and the collector need not be
+ * listening yet: the agent connects again until it is.
+ *
+ * \param[in] ctx    The scan context.
+ * \param[in] where  The collector, a TCP host:port or a UNIX socket.
+ * \param[in] name   Name of the agent, NULL for the host name.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+int32_t
+tdu_agent(struct tdu_ctx *ctx, const char *where, const char *name)
+{
+	char host[256];
+	struct timespec ts = {0};
+	struct agent *a = NULL;
+
+	if (ctx == NULL || where == NULL || ctx->agent != NULL) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+
+	if ((a = calloc(1, sizeof(struct agent))) == NULL) {
+		return(EXIT_FAILURE);
+	}
+	if (agent_address(where, &a->addr, &a->alen)) {
+		free(a);
+		return(EXIT_FAILURE);
+	}
+	if (name == NULL) {
+		if (gethostname(host, sizeof(host)) != 0) {
+			snprintf(host, sizeof(host), "localhost");
+		}
+		host[sizeof(host) - 1] = '\0';
+		name = host;
+	}
+	if ((a->name = strdup(name)) == NULL ||
+	    (a->where = strdup(where)) == NULL) {
+		free(a->name);
+		free(a);
+		errno = ENOMEM;
+		return(EXIT_FAILURE);
+	}
+	a->verbose = ctx->opts.verbose;
+
+	/* The collector is queried at any access age, as tdud is */
+	ctx->opts.flags |= TDU_F_AGES;
+
+	/* A run that is started again is a new instance */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	a->instance = ((uint64_t)ts.tv_sec << 30 ^ (uint64_t)ts.tv_nsec) *
+		0x9e3779b97f4a7c15ULL ^ (uint64_t)getpid();
+
+	pthread_mutex_init(&a->slock, NULL);
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->cond, NULL);
+	if (pthread_create(&a->tid, NULL, sender, a) != 0) {
+		pthread_mutex_destroy(&a->slock);
+		pthread_mutex_destroy(&a->lock);
+		pthread_cond_destroy(&a->cond);
+		free(a->name);
+		free(a->where);
+		free(a);
+		errno = EAGAIN;
+		return(EXIT_FAILURE);
+	}
+	ctx->agent = a;
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Start streaming a scan, when the scan starts.
+ *
+ * \param[in] ctx  The scan context.
+ **/
+void
+agent_begin(struct tdu_ctx *ctx)
+{
+	struct agent *a = ctx->agent;
+
+	a->entries = 0;
+	a->next = now_ms() + AGENT_INTERVAL;
+
+	/* The collector drops the previous scan, so the changes are all */
+	pthread_mutex_lock(&a->slock);
+	free(a->root);
+	a->scantime = ctx->now;
+	a->ended = 0;
+	a->lost = 0;
+	sent_free(a);
+	/* Without memory for its path the scan is not streamed */
+	if ((a->root = strdup(ctx->opts.path)) != NULL) {
+		queue_scan(a);
+	}
+	pthread_mutex_unlock(&a->slock);
+}
+
+/**
+ * Stream the changes now and then, as entries are found.
+ *
+ * \param[in] ctx  The scan context.
+ **/
+void
+agent_observe(struct tdu_ctx *ctx)
+{
+	struct agent *a = ctx->agent;
+
+	if (++a->entries % AGENT_CHECK == 0 && now_ms() >= a->next) {
+		flush(ctx, 0);
+	}
+}
+
+/**
+ * Stream the changes of the aggregated paths, unless the collector is
+ * behind.
+ *
+ * \param[in] ctx  The scan context.
+ **/
+void
+agent_flush(struct tdu_ctx *ctx)
+{
+
+	flush(ctx, 0);
+}
+
+/**
+ * Finish streaming a scan.
+ *
+ * \param[in] ctx  The scan context.
+ * \param[in] rc   How the scan finished.
+ **/
+void
+agent_finish(struct tdu_ctx *ctx, int32_t rc)
+{
+	struct agent *a = ctx->agent;
+
+	if (a == NULL || a->root == NULL) {
+		return;
+	}
+
+	flush(ctx, 1);
+	pthread_mutex_lock(&a->slock);
+	a->ended = 1;
+	a->duration = time(NULL) - a->scantime;
+	a->failed = rc != EXIT_SUCCESS || a->lost;
+	queue_end(a);
+	pthread_mutex_unlock(&a->slock);
+}
+
+/**
+ * Deliver what is left and stop streaming.
+ *
+ * The collector is given AGENT_LINGER seconds to acknowledge it.
+ *
+ * \param[in] ctx  The scan context.
+ **/
+void
+agent_free(struct tdu_ctx *ctx)
+{
+	struct msg *m = NULL;
+	struct timespec ts = {0};
+	struct agent *a = ctx->agent;
+
+	if (a == NULL) {
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += AGENT_LINGER;
+	pthread_mutex_lock(&a->lock);
+	a->stop = 1;
+	pthread_cond_broadcast(&a->cond);
+	while (!a->done) {
+		if (pthread_cond_timedwait(&a->cond, &a->lock, &ts) == ETIMEDOUT) {
+			a->abandon = 1;
+			pthread_cond_broadcast(&a->cond);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&a->lock);
+	pthread_join(a->tid, NULL);
+
+	if (a->queued > 0) {
+		warnx(_("%zu messages were not delivered to %s"), a->queued,
+		      a->where);
+	}
+	while ((m = a->head) != NULL) {
+		a->head = m->next;
+		free(m->p);
+		free(m);
+	}
+	sent_free(a);
+	pthread_mutex_destroy(&a->slock);
+	pthread_mutex_destroy(&a->lock);
+	pthread_cond_destroy(&a->cond);
+	free(a->root);
+	free(a->name);
+	free(a->where);
+	free(a);
+	ctx->agent = NULL;
+}
+
+/**
+ * A counter of a node by its index.
+ *
+ * \param[in] n  The node.
+ * \param[in] i  The index, less than AGENT_NCOUNT.
+ *
+ * \retval c  The counter.
+ **/
+uint64_t *
+agent_counter(struct pinfo *n, uint32_t i)
+{
+	static const size_t scalar[] = {
+		offsetof(struct pinfo, total),
+		offsetof(struct pinfo, greater),
+		offsetof(struct pinfo, files),
+		offsetof(struct pinfo, dirs),
+		offsetof(struct pinfo, links),
+		offsetof(struct pinfo, dup),
+		offsetof(struct pinfo, comp_bytes),
+		offsetof(struct pinfo, comp_total),
+		offsetof(struct pinfo, comp_low),
+		offsetof(struct pinfo, comp_high),
+		offsetof(struct pinfo, comp_samples)
+	};
+
+	if (i < 11) {
+		return((uint64_t *)((char *)n + scalar[i]));
+	}
+	if ((i -= 11) < TDU_NAGE) {
+		return(&n->age[i]);
+	}
+	if ((i -= TDU_NAGE) < TDU_NSIZE) {
+		return(&n->size[i]);
+	}
+	if ((i -= TDU_NSIZE) < TDU_NTYPE) {
+		return(&n->type_total[i]);
+	}
+
+	return(&n->type_greater[i - TDU_NTYPE]);
+}
+
+/**
+ * Resolve a TCP host:port or a UNIX socket path.
+ *
+ * A path has a /, a host may be empty for any address, or an IPv6
+ * address in brackets.
+ *
+ * \param[in]  s    The address.
+ * \param[out] ss   The socket address.
+ * \param[out] len  Its length.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+int
+agent_address(const char *s, struct sockaddr_storage *ss, socklen_t *len)
+{
+	int rc = 0;
+	char *host = NULL;
+	const char *port = NULL;
+	struct addrinfo hints = {0};
+	struct addrinfo *res = NULL;
+	struct sockaddr_un *sun = (struct sockaddr_un *)ss;
+
+	memset(ss, 0, sizeof(*ss));
+	if (strchr(s, '/') != NULL) {
+		if (strlen(s) >= sizeof(sun->sun_path)) {
+			errno = ENAMETOOLONG;
+			return(EXIT_FAILURE);
+		}
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, s);
+		*len = sizeof(struct sockaddr_un);
+		return(EXIT_SUCCESS);
+	}
+
+	if ((port = strrchr(s, ':')) == NULL || port[1] == '\0') {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+	if ((host = strndup(s, port++ - s)) == NULL) {
+		return(EXIT_FAILURE);
+	}
+	if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+		host[strlen(host) - 1] = '\0';
+		memmove(host, host + 1, strlen(host));
+	}
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	rc = getaddrinfo(*host != '\0' ? host : NULL, port, &hints, &res);
+	free(host);
+	if (rc != 0) {
+		errno = rc == EAI_SYSTEM ? errno : EADDRNOTAVAIL;
+		return(EXIT_FAILURE);
+	}
+	memcpy(ss, res->ai_addr, res->ai_addrlen);
+	*len = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Queue the changes of the aggregated paths since the last delta.
+ *
+ * \param[in] ctx    The scan context.
+ * \param[in] force  Queue them even when the collector is behind.
+ **/
+static void
+flush(struct tdu_ctx *ctx, int force)
+{
+	int behind = 0;
+	struct delta d = {0};
+	struct agent *a = ctx->agent;
+
+	a->next = now_ms() + AGENT_INTERVAL;
+
+	pthread_mutex_lock(&a->slock);
+	pthread_mutex_lock(&a->lock);
+	behind = !force && a->queued >= AGENT_QUEUE;
+	pthread_mutex_unlock(&a->lock);
+	if (a->root == NULL || behind) {
+		/* Changes add up while the collector is behind */
+		pthread_mutex_unlock(&a->slock);
+		return;
+	}
+
+	d.a = a;
+	tdu_visit(ctx, diff, &d);
+	for (; d.i < a->nsent; ++d.i) {
+		encode(&d, NULL, &a->sent[d.i]);
+		free(a->sent[d.i].path);
+	}
+	free(a->sent);
+	a->sent = d.sent;
+	a->nsent = d.nsent;
+	if (queue_delta(&d)) {
+		/* The collector starts over, every path sent is new */
+		sent_free(a);
+		a->lost = 1;
+		queue_scan(a);
+	}
+	pthread_mutex_unlock(&a->slock);
+}
+
+/**
+ * Encode the change of a path, called back in path order.
+ *
+ * The paths last sent are walked along, those before it were removed.
+ *
+ * \param[in] n    The aggregated path.
+ * \param[in] arg  The delta.
+ *
+ * \retval 0 Always, to visit every path.
+ **/
+static int
+diff(const struct pinfo *n, void *arg)
+{
+	int c = 0;
+	struct delta *d = arg;
+	struct agent *a = d->a;
+
+	while (d->i < a->nsent && (c = tdu_cmp(&a->sent[d->i], n)) < 0) {
+		encode(d, NULL, &a->sent[d->i]);
+		free(a->sent[d->i++].path);
+	}
+	if (d->i < a->nsent && c == 0) {
+		encode(d, n, &a->sent[d->i]);
+		keep(d, n, a->sent[d->i++].path);
+	} else {
+		encode(d, n, NULL);
+		keep(d, n, strdup(n->path));
+	}
+
+	return(0);
+}
+
+/**
+ * Encode the change of a path, unless there is none.
+ *
+ * \param[in] d     The delta.
+ * \param[in] n     The path now, NULL when it was removed.
+ * \param[in] last  The path last sent, NULL when it is new.
+ **/
+static void
+encode(struct delta *d, const struct pinfo *n, const struct pinfo *last)
+{
+	uint32_t i = 0;
+	uint32_t nz = 0;
+	uint32_t prev = 0;
+	size_t same = 0;
+	int64_t v[AGENT_NCOUNT];
+	char *p = NULL;
+	const char *path = n != NULL ? n->path : last->path;
+
+	for (i = 0; i < AGENT_NCOUNT; ++i) {
+		v[i] = (int64_t)((n != NULL ? *agent_counter((struct pinfo *)n, i) : 0) -
+				 (last != NULL ? *agent_counter((struct pinfo *)last, i) : 0));
+		nz += v[i] != 0;
+	}
+	if (nz == 0) {
+		return;
+	}
+
+	/* Paths come in order, so each mostly shares the one before */
+	if (d->n > 0) {
+		while (d->prev[same] != '\0' && d->prev[same] == path[same]) {
+			++same;
+		}
+	}
+	varint(&d->body, same);
+	string(&d->body, path + same);
+	varint(&d->body, (uint64_t)(n != NULL ? n->level : last->level));
+	varint(&d->body, nz);
+	for (i = 0; i < AGENT_NCOUNT; ++i) {
+		if (v[i] != 0) {
+			varint(&d->body, i - prev);
+			varint(&d->body, (uint64_t)v[i] << 1 ^ (uint64_t)(v[i] >> 63));
+			prev = i;
+		}
+	}
+	if (strlen(path) + 1 > d->psize) {
+		if ((p = realloc(d->prev, 2 * (strlen(path) + 1))) == NULL) {
+			d->error = 1;
+			return;
+		}
+		d->prev = p;
+		d->psize = 2 * (strlen(path) + 1);
+	}
+	strcpy(d->prev, path);
+	++d->n;
+}
+
+/**
+ * Keep the counters of a path as sent.
+ *
+ * \param[in] d     The delta.
+ * \param[in] n     The path.
+ * \param[in] path  Its path, now owned by the counters sent, or NULL
+ *                  when there was no memory for it.
+ **/
+static void
+keep(struct delta *d, const struct pinfo *n, char *path)
+{
+	struct pinfo *sent = NULL;
+
+	if (path == NULL) {
+		d->error = 1;
+		return;
+	}
+	if (d->nsent % 1024 == 0) {
+		if ((sent = realloc(d->sent, (d->nsent + 1024) *
+				    sizeof(struct pinfo))) == NULL) {
+			d->error = 1;
+			free(path);
+			return;
+		}
+		d->sent = sent;
+	}
+	d->sent[d->nsent] = *n;
+	d->sent[d->nsent].path = path;
+	++d->nsent;
+}
+
+/**
+ * Queue the whole scan again from the counters last sent, with slock
+ * held.
+ *
+ * \param[in] a  The agent.
+ **/
+static void
+resend(struct agent *a)
+{
+	size_t i = 0;
+	struct delta d = {0};
+
+	if (a->root == NULL) {
+		return;
+	}
+
+	queue_scan(a);
+	d.a = a;
+	for (i = 0; i < a->nsent; ++i) {
+		encode(&d, &a->sent[i], NULL);
+	}
+	if (queue_delta(&d)) {
+		/* The next delta sends every path again */
+		sent_free(a);
+		a->lost = 1;
+	}
+	if (a->ended) {
+		queue_end(a);
+	}
+}
+
+/**
+ * Queue an encoded delta, unless it is empty, and release it.
+ *
+ * \param[in] d  The delta.
+ *
+ * \retval 0 If the delta was queued.
+ * \retval 1 If there was no memory for it, nothing was queued.
+ **/
+static int32_t
+queue_delta(struct delta *d)
+{
+	int32_t rc = EXIT_SUCCESS;
+
+	if (d->error || d->body.error) {
+		rc = EXIT_FAILURE;
+	} else if (d->n > 0) {
+		varint(&d->head, d->n);
+		bytes(&d->head, d->body.p, d->body.len);
+		rc = d->head.error ? EXIT_FAILURE :
+			queue(d->a, F_DELTA, &d->head);
+	}
+	free(d->head.p);
+	free(d->body.p);
+	free(d->prev);
+
+	return(rc);
+}
+
+/**
+ * Release the counters sent.
+ *
+ * \param[in] a  The agent.
+ **/
+static void
+sent_free(struct agent *a)
+{
+	size_t i = 0;
+
+	for (i = 0; i < a->nsent; ++i) {
+		free(a->sent[i].path);
+	}
+	free(a->sent);
+	a->sent = NULL;
+	a->nsent = 0;
+}
+
+/**
+ * Queue a message with the next sequence number.
+ *
+ * \param[in] a     The agent.
+ * \param[in] type  Its type.
+ * \param[in] body  What follows the sequence number.
+ *
+ * \retval 0 If the message was queued.
+ * \retval 1 If there was no memory for it.
+ **/
+static int32_t
+queue(struct agent *a, int type, const struct obuf *body)
+{
+	uint8_t t = type;
+	struct obuf o = {0};
+	struct msg *m = NULL;
+
+	/* Room for all of it, so the frame is complete when it is made */
+	if (body->error || (m = calloc(1, sizeof(struct msg))) == NULL ||
+	    room(&o, body->len + 16) == NULL) {
+		free(m);
+		return(EXIT_FAILURE);
+	}
+
+	pthread_mutex_lock(&a->lock);
+	m->seq = ++a->seq;
+	o.len = 4;
+	bytes(&o, &t, 1);
+	varint(&o, m->seq);
+	bytes(&o, body->p, body->len);
+	o.p[0] = (uint8_t)(o.len - 4);
+	o.p[1] = (uint8_t)((o.len - 4) >> 8);
+	o.p[2] = (uint8_t)((o.len - 4) >> 16);
+	o.p[3] = (uint8_t)((o.len - 4) >> 24);
+	m->p = o.p;
+	m->len = o.len;
+
+	if (a->tail != NULL) {
+		a->tail->next = m;
+	} else {
+		a->head = m;
+	}
+	a->tail = m;
+	if (a->unsent == NULL) {
+		a->unsent = m;
+	}
+	++a->queued;
+	pthread_cond_broadcast(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Queue the start of the scan.
+ *
+ * \param[in] a  The agent.
+ **/
+static void
+queue_scan(struct agent *a)
+{
+	struct obuf o = {0};
+
+	varint(&o, (uint64_t)a->scantime);
+	string(&o, a->root);
+	if (queue(a, F_SCAN, &o)) {
+		a->lost = 1;
+	}
+	free(o.p);
+}
+
+/**
+ * Queue the end of the scan.
+ *
+ * \param[in] a  The agent.
+ **/
+static void
+queue_end(struct agent *a)
+{
+	struct obuf o = {0};
+
+	varint(&o, (uint64_t)a->duration);
+	varint(&o, (uint64_t)a->failed);
+	if (queue(a, F_END, &o)) {
+		a->lost = 1;
+	}
+	free(o.p);
+}
+
+/**
+ * Release the messages acknowledged, with the lock held.
+ *
+ * \param[in] a    The agent.
+ * \param[in] seq  The last message applied.
+ **/
+static void
+release(struct agent *a, uint64_t seq)
+{
+	struct msg *m = NULL;
+
+	while ((m = a->head) != NULL && m->seq <= seq) {
+		if ((a->head = m->next) == NULL) {
+			a->tail = NULL;
+		}
+		if (a->unsent == m) {
+			a->unsent = m->next;
+		}
+		free(m->p);
+		free(m);
+		--a->queued;
+	}
+	if (seq > a->acked) {
+		a->acked = seq;
+	}
+	pthread_cond_broadcast(&a->cond);
+}
+
+/**
+ * Send the queue to the collector, in a thread of its own.
+ *
+ * \param[in] arg  The agent.
+ *
+ * \retval NULL Always.
+ **/
+static void *
+sender(void *arg)
+{
+	int fd = -1;
+	uint32_t wait = 1;
+	struct msg *m = NULL;
+	struct pollfd pfd = {0};
+	struct timespec ts = {0};
+	struct agent *a = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&a->lock);
+		if (a->abandon || (a->stop && a->head == NULL)) {
+			pthread_mutex_unlock(&a->lock);
+			break;
+		}
+		pthread_mutex_unlock(&a->lock);
+
+		if (fd < 0 && (fd = dial(a)) < 0) {
+			/* Wait a little longer each time */
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += wait;
+			pthread_mutex_lock(&a->lock);
+			if (!a->abandon) {
+				pthread_cond_timedwait(&a->cond, &a->lock, &ts);
+			}
+			pthread_mutex_unlock(&a->lock);
+			wait = wait < AGENT_RETRY ? 2 * wait : AGENT_RETRY;
+			continue;
+		}
+		wait = 1;
+
+		pthread_mutex_lock(&a->lock);
+		if ((m = a->unsent) != NULL) {
+			a->unsent = m->next;
+		}
+		pthread_mutex_unlock(&a->lock);
+
+		/* Only this thread releases messages, so m stays */
+		if (m != NULL && send_all(fd, m->p, m->len) != 0) {
+			close(fd);
+			fd = -1;
+			continue;
+		}
+
+		/* Acknowledgements, waited for when all is sent */
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, m != NULL ? 0 : AGENT_POLL) > 0 &&
+		    acks(a, fd, 0) != 0) {
+			if (a->verbose) {
+				warnx(_("lost the connection to %s"), a->where);
+			}
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+	pthread_mutex_lock(&a->lock);
+	a->done = 1;
+	pthread_cond_broadcast(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+
+	return(NULL);
+}
+
+/**
+ * Connect to the collector and agree where to resume.
+ *
+ * \param[in] a  The agent.
+ *
+ * \retval fd  The connection.
+ * \retval -1  If there was an error.
+ **/
+static int
+dial(struct agent *a)
+{
+	int fd = -1;
+	int on = 1;
+	int type = 0;
+	int resync = 0;
+	uint8_t t = F_HELLO;
+	int rc = 0;
+	uint64_t seq = 0;
+	struct obuf o = {0};
+	struct timeval tv = {AGENT_TIMEOUT, 0};
+
+	if ((fd = socket(a->addr.ss_family, SOCK_STREAM, 0)) < 0) {
+		return(-1);
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (a->addr.ss_family != AF_UNIX) {
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+	if (connect(fd, (struct sockaddr *)&a->addr, a->alen) < 0) {
+		close(fd);
+		return(-1);
+	}
+
+	if (room(&o, 64) == NULL) {
+		close(fd);
+		return(-1);
+	}
+	o.len = 4;
+	bytes(&o, &t, 1);
+	varint(&o, AGENT_MAGIC);
+	string(&o, a->name);
+	varint(&o, a->instance);
+	if (o.error) {
+		free(o.p);
+		close(fd);
+		return(-1);
+	}
+	o.p[0] = (uint8_t)(o.len - 4);
+	o.p[1] = (uint8_t)((o.len - 4) >> 8);
+	o.p[2] = (uint8_t)((o.len - 4) >> 16);
+	o.p[3] = (uint8_t)((o.len - 4) >> 24);
+	rc = send_all(fd, o.p, o.len);
+	free(o.p);
+
+	a->rlen = 0;
+	while (rc == 0 && (rc = frame(a, &type, &seq)) == 0) {
+		rc = acks(a, fd, 1);
+	}
+	if (rc != 1 || type != F_WELCOME) {
+		close(fd);
+		return(-1);
+	}
+
+	/* No delta is queued meanwhile, it would follow what was lost */
+	pthread_mutex_lock(&a->slock);
+	pthread_mutex_lock(&a->lock);
+	resync = seq > a->seq || seq < a->acked;
+	if (resync) {
+		/* It lost what it was sent, or never had it */
+		release(a, UINT64_MAX);
+		a->seq = a->acked = seq;
+	} else {
+		release(a, seq);
+	}
+	pthread_mutex_unlock(&a->lock);
+	if (resync) {
+		resend(a);
+	}
+	pthread_mutex_lock(&a->lock);
+	a->unsent = a->head;
+	pthread_cond_broadcast(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+	pthread_mutex_unlock(&a->slock);
+
+	if (a->verbose) {
+		warnx(_("connected to %s, from message %llu"), a->where,
+		      (unsigned long long)seq + 1);
+	}
+
+	return(fd);
+}
+
+/**
+ * Read acknowledgements from the collector.
+ *
+ * \param[in] a      The agent.
+ * \param[in] fd     The connection.
+ * \param[in] block  Wait for bytes, leaving them to be parsed.
+ *
+ * \retval 0  If there were no errors.
+ * \retval -1 If the connection was lost or is broken.
+ **/
+static int
+acks(struct agent *a, int fd, int block)
+{
+	int rc = 0;
+	int type = 0;
+	ssize_t n = 0;
+	uint64_t seq = 0;
+
+	n = recv(fd, a->rbuf + a->rlen, sizeof(a->rbuf) - a->rlen,
+		 block ? 0 : MSG_DONTWAIT);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+		return(-1);
+	}
+	if (n > 0) {
+		a->rlen += n;
+	}
+	if (block) {
+		return(0);
+	}
+
+	while ((rc = frame(a, &type, &seq)) == 1) {
+		if (type != F_ACK) {
+			return(-1);
+		}
+		pthread_mutex_lock(&a->lock);
+		release(a, seq);
+		pthread_mutex_unlock(&a->lock);
+	}
+
+	return(rc);
+}
+
+/**
+ * Take a frame of a sequence number from the bytes received.
+ *
+ * \param[in]  a     The agent.
+ * \param[out] type  Its type.
+ * \param[out] seq   The sequence number.
+ *
+ * \retval 1  If a frame was taken.
+ * \retval 0  If more bytes are needed.
+ * \retval -1 If it is malformed.
+ **/
+static int
+frame(struct agent *a, int *type, uint64_t *seq)
+{
+	size_t i = 0;
+	uint32_t len = 0;
+	uint32_t shift = 0;
+
+	if (a->rlen < 4) {
+		return(0);
+	}
+	len = a->rbuf[0] | a->rbuf[1] << 8 | a->rbuf[2] << 16 |
+		(uint32_t)a->rbuf[3] << 24;
+	if (len < 2 || len > sizeof(a->rbuf) - 4) {
+		return(-1);
+	}
+	if (a->rlen < 4 + len) {
+		return(0);
+	}
+
+	*type = a->rbuf[4];
+	*seq = 0;
+	for (i = 5; i < 4 + len && shift < 64; ++i, shift += 7) {
+		*seq |= (uint64_t)(a->rbuf[i] & 0x7f) << shift;
+		if (!(a->rbuf[i] & 0x80)) {
+			break;
+		}
+	}
+	if (i == 4 + len || shift >= 64) {
+		return(-1);
+	}
+
+	memmove(a->rbuf, a->rbuf + 4 + len, a->rlen - 4 - len);
+	a->rlen -= 4 + len;
+
+	return(1);
+}
+
+/**
+ * Send all of a buffer.
+ *
+ * \retval 0  If there were no errors.
+ * \retval -1 If there was an error, errno is set.
+ **/
+static int
+send_all(int fd, const void *p, size_t n)
+{
+	ssize_t w = 0;
+	const uint8_t *b = p;
+
+	while (n > 0) {
+		if ((w = send(fd, b, n, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return(-1);
+		}
+		b += w;
+		n -= w;
+	}
+
+	return(0);
+}
+
+/**
+ * Monotonic time in milliseconds.
+ **/
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/**
+ * Make room for more bytes at the end of a buffer.
+ *
+ * \param[in,out] o  The buffer.
+ * \param[in]     n  Number of bytes.
+ *
+ * \retval p     Where they go, the length is not changed.
+ * \retval NULL  If there was no memory, the buffer error is set.
+ **/
+static uint8_t *
+room(struct obuf *o, size_t n)
+{
+	size_t size = o->size;
+	uint8_t *p = NULL;
+
+	if (o->len + n > o->size) {
+		size = size ? size : 4096;
+		while (o->len + n > size) {
+			size *= 2;
+		}
+		if ((p = realloc(o->p, size)) == NULL) {
+			o->error = 1;
+			return(NULL);
+		}
+		o->p = p;
+		o->size = size;
+	}
+
+	return(o->p + o->len);
+}
+
+/**
+ * Append bytes to a buffer.
+ **/
+static void
+bytes(struct obuf *o, const void *p, size_t n)
+{
+	uint8_t *q = NULL;
+
+	if ((q = room(o, n)) == NULL) {
+		return;
+	}
+	memcpy(q, p, n);
+	o->len += n;
+}
+
+/**
+ * Append an unsigned LEB128 varint to a buffer.
+ **/
+static void
+varint(struct obuf *o, uint64_t v)
+{
+	uint8_t *p = NULL;
+
+	if ((p = room(o, 10)) == NULL) {
+		return;
+	}
+
+	while (v >= 0x80) {
+		*p++ = (uint8_t)(v | 0x80);
+		v >>= 7;
+		++o->len;
+	}
+	*p = (uint8_t)v;
+	++o->len;
+}
+
+/**
+ * Append a string, its length and its bytes, to a buffer.
+ **/
+static void
+string(struct obuf *o, const char *s)
+{
+	size_t n = strlen(s);
+
+	varint(o, n);
+	bytes(o, s, n);
+}
+
+/**
+ * \}
+ **/
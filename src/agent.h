@@ -0,0 +1,111 @@
+/* BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file agent.h
+ * Internal definitions for streaming scans to a collector.
+ *
+ * An agent and a collector talk in frames of a 4 byte little endian
+ * length, a type byte and a body of unsigned LEB128 varints and
+ * strings, each a varint length and its bytes:
+ *
+ *     HELLO    name, instance          agent to collector, on connecting
+ *     WELCOME  seq                     the last message applied
+ *     SCAN     seq, scan time, path    a scan started, it replaces the
+ *                                      previous one of the agent
+ *     DELTA    seq, count, nodes       changes of the aggregated paths
+ *     END      seq, duration, failed   the scan finished
+ *     ACK      seq                     the last message applied
+ *
+ * Every message of an agent after HELLO has the next sequence number.
+ * The collector applies each once, in order, and the agent keeps it
+ * until acknowledged, sending again what was not applied when it
+ * reconnects. A node of a DELTA is its path, as the length shared
+ * with the path before and the rest, its level and the counters that
+ * changed, as a count and pairs of the gap from the previous counter
+ * and the zigzag encoded change.
+ *
+ * \ingroup agent
+ * \{
+ **/
+
+#ifndef TDU_AGENT_H
+#define TDU_AGENT_H
+
+#include <sys/socket.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define AGENT_MAGIC     0x31554454  /**< "TDU1" **/
+#define AGENT_FRAME_MAX (1 << 26)   /**< Largest frame **/
+
+/** Counters of a node, see agent_counter() **/
+#define AGENT_NCOUNT    (11 + TDU_NAGE + TDU_NSIZE + 2 * TDU_NTYPE)
+
+/**
+ * Frame types.
+ **/
+enum agent_frame { F_HELLO = 1, F_WELCOME, F_SCAN, F_DELTA, F_END, F_ACK };
+
+struct agent;
+
+/* Start streaming a scan, when the scan starts */
+void agent_begin(struct tdu_ctx *);
+
+/* Stream the changes now and then, as entries are found */
+void agent_observe(struct tdu_ctx *);
+
+/* Stream the changes of the aggregated paths */
+void agent_flush(struct tdu_ctx *);
+
+/* Finish streaming a scan */
+void agent_finish(struct tdu_ctx *, int32_t);
+
+/* Deliver what is left and stop streaming */
+void agent_free(struct tdu_ctx *);
+
+/* A counter of a node by its index */
+uint64_t *agent_counter(struct pinfo *, uint32_t);
+
+/* Resolve a TCP host:port or a UNIX socket path */
+int agent_address(const char *, struct sockaddr_storage *, socklen_t *);
+
+#ifdef __cplusplus
+}                               /* extern "C" */
+#endif
+
+#endif                          /* TDU_AGENT_H */
+/**
+ * \}
+ **/
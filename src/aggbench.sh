@@ -0,0 +1,93 @@
+#!/bin/sh
+#
+# Measure how the threaded walk scales with the number of stat workers,
+# each aggregating into its own shard of the tree.
+#
+# usage: aggbench.sh [-m depth] directory [threads ...]
+#
+# Run from the build directory after make. Each scan is run twice and
+# the faster kept, so the directory is in the cache. The results of
+# every thread count are checked against the serial walk. When perf is
+# installed, the last level cache misses per entry are shown as well;
+# with the aggregation sharded they stay flat as threads are added,
+# as the workers write to no cache line in common.
+#
+
+depth=100
+while getopts "m:" opt; do
+	case $opt in
+		m) depth=$OPTARG ;;
+		*) exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -lt 1 ]; then
+	echo "usage: $0 [-m depth] directory [threads ...]" >&2
+	exit 1
+fi
+dir=$1
+shift
+[ $# -gt 0 ] || set -- 1 2 4 8 16
+
+here=$(dirname "$0")
+tdu=$here/tdu
+if [ ! -x "$tdu" ]; then
+	echo "$0: build tdu first" >&2
+	exit 1
+fi
+perf=$(command -v perf)
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+entries=$(find "$dir" -xdev | wc -l)
+"$tdu" -a 0 -m "$depth" "$dir" > "$tmp/serial" 2>/dev/null
+
+# Seconds the faster of two scans of dir with $1 threads takes
+scan() {
+	best=
+	for i in 1 2; do
+		start=$(date +%s.%N)
+		"$tdu" -a 0 -m "$depth" -j "$1" "$dir" > "$tmp/out" 2>/dev/null
+		end=$(date +%s.%N)
+		t=$(echo "$start $end" | awk '{ printf "%.3f", $2 - $1 }')
+		if [ -z "$best" ] ||
+		   [ "$(echo "$t $best" | awk '{ print $1 < $2 }')" = 1 ]; then
+			best=$t
+		fi
+	done
+	echo "$best"
+}
+
+# Last level cache misses of a scan of dir with $1 threads
+misses() {
+	if [ -z "$perf" ]; then
+		echo 0
+		return
+	fi
+	"$perf" stat -x, -e LLC-load-misses -- \
+		"$tdu" -a 0 -m "$depth" -j "$1" "$dir" 2>&1 >/dev/null |
+		awk -F, '/LLC-load-misses/ { print $1 + 0 }'
+}
+
+# Milliseconds the merge of the shards took
+merge() {
+	"$tdu" -v -a 0 -m "$depth" -j "$1" "$dir" 2>&1 >/dev/null |
+		awk '/merged in/ { print $(NF-1) }'
+}
+
+printf "%s: %d entries, %d cpus\n" "$dir" "$entries" "$(nproc)"
+printf "%8s %10s %12s %8s %10s %12s %6s\n" "threads" "time [s]" \
+	"rate [1/s]" "speedup" "merge [ms]" "misses/entry" "same"
+base=
+for j in "$@"; do
+	t=$(scan "$j")
+	[ -n "$base" ] || base=$t
+	same=yes
+	cmp -s "$tmp/serial" "$tmp/out" || same=no
+	m=$(merge "$j")
+	c=$(misses "$j")
+	echo "$j $t $base $entries ${m:-0} ${c:-0} $same" | awk '{
+		printf "%8d %10.3f %12.0f %8.2f %10.1f %12.2f %6s\n",
+		       $1, $2, $4 / $2, $3 / $2, $5, $6 / $4, $7 }'
+done
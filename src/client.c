@@ -0,0 +1,236 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file client.c
+ * Routines to report disk usage from a tdud daemon.
+ *
+ * \ingroup client
+ * \{
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <sysexits.h>
+#include <err.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "extern.h"
+#include "mem.h"
+#include "report.h"
+#include "client.h"
+
+/**
+ * Query a daemon for the options path and print the report.
+ *
+ * \param[in] sockpath  The daemon socket.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted.
+ **/
+int32_t
+client(const char *sockpath)
+{
+	int fd = -1;
+	int i = 0;
+	size_t n = 0;
+	ssize_t len = 0;
+	char *buf = NULL;
+	char *path = NULL;
+	char *tab = NULL;
+	FILE *fp = NULL;
+	long long age = 0;
+	long long scantime = 0;
+	unsigned int b = 0;
+	int32_t t = 0;
+	unsigned long long count = 0;
+	unsigned long long old = 0;
+	char name[64];
+	size_t j = 0;
+	size_t nrows = 0;
+	struct pinfo node = {0};
+	struct pinfo all = {0};
+	struct pinfo *rows = NULL;
+	struct pinfo **order = NULL;
+	struct sockaddr_un sun = {0};
+	int32_t rc = EXIT_FAILURE;
+
+	if (strlen(sockpath) >= sizeof(sun.sun_path)) {
+		warnx(_("socket path %s is too long"), sockpath);
+		return(EXIT_FAILURE);
+	}
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, sockpath);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	    connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		warn(_("unable to connect to %s"), sockpath);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return(EXIT_FAILURE);
+	}
+
+	/* The daemon holds absolute paths */
+	if ((path = realpath(options.path, NULL)) == NULL) {
+		path = strdup(options.path);
+	}
+
+	if ((fp = fdopen(fd, "r")) == NULL) {
+		close(fd);
+		free(path);
+		return(EXIT_FAILURE);
+	}
+	dprintf(fd, "query depth=%u units=%s cost=%f atime=%d path=%s\n",
+		options.maxdepth, options.units, options.cost,
+		options.atime_days, path);
+	shutdown(fd, SHUT_WR);
+
+	if ((len = getline(&buf, &n, fp)) <= 0) {
+		warnx(_("no reply from %s"), sockpath);
+	} else if (strncmp(buf, "ok ", 3) != 0) {
+		buf[strcspn(buf, "\n")] = '\0';
+		warnx(_("query of %s failed: %s"), path,
+		      strncmp(buf, "error ", 6) == 0 ? buf + 6 : buf);
+	} else if (sscanf(buf, "ok %lld %lld %d", &scantime, &age,
+			  &options.atime_days) != 3) {
+		warnx(_("malformed reply from %s"), sockpath);
+	} else {
+		printf(_("Scanned %lld seconds ago\n"), age);
+		report_header();
+		while ((len = getline(&buf, &n, fp)) > 0) {
+			buf[strcspn(buf, "\n")] = '\0';
+			memset(&node, 0, sizeof(node));
+			if (sscanf(buf, "%d\t%llu\t%llu\t%*f\t%llu\t%llu\t%llu",
+				   &node.level,
+				   (unsigned long long *)&node.total,
+				   (unsigned long long *)&node.greater,
+				   (unsigned long long *)&node.files,
+				   (unsigned long long *)&node.dirs,
+				   (unsigned long long *)&node.links) != 6) {
+				continue;
+			}
+			/* The size histogram is the eighth field */
+			for (i = 0, tab = buf; i < 7 && tab != NULL; ++i) {
+				if ((tab = strchr(tab, '\t')) != NULL) {
+					++tab;
+				}
+			}
+			if (tab == NULL) {
+				continue;
+			}
+			while (sscanf(tab, "%u:%llu", &b, &count) == 2) {
+				if (b < TDU_NSIZE) {
+					node.size[b] = count;
+				}
+				tab += strcspn(tab, ",\t");
+				if (*tab == ',') {
+					++tab;
+				}
+			}
+			/* The file types are the ninth field */
+			if ((tab = strchr(tab, '\t')) == NULL) {
+				continue;
+			}
+			++tab;
+			while (sscanf(tab, "%63[^:,\t]:%llu:%llu", name, &count,
+				      &old) == 3) {
+				if ((t = tdu_type_find(name)) >= 0) {
+					node.type_total[t] = count;
+					node.type_greater[t] = old;
+				}
+				tab += strcspn(tab, ",\t");
+				if (*tab == ',') {
+					++tab;
+				}
+			}
+			/* The path is everything after the ninth tab */
+			if ((tab = strchr(tab, '\t')) == NULL) {
+				continue;
+			}
+			++tab;
+			node.path = strdup(tab);
+			if (nrows % 1024 == 0) {
+				rows = xrealloc(rows, (nrows + 1024) *
+						sizeof(struct pinfo));
+			}
+			rows[nrows++] = node;
+		}
+
+		/* The rows come sorted, so their subtrees can be totalled */
+		order = xmalloc((nrows + 1) * sizeof(struct pinfo *));
+		for (j = 0; j < nrows; ++j) {
+			order[j] = &rows[j];
+		}
+		if (tdu_rollup(order, nrows)) {
+			err(EX_SOFTWARE, _("unable to total the subtrees"));
+		}
+		free(order);
+		for (j = 0; j < nrows; ++j) {
+			report_node(&rows[j]);
+			report_add_types(&rows[j], &all);
+			free(rows[j].path);
+		}
+		free(rows);
+		if (columns & COL_TYPES) {
+			report_types(&all);
+		}
+		rc = EXIT_SUCCESS;
+	}
+
+	free(buf);
+	free(path);
+	fclose(fp);
+
+	return(rc);
+}
+
+/**
+ * \}
+ **/
@@ -0,0 +1,1030 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file collect.c
+ * The collect sub-command, merging the scans streamed by agents.
+ *
+ * The collector listens for agents, see agent.h, and adds the deltas
+ * each streams into a tree of its own and into one tree of every
+ * path, the scan an agent starts replacing its previous one. It
+ * answers the requests of tdud on a UNIX socket, so the merged tree is
+ * reported with tdu -s:
+ *
+ *     query [depth=n] [units=u] [cost=c] [atime=n] path=<path>
+ *     status
+ *
+ * A status reply is a status line followed by one line per agent:
+ *
+ *     ok <agents>
+ *     <scan time>\t<age>\t<duration>\t<paths>\t<state>\t<link>\t<name>\t<root>
+ *
+ * where state is idle before a scan, scanning, done or failed, and
+ * link is up while the agent is connected and down otherwise.
+ *
+ * \ingroup collect
+ * \{
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <search.h>
+#include <signal.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "extern.h"
+#include "mem.h"
+#include "walk.h"
+#include "snapshot.h"
+#include "agent.h"
+#include "collect.h"
+
+#define COLLECT_READ    (1 << 16)   /**< Bytes read from an agent at once **/
+#define REQUEST_MAX     (PATH_MAX + 128)
+
+/**
+ * What an agent is doing.
+ **/
+enum state { ST_IDLE, ST_SCANNING, ST_DONE, ST_FAILED };
+
+/**
+ * An agent.
+ **/
+struct source {
+	char *name;            /**< Its name **/
+	uint64_t instance;     /**< The run of the agent streaming **/
+	uint64_t seq;          /**< Last message applied **/
+	char *root;            /**< Path of its scan, NULL before one **/
+	time_t scantime;       /**< When the scan started **/
+	time_t duration;       /**< How long it took **/
+	enum state state;      /**< What it is doing **/
+	void *nodes;           /**< Its paths **/
+	size_t n;              /**< Number of them **/
+	struct conn *conn;     /**< Its connection, or NULL **/
+};
+
+/**
+ * A connection of an agent.
+ **/
+struct conn {
+	int fd;                /**< The socket **/
+	struct source *src;    /**< The agent, NULL before HELLO **/
+	uint8_t *buf;          /**< Bytes received **/
+	size_t len;            /**< Number of them **/
+	size_t size;           /**< Bytes allocated **/
+	uint64_t acked;        /**< Last message acknowledged **/
+};
+
+/* Internal functions */
+static void       print_usage(void);
+static int        listen_at(const char *);
+static void       enter(int);
+static void       leave(size_t);
+static int        receive(struct conn *);
+static int        handle(struct conn *, int, const uint8_t *,
+			 const uint8_t *);
+static int        hello(struct conn *, const uint8_t *, const uint8_t *);
+static int        delta(struct source *, const uint8_t *, const uint8_t *,
+			int);
+static int        add(void **, const struct pinfo *);
+static void       drop(struct source *);
+static void       unmerge(const void *, VISIT, int);
+static int        reply(int, int, uint64_t);
+static void       serve(int);
+static void       query(FILE *, char *);
+static void       status(FILE *);
+static void       ancestors(struct snapshot *);
+static int        get(const uint8_t **, const uint8_t *, uint64_t *);
+static int        get_str(const uint8_t **, const uint8_t *, const char **,
+			  size_t *);
+static void       stop(int);
+
+static struct tdu_ctx *merged = NULL;  /**< Every path of every agent **/
+static struct source **sources = NULL; /**< The agents **/
+static size_t nsources = 0;            /**< Number of them **/
+static struct conn **conns = NULL;     /**< Their connections **/
+static size_t nconns = 0;              /**< Number of them **/
+static struct snapshot *snap = NULL;   /**< The tree as last queried **/
+static int changed = 0;                /**< The tree changed since **/
+static char *pbuf = NULL;              /**< Path of a delta node **/
+static size_t pbufsize = 0;            /**< Size of pbuf **/
+static volatile sig_atomic_t done = 0; /**< Set on termination **/
+
+/**
+ * The collect sub-command.
+ *
+ * \param argc  Number of arguments, the first is "collect".
+ * \param argv  The arguments.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted.
+ **/
+int32_t
+collect_main(int32_t argc, char **argv)
+{
+	int afd = -1;
+	int qfd = -1;
+	int32_t opt = 0;
+	int32_t opt_index = 0;
+	size_t i = 0;
+	size_t n = 0;
+	char *sockpath = COLLECT_SOCKET;
+	struct tdu_opts opts = options;
+	struct pollfd *pfd = NULL;
+	struct sigaction sa = {0};
+	char *soptions = "hvs:T:";		/* short options structure */
+	static struct option loptions[] = {	/* long options structure */
+		{"help",     no_argument,       NULL, 'h'},
+		{"verbose",  no_argument,       NULL, 'v'},
+		{"socket",   required_argument, NULL, 's'},
+		{"type-table",required_argument,NULL, 'T'},
+		{NULL,       0,                 NULL,  0}
+	};
+
+	while ((opt = getopt_long(argc, argv, soptions, loptions,
+			    &opt_index)) != -1) {
+		switch (opt) {
+			case 'v':
+				options.verbose = 1;
+				break;
+			case 's':
+				sockpath = optarg;
+				break;
+			case 'T':
+				if (tdu_type_load(optarg)) {
+					err(EX_DATAERR, _("unable to load types from %s"),
+					    optarg);
+				}
+				break;
+			default:
+				print_usage();
+				break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) {
+		print_usage();
+	}
+	if (strchr(sockpath, '/') == NULL) {
+		warnx(_("error: the socket must be a path"));
+		print_usage();
+	}
+
+	/* The merged tree holds absolute paths at any depth */
+	opts.path = "/";
+	opts.maxdepth = PATH_MAX;
+	if ((merged = tdu_create(&opts)) == NULL) {
+		err(EX_SOFTWARE, _("unable to create the merged tree"));
+	}
+
+	sa.sa_handler = stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	if ((afd = listen_at(argv[0])) < 0) {
+		exit(EX_OSERR);
+	}
+	if ((qfd = listen_at(sockpath)) < 0) {
+		close(afd);
+		exit(EX_OSERR);
+	}
+
+	while (!done) {
+		n = nconns;
+		pfd = xrealloc(pfd, (n + 2) * sizeof(struct pollfd));
+		pfd[0].fd = afd;
+		pfd[1].fd = qfd;
+		for (i = 0; i < n; ++i) {
+			pfd[i + 2].fd = conns[i]->fd;
+		}
+		for (i = 0; i < n + 2; ++i) {
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+		}
+		if (poll(pfd, n + 2, 1000) <= 0) {
+			continue;
+		}
+
+		/* Leaving moves the last connection, so they go backwards */
+		for (i = n; i-- > 0;) {
+			if (pfd[i + 2].revents != 0 && receive(conns[i]) != 0) {
+				leave(i);
+			}
+		}
+		if (pfd[1].revents & POLLIN) {
+			serve(qfd);
+		}
+		if (pfd[0].revents & POLLIN) {
+			enter(afd);
+		}
+	}
+
+	while (nconns > 0) {
+		leave(nconns - 1);
+	}
+	for (i = 0; i < nsources; ++i) {
+		tdu_nodes_free(&sources[i]->nodes);
+		free(sources[i]->root);
+		free(sources[i]->name);
+		free(sources[i]);
+	}
+	free(sources);
+	free(conns);
+	free(pfd);
+	free(pbuf);
+	snapshot_free(snap);
+	tdu_destroy(merged);
+	close(qfd);
+	unlink(sockpath);
+	close(afd);
+	if (strchr(argv[0], '/') != NULL) {
+		unlink(argv[0]);
+	}
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Create, bind and listen on a socket.
+ *
+ * \param[in] where  A TCP host:port or a UNIX socket path, any stale
+ *                   socket is removed.
+ *
+ * \retval fd  The listening socket.
+ * \retval -1  If there was an error.
+ **/
+static int
+listen_at(const char *where)
+{
+	int fd = -1;
+	int on = 1;
+	socklen_t len = 0;
+	struct sockaddr_storage ss = {0};
+
+	if (agent_address(where, &ss, &len)) {
+		warn(_("unable to resolve %s"), where);
+		return(-1);
+	}
+	if ((fd = socket(ss.ss_family, SOCK_STREAM, 0)) < 0) {
+		warn(_("unable to create a socket"));
+		return(-1);
+	}
+
+	if (ss.ss_family == AF_UNIX) {
+		unlink(where);
+	} else {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	}
+	if (bind(fd, (struct sockaddr *)&ss, len) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		warn(_("unable to listen on %s"), where);
+		close(fd);
+		return(-1);
+	}
+
+	return(fd);
+}
+
+/**
+ * Accept the connection of an agent.
+ *
+ * \param[in] fd  The listening socket.
+ **/
+static void
+enter(int fd)
+{
+	int cfd = -1;
+	struct conn *c = NULL;
+
+	if ((cfd = accept(fd, NULL, NULL)) < 0) {
+		return;
+	}
+	fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+
+	c = xmalloc(sizeof(struct conn));
+	c->fd = cfd;
+	if (nconns % 64 == 0) {
+		conns = xrealloc(conns, (nconns + 64) * sizeof(struct conn *));
+	}
+	conns[nconns++] = c;
+}
+
+/**
+ * Close the connection of an agent.
+ *
+ * \param[in] i  The connection, the last one takes its place.
+ **/
+static void
+leave(size_t i)
+{
+	struct conn *c = conns[i];
+
+	if (c->src != NULL && c->src->conn == c) {
+		if (options.verbose) {
+			warnx(_("%s disconnected"), c->src->name);
+		}
+		c->src->conn = NULL;
+	}
+	close(c->fd);
+	free(c->buf);
+	free(c);
+	conns[i] = conns[--nconns];
+}
+
+/**
+ * Read from an agent, applying every whole frame received and
+ * acknowledging them.
+ *
+ * \param[in] c  The connection.
+ *
+ * \retval 0  If there were no errors.
+ * \retval -1 If the connection is lost or the agent is broken.
+ **/
+static int
+receive(struct conn *c)
+{
+	size_t off = 0;
+	ssize_t n = 0;
+	uint32_t len = 0;
+	const uint8_t *p = NULL;
+
+	if (c->size - c->len < COLLECT_READ) {
+		c->size = c->size ? 2 * c->size : 2 * COLLECT_READ;
+		c->buf = xrealloc(c->buf, c->size);
+	}
+	if ((n = recv(c->fd, c->buf + c->len, c->size - c->len, 0)) <= 0) {
+		return(n < 0 && (errno == EAGAIN || errno == EINTR) ? 0 : -1);
+	}
+	c->len += n;
+
+	while (c->len - off >= 4) {
+		p = c->buf + off;
+		len = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+		if (len < 1 || len > AGENT_FRAME_MAX) {
+			return(-1);
+		}
+		if (c->len - off < 4 + (size_t)len) {
+			break;
+		}
+		if (handle(c, p[4], p + 5, p + 4 + len) != 0) {
+			return(-1);
+		}
+		off += 4 + len;
+	}
+	memmove(c->buf, c->buf + off, c->len - off);
+	c->len -= off;
+
+	/* One acknowledgement for all that was read */
+	if (c->src != NULL && c->src->seq > c->acked) {
+		c->acked = c->src->seq;
+		return(reply(c->fd, F_ACK, c->acked));
+	}
+
+	return(0);
+}
+
+/**
+ * Apply a frame of an agent.
+ *
+ * A message applied before is sent again by an agent that lost its
+ * connection before the acknowledgement, and skipped.
+ *
+ * \param[in] c     The connection.
+ * \param[in] type  Type of the frame.
+ * \param[in] p     Its body.
+ * \param[in] end   The end of it.
+ *
+ * \retval 0  If there were no errors.
+ * \retval -1 If the frame is malformed or out of order.
+ **/
+static int
+handle(struct conn *c, int type, const uint8_t *p, const uint8_t *end)
+{
+	size_t len = 0;
+	uint64_t seq = 0;
+	uint64_t v = 0;
+	uint64_t failed = 0;
+	const char *root = NULL;
+	struct source *src = c->src;
+
+	if (src == NULL) {
+		return(type == F_HELLO ? hello(c, p, end) : -1);
+	}
+	if (get(&p, end, &seq)) {
+		return(-1);
+	}
+	if (seq <= src->seq) {
+		return(0);
+	}
+	if (seq != src->seq + 1) {
+		return(-1);
+	}
+
+	switch (type) {
+		case F_SCAN:
+			if (get(&p, end, &v) || get_str(&p, end, &root, &len) ||
+			    p != end) {
+				return(-1);
+			}
+			drop(src);
+			free(src->root);
+			src->root = strndup(root, len);
+			src->scantime = (time_t)v;
+			src->duration = 0;
+			src->state = ST_SCANNING;
+			if (options.verbose) {
+				warnx(_("%s started a scan of %s"), src->name,
+				      src->root);
+			}
+			break;
+		case F_DELTA:
+			/* Checked whole first, so it is applied whole or not */
+			if (delta(src, p, end, 0) || delta(src, p, end, 1)) {
+				return(-1);
+			}
+			break;
+		case F_END:
+			if (get(&p, end, &v) || get(&p, end, &failed) ||
+			    p != end) {
+				return(-1);
+			}
+			src->duration = (time_t)v;
+			src->state = failed ? ST_FAILED : ST_DONE;
+			if (options.verbose) {
+				warnx(_("%s finished a scan of %s in %lld s, "
+					"%zu paths"), src->name, src->root,
+				      (long long)src->duration, src->n);
+			}
+			break;
+		default:
+			return(-1);
+	}
+	src->seq = seq;
+	changed = 1;
+
+	return(0);
+}
+
+/**
+ * Greet an agent, telling it where to resume.
+ *
+ * An agent is known by its name. When it runs again its previous
+ * scan is dropped, as what it was sent can not be resumed.
+ *
+ * \param[in] c    The connection.
+ * \param[in] p    The body of the HELLO.
+ * \param[in] end  The end of it.
+ *
+ * \retval 0  If there were no errors.
+ * \retval -1 If the frame is malformed.
+ **/
+static int
+hello(struct conn *c, const uint8_t *p, const uint8_t *end)
+{
+	size_t i = 0;
+	size_t len = 0;
+	uint64_t magic = 0;
+	uint64_t instance = 0;
+	const char *name = NULL;
+	struct source *src = NULL;
+
+	if (get(&p, end, &magic) || magic != AGENT_MAGIC ||
+	    get_str(&p, end, &name, &len) || len == 0 ||
+	    get(&p, end, &instance) || p != end) {
+		return(-1);
+	}
+
+	for (i = 0; i < nsources; ++i) {
+		if (strlen(sources[i]->name) == len &&
+		    memcmp(sources[i]->name, name, len) == 0) {
+			src = sources[i];
+			break;
+		}
+	}
+	if (src == NULL) {
+		src = xmalloc(sizeof(struct source));
+		src->name = strndup(name, len);
+		if (nsources % 64 == 0) {
+			sources = xrealloc(sources, (nsources + 64) *
+					   sizeof(struct source *));
+		}
+		sources[nsources++] = src;
+	}
+
+	/* A connection left behind is closed when it is next read */
+	if (src->conn != NULL) {
+		src->conn->src = NULL;
+		shutdown(src->conn->fd, SHUT_RDWR);
+	}
+	if (src->instance != instance) {
+		drop(src);
+		free(src->root);
+		src->root = NULL;
+		src->instance = instance;
+		src->seq = 0;
+		src->state = ST_IDLE;
+		changed = 1;
+	}
+	src->conn = c;
+	c->src = src;
+	c->acked = src->seq;
+
+	if (options.verbose) {
+		warnx(_("%s connected, from message %llu"), src->name,
+		      (unsigned long long)src->seq + 1);
+	}
+
+	return(reply(c->fd, F_WELCOME, src->seq));
+}
+
+/**
+ * Check or apply the nodes of a DELTA.
+ *
+ * \param[in] src    The agent.
+ * \param[in] p      The nodes.
+ * \param[in] end    The end of them.
+ * \param[in] apply  Apply them rather than check them.
+ *
+ * \retval 0  If there were no errors.
+ * \retval -1 If they are malformed.
+ **/
+static int
+delta(struct source *src, const uint8_t *p, const uint8_t *end, int apply)
+{
+	size_t plen = 0;
+	size_t len = 0;
+	uint32_t idx = 0;
+	uint64_t i = 0;
+	uint64_t k = 0;
+	uint64_t n = 0;
+	uint64_t same = 0;
+	uint64_t level = 0;
+	uint64_t nz = 0;
+	uint64_t gap = 0;
+	uint64_t v = 0;
+	const char *s = NULL;
+	struct pinfo d;
+
+	if (get(&p, end, &n)) {
+		return(-1);
+	}
+	for (i = 0; i < n; ++i) {
+		if (get(&p, end, &same) || same > plen ||
+		    get_str(&p, end, &s, &len) || memchr(s, '\0', len) != NULL) {
+			return(-1);
+		}
+		if (same + len + 1 > pbufsize) {
+			pbufsize = 2 * (same + len + 1);
+			pbuf = xrealloc(pbuf, pbufsize);
+		}
+		memcpy(pbuf + same, s, len);
+		plen = same + len;
+		pbuf[plen] = '\0';
+
+		if (get(&p, end, &level) || level > PATH_MAX ||
+		    get(&p, end, &nz) || nz > AGENT_NCOUNT) {
+			return(-1);
+		}
+		memset(&d, 0, sizeof(d));
+		for (k = 0, idx = 0; k < nz; ++k) {
+			if (get(&p, end, &gap) || get(&p, end, &v) ||
+			    (k > 0 && gap == 0) || gap >= AGENT_NCOUNT - idx) {
+				return(-1);
+			}
+			idx += gap;
+			*agent_counter(&d, idx) = v >> 1 ^ -(v & 1);
+		}
+
+		if (apply && plen > 0) {
+			d.path = pbuf;
+			d.level = (int)level;
+			src->n += add(&src->nodes, &d);
+			add(&merged->root, &d);
+		}
+	}
+
+	return(p == end ? 0 : -1);
+}
+
+/**
+ * Add the counters of a node into the node of its path in a tree.
+ *
+ * The counters wrap around, so a node may also be taken away, and a
+ * node left with nothing is removed.
+ *
+ * \param[in,out] root  The tree.
+ * \param[in]     d     The counters to add.
+ *
+ * \retval 1  If the node was created.
+ * \retval -1 If it was removed.
+ * \retval 0  Otherwise.
+ **/
+static int
+add(void **root, const struct pinfo *d)
+{
+	int rc = 0;
+	uint32_t i = 0;
+	struct pinfo *n = NULL;
+	struct pinfo **ptr = NULL;
+
+	if ((ptr = tfind(d, root, tdu_cmp)) == NULL) {
+		n = xmalloc(sizeof(struct pinfo));
+		n->path = strdup(d->path);
+		n->level = d->level;
+		ptr = tsearch(n, root, tdu_cmp);
+		rc = 1;
+	}
+	n = *ptr;
+	tdu_node_add(n, d);
+
+	for (i = 0; i < AGENT_NCOUNT && *agent_counter(n, i) == 0; ++i) {
+		;
+	}
+	if (i == AGENT_NCOUNT) {
+		tdelete(n, root, tdu_cmp);
+		free(n->path);
+		free(n);
+		rc -= 1;
+	}
+
+	return(rc);
+}
+
+/**
+ * Take the paths of an agent out of the merged tree.
+ *
+ * \param[in] src  The agent.
+ **/
+static void
+drop(struct source *src)
+{
+
+	twalk(src->nodes, unmerge);
+	tdu_nodes_free(&src->nodes);
+	src->n = 0;
+	changed = 1;
+}
+
+/**
+ * Take a node of an agent out of the merged tree, called back by
+ * twalk().
+ *
+ * \param[in] nodep  The node.
+ * \param[in] v      Which visit of the node this is.
+ * \param[in] depth  Depth of the node in the binary tree.
+ **/
+static void
+unmerge(const void *nodep, VISIT v, int depth)
+{
+	uint32_t i = 0;
+	struct pinfo d = {0};
+	struct pinfo *n = *(struct pinfo *const *)nodep;
+
+	(void)depth;
+	if (v == postorder || v == leaf) {
+		for (i = 0; i < AGENT_NCOUNT; ++i) {
+			*agent_counter(&d, i) = -*agent_counter(n, i);
+		}
+		d.path = n->path;
+		d.level = n->level;
+		add(&merged->root, &d);
+	}
+}
+
+/**
+ * Send a WELCOME or an ACK.
+ *
+ * \param[in] fd    The connection.
+ * \param[in] type  The frame type.
+ * \param[in] seq   The last message applied.
+ *
+ * \retval 0  If there were no errors.
+ * \retval -1 If it could not be sent whole.
+ **/
+static int
+reply(int fd, int type, uint64_t seq)
+{
+	size_t n = 5;
+	uint8_t b[16];
+
+	b[4] = (uint8_t)type;
+	while (seq >= 0x80) {
+		b[n++] = (uint8_t)(seq | 0x80);
+		seq >>= 7;
+	}
+	b[n++] = (uint8_t)seq;
+	b[0] = (uint8_t)(n - 4);
+	b[1] = b[2] = b[3] = 0;
+
+	/* An acknowledgement that does not fit is covered by the next */
+	if (send(fd, b, n, MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)n) {
+		return(type == F_ACK && errno == EAGAIN ? 0 : -1);
+	}
+
+	return(0);
+}
+
+/**
+ * Accept a connection and answer its request.
+ *
+ * \param[in] fd  The listening socket.
+ **/
+static void
+serve(int fd)
+{
+	int cfd = -1;
+	size_t n = 0;
+	char *buf = NULL;
+	FILE *in = NULL;
+	FILE *fp = NULL;
+	struct timeval tv = {1, 0};
+
+	if ((cfd = accept(fd, NULL, NULL)) < 0) {
+		return;
+	}
+
+	/* A client may not hold up the agents */
+	setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if ((in = fdopen(cfd, "r")) == NULL) {
+		close(cfd);
+		return;
+	}
+	if ((fp = fdopen(dup(cfd), "w")) == NULL) {
+		fclose(in);
+		return;
+	}
+
+	if (getline(&buf, &n, in) > 0 && strlen(buf) < REQUEST_MAX) {
+		buf[strcspn(buf, "\r\n")] = '\0';
+		if (strncmp(buf, "query ", 6) == 0) {
+			query(fp, buf + 6);
+		} else if (strcmp(buf, "status") == 0) {
+			status(fp);
+		} else {
+			fprintf(fp, "error %s\n", _("unknown request"));
+		}
+	}
+
+	free(buf);
+	fclose(fp);
+	fclose(in);
+}
+
+/**
+ * Answer a query request from the merged tree.
+ *
+ * The scan time is that of the oldest scan merged.
+ *
+ * \param[in] fp   The client connection.
+ * \param[in] req  The request keys.
+ **/
+static void
+query(FILE *fp, char *req)
+{
+	size_t i = 0;
+	struct query q = {0};
+
+	q.depth = options.maxdepth;
+	q.atime_days = options.atime_days;
+	strcpy(q.units, options.units);
+	if (snapshot_parse(&q, req, fp)) {
+		return;
+	}
+
+	if (snap == NULL || changed) {
+		snapshot_free(snap);
+		snap = snapshot_take(merged, 0);
+		ancestors(snap);
+		snap->scantime = time(NULL);
+		for (i = 0; i < nsources; ++i) {
+			if (sources[i]->root != NULL &&
+			    sources[i]->scantime < snap->scantime) {
+				snap->scantime = sources[i]->scantime;
+			}
+		}
+		changed = 0;
+	}
+	snapshot_query(snap, &q, fp);
+}
+
+/**
+ * Add the directories above the scans to a snapshot, so any of them
+ * can be queried.
+ *
+ * \param[in,out] snap  The snapshot.
+ **/
+static void
+ancestors(struct snapshot *snap)
+{
+	size_t i = 0;
+	size_t j = 0;
+	size_t n = snap->n;
+	char *p = NULL;
+	struct pinfo key = {0};
+
+	for (i = 0; i < nsources; ++i) {
+		if (sources[i]->root == NULL) {
+			continue;
+		}
+		key.path = strdup(sources[i]->root);
+		while (key.path[1] != '\0' && (p = strrchr(key.path, '/')) != NULL) {
+			/* The root keeps its / */
+			p[p == key.path] = '\0';
+			if (bsearch(&key, snap->nodes, n, sizeof(struct pinfo),
+				    tdu_cmp) == NULL) {
+				snap->nodes = xrealloc(snap->nodes,
+				    (snap->n + 1) * sizeof(struct pinfo));
+				memset(&snap->nodes[snap->n], 0, sizeof(struct pinfo));
+				snap->nodes[snap->n++].path = strdup(key.path);
+			}
+		}
+		free(key.path);
+	}
+	if (snap->n == n) {
+		return;
+	}
+
+	/* Scans may share an ancestor */
+	qsort(snap->nodes, snap->n, sizeof(struct pinfo), tdu_cmp);
+	for (i = 0, j = 1; j < snap->n; ++j) {
+		if (tdu_cmp(&snap->nodes[i], &snap->nodes[j]) == 0) {
+			free(snap->nodes[j].path);
+		} else {
+			snap->nodes[++i] = snap->nodes[j];
+		}
+	}
+	snap->n = i + 1;
+	snap->root = snap->nodes[0].path;
+}
+
+/**
+ * Answer a status request.
+ *
+ * \param[in] fp   The client connection.
+ **/
+static void
+status(FILE *fp)
+{
+	size_t i = 0;
+	time_t now = time(NULL);
+	struct source *s = NULL;
+	static const char *state[] = {"idle", "scanning", "done", "failed"};
+
+	fprintf(fp, "ok %zu\n", nsources);
+	for (i = 0; i < nsources; ++i) {
+		s = sources[i];
+		fprintf(fp, "%lld\t%lld\t%lld\t%zu\t%s\t%s\t%s\t%s\n",
+			(long long)s->scantime,
+			(long long)(s->root != NULL ? now - s->scantime : 0),
+			(long long)s->duration, s->n, state[s->state],
+			s->conn != NULL ? "up" : "down", s->name,
+			s->root != NULL ? s->root : "");
+	}
+}
+
+/**
+ * Read a varint.
+ *
+ * \param[in,out] p    The position to read from.
+ * \param[in]     end  The end of the data.
+ * \param[out]    v    The value.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the varint runs past the end.
+ **/
+static int
+get(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while (*p < end && shift < 64) {
+		*v |= (uint64_t)(**p & 0x7f) << shift;
+		if ((*(*p)++ & 0x80) == 0) {
+			return(0);
+		}
+		shift += 7;
+	}
+
+	return(1);
+}
+
+/**
+ * Read a string, its length and its bytes.
+ *
+ * \param[in,out] p    The position to read from.
+ * \param[in]     end  The end of the data.
+ * \param[out]    s    The bytes, not terminated.
+ * \param[out]    len  Number of them.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the string runs past the end.
+ **/
+static int
+get_str(const uint8_t **p, const uint8_t *end, const char **s, size_t *len)
+{
+	uint64_t n = 0;
+
+	if (get(p, end, &n) || n > (uint64_t)(end - *p)) {
+		return(1);
+	}
+	*s = (const char *)*p;
+	*len = n;
+	*p += n;
+
+	return(0);
+}
+
+/**
+ * Signal handler to stop collecting.
+ *
+ * \param[in] sig  The signal.
+ **/
+static void
+stop(int sig)
+{
+
+	(void)sig;
+	done = 1;
+}
+
+/**
+ * Prints a short usage statement of the sub-command.
+ **/
+static void
+print_usage(void)
+{
+	printf(_(\
+"usage: tdu collect [-h] [-v] [-s socket] [-T file] address\n\
+  -h, --help       display this help and exit.\n\
+  -v, --verbose    report the agents and their scans.\n\
+  -s, --socket     the socket to answer tdu -s on.\n\
+  -T, --type-table add the file types of a table, as the agents do.\n\
+  address          the TCP host:port or UNIX socket the agents stream to.\n\
+"));
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * \}
+ **/
@@ -0,0 +1,654 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file compress.c
+ * Routines to estimate the compressed size of each path from a sample.
+ *
+ * Each aggregated path keeps COMP_SLOTS sampled blocks of its regular
+ * files, chosen during the walk so that every byte is equally likely:
+ * each slot is a weighted reservoir of one, replaced by a file with
+ * the probability of its share of the bytes seen so far. Rather than
+ * drawing for every file, a slot draws the number of bytes at which it
+ * is next replaced, so the cost per file is one comparison. The block
+ * is the COMP_BLOCK aligned block holding a uniformly chosen byte of
+ * the file.
+ *
+ * After the walk the read budget is shared out: every path with files
+ * is given two blocks, largest first, and what is left goes to the
+ * paths in proportion to their bytes. Each block read is compressed
+ * on its own, as a compressing file system would, by a greedy LZ4
+ * style matcher that only counts the bytes of its output. The mean
+ * compressed share of the blocks, with its 95% confidence interval,
+ * is applied to the bytes of the regular files of the path.
+ *
+ * \ingroup compress
+ * \{
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <math.h>
+#include <search.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "walk.h"
+#include "compress.h"
+
+#define COMP_SLOTS      32          /**< Most blocks sampled per path **/
+#define COMP_MIN        2           /**< Blocks given to every path first **/
+#define COMP_BLOCK      65536       /**< Bytes compressed at once **/
+#define COMP_Z          1.96        /**< Normal quantile of the interval **/
+#define LZ_HASHLOG      12          /**< Log2 of the match table size **/
+#define LZ_MINMATCH     4           /**< Shortest match **/
+#define LZ_LASTLITERALS 5           /**< Bytes always left as literals **/
+
+/**
+ * A sampled block.
+ **/
+struct slot {
+	char *path;            /**< The file **/
+	uint64_t off;          /**< Offset of the block **/
+	uint32_t len;          /**< Length of the block **/
+};
+
+/**
+ * The samples of an aggregated path.
+ **/
+struct cpath {
+	char *path;            /**< The aggregated path **/
+	int level;             /**< Its level **/
+	uint32_t take;         /**< Slots to read **/
+	uint64_t bytes;        /**< Bytes of its regular files **/
+	double next;           /**< Fewest bytes at which a slot is replaced **/
+	double at[COMP_SLOTS]; /**< Bytes at which each slot is replaced **/
+	struct slot slot[COMP_SLOTS];/**< The sampled blocks **/
+};
+
+/**
+ * Compression estimate state.
+ **/
+struct compress {
+	uint64_t budget;       /**< Bytes that may be read **/
+	uint64_t rng;          /**< Random number state **/
+	void *root;            /**< Paths by name **/
+	struct cpath *last;    /**< Path of the last file **/
+	struct cpath **all;    /**< Every path **/
+	size_t n;              /**< Number of paths **/
+	size_t a;              /**< Paths allocated **/
+	uint8_t *buf;          /**< Read buffer **/
+	uint64_t blocks;       /**< Blocks read **/
+	uint64_t bytes;        /**< Bytes read **/
+	uint64_t unread;       /**< Blocks that could not be read **/
+};
+
+/* Internal functions */
+static double     uniform(struct compress *);
+static int32_t    replace(struct compress *, struct cpath *, const char *,
+			  uint64_t);
+static void       share(struct compress *);
+static void       estimate(struct tdu_ctx *, struct compress *,
+			   struct cpath *);
+static int        block(struct compress *, const struct slot *, double *);
+static size_t     lz_size(const uint8_t *, size_t);
+static void       release(void *);
+static int        by_name(const void *, const void *);
+static int        by_bytes(const void *, const void *);
+
+/**
+ * Estimate the compressed size of each path of every following scan.
+ *
+ * Estimates are in the comp_ members of the results of each path,
+ * from blocks read within the budget.
+ *
+ * \param[in] ctx     The scan context, not keeping every directory.
+ * \param[in] budget  Most bytes read for the estimates.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+int32_t
+tdu_compress(struct tdu_ctx *ctx, uint64_t budget)
+{
+
+	if (ctx == NULL || ctx->compress != NULL || budget < COMP_BLOCK ||
+	    (ctx->opts.flags & TDU_F_TREE)) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+
+	if ((ctx->compress = calloc(1, sizeof(struct compress))) == NULL) {
+		errno = ENOMEM;
+		return(EXIT_FAILURE);
+	}
+	ctx->compress->budget = budget;
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Offer a regular file found by a walk to the samples of its path.
+ *
+ * \param[in] ctx    The scan context.
+ * \param[in] fpath  Name of the entry.
+ * \param[in] sb     Stat buffer of the entry.
+ * \param[in] level  Level of the entry below the top level path.
+ **/
+void
+compress_file(struct tdu_ctx *ctx, const char *fpath, const struct stat *sb,
+	      int level)
+{
+	size_t a = 0;
+	struct compress *z = ctx->compress;
+	struct pinfo *n = NULL;
+	struct cpath key = {0};
+	struct cpath *p = NULL;
+	struct cpath **all = NULL;
+	struct cpath **ptr = NULL;
+
+	if (!S_ISREG(sb->st_mode) || sb->st_size == 0) {
+		return;
+	}
+
+	if ((n = tdu_node(ctx, fpath, FTW_F, level)) == NULL) {
+		return;
+	}
+	if ((p = z->last) == NULL || strcmp(p->path, n->path) != 0) {
+		key.path = n->path;
+		if ((ptr = tsearch(&key, &z->root, by_name)) == NULL) {
+			tdu_fail(ctx, ENOMEM);
+			return;
+		}
+		if (*ptr == &key) {
+			if (z->n == z->a) {
+				a = z->a == 0 ? 1024 : 2 * z->a;
+				if ((all = realloc(z->all, a *
+				    sizeof(struct cpath *))) != NULL) {
+					z->all = all;
+					z->a = a;
+				}
+			}
+			if (z->n == z->a ||
+			    (p = calloc(1, sizeof(struct cpath))) == NULL ||
+			    (p->path = strdup(n->path)) == NULL) {
+				free(p);
+				tdelete(&key, &z->root, by_name);
+				tdu_fail(ctx, ENOMEM);
+				return;
+			}
+			p->level = n->level;
+			*ptr = p;
+			z->all[z->n++] = p;
+		}
+		p = *ptr;
+		z->last = p;
+	}
+
+	p->bytes += sb->st_size;
+	if (p->bytes >= p->next && replace(z, p, fpath, sb->st_size)) {
+		tdu_fail(ctx, ENOMEM);
+	}
+}
+
+/**
+ * Read the samples of a scan and estimate each path.
+ *
+ * \param[in] ctx  The scan context.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If there was no memory for the samples, errno is set.
+ **/
+int32_t
+compress_finish(struct tdu_ctx *ctx)
+{
+	size_t i = 0;
+	uint64_t bytes = 0;
+	uint64_t t0 = 0;
+	struct timespec ts = {0};
+	struct compress *z = ctx->compress;
+
+	if (z == NULL) {
+		return(EXIT_SUCCESS);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	t0 = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	/* A failed scan may have lost samples, and is not estimated */
+	if (ctx->error == 0 && (z->buf = malloc(COMP_BLOCK)) == NULL) {
+		tdu_fail(ctx, ENOMEM);
+	}
+	if (ctx->error == 0) {
+		share(z);
+		for (i = 0; i < z->n; ++i) {
+			estimate(ctx, z, z->all[i]);
+			bytes += z->all[i]->bytes;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	if (ctx->opts.verbose) {
+		warnx(_("sampled %llu blocks of %zu paths, %.1f MB of %.1f MB "
+			"read in %.3f s"), (unsigned long long)z->blocks,
+		      z->n, z->bytes / 1e6, bytes / 1e6,
+		      (ts.tv_sec * 1000000000ULL + ts.tv_nsec - t0) / 1e9);
+		if (z->unread > 0) {
+			warnx(_("%llu sampled blocks could not be read"),
+			      (unsigned long long)z->unread);
+		}
+	}
+
+	/* Start over for the next scan */
+	bytes = z->budget;
+	compress_free(ctx);
+	if (tdu_compress(ctx, bytes) && ctx->error == 0) {
+		tdu_fail(ctx, errno);
+	}
+
+	if (ctx->error != 0) {
+		errno = ctx->error;
+		return(EXIT_FAILURE);
+	}
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Release the compression estimate state of a context.
+ *
+ * \param[in] ctx  The scan context.
+ **/
+void
+compress_free(struct tdu_ctx *ctx)
+{
+	struct compress *z = ctx->compress;
+
+	if (z == NULL) {
+		return;
+	}
+#if HAVE_TDESTROY
+	tdestroy(z->root, release);
+#else
+	struct cpath *p = NULL;
+
+	while (z->root != NULL) {
+		p = *(struct cpath **)z->root;
+		tdelete(p, &z->root, by_name);
+		release(p);
+	}
+#endif /* HAVE_TDESTROY */
+	free(z->all);
+	free(z->buf);
+	free(z);
+	ctx->compress = NULL;
+}
+
+/**
+ * A uniform random number in (0, 1].
+ *
+ * \param[in,out] z  The compression estimate state.
+ *
+ * \retval u  The number.
+ **/
+static double
+uniform(struct compress *z)
+{
+
+	/* xorshift64*, seeded so a scan samples the same blocks again */
+	if (z->rng == 0) {
+		z->rng = 0x9E3779B97F4A7C15ULL;
+	}
+	z->rng ^= z->rng >> 12;
+	z->rng ^= z->rng << 25;
+	z->rng ^= z->rng >> 27;
+
+	return(((z->rng * 2685821657736338717ULL >> 11) + 1) /
+	       9007199254740992.0);
+}
+
+/**
+ * Replace the slots of a path due at its bytes with a block of a file.
+ *
+ * A slot replaced at W bytes is next replaced at W / u bytes, with u
+ * uniform, which is when a file would first win the draw of its share
+ * of the bytes so far.
+ *
+ * \param[in,out] z     The compression estimate state.
+ * \param[in,out] p     The path.
+ * \param[in]     file  The file.
+ * \param[in]     size  Its size.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If there was no memory for the name of the file.
+ **/
+static int32_t
+replace(struct compress *z, struct cpath *p, const char *file, uint64_t size)
+{
+	uint32_t i = 0;
+	uint64_t x = 0;
+	char *path = NULL;
+	struct slot *s = NULL;
+
+	p->next = HUGE_VAL;
+	for (i = 0; i < COMP_SLOTS; ++i) {
+		if (p->bytes >= p->at[i]) {
+			s = &p->slot[i];
+			x = (uint64_t)(uniform(z) * size);
+			x = x < size ? x : size - 1;
+			if ((path = strdup(file)) == NULL) {
+				return(EXIT_FAILURE);
+			}
+			free(s->path);
+			s->path = path;
+			s->off = x - x % COMP_BLOCK;
+			s->len = size - s->off < COMP_BLOCK ?
+				size - s->off : COMP_BLOCK;
+			p->at[i] = p->bytes / uniform(z);
+		}
+		if (p->at[i] < p->next) {
+			p->next = p->at[i];
+		}
+	}
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Share the read budget out between the paths.
+ *
+ * \param[in,out] z  The compression estimate state.
+ **/
+static void
+share(struct compress *z)
+{
+	size_t i = 0;
+	uint32_t m = 0;
+	uint64_t left = z->budget / COMP_BLOCK;
+	uint64_t bytes = 0;
+	struct cpath *p = NULL;
+
+	qsort(z->all, z->n, sizeof(struct cpath *), by_bytes);
+
+	for (i = 0; i < z->n && left > 0; ++i) {
+		p = z->all[i];
+		p->take = left < COMP_MIN ? left : COMP_MIN;
+		left -= p->take;
+		bytes += p->bytes;
+	}
+	if (left == 0 || bytes == 0) {
+		return;
+	}
+	for (i = 0; i < z->n; ++i) {
+		p = z->all[i];
+		m = (uint32_t)((double)left * p->bytes / bytes);
+		p->take = p->take + m < COMP_SLOTS ? p->take + m : COMP_SLOTS;
+	}
+}
+
+/**
+ * Read the blocks of a path and set its estimate.
+ *
+ * Slots holding the same block are read once, though they still count
+ * as separate draws.
+ *
+ * \param[in]     ctx  The scan context.
+ * \param[in,out] z    The compression estimate state.
+ * \param[in]     p    The path.
+ **/
+static void
+estimate(struct tdu_ctx *ctx, struct compress *z, struct cpath *p)
+{
+	uint32_t i = 0;
+	uint32_t j = 0;
+	uint32_t m = 0;
+	double r[COMP_SLOTS];
+	int ok[COMP_SLOTS];
+	double mean = 0.0;
+	double var = 0.0;
+	double half = 0.0;
+	struct pinfo *n = NULL;
+
+	for (i = 0; i < p->take; ++i) {
+		for (j = 0; j < i; ++j) {
+			if (p->slot[j].off == p->slot[i].off &&
+			    strcmp(p->slot[j].path, p->slot[i].path) == 0) {
+				break;
+			}
+		}
+		if (j < i) {
+			r[i] = r[j];
+			ok[i] = ok[j];
+		} else {
+			ok[i] = block(z, &p->slot[i], &r[i]) == EXIT_SUCCESS;
+		}
+		if (ok[i]) {
+			mean += r[i];
+			++m;
+		}
+	}
+	if (m == 0) {
+		return;
+	}
+	mean /= m;
+	for (i = 0; i < p->take; ++i) {
+		if (ok[i]) {
+			var += (r[i] - mean) * (r[i] - mean);
+		}
+	}
+
+	/* One block says nothing of the spread */
+	half = m > 1 ? COMP_Z * sqrt(var / (m - 1) / m) : 1.0;
+
+	/* Only add, as spilled runs and shards are merged by adding */
+	if ((n = tdu_node(ctx, p->path, FTW_D, p->level)) == NULL) {
+		return;
+	}
+	n->comp_samples += m;
+	n->comp_bytes += p->bytes;
+	n->comp_total += mean * p->bytes;
+	n->comp_low += (mean - half > 0.0 ? mean - half : 0.0) * p->bytes;
+	n->comp_high += (mean + half < 1.0 ? mean + half : 1.0) * p->bytes;
+}
+
+/**
+ * Read and compress a sampled block.
+ *
+ * \param[in,out] z    The compression estimate state.
+ * \param[in]     s    The block.
+ * \param[out]    r    Its compressed share.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If it could not be read.
+ **/
+static int
+block(struct compress *z, const struct slot *s, double *r)
+{
+	int fd = -1;
+	ssize_t n = 0;
+	size_t c = 0;
+
+#ifdef O_NOATIME
+	if ((fd = open(s->path, O_RDONLY | O_NOATIME)) < 0 && errno == EPERM) {
+		fd = open(s->path, O_RDONLY);
+	}
+#else
+	fd = open(s->path, O_RDONLY);
+#endif
+	if (fd < 0) {
+		++z->unread;
+		return(EXIT_FAILURE);
+	}
+	while ((n = pread(fd, z->buf, s->len, s->off)) < 0 && errno == EINTR) {
+		;
+	}
+	close(fd);
+	if (n <= 0) {
+		++z->unread;
+		return(EXIT_FAILURE);
+	}
+
+	++z->blocks;
+	z->bytes += n;
+	c = lz_size(z->buf, n);
+	*r = c < (size_t)n ? (double)c / n : 1.0;
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Size of a block compressed by a greedy LZ4 style matcher.
+ *
+ * Only the size of the output is counted: a token, the literals with
+ * their extra length bytes, a two byte offset and the extra length
+ * bytes of the match. Like LZ4 it steps faster over data it finds no
+ * matches in.
+ *
+ * \param[in] p  The block.
+ * \param[in] n  Its length, at most 65536.
+ *
+ * \retval size  The compressed size in bytes.
+ **/
+static size_t
+lz_size(const uint8_t *p, size_t n)
+{
+	uint32_t v = 0;
+	uint32_t w = 0;
+	uint32_t h = 0;
+	size_t i = 0;
+	size_t ref = 0;
+	size_t len = 0;
+	size_t lit = 0;
+	size_t anchor = 0;
+	size_t out = 0;
+	size_t limit = 0;
+	uint32_t tab[1 << LZ_HASHLOG];
+
+	if (n < LZ_MINMATCH + LZ_LASTLITERALS + 1) {
+		return(n + 1);
+	}
+	memset(tab, 0xff, sizeof(tab));
+	limit = n - LZ_LASTLITERALS - LZ_MINMATCH;
+
+	while (i < limit) {
+		memcpy(&v, p + i, sizeof(v));
+		h = (v * 2654435761U) >> (32 - LZ_HASHLOG);
+		ref = tab[h];
+		tab[h] = i;
+		if (ref < i) {
+			memcpy(&w, p + ref, sizeof(w));
+		}
+		if (ref >= i || v != w) {
+			i += 1 + ((i - anchor) >> 6);
+			continue;
+		}
+		len = LZ_MINMATCH;
+		while (i + len < n - LZ_LASTLITERALS && p[ref + len] == p[i + len]) {
+			++len;
+		}
+		lit = i - anchor;
+		out += 1 + lit + (lit >= 15 ? (lit - 15) / 255 + 1 : 0) + 2 +
+			(len - LZ_MINMATCH >= 15 ?
+			 (len - LZ_MINMATCH - 15) / 255 + 1 : 0);
+		i += len;
+		anchor = i;
+	}
+	lit = n - anchor;
+	out += 1 + lit + (lit >= 15 ? (lit - 15) / 255 + 1 : 0);
+
+	return(out);
+}
+
+/**
+ * Release a path and its samples.
+ **/
+static void
+release(void *arg)
+{
+	uint32_t i = 0;
+	struct cpath *p = arg;
+
+	for (i = 0; i < COMP_SLOTS; ++i) {
+		free(p->slot[i].path);
+	}
+	free(p->path);
+	free(p);
+}
+
+/**
+ * Compare two paths by name.
+ **/
+static int
+by_name(const void *a, const void *b)
+{
+	const struct cpath *x = a;
+	const struct cpath *y = b;
+
+	return(strcmp(x->path, y->path));
+}
+
+/**
+ * Compare two paths by bytes, most first.
+ **/
+static int
+by_bytes(const void *a, const void *b)
+{
+	const struct cpath *x = *(struct cpath * const *)a;
+	const struct cpath *y = *(struct cpath * const *)b;
+
+	if (x->bytes != y->bytes) {
+		return(x->bytes > y->bytes ? -1 : 1);
+	}
+
+	return(strcmp(x->path, y->path));
+}
+
+/**
+ * \}
+ **/
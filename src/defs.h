@@ -78,6 +78,39 @@ extern "C"
   #define ATT_ALIAS(x)
 #endif
 
+/** Default tdud socket **/
+#define TDUD_SOCKET     "/tmp/tdud.sock"
+
+/** Default socket of tdu collect **/
+#define COLLECT_SOCKET  "/tmp/tducollect.sock"
+
+/** Report entry counts and the file size distribution **/
+#define COL_FILES       0x01
+
+/** Report the type of file holding the most old bytes **/
+#define COL_TYPES       0x02
+
+/** Report the cumulative totals of each subtree **/
+#define COL_SUBTREE     0x04
+
+/** Report the reclaimable bytes of duplicate files **/
+#define COL_DUPS        0x08
+
+/** Report the estimated compressed size **/
+#define COL_COMPRESS    0x10
+
+/** Report the bytes matching --where rather than the old bytes **/
+#define COL_WHERE       0x20
+
+/** Small file threshold for the file size distribution **/
+#define SMALL_FILE      4096
+
+/** Walk threads for high latency storage when not given **/
+#define LATENCY_JOBS    64
+
+/** Seconds in a day **/
+#define SECONDS_IN_DAY  (60 * 60 * 24)
+
 /**
  * Byte units
  **/
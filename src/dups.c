@@ -0,0 +1,865 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file dups.c
+ * Routines to find duplicate files and the space they could free.
+ *
+ * Every regular file a scan finds is a candidate, known by its size,
+ * device, inode and path. After the walk the candidates are narrowed
+ * in stages, each only reading the files that survived the last:
+ *
+ *   - files are grouped by size, and hard links to one inode counted
+ *     once, a file of a size no other file has is not read at all;
+ *   - the first and last DUP_EDGE bytes of the files of each size are
+ *     hashed, which settles files of up to twice that size;
+ *   - files whose edges match are hashed in full with large
+ *     sequential reads, and optionally compared byte by byte.
+ *
+ * Of each set of identical files the one with the first path is kept,
+ * the size of every other is reclaimable and added to the duplicate
+ * bytes of the path it is reported under. Files are read without
+ * changing their access time where the system allows it.
+ *
+ * The hash is XXH64, computed on native words as hashes are only
+ * compared within one scan.
+ *
+ * \ingroup dups
+ * \{
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "walk.h"
+#include "dups.h"
+
+#define DUP_EDGE        4096        /**< Bytes hashed at each end **/
+#define DUP_CHUNK       (1 << 20)   /**< Bytes read at once **/
+#define DUP_GROW        4096        /**< First allocation of candidates **/
+
+#define P1      11400714785074694791ULL
+#define P2      14029467366897019727ULL
+#define P3      1609587929392839161ULL
+#define P4      9650029242287828579ULL
+#define P5      2870177450012600261ULL
+
+/**
+ * What is known of a candidate.
+ **/
+enum cstate {
+	CAND_OK = 0,           /**< Still a candidate **/
+	CAND_LINK,             /**< Another link to an inode already seen **/
+	CAND_SKIP              /**< Could not be read or changed **/
+};
+
+/**
+ * A candidate file.
+ **/
+struct cand {
+	uint64_t size;         /**< Size in bytes **/
+	uint64_t dev;          /**< Device **/
+	uint64_t ino;          /**< Inode **/
+	uint64_t part;         /**< Hash of the first and last bytes **/
+	uint64_t full;         /**< Hash of the whole file **/
+	size_t path;           /**< Its path in the path pool **/
+	const char *name;      /**< Its path, once the pool is complete **/
+	int level;             /**< Its level below the top level path **/
+	int state;             /**< What is known of it (cstate) **/
+};
+
+/**
+ * Duplicate file state.
+ **/
+struct dups {
+	int verify;            /**< Compare duplicates byte by byte **/
+	struct cand *c;        /**< Candidates **/
+	size_t n;              /**< Number of candidates **/
+	size_t a;              /**< Candidates allocated **/
+	char *paths;           /**< Path pool **/
+	size_t npath;          /**< Bytes of paths **/
+	size_t apath;          /**< Bytes allocated **/
+	uint8_t *buf[2];       /**< Read buffers **/
+	uint64_t sized;        /**< Files sharing their size **/
+	uint64_t parts;        /**< Files with their edges hashed **/
+	uint64_t fulls;        /**< Files hashed in full **/
+	uint64_t compared;     /**< Files compared byte by byte **/
+	uint64_t bytes;        /**< Bytes read **/
+	uint64_t sets;         /**< Sets of identical files **/
+	uint64_t ndup;         /**< Reclaimable files **/
+	uint64_t reclaim;      /**< Reclaimable bytes **/
+};
+
+/**
+ * Streaming hash state.
+ **/
+struct hash {
+	uint64_t v[4];         /**< Accumulators **/
+	uint64_t len;          /**< Bytes hashed **/
+	uint64_t seed;         /**< The seed **/
+};
+
+/* Internal functions */
+static void       sizes(struct tdu_ctx *, struct dups *, size_t, size_t);
+static void       same(struct tdu_ctx *, struct dups *, size_t, size_t);
+static void       charge(struct tdu_ctx *, struct dups *, struct cand *);
+static int        partial(struct dups *, struct cand *);
+static int        full(struct dups *, struct cand *);
+static int        equal(struct dups *, const struct cand *,
+			const struct cand *);
+static int        ropen(const char *);
+static ssize_t    fill(int, uint8_t *, size_t, off_t);
+static void       hash_init(struct hash *, uint64_t);
+static void       hash_update(struct hash *, const uint8_t *, size_t);
+static uint64_t   hash_final(struct hash *, const uint8_t *, size_t);
+static int        by_size(const void *, const void *);
+static int        by_part(const void *, const void *);
+static int        by_full(const void *, const void *);
+static int        by_path(const void *, const void *);
+
+/** Rotate left **/
+static inline uint64_t
+rotl(uint64_t x, int r)
+{
+
+	return((x << r) | (x >> (64 - r)));
+}
+
+/** Mix a word into an accumulator **/
+static inline uint64_t
+mix(uint64_t acc, uint64_t in)
+{
+
+	acc += in * P2;
+	acc = rotl(acc, 31);
+
+	return(acc * P1);
+}
+
+/** A native 64 bit word **/
+static inline uint64_t
+word(const uint8_t *p)
+{
+	uint64_t v = 0;
+
+	memcpy(&v, p, sizeof(v));
+
+	return(v);
+}
+
+/**
+ * Find the duplicate files of every following scan of a context.
+ *
+ * The reclaimable bytes of each path are in the dup member of its
+ * results. Files in the same set are compared byte by byte when
+ * verify is set, otherwise files with the same size and hash are
+ * taken to be identical.
+ *
+ * \param[in] ctx     The scan context, not keeping every directory.
+ * \param[in] verify  Compare files byte by byte.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+int32_t
+tdu_dups(struct tdu_ctx *ctx, int verify)
+{
+
+	if (ctx == NULL || ctx->dups != NULL ||
+	    (ctx->opts.flags & TDU_F_TREE)) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+
+	if ((ctx->dups = calloc(1, sizeof(struct dups))) == NULL) {
+		errno = ENOMEM;
+		return(EXIT_FAILURE);
+	}
+	ctx->dups->verify = verify;
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Add a regular file found by a walk to the candidates.
+ *
+ * \param[in] ctx    The scan context.
+ * \param[in] fpath  Name of the entry.
+ * \param[in] sb     Stat buffer of the entry.
+ * \param[in] level  Level of the entry below the top level path.
+ **/
+void
+dups_file(struct tdu_ctx *ctx, const char *fpath, const struct stat *sb,
+	  int level)
+{
+	size_t a = 0;
+	size_t len = 0;
+	char *p = NULL;
+	struct dups *d = ctx->dups;
+	struct cand *c = NULL;
+
+	if (!S_ISREG(sb->st_mode) || sb->st_size == 0) {
+		return;
+	}
+
+	if (d->n == d->a) {
+		a = d->a == 0 ? DUP_GROW : 2 * d->a;
+		if ((c = realloc(d->c, a * sizeof(struct cand))) == NULL) {
+			tdu_fail(ctx, ENOMEM);
+			return;
+		}
+		d->c = c;
+		d->a = a;
+	}
+	len = strlen(fpath) + 1;
+	for (a = d->apath; d->npath + len > a;) {
+		a = a == 0 ? DUP_CHUNK : 2 * a;
+	}
+	if (a != d->apath) {
+		if ((p = realloc(d->paths, a)) == NULL) {
+			tdu_fail(ctx, ENOMEM);
+			return;
+		}
+		d->paths = p;
+		d->apath = a;
+	}
+	memcpy(d->paths + d->npath, fpath, len);
+
+	c = &d->c[d->n++];
+	memset(c, 0, sizeof(struct cand));
+	c->size = sb->st_size;
+	c->dev = sb->st_dev;
+	c->ino = sb->st_ino;
+	c->path = d->npath;
+	c->level = level;
+	d->npath += len;
+}
+
+/**
+ * Find the duplicates among the candidates of a scan, adding their
+ * sizes to the paths they are reported under.
+ *
+ * \param[in] ctx  The scan context.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If there was no memory to compare the files, errno is set.
+ **/
+int32_t
+dups_finish(struct tdu_ctx *ctx)
+{
+	size_t i = 0;
+	size_t j = 0;
+	size_t k = 0;
+	size_t m = 0;
+	int verify = 0;
+	uint64_t t0 = 0;
+	struct timespec ts = {0};
+	struct dups *d = ctx->dups;
+
+	if (d == NULL) {
+		return(EXIT_SUCCESS);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	t0 = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	/* Only files sharing their size with another inode are read */
+	for (i = 0; i < d->n; ++i) {
+		d->c[i].name = d->paths + d->c[i].path;
+	}
+	qsort(d->c, d->n, sizeof(struct cand), by_size);
+	for (i = 0; i < d->n; i = j) {
+		for (j = i + 1, m = 1; j < d->n && d->c[j].size == d->c[i].size;
+		     ++j) {
+			k = j - 1;
+			if (d->c[j].dev == d->c[k].dev &&
+			    d->c[j].ino == d->c[k].ino) {
+				d->c[j].state = CAND_LINK;
+			} else {
+				++m;
+			}
+		}
+		if (m > 1) {
+			d->sized += m;
+			sizes(ctx, d, i, j);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	if (ctx->opts.verbose) {
+		warnx(_("%llu files share their size, %llu hashed at the "
+			"edges, %llu in full, %llu compared, %.1f MB read "
+			"in %.3f s"), (unsigned long long)d->sized,
+		      (unsigned long long)d->parts,
+		      (unsigned long long)d->fulls,
+		      (unsigned long long)d->compared, d->bytes / 1e6,
+		      (ts.tv_sec * 1000000000ULL + ts.tv_nsec - t0) / 1e9);
+		warnx(_("%llu duplicate files in %llu sets, %llu bytes "
+			"reclaimable"), (unsigned long long)d->ndup,
+		      (unsigned long long)d->sets,
+		      (unsigned long long)d->reclaim);
+	}
+
+	/* Start over for the next scan */
+	verify = d->verify;
+	free(d->c);
+	free(d->paths);
+	free(d->buf[0]);
+	free(d->buf[1]);
+	memset(d, 0, sizeof(struct dups));
+	d->verify = verify;
+
+	if (ctx->error != 0) {
+		errno = ctx->error;
+		return(EXIT_FAILURE);
+	}
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Release the duplicate file state of a context.
+ *
+ * \param[in] ctx  The scan context.
+ **/
+void
+dups_free(struct tdu_ctx *ctx)
+{
+	struct dups *d = ctx->dups;
+
+	if (d == NULL) {
+		return;
+	}
+	free(d->c);
+	free(d->paths);
+	free(d->buf[0]);
+	free(d->buf[1]);
+	free(d);
+	ctx->dups = NULL;
+}
+
+/**
+ * Narrow the files of one size to sets of identical files.
+ *
+ * \param[in]     ctx  The scan context.
+ * \param[in,out] d    The duplicate file state.
+ * \param[in]     i    The first file of the size.
+ * \param[in]     j    Past the last file of the size.
+ **/
+static void
+sizes(struct tdu_ctx *ctx, struct dups *d, size_t i, size_t j)
+{
+	size_t a = 0;
+	size_t b = 0;
+	size_t k = 0;
+	size_t l = 0;
+
+	if (d->buf[0] == NULL) {
+		d->buf[0] = malloc(DUP_CHUNK);
+	}
+	if (d->buf[1] == NULL) {
+		d->buf[1] = malloc(DUP_CHUNK);
+	}
+	if (d->buf[0] == NULL || d->buf[1] == NULL) {
+		tdu_fail(ctx, ENOMEM);
+		return;
+	}
+
+	for (k = i; k < j; ++k) {
+		if (d->c[k].state == CAND_OK && partial(d, &d->c[k])) {
+			d->c[k].state = CAND_SKIP;
+		}
+	}
+	qsort(d->c + i, j - i, sizeof(struct cand), by_part);
+
+	for (a = i; a < j && d->c[a].state == CAND_OK; a = b) {
+		b = a + 1;
+		while (b < j && d->c[b].state == CAND_OK &&
+		       d->c[b].part == d->c[a].part) {
+			++b;
+		}
+		if (b - a < 2) {
+			continue;
+		}
+		/* The edges covered the files */
+		if (d->c[a].size <= 2 * DUP_EDGE) {
+			same(ctx, d, a, b);
+			continue;
+		}
+
+		for (k = a; k < b; ++k) {
+			if (full(d, &d->c[k])) {
+				d->c[k].state = CAND_SKIP;
+			}
+		}
+		qsort(d->c + a, b - a, sizeof(struct cand), by_full);
+		for (k = a; k < b && d->c[k].state == CAND_OK; k = l) {
+			l = k + 1;
+			while (l < b && d->c[l].state == CAND_OK &&
+			       d->c[l].full == d->c[k].full) {
+				++l;
+			}
+			if (l - k > 1) {
+				same(ctx, d, k, l);
+			}
+		}
+	}
+}
+
+/**
+ * Charge the reclaimable files of a set with the same size and hash.
+ *
+ * The files are put in path order, and the first kept. When verifying,
+ * each file is compared with the first not yet matched, so a set split
+ * by a hash collision is still charged correctly.
+ *
+ * \param[in]     ctx  The scan context.
+ * \param[in,out] d    The duplicate file state.
+ * \param[in]     a    The first file of the set.
+ * \param[in]     b    Past the last file of the set.
+ **/
+static void
+same(struct tdu_ctx *ctx, struct dups *d, size_t a, size_t b)
+{
+	size_t i = 0;
+	size_t k = 0;
+	size_t ref = 0;
+	size_t left = b - a;
+
+	/* The kept file must not depend on the order of the walk */
+	qsort(d->c + a, b - a, sizeof(struct cand), by_path);
+
+	if (!d->verify) {
+		++d->sets;
+		for (i = a + 1; i < b; ++i) {
+			charge(ctx, d, &d->c[i]);
+		}
+		return;
+	}
+
+	/* Matched files become links to their first */
+	for (ref = a; left > 1; ++ref) {
+		if (d->c[ref].state != CAND_OK) {
+			continue;
+		}
+		d->c[ref].state = CAND_LINK;
+		--left;
+		for (i = ref + 1, k = 0; i < b; ++i) {
+			if (d->c[i].state == CAND_OK &&
+			    equal(d, &d->c[ref], &d->c[i])) {
+				d->c[i].state = CAND_LINK;
+				--left;
+				++k;
+				charge(ctx, d, &d->c[i]);
+			}
+		}
+		d->sets += k > 0;
+	}
+}
+
+/**
+ * Charge a reclaimable file to the path it is reported under.
+ *
+ * \param[in]     ctx  The scan context.
+ * \param[in,out] d    The duplicate file state.
+ * \param[in]     c    The file.
+ **/
+static void
+charge(struct tdu_ctx *ctx, struct dups *d, struct cand *c)
+{
+	struct pinfo *n = NULL;
+
+	if ((n = tdu_node(ctx, c->name, FTW_F, c->level)) == NULL) {
+		return;
+	}
+	n->dup += c->size;
+	d->reclaim += c->size;
+	++d->ndup;
+}
+
+/**
+ * Hash the first and last DUP_EDGE bytes of a file, or all of it if
+ * it is no longer than both.
+ *
+ * \param[in,out] d  The duplicate file state.
+ * \param[in,out] c  The file.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If it could not be read or has changed size.
+ **/
+static int
+partial(struct dups *d, struct cand *c)
+{
+	int fd = -1;
+	size_t len = c->size <= 2 * DUP_EDGE ? c->size : DUP_EDGE;
+	ssize_t n = 0;
+	ssize_t m = len;
+	struct hash h;
+
+	if ((fd = ropen(c->name)) < 0) {
+		return(EXIT_FAILURE);
+	}
+	n = fill(fd, d->buf[0], len, 0);
+	if (n == m && c->size > 2 * DUP_EDGE) {
+		n += fill(fd, d->buf[0] + len, len, c->size - len);
+		m += len;
+	}
+	close(fd);
+	if (n != m) {
+		return(EXIT_FAILURE);
+	}
+	d->bytes += n;
+	++d->parts;
+
+	hash_init(&h, c->size);
+	hash_update(&h, d->buf[0], n & ~(size_t)31);
+	c->part = hash_final(&h, d->buf[0] + (n & ~(size_t)31), n & 31);
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Hash a whole file with large sequential reads.
+ *
+ * \param[in,out] d  The duplicate file state.
+ * \param[in,out] c  The file.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If it could not be read or has changed size.
+ **/
+static int
+full(struct dups *d, struct cand *c)
+{
+	int fd = -1;
+	uint64_t off = 0;
+	ssize_t n = 0;
+	struct hash h;
+
+	if ((fd = ropen(c->name)) < 0) {
+		return(EXIT_FAILURE);
+	}
+	hash_init(&h, c->size);
+	while ((n = fill(fd, d->buf[0], DUP_CHUNK, off)) == DUP_CHUNK) {
+		hash_update(&h, d->buf[0], n);
+		off += n;
+	}
+	close(fd);
+	if (n < 0 || off + n != c->size) {
+		return(EXIT_FAILURE);
+	}
+	d->bytes += c->size;
+	++d->fulls;
+	hash_update(&h, d->buf[0], n & ~(size_t)31);
+	c->full = hash_final(&h, d->buf[0] + (n & ~(size_t)31), n & 31);
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Compare two files of the same size byte by byte.
+ *
+ * \param[in,out] d  The duplicate file state.
+ * \param[in]     x  A file.
+ * \param[in]     y  The other.
+ *
+ * \retval 1 If they are identical.
+ * \retval 0 If they differ or could not be read.
+ **/
+static int
+equal(struct dups *d, const struct cand *x, const struct cand *y)
+{
+	int fx = -1;
+	int fy = -1;
+	int same = 0;
+	uint64_t off = 0;
+	ssize_t n = 0;
+
+	++d->compared;
+	if ((fx = ropen(x->name)) < 0 || (fy = ropen(y->name)) < 0) {
+		if (fx >= 0) {
+			close(fx);
+		}
+		return(0);
+	}
+	for (same = 1; same && off < x->size; off += n) {
+		n = fill(fx, d->buf[0], DUP_CHUNK, off);
+		same = n > 0 && fill(fy, d->buf[1], n, off) == n &&
+			memcmp(d->buf[0], d->buf[1], n) == 0;
+		d->bytes += 2 * (n > 0 ? n : 0);
+	}
+	close(fx);
+	close(fy);
+
+	return(same);
+}
+
+/**
+ * Open a file to read, without changing its access time if allowed.
+ *
+ * \param[in] path  The file.
+ *
+ * \retval fd  The open file.
+ * \retval -1  If it could not be opened.
+ **/
+static int
+ropen(const char *path)
+{
+	int fd = -1;
+
+#ifdef O_NOATIME
+	/* Only the owner of a file may leave its access time alone */
+	if ((fd = open(path, O_RDONLY | O_NOATIME)) < 0 && errno == EPERM) {
+		fd = open(path, O_RDONLY);
+	}
+#else
+	fd = open(path, O_RDONLY);
+#endif
+#ifdef POSIX_FADV_SEQUENTIAL
+	if (fd >= 0) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+#endif
+
+	return(fd);
+}
+
+/**
+ * Read up to len bytes at an offset, stopping short only at the end.
+ *
+ * \param[in]  fd   The file.
+ * \param[out] buf  The buffer.
+ * \param[in]  len  Bytes to read.
+ * \param[in]  off  Offset in the file.
+ *
+ * \retval n   Bytes read.
+ * \retval -1  If the read failed.
+ **/
+static ssize_t
+fill(int fd, uint8_t *buf, size_t len, off_t off)
+{
+	ssize_t r = 0;
+	size_t done = 0;
+
+	while (done < len) {
+		r = pread(fd, buf + done, len - done, off + done);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r < 0) {
+			return(-1);
+		}
+		if (r == 0) {
+			break;
+		}
+		done += r;
+	}
+
+	return(done);
+}
+
+/**
+ * Start a hash.
+ *
+ * \param[out] h     The hash state.
+ * \param[in]  seed  The seed.
+ **/
+static void
+hash_init(struct hash *h, uint64_t seed)
+{
+
+	h->v[0] = seed + P1 + P2;
+	h->v[1] = seed + P2;
+	h->v[2] = seed;
+	h->v[3] = seed - P1;
+	h->len = 0;
+	h->seed = seed;
+}
+
+/**
+ * Add whole 32 byte stripes to a hash.
+ *
+ * \param[in,out] h    The hash state.
+ * \param[in]     p    The data.
+ * \param[in]     len  Its length, a multiple of 32.
+ **/
+static void
+hash_update(struct hash *h, const uint8_t *p, size_t len)
+{
+	const uint8_t *end = p + len;
+
+	for (; p < end; p += 32) {
+		h->v[0] = mix(h->v[0], word(p));
+		h->v[1] = mix(h->v[1], word(p + 8));
+		h->v[2] = mix(h->v[2], word(p + 16));
+		h->v[3] = mix(h->v[3], word(p + 24));
+	}
+	h->len += len;
+}
+
+/**
+ * Finish a hash with the last bytes.
+ *
+ * \param[in,out] h    The hash state.
+ * \param[in]     p    The last bytes.
+ * \param[in]     len  Their number, less than 32.
+ *
+ * \retval hash  The hash.
+ **/
+static uint64_t
+hash_final(struct hash *h, const uint8_t *p, size_t len)
+{
+	int i = 0;
+	uint32_t w = 0;
+	uint64_t acc = 0;
+
+	if (h->len >= 32) {
+		acc = rotl(h->v[0], 1) + rotl(h->v[1], 7) +
+			rotl(h->v[2], 12) + rotl(h->v[3], 18);
+		for (i = 0; i < 4; ++i) {
+			acc = (acc ^ mix(0, h->v[i])) * P1 + P4;
+		}
+	} else {
+		acc = h->seed + P5;
+	}
+	acc += h->len + len;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		acc = rotl(acc ^ mix(0, word(p)), 27) * P1 + P4;
+	}
+	if (len >= 4) {
+		memcpy(&w, p, sizeof(w));
+		acc = rotl(acc ^ (w * P1), 23) * P2 + P3;
+		p += 4;
+		len -= 4;
+	}
+	for (; len > 0; ++p, --len) {
+		acc = rotl(acc ^ (*p * P5), 11) * P1;
+	}
+
+	acc ^= acc >> 33;
+	acc *= P2;
+	acc ^= acc >> 29;
+	acc *= P3;
+	acc ^= acc >> 32;
+
+	return(acc);
+}
+
+/**
+ * Compare two candidates by size, inode then path, so the first link
+ * to an inode is the one kept.
+ **/
+static int
+by_size(const void *a, const void *b)
+{
+	const struct cand *x = a;
+	const struct cand *y = b;
+
+	if (x->size != y->size) {
+		return(x->size < y->size ? -1 : 1);
+	}
+	if (x->dev != y->dev) {
+		return(x->dev < y->dev ? -1 : 1);
+	}
+	if (x->ino != y->ino) {
+		return(x->ino < y->ino ? -1 : 1);
+	}
+
+	return(strcmp(x->name, y->name));
+}
+
+/**
+ * Compare two candidates by the hash of their edges, the others last.
+ **/
+static int
+by_part(const void *a, const void *b)
+{
+	const struct cand *x = a;
+	const struct cand *y = b;
+
+	if ((x->state != CAND_OK) != (y->state != CAND_OK)) {
+		return(x->state != CAND_OK ? 1 : -1);
+	}
+
+	return((x->part > y->part) - (x->part < y->part));
+}
+
+/**
+ * Compare two candidates by their full hash, the others last.
+ **/
+static int
+by_full(const void *a, const void *b)
+{
+	const struct cand *x = a;
+	const struct cand *y = b;
+
+	if ((x->state != CAND_OK) != (y->state != CAND_OK)) {
+		return(x->state != CAND_OK ? 1 : -1);
+	}
+
+	return((x->full > y->full) - (x->full < y->full));
+}
+
+/**
+ * Compare two candidates by path.
+ **/
+static int
+by_path(const void *a, const void *b)
+{
+	const struct cand *x = a;
+	const struct cand *y = b;
+
+	return(strcmp(x->name, y->name));
+}
+
+/**
+ * \}
+ **/
@@ -0,0 +1,401 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file emit.c
+ * Routines to write the list of cold files found by a scan.
+ *
+ * The list is written by its own thread so the walk never waits on
+ * the output. The walk fills a buffer per output file and hands full
+ * buffers over to the writer; it only waits when every buffer is
+ * queued for writing. Each file name is terminated by a NUL.
+ *
+ * When the list is split, every file goes to the output holding the
+ * fewest bytes so far, so parallel movers are given similar work.
+ *
+ * \ingroup emit
+ * \{
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "walk.h"
+#include "emit.h"
+
+#define EMIT_BUFSIZE     (1 << 20)
+#define EMIT_NBUFS       4       /**< Buffers beyond one per output **/
+#define EMIT_MAXSPLIT    256
+
+/**
+ * A buffer of file names.
+ **/
+struct ebuf {
+	uint32_t out;          /**< Output the buffer is for **/
+	size_t len;            /**< Bytes used **/
+	char *data;            /**< The names **/
+};
+
+/**
+ * Cold file list state.
+ **/
+struct emit {
+	uint64_t floor;        /**< Smallest file to list **/
+	uint32_t nout;         /**< Number of outputs **/
+	int *fds;              /**< Output files **/
+	uint64_t *bytes;       /**< Bytes of the files in each output **/
+	struct ebuf **cur;     /**< Buffer being filled for each output **/
+	size_t nbufs;          /**< Number of buffers **/
+	struct ebuf **bufs;    /**< Every buffer **/
+	struct ebuf **free;    /**< Buffers ready to be filled **/
+	size_t nfree;          /**< Number of free buffers **/
+	struct ebuf **queue;   /**< Buffers waiting to be written **/
+	size_t head;           /**< First queued buffer **/
+	size_t nqueue;         /**< Number of queued buffers **/
+	int done;              /**< No more buffers will be queued **/
+	int error;             /**< errno of a failed write **/
+	pthread_t writer;      /**< The writer thread **/
+	pthread_mutex_t lock;  /**< Protects the queues **/
+	pthread_cond_t ready;  /**< A buffer was queued **/
+	pthread_cond_t freed;  /**< A buffer was written **/
+};
+
+/* Internal functions */
+static void      *writer(void *);
+static void       queue(struct emit *, uint32_t);
+
+/**
+ * List the cold files of the next scan of a context.
+ *
+ * Files not accessed within the access time window and of at least
+ * floor bytes are written to path, or when split is more than one,
+ * spread over path.0 to path.split-1.
+ *
+ * \param[in] ctx    The scan context.
+ * \param[in] path   The output file.
+ * \param[in] floor  The smallest file size to list.
+ * \param[in] split  The number of output files.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+int32_t
+tdu_emit_cold(struct tdu_ctx *ctx, const char *path, uint64_t floor,
+	      uint32_t split)
+{
+	uint32_t i = 0;
+	int error = 0;
+	struct emit *e = NULL;
+	char name[PATH_MAX];
+
+	if (ctx == NULL || path == NULL || ctx->emit != NULL) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+	if (split < 1) {
+		split = 1;
+	}
+	if (split > EMIT_MAXSPLIT) {
+		split = EMIT_MAXSPLIT;
+	}
+
+	if ((e = calloc(1, sizeof(struct emit))) == NULL) {
+		return(EXIT_FAILURE);
+	}
+	e->floor = floor;
+	e->nout = split;
+	e->fds = malloc(split * sizeof(int));
+	e->bytes = calloc(split, sizeof(uint64_t));
+	e->cur = calloc(split, sizeof(struct ebuf *));
+	e->nbufs = split + EMIT_NBUFS;
+	e->bufs = calloc(e->nbufs, sizeof(struct ebuf *));
+	e->free = calloc(e->nbufs, sizeof(struct ebuf *));
+	e->queue = calloc(e->nbufs, sizeof(struct ebuf *));
+
+	for (i = 0; e->fds != NULL && i < split; ++i) {
+		e->fds[i] = -1;
+	}
+	if (e->fds == NULL || e->bytes == NULL || e->cur == NULL ||
+	    e->bufs == NULL || e->free == NULL || e->queue == NULL) {
+		errno = ENOMEM;
+		goto fail;
+	}
+	for (i = 0; i < split; ++i) {
+		if (split == 1) {
+			snprintf(name, sizeof(name), "%s", path);
+		} else {
+			snprintf(name, sizeof(name), "%s.%u", path, i);
+		}
+		if ((e->fds[i] = open(name, O_WRONLY | O_CREAT | O_TRUNC,
+				      0644)) < 0) {
+			goto fail;
+		}
+	}
+
+	for (i = 0; i < e->nbufs; ++i) {
+		if ((e->bufs[i] = calloc(1, sizeof(struct ebuf))) == NULL ||
+		    (e->bufs[i]->data = malloc(EMIT_BUFSIZE)) == NULL) {
+			errno = ENOMEM;
+			goto fail;
+		}
+		e->free[e->nfree++] = e->bufs[i];
+	}
+	for (i = 0; i < split; ++i) {
+		e->cur[i] = e->free[--e->nfree];
+		e->cur[i]->out = i;
+	}
+
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_cond_init(&e->ready, NULL);
+	pthread_cond_init(&e->freed, NULL);
+	if ((error = pthread_create(&e->writer, NULL, writer, e)) != 0) {
+		errno = error;
+		goto fail;
+	}
+
+	ctx->emit = e;
+
+	return(EXIT_SUCCESS);
+fail:
+	error = errno;
+	for (i = 0; e->fds != NULL && i < split; ++i) {
+		if (e->fds[i] >= 0) {
+			close(e->fds[i]);
+		}
+	}
+	for (i = 0; e->bufs != NULL && i < e->nbufs; ++i) {
+		if (e->bufs[i] != NULL) {
+			free(e->bufs[i]->data);
+			free(e->bufs[i]);
+		}
+	}
+	free(e->bufs);
+	free(e->free);
+	free(e->queue);
+	free(e->fds);
+	free(e->bytes);
+	free(e->cur);
+	free(e);
+	errno = error;
+
+	return(EXIT_FAILURE);
+}
+
+/**
+ * Add a cold file to the list.
+ *
+ * \param[in] e     The cold file list.
+ * \param[in] path  The file.
+ * \param[in] size  Its size in bytes.
+ **/
+void
+emit_file(struct emit *e, const char *path, uint64_t size)
+{
+	uint32_t i = 0;
+	uint32_t out = 0;
+	size_t n = 0;
+	struct ebuf *b = NULL;
+
+	if (size < e->floor) {
+		return;
+	}
+
+	for (i = 1; i < e->nout; ++i) {
+		if (e->bytes[i] < e->bytes[out]) {
+			out = i;
+		}
+	}
+	e->bytes[out] += size;
+
+	n = strlen(path) + 1;
+	b = e->cur[out];
+	if (b->len + n > EMIT_BUFSIZE) {
+		queue(e, out);
+		b = e->cur[out];
+	}
+	memcpy(b->data + b->len, path, n);
+	b->len += n;
+}
+
+/**
+ * Flush and close the cold file list of a context.
+ *
+ * \param[in] ctx  The scan context.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If writing the list failed, errno is set.
+ **/
+int32_t
+emit_finish(struct tdu_ctx *ctx)
+{
+	uint32_t i = 0;
+	int error = 0;
+	struct emit *e = ctx->emit;
+
+	if (e == NULL) {
+		return(EXIT_SUCCESS);
+	}
+
+	pthread_mutex_lock(&e->lock);
+	for (i = 0; i < e->nout; ++i) {
+		if (e->cur[i]->len > 0) {
+			e->queue[(e->head + e->nqueue++) % e->nbufs] = e->cur[i];
+		}
+	}
+	e->done = 1;
+	pthread_cond_signal(&e->ready);
+	pthread_mutex_unlock(&e->lock);
+	pthread_join(e->writer, NULL);
+
+	error = e->error;
+	for (i = 0; i < e->nout; ++i) {
+		if (close(e->fds[i]) != 0 && error == 0) {
+			error = errno;
+		}
+	}
+	for (i = 0; i < e->nbufs; ++i) {
+		free(e->bufs[i]->data);
+		free(e->bufs[i]);
+	}
+	free(e->bufs);
+	free(e->free);
+	free(e->queue);
+	pthread_mutex_destroy(&e->lock);
+	pthread_cond_destroy(&e->ready);
+	pthread_cond_destroy(&e->freed);
+	free(e->fds);
+	free(e->bytes);
+	free(e->cur);
+	free(e);
+	ctx->emit = NULL;
+
+	if (error != 0) {
+		errno = error;
+		return(EXIT_FAILURE);
+	}
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Hand the buffer of an output to the writer and take a free one.
+ *
+ * \param[in] e    The cold file list.
+ * \param[in] out  The output.
+ **/
+static void
+queue(struct emit *e, uint32_t out)
+{
+
+	pthread_mutex_lock(&e->lock);
+	e->queue[(e->head + e->nqueue++) % e->nbufs] = e->cur[out];
+	pthread_cond_signal(&e->ready);
+	while (e->nfree == 0) {
+		pthread_cond_wait(&e->freed, &e->lock);
+	}
+	e->cur[out] = e->free[--e->nfree];
+	pthread_mutex_unlock(&e->lock);
+
+	e->cur[out]->out = out;
+	e->cur[out]->len = 0;
+}
+
+/**
+ * The writer thread, writing queued buffers until the list is done.
+ *
+ * \param[in] arg  The cold file list.
+ *
+ * \retval NULL  Always.
+ **/
+static void *
+writer(void *arg)
+{
+	size_t off = 0;
+	ssize_t n = 0;
+	struct ebuf *b = NULL;
+	struct emit *e = arg;
+
+	pthread_mutex_lock(&e->lock);
+	for (;;) {
+		while (e->nqueue == 0 && !e->done) {
+			pthread_cond_wait(&e->ready, &e->lock);
+		}
+		if (e->nqueue == 0) {
+			break;
+		}
+		b = e->queue[e->head];
+		e->head = (e->head + 1) % e->nbufs;
+		--e->nqueue;
+		pthread_mutex_unlock(&e->lock);
+
+		for (off = 0; off < b->len && e->error == 0; off += n) {
+			if ((n = write(e->fds[b->out], b->data + off,
+				       b->len - off)) < 0) {
+				if (errno == EINTR) {
+					n = 0;
+					continue;
+				}
+				e->error = errno;
+			}
+		}
+
+		pthread_mutex_lock(&e->lock);
+		b->len = 0;
+		e->free[e->nfree++] = b;
+		pthread_cond_signal(&e->freed);
+	}
+	pthread_mutex_unlock(&e->lock);
+
+	return(NULL);
+}
+
+/**
+ * \}
+ **/
@@ -0,0 +1,1382 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file export.c
+ * Routines to export the entries of a scan as a Parquet file.
+ *
+ * Every entry is a row of
+ *
+ *     id      INT64                  entry id, the top level path 0
+ *     parent  INT64                  id of the directory holding it,
+ *                                    -1 for the top level path
+ *     dir     BYTE_ARRAY (UTF8)      path of that directory
+ *     name    BYTE_ARRAY (UTF8)      name of the entry
+ *     type    BYTE_ARRAY (UTF8)      f, d, l, o for others, ? unknown
+ *     size    INT64                  size in bytes
+ *     blocks  INT64                  512 byte blocks allocated
+ *     atime   INT64 (TIMESTAMP_MICROS)
+ *     mtime   INT64 (TIMESTAMP_MICROS)
+ *     uid     INT32 (UINT_32)
+ *     gid     INT32 (UINT_32)
+ *
+ * in the order the walk found them. Directories are given ids as in a
+ * trace, when first seen, and other entries the next id when found.
+ * The dir column is dictionary encoded: each row group has a table of
+ * the directories its rows are in, and the rows hold run length
+ * encoded indices into it, so a directory costs its path once per row
+ * group and its entries, which mostly arrive together, next to
+ * nothing. Pages are not compressed, and the numeric columns carry
+ * their minimum and maximum so readers can skip row groups.
+ *
+ * Rows are added to a row group of EXPORT_ROWS rows, which when full
+ * is handed to one of EXPORT_THREADS threads to be encoded while the
+ * walk fills another. The row groups are written in turn, and no more
+ * than EXPORT_GROUPS are held at once: a walk that outruns the threads
+ * waits for one to be written. The footer is written at the end.
+ *
+ * \ingroup export
+ * \{
+ **/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "walk.h"
+#include "export.h"
+
+#define EXPORT_MAGIC    "PAR1"
+#define EXPORT_ROWS     (1 << 17)   /**< Rows of a row group **/
+#define EXPORT_THREADS  2           /**< Row group encoding threads **/
+#define EXPORT_GROUPS   (EXPORT_THREADS + 2)/**< Row groups held at once **/
+#define EXPORT_NAMES    (1 << 22)   /**< Initial bytes of names **/
+
+/** Parquet physical types **/
+#define PQ_INT32        1
+#define PQ_INT64        2
+#define PQ_BYTE_ARRAY   6
+
+/** Parquet converted types, -1 for none **/
+#define PQ_UTF8         0
+#define PQ_TS_MICROS    10
+#define PQ_UINT_32      13
+
+/** Parquet encodings **/
+#define PQ_PLAIN        0
+#define PQ_RLE          3
+#define PQ_RLE_DICT     8
+
+/** Parquet page types **/
+#define PQ_DATA_PAGE    0
+#define PQ_DICT_PAGE    2
+
+/** Thrift compact protocol types **/
+#define TC_I32          5
+#define TC_I64          6
+#define TC_BINARY       8
+#define TC_LIST         9
+#define TC_STRUCT       12
+
+/**
+ * Columns.
+ **/
+enum column { C_ID, C_PARENT, C_DIR, C_NAME, C_TYPE, C_SIZE, C_BLOCKS,
+	      C_ATIME, C_MTIME, C_UID, C_GID, C_NCOL };
+
+/**
+ * The schema.
+ **/
+static const struct {
+	const char *name;      /**< Column name **/
+	int type;              /**< Physical type **/
+	int conv;              /**< Converted type, or -1 **/
+} schema[C_NCOL] = {
+	{"id", PQ_INT64, -1},
+	{"parent", PQ_INT64, -1},
+	{"dir", PQ_BYTE_ARRAY, PQ_UTF8},
+	{"name", PQ_BYTE_ARRAY, PQ_UTF8},
+	{"type", PQ_BYTE_ARRAY, PQ_UTF8},
+	{"size", PQ_INT64, -1},
+	{"blocks", PQ_INT64, -1},
+	{"atime", PQ_INT64, PQ_TS_MICROS},
+	{"mtime", PQ_INT64, PQ_TS_MICROS},
+	{"uid", PQ_INT32, PQ_UINT_32},
+	{"gid", PQ_INT32, PQ_UINT_32}
+};
+
+/**
+ * A growing byte buffer.
+ **/
+struct obuf {
+	uint8_t *p;            /**< The bytes **/
+	size_t len;            /**< Bytes used **/
+	size_t size;           /**< Bytes allocated **/
+	int error;             /**< There was no memory for some bytes **/
+};
+
+/**
+ * A row group being filled or encoded.
+ **/
+struct group {
+	uint64_t seq;          /**< Order of the row group **/
+	uint32_t n;            /**< Number of rows **/
+	int64_t *col[C_NCOL];  /**< Numeric columns, by column **/
+	uint32_t *dir;         /**< Dictionary index of the directory **/
+	uint8_t *type;         /**< Type letters **/
+	uint32_t *noff;        /**< End of each name in names **/
+	struct obuf names;     /**< Names **/
+	uint32_t ndict;        /**< Directories of the row group **/
+	uint32_t *doff;        /**< End of each directory in dict **/
+	uint32_t dsize;        /**< Directories allocated **/
+	struct obuf dict;      /**< Directory paths **/
+	struct group *next;    /**< Next in its list **/
+};
+
+/**
+ * A column chunk written.
+ **/
+struct chunk {
+	int64_t dict;          /**< Offset of the dictionary page of dir **/
+	int64_t data;          /**< Offset of the data page **/
+	int64_t size;          /**< Bytes with the page headers **/
+	int64_t min;           /**< Smallest value **/
+	int64_t max;           /**< Largest value **/
+};
+
+/**
+ * A row group written.
+ **/
+struct rowgroup {
+	uint32_t n;            /**< Number of rows **/
+	int64_t size;          /**< Bytes of its column chunks **/
+	struct chunk col[C_NCOL];/**< Its column chunks **/
+};
+
+/**
+ * A directory by path.
+ **/
+struct edir {
+	uint64_t hash;         /**< Hash of the path **/
+	int64_t id;            /**< Its id **/
+	uint64_t seq;          /**< Last row group it is in, plus one **/
+	uint32_t local;        /**< Its index in that row group **/
+	char *path;            /**< The path, NULL when the slot is empty **/
+};
+
+/**
+ * An export being written.
+ **/
+struct export {
+	int fd;                /**< The file **/
+	int error;             /**< First write error **/
+	int nomem;             /**< An entry was left out, of the walk **/
+	char *root;            /**< Top level path **/
+	time_t now;            /**< Time the scan started **/
+	int64_t nid;           /**< Next id **/
+	uint64_t rows;         /**< Rows added **/
+	struct edir *dirs;     /**< Directories by path **/
+	size_t ndirs;          /**< Number of directories **/
+	size_t size;           /**< Slots in dirs **/
+	char *lpath;           /**< Path of the last parent **/
+	size_t llen;           /**< Length of lpath **/
+	int64_t lid;           /**< Id of the last parent **/
+	uint64_t lseq;         /**< Row group of llocal, plus one **/
+	uint32_t llocal;       /**< Index of the last parent **/
+	struct group *cur;     /**< Row group being filled **/
+	uint64_t seq;          /**< Next row group to fill **/
+	pthread_mutex_t lock;  /**< Protects the lists and wseq **/
+	pthread_cond_t cond;   /**< Signals a change of them **/
+	struct group *free;    /**< Row groups to fill **/
+	struct group *head;    /**< Row groups to encode **/
+	struct group *tail;    /**< Last of them **/
+	uint64_t wseq;         /**< Next row group to write **/
+	int done;              /**< No more row groups are coming **/
+	pthread_t threads[EXPORT_THREADS];/**< Encoding threads **/
+	int64_t offset;        /**< Bytes written, of the writing thread **/
+	struct rowgroup *rgs;  /**< Row groups written **/
+	size_t nrgs;           /**< Number of them **/
+	uint64_t wait;         /**< Time the walk waited, ns **/
+};
+
+/* Internal functions */
+static void       *encoder(void *);
+static void       encode(const struct group *, struct obuf *, struct obuf *,
+			 struct rowgroup *);
+static void       page(struct obuf *, int, const struct obuf *, uint32_t,
+		       int);
+static void       footer(struct export *, struct obuf *);
+static void       submit(struct export *, struct group *);
+static struct group *take(struct export *);
+static struct group *group_new(void);
+static void       group_free(struct group *);
+static uint32_t   dict_add(struct group *, const char *, size_t);
+static int32_t    parent(struct export *, struct group *, const char *,
+			 size_t, int64_t *, uint32_t *);
+static size_t     find(struct export *, const char *, size_t);
+static int32_t    grow(struct export *);
+static uint64_t   fnv(const char *, size_t);
+static uint8_t    *room(struct obuf *, size_t);
+static void       bytes(struct obuf *, const void *, size_t);
+static void       varint(struct obuf *, uint64_t);
+static void       le32(struct obuf *, uint32_t);
+static void       t_field(struct obuf *, int16_t *, int16_t, int);
+static void       t_i32(struct obuf *, int16_t *, int16_t, int32_t);
+static void       t_i64(struct obuf *, int16_t *, int16_t, int64_t);
+static void       t_bin(struct obuf *, int16_t *, int16_t, const void *,
+			size_t);
+static void       t_list(struct obuf *, int16_t *, int16_t, int, size_t);
+static void       write_all(struct export *, const void *, size_t);
+
+/**
+ * Export the entries of the next scan of a context.
+ *
+ * \param[in] ctx   The scan context.
+ * \param[in] path  The Parquet file to write.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+int32_t
+tdu_export(struct tdu_ctx *ctx, const char *path)
+{
+	int fd = -1;
+	struct export *e = NULL;
+
+	if (ctx == NULL || path == NULL || ctx->export != NULL) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		return(EXIT_FAILURE);
+	}
+
+	if ((e = calloc(1, sizeof(struct export))) == NULL) {
+		close(fd);
+		errno = ENOMEM;
+		return(EXIT_FAILURE);
+	}
+	e->fd = fd;
+	e->llen = SIZE_MAX;
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_cond_init(&e->cond, NULL);
+	ctx->export = e;
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Start the export, when the scan starts.
+ *
+ * Without memory for the export it is abandoned, and finishing it
+ * fails with ENOMEM.
+ *
+ * \param[in] ctx  The scan context.
+ **/
+void
+export_begin(struct tdu_ctx *ctx)
+{
+	uint32_t i = 0;
+	struct group *g = NULL;
+	struct export *e = ctx->export;
+
+	e->now = ctx->now;
+	if ((e->root = strdup(ctx->opts.path)) == NULL) {
+		e->nomem = 1;
+		return;
+	}
+	write_all(e, EXPORT_MAGIC, 4);
+	e->offset = 4;
+
+	/* The top level path is directory 0 */
+	if (find(e, e->root, strlen(e->root)) == SIZE_MAX) {
+		e->nomem = 1;
+	}
+
+	for (i = 0; i < EXPORT_GROUPS; ++i) {
+		if ((g = group_new()) == NULL) {
+			break;
+		}
+		g->next = e->free;
+		e->free = g;
+	}
+	/* A row group to fill is all that is needed */
+	if (e->free == NULL) {
+		e->nomem = 1;
+	}
+	for (i = 0; i < EXPORT_THREADS; ++i) {
+		pthread_create(&e->threads[i], NULL, encoder, e);
+	}
+}
+
+/**
+ * Export an entry found by a walk.
+ *
+ * \param[in] ctx    The scan context.
+ * \param[in] fpath  Name of the entry.
+ * \param[in] sb     Stat buffer of the entry.
+ * \param[in] tflag  File type flags.
+ * \param[in] level  Level of the entry below the top level path.
+ **/
+void
+export_record(struct tdu_ctx *ctx, const char *fpath, const struct stat *sb,
+	      int tflag, int level)
+{
+	uint32_t r = 0;
+	size_t i = 0;
+	size_t len = 0;
+	int64_t id = 0;
+	int64_t pid = -1;
+	uint32_t idx = 0;
+	const char *name = fpath;
+	struct group *g = NULL;
+	struct export *e = ctx->export;
+	static const struct stat none;
+
+	/* An export with an entry left out is abandoned */
+	if (e->nomem) {
+		return;
+	}
+	if ((g = e->cur) == NULL) {
+		g = e->cur = take(e);
+	}
+
+	if (level > 0 && (name = strrchr(fpath, '/')) != NULL) {
+		/* Entries right below / are in / */
+		len = name > fpath ? (size_t)(name - fpath) : 1;
+		if (parent(e, g, fpath, len, &pid, &idx)) {
+			e->nomem = 1;
+			return;
+		}
+		++name;
+		if (S_ISDIR(sb->st_mode) && tflag != FTW_NS) {
+			if ((i = find(e, fpath, strlen(fpath))) == SIZE_MAX) {
+				e->nomem = 1;
+				return;
+			}
+			id = e->dirs[i].id;
+		} else {
+			id = e->nid++;
+		}
+	} else {
+		name = fpath;
+		if ((idx = dict_add(g, "", 0)) == UINT32_MAX) {
+			e->nomem = 1;
+			return;
+		}
+	}
+	if (tflag == FTW_NS) {
+		sb = &none;
+	}
+
+	r = g->n;
+	g->col[C_ID][r] = id;
+	g->col[C_PARENT][r] = pid;
+	g->dir[r] = idx;
+	len = strlen(name);
+	bytes(&g->names, name, len);
+	if (g->names.error) {
+		e->nomem = 1;
+		return;
+	}
+	g->noff[r] = g->names.len;
+	g->type[r] = tflag == FTW_NS ? '?' : S_ISREG(sb->st_mode) ? 'f' :
+		S_ISDIR(sb->st_mode) ? 'd' : S_ISLNK(sb->st_mode) ? 'l' : 'o';
+	g->col[C_SIZE][r] = sb->st_size;
+	g->col[C_BLOCKS][r] = sb->st_blocks;
+	g->col[C_ATIME][r] = (int64_t)sb->st_atim.tv_sec * 1000000 +
+		sb->st_atim.tv_nsec / 1000;
+	g->col[C_MTIME][r] = (int64_t)sb->st_mtim.tv_sec * 1000000 +
+		sb->st_mtim.tv_nsec / 1000;
+	g->col[C_UID][r] = sb->st_uid;
+	g->col[C_GID][r] = sb->st_gid;
+	++e->rows;
+
+	if (++g->n == EXPORT_ROWS) {
+		submit(e, g);
+		e->cur = NULL;
+	}
+}
+
+/**
+ * Finish the export of a scan.
+ *
+ * \param[in] ctx  The scan context.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the file could not be written, errno is set.
+ **/
+int32_t
+export_finish(struct tdu_ctx *ctx)
+{
+	int error = 0;
+	size_t i = 0;
+	struct group *g = NULL;
+	struct obuf o = {0};
+	struct export *e = ctx->export;
+
+	if (e == NULL) {
+		return(EXIT_SUCCESS);
+	}
+
+	/* A context destroyed before its scan started has no threads */
+	if (e->root != NULL) {
+		if (e->cur != NULL && e->cur->n > 0) {
+			submit(e, e->cur);
+			e->cur = NULL;
+		}
+		pthread_mutex_lock(&e->lock);
+		e->done = 1;
+		pthread_cond_broadcast(&e->cond);
+		pthread_mutex_unlock(&e->lock);
+		for (i = 0; i < EXPORT_THREADS; ++i) {
+			pthread_join(e->threads[i], NULL);
+		}
+
+		/* The footer ends with its length */
+		footer(e, &o);
+		le32(&o, o.len);
+		bytes(&o, EXPORT_MAGIC, 4);
+		write_all(e, o.p, o.len);
+		e->offset += o.len;
+	}
+
+	error = e->error;
+	if (error == 0 && (e->nomem || o.error)) {
+		error = ENOMEM;
+	}
+	if (close(e->fd) != 0 && error == 0) {
+		error = errno;
+	}
+	if (ctx->opts.verbose) {
+		warnx(_("exported %llu entries in %zu row groups, %.1f MB, "
+			"the walk waited %.3f s"), (unsigned long long)e->rows,
+		      e->nrgs, e->offset / 1e6, e->wait / 1e9);
+	}
+
+	if (e->cur != NULL) {
+		group_free(e->cur);
+	}
+	while ((g = e->free) != NULL) {
+		e->free = g->next;
+		group_free(g);
+	}
+	for (i = 0; i < e->size; ++i) {
+		free(e->dirs[i].path);
+	}
+	pthread_mutex_destroy(&e->lock);
+	pthread_cond_destroy(&e->cond);
+	free(e->dirs);
+	free(e->lpath);
+	free(e->rgs);
+	free(e->root);
+	free(o.p);
+	free(e);
+	ctx->export = NULL;
+
+	if (error != 0) {
+		errno = error;
+		return(EXIT_FAILURE);
+	}
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Encode and write row groups, in a thread of their own.
+ *
+ * \param[in] arg  The export.
+ *
+ * \retval NULL Always.
+ **/
+static void *
+encoder(void *arg)
+{
+	uint32_t c = 0;
+	struct export *e = arg;
+	struct group *g = NULL;
+	struct obuf o = {0};
+	struct obuf s = {0};
+	struct rowgroup rg = {0};
+	struct rowgroup *rgs = NULL;
+
+	for (;;) {
+		pthread_mutex_lock(&e->lock);
+		while (e->head == NULL && !e->done) {
+			pthread_cond_wait(&e->cond, &e->lock);
+		}
+		if ((g = e->head) == NULL) {
+			pthread_mutex_unlock(&e->lock);
+			break;
+		}
+		if ((e->head = g->next) == NULL) {
+			e->tail = NULL;
+		}
+		pthread_mutex_unlock(&e->lock);
+
+		encode(g, &o, &s, &rg);
+
+		/* Row groups are written in turn */
+		pthread_mutex_lock(&e->lock);
+		while (e->wseq != g->seq) {
+			pthread_cond_wait(&e->cond, &e->lock);
+		}
+		pthread_mutex_unlock(&e->lock);
+
+		for (c = 0; c < C_NCOL; ++c) {
+			rg.col[c].dict += e->offset;
+			rg.col[c].data += e->offset;
+		}
+		rg.size = o.len;
+		if (e->nrgs % 64 == 0 && e->error == 0) {
+			if ((rgs = realloc(e->rgs, (e->nrgs + 64) *
+					   sizeof(struct rowgroup))) == NULL) {
+				e->error = ENOMEM;
+			} else {
+				e->rgs = rgs;
+			}
+		}
+		/* Nothing more is written once a row group is lost */
+		if ((o.error || s.error) && e->error == 0) {
+			e->error = ENOMEM;
+		}
+		write_all(e, o.p, o.len);
+		e->offset += o.len;
+		if (e->error == 0) {
+			e->rgs[e->nrgs++] = rg;
+		}
+
+		pthread_mutex_lock(&e->lock);
+		++e->wseq;
+		g->next = e->free;
+		e->free = g;
+		pthread_cond_broadcast(&e->cond);
+		pthread_mutex_unlock(&e->lock);
+	}
+
+	free(o.p);
+	free(s.p);
+
+	return(NULL);
+}
+
+/**
+ * Encode the column chunks of a row group.
+ *
+ * Offsets are from the start of the row group.
+ *
+ * \param[in]  g   The row group.
+ * \param[out] o   The encoded row group.
+ * \param[out] s   Scratch for the page bodies.
+ * \param[out] rg  Where its column chunks are.
+ **/
+static void
+encode(const struct group *g, struct obuf *o, struct obuf *s,
+       struct rowgroup *rg)
+{
+	uint32_t c = 0;
+	uint32_t i = 0;
+	uint32_t b = 0;
+	uint32_t bw = 0;
+	uint32_t run = 0;
+	uint32_t from = 0;
+	int enc = PQ_PLAIN;
+	int64_t v = 0;
+	int64_t min = 0;
+	int64_t max = 0;
+	uint8_t *p = NULL;
+	size_t start = 0;
+	const int64_t *x = NULL;
+	struct chunk *k = NULL;
+
+	o->len = 0;
+	rg->n = g->n;
+	for (c = 0; c < C_NCOL; ++c) {
+		k = &rg->col[c];
+		k->dict = 0;
+		start = o->len;
+		s->len = 0;
+		enc = PQ_PLAIN;
+		x = g->col[c];
+
+		switch (c) {
+			case C_DIR:
+				for (i = 0, from = 0; i < g->ndict; ++i) {
+					le32(s, g->doff[i] - from);
+					bytes(s, g->dict.p + from,
+					      g->doff[i] - from);
+					from = g->doff[i];
+				}
+				k->dict = o->len;
+				page(o, PQ_DICT_PAGE, s, g->ndict, PQ_PLAIN);
+
+				/* Run length encoded indices */
+				s->len = 0;
+				for (bw = 1; (1U << bw) < g->ndict; ++bw) {
+					;
+				}
+				if ((p = room(s, 1)) == NULL) {
+					break;
+				}
+				p[0] = bw;
+				++s->len;
+				for (i = 0; i < g->n; i += run) {
+					for (run = 1; i + run < g->n &&
+					     g->dir[i + run] == g->dir[i]; ++run) {
+						;
+					}
+					varint(s, (uint64_t)run << 1);
+					if ((p = room(s, 4)) == NULL) {
+						break;
+					}
+					for (b = 0; b < (bw + 7) / 8; ++b) {
+						p[b] = (uint8_t)(g->dir[i] >> 8 * b);
+					}
+					s->len += b;
+				}
+				enc = PQ_RLE_DICT;
+				break;
+			case C_NAME:
+				for (i = 0, from = 0; i < g->n; ++i) {
+					le32(s, g->noff[i] - from);
+					bytes(s, g->names.p + from,
+					      g->noff[i] - from);
+					from = g->noff[i];
+				}
+				break;
+			case C_TYPE:
+				if ((p = room(s, 5 * (size_t)g->n)) == NULL) {
+					break;
+				}
+				for (i = 0; i < g->n; ++i) {
+					p[5 * i] = 1;
+					p[5 * i + 1] = 0;
+					p[5 * i + 2] = 0;
+					p[5 * i + 3] = 0;
+					p[5 * i + 4] = g->type[i];
+				}
+				s->len += 5 * (size_t)g->n;
+				break;
+			case C_UID:
+			case C_GID:
+				if ((p = room(s, 4 * (size_t)g->n)) == NULL) {
+					break;
+				}
+				for (i = 0, min = max = x[0]; i < g->n; ++i) {
+					v = x[i];
+					min = v < min ? v : min;
+					max = v > max ? v : max;
+					for (b = 0; b < 4; ++b) {
+						p[4 * i + b] = (uint8_t)(v >> 8 * b);
+					}
+				}
+				s->len += 4 * (size_t)g->n;
+				break;
+			default:
+				if ((p = room(s, 8 * (size_t)g->n)) == NULL) {
+					break;
+				}
+				for (i = 0, min = max = x[0]; i < g->n; ++i) {
+					v = x[i];
+					min = v < min ? v : min;
+					max = v > max ? v : max;
+					for (b = 0; b < 8; ++b) {
+						p[8 * i + b] = (uint8_t)(v >> 8 * b);
+					}
+				}
+				s->len += 8 * (size_t)g->n;
+				break;
+		}
+
+		k->min = min;
+		k->max = max;
+		k->data = o->len;
+		page(o, PQ_DATA_PAGE, s, g->n, enc);
+		k->size = o->len - start;
+	}
+}
+
+/**
+ * Add a page to a column chunk.
+ *
+ * \param[out] o     The column chunk.
+ * \param[in]  type  PQ_DATA_PAGE or PQ_DICT_PAGE.
+ * \param[in]  body  The encoded values.
+ * \param[in]  n     Number of values.
+ * \param[in]  enc   Their encoding.
+ **/
+static void
+page(struct obuf *o, int type, const struct obuf *body, uint32_t n, int enc)
+{
+	int16_t l0 = 0;
+	int16_t l1 = 0;
+
+	t_i32(o, &l0, 1, type);
+	t_i32(o, &l0, 2, body->len);
+	t_i32(o, &l0, 3, body->len);
+	if (type == PQ_DATA_PAGE) {
+		t_field(o, &l0, 5, TC_STRUCT);
+		t_i32(o, &l1, 1, n);
+		t_i32(o, &l1, 2, enc);
+		t_i32(o, &l1, 3, PQ_RLE);
+		t_i32(o, &l1, 4, PQ_RLE);
+	} else {
+		t_field(o, &l0, 7, TC_STRUCT);
+		t_i32(o, &l1, 1, n);
+		t_i32(o, &l1, 2, enc);
+	}
+	bytes(o, "\0\0", 2);
+	bytes(o, body->p, body->len);
+}
+
+/**
+ * Encode the file metadata.
+ *
+ * \param[in]  e  The export, every row group written.
+ * \param[out] o  The file metadata.
+ **/
+static void
+footer(struct export *e, struct obuf *o)
+{
+	size_t i = 0;
+	uint32_t c = 0;
+	uint32_t w = 0;
+	uint32_t b = 0;
+	int16_t l0 = 0;
+	int16_t l1 = 0;
+	int16_t l2 = 0;
+	int16_t l3 = 0;
+	int16_t l4 = 0;
+	uint8_t v[16];
+	char now[32];
+	const struct rowgroup *rg = NULL;
+	const struct chunk *k = NULL;
+
+	t_i32(o, &l0, 1, 1);
+	t_list(o, &l0, 2, TC_STRUCT, C_NCOL + 1);
+	l1 = 0;
+	t_bin(o, &l1, 4, "schema", 6);
+	t_i32(o, &l1, 5, C_NCOL);
+	bytes(o, "", 1);
+	for (c = 0; c < C_NCOL; ++c) {
+		l1 = 0;
+		t_i32(o, &l1, 1, schema[c].type);
+		t_i32(o, &l1, 3, 0);
+		t_bin(o, &l1, 4, schema[c].name, strlen(schema[c].name));
+		if (schema[c].conv >= 0) {
+			t_i32(o, &l1, 6, schema[c].conv);
+		}
+		bytes(o, "", 1);
+	}
+	t_i64(o, &l0, 3, e->rows);
+
+	t_list(o, &l0, 4, TC_STRUCT, e->nrgs);
+	for (i = 0; i < e->nrgs; ++i) {
+		rg = &e->rgs[i];
+		l1 = 0;
+		t_list(o, &l1, 1, TC_STRUCT, C_NCOL);
+		for (c = 0; c < C_NCOL; ++c) {
+			k = &rg->col[c];
+			l2 = l3 = 0;
+			t_i64(o, &l2, 2, c == C_DIR ? k->dict : k->data);
+			t_field(o, &l2, 3, TC_STRUCT);
+			t_i32(o, &l3, 1, schema[c].type);
+			if (c == C_DIR) {
+				t_list(o, &l3, 2, TC_I32, 3);
+				varint(o, 2 * PQ_PLAIN);
+				varint(o, 2 * PQ_RLE);
+				varint(o, 2 * PQ_RLE_DICT);
+			} else {
+				t_list(o, &l3, 2, TC_I32, 1);
+				varint(o, 2 * PQ_PLAIN);
+			}
+			t_list(o, &l3, 3, TC_BINARY, 1);
+			varint(o, strlen(schema[c].name));
+			bytes(o, schema[c].name, strlen(schema[c].name));
+			t_i32(o, &l3, 4, 0);
+			t_i64(o, &l3, 5, rg->n);
+			t_i64(o, &l3, 6, k->size);
+			t_i64(o, &l3, 7, k->size);
+			t_i64(o, &l3, 9, k->data);
+			if (c == C_DIR) {
+				t_i64(o, &l3, 11, k->dict);
+			}
+
+			/* Statistics of the numbers, in their plain encoding */
+			if (schema[c].type != PQ_BYTE_ARRAY) {
+				w = schema[c].type == PQ_INT64 ? 8 : 4;
+				for (b = 0; b < w; ++b) {
+					v[b] = (uint8_t)(k->max >> 8 * b);
+					v[w + b] = (uint8_t)(k->min >> 8 * b);
+				}
+				l4 = 0;
+				t_field(o, &l3, 12, TC_STRUCT);
+				t_i64(o, &l4, 3, 0);
+				t_bin(o, &l4, 5, v, w);
+				t_bin(o, &l4, 6, v + w, w);
+				bytes(o, "", 1);
+			}
+			bytes(o, "\0\0", 2);
+		}
+		t_i64(o, &l1, 2, rg->size);
+		t_i64(o, &l1, 3, rg->n);
+		bytes(o, "", 1);
+	}
+
+	/* Where and when the scan was */
+	snprintf(now, sizeof(now), "%lld", (long long)e->now);
+	t_list(o, &l0, 5, TC_STRUCT, 2);
+	l1 = 0;
+	t_bin(o, &l1, 1, "tdu.root", 8);
+	t_bin(o, &l1, 2, e->root, strlen(e->root));
+	bytes(o, "", 1);
+	l1 = 0;
+	t_bin(o, &l1, 1, "tdu.time", 8);
+	t_bin(o, &l1, 2, now, strlen(now));
+	bytes(o, "", 1);
+	t_bin(o, &l0, 6, PACKAGE " version " VERSION,
+	      strlen(PACKAGE " version " VERSION));
+
+	/* Every column in the order of its type, so its statistics hold */
+	t_list(o, &l0, 7, TC_STRUCT, C_NCOL);
+	for (c = 0; c < C_NCOL; ++c) {
+		bytes(o, "\x1c\0\0", 3);
+	}
+	bytes(o, "", 1);
+}
+
+/**
+ * Hand a full row group to the encoding threads.
+ *
+ * \param[in] e  The export.
+ * \param[in] g  The row group.
+ **/
+static void
+submit(struct export *e, struct group *g)
+{
+
+	pthread_mutex_lock(&e->lock);
+	g->next = NULL;
+	if (e->tail != NULL) {
+		e->tail->next = g;
+	} else {
+		e->head = g;
+	}
+	e->tail = g;
+	pthread_cond_broadcast(&e->cond);
+	pthread_mutex_unlock(&e->lock);
+}
+
+/**
+ * Take an empty row group to fill, waiting for one to be written.
+ *
+ * \param[in] e  The export.
+ *
+ * \retval g  The row group.
+ **/
+static struct group *
+take(struct export *e)
+{
+	struct group *g = NULL;
+	struct timespec t0 = {0};
+	struct timespec t1 = {0};
+
+	pthread_mutex_lock(&e->lock);
+	if (e->free == NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		while (e->free == NULL) {
+			pthread_cond_wait(&e->cond, &e->lock);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		e->wait += (t1.tv_sec - t0.tv_sec) * 1000000000ULL +
+			t1.tv_nsec - t0.tv_nsec;
+	}
+	g = e->free;
+	e->free = g->next;
+	pthread_mutex_unlock(&e->lock);
+
+	g->seq = e->seq++;
+	g->n = 0;
+	g->names.len = 0;
+	g->ndict = 0;
+	g->dict.len = 0;
+
+	return(g);
+}
+
+/**
+ * Allocate a row group.
+ *
+ * \retval g     The row group.
+ * \retval NULL  If there was no memory.
+ **/
+static struct group *
+group_new(void)
+{
+	uint32_t c = 0;
+	struct group *g = NULL;
+
+	if ((g = calloc(1, sizeof(struct group))) == NULL) {
+		return(NULL);
+	}
+	for (c = 0; c < C_NCOL; ++c) {
+		if (c != C_DIR && c != C_NAME && c != C_TYPE &&
+		    (g->col[c] = calloc(EXPORT_ROWS,
+					sizeof(int64_t))) == NULL) {
+			group_free(g);
+			return(NULL);
+		}
+	}
+	g->dir = calloc(EXPORT_ROWS, sizeof(uint32_t));
+	g->type = calloc(EXPORT_ROWS, 1);
+	g->noff = calloc(EXPORT_ROWS, sizeof(uint32_t));
+	if (g->dir == NULL || g->type == NULL || g->noff == NULL ||
+	    room(&g->names, EXPORT_NAMES) == NULL) {
+		group_free(g);
+		return(NULL);
+	}
+
+	return(g);
+}
+
+/**
+ * Release a row group.
+ *
+ * \param[in] g  The row group.
+ **/
+static void
+group_free(struct group *g)
+{
+	uint32_t c = 0;
+
+	for (c = 0; c < C_NCOL; ++c) {
+		free(g->col[c]);
+	}
+	free(g->dir);
+	free(g->type);
+	free(g->noff);
+	free(g->names.p);
+	free(g->doff);
+	free(g->dict.p);
+	free(g);
+}
+
+/**
+ * Add a directory to the dictionary of a row group.
+ *
+ * \param[in] g     The row group.
+ * \param[in] path  The directory.
+ * \param[in] len   Length of its path.
+ *
+ * \retval i           Its index.
+ * \retval UINT32_MAX  If there was no memory.
+ **/
+static uint32_t
+dict_add(struct group *g, const char *path, size_t len)
+{
+	uint32_t size = 0;
+	uint32_t *doff = NULL;
+
+	if (g->ndict == g->dsize) {
+		size = g->dsize ? 2 * g->dsize : 1024;
+		if ((doff = realloc(g->doff, size * sizeof(uint32_t))) == NULL) {
+			return(UINT32_MAX);
+		}
+		g->doff = doff;
+		g->dsize = size;
+	}
+	bytes(&g->dict, path, len);
+	if (g->dict.error) {
+		return(UINT32_MAX);
+	}
+	g->doff[g->ndict] = g->dict.len;
+
+	return(g->ndict++);
+}
+
+/**
+ * Find the id and dictionary index of the directory of an entry.
+ *
+ * \param[in]  e     The export.
+ * \param[in]  g     The row group of the entry.
+ * \param[in]  path  The directory.
+ * \param[in]  len   Length of its path.
+ * \param[out] id    Its id.
+ * \param[out] idx   Its index in the dictionary of the row group.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If there was no memory.
+ **/
+static int32_t
+parent(struct export *e, struct group *g, const char *path, size_t len,
+       int64_t *id, uint32_t *idx)
+{
+	size_t i = 0;
+	char *lpath = NULL;
+	struct edir *d = NULL;
+
+	/* Entries of a directory mostly arrive together */
+	if (len == e->llen && e->lseq == g->seq + 1 &&
+	    memcmp(path, e->lpath, len) == 0) {
+		*id = e->lid;
+		*idx = e->llocal;
+		return(EXIT_SUCCESS);
+	}
+
+	/* Finding it may grow the table */
+	if ((i = find(e, path, len)) == SIZE_MAX) {
+		return(EXIT_FAILURE);
+	}
+	d = &e->dirs[i];
+	if (d->seq != g->seq + 1) {
+		if ((d->local = dict_add(g, path, len)) == UINT32_MAX) {
+			return(EXIT_FAILURE);
+		}
+		d->seq = g->seq + 1;
+	}
+	*id = d->id;
+	*idx = d->local;
+
+	/* Without room the last parent is only not remembered */
+	if ((lpath = realloc(e->lpath, len + 1)) == NULL) {
+		return(EXIT_SUCCESS);
+	}
+	e->lpath = lpath;
+	memcpy(e->lpath, path, len);
+	e->llen = len;
+	e->lid = d->id;
+	e->lseq = d->seq;
+	e->llocal = d->local;
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Find a directory, giving it the next id when first seen.
+ *
+ * \param[in] e     The export.
+ * \param[in] path  The directory.
+ * \param[in] len   Length of its path.
+ *
+ * \retval i         Its slot in the directory table.
+ * \retval SIZE_MAX  If there was no memory.
+ **/
+static size_t
+find(struct export *e, const char *path, size_t len)
+{
+	size_t i = 0;
+	uint64_t h = 0;
+	char *p = NULL;
+
+	if (2 * (e->ndirs + 1) > e->size && grow(e)) {
+		return(SIZE_MAX);
+	}
+	h = fnv(path, len);
+	for (i = h & (e->size - 1); e->dirs[i].path != NULL;
+	     i = (i + 1) & (e->size - 1)) {
+		if (e->dirs[i].hash == h &&
+		    strncmp(e->dirs[i].path, path, len) == 0 &&
+		    e->dirs[i].path[len] == '\0') {
+			return(i);
+		}
+	}
+	if ((p = strndup(path, len)) == NULL) {
+		return(SIZE_MAX);
+	}
+	e->dirs[i].hash = h;
+	e->dirs[i].id = e->nid++;
+	e->dirs[i].path = p;
+	++e->ndirs;
+
+	return(i);
+}
+
+/**
+ * Double the directory table of an export.
+ *
+ * \param[in] e  The export.
+ *
+ * \retval 0 If the table was grown.
+ * \retval 1 If there was no memory, the table is left as it was.
+ **/
+static int32_t
+grow(struct export *e)
+{
+	size_t i = 0;
+	size_t j = 0;
+	size_t size = e->size ? e->size * 2 : 1024;
+	struct edir *dirs = NULL;
+
+	if ((dirs = calloc(size, sizeof(struct edir))) == NULL) {
+		return(EXIT_FAILURE);
+	}
+	for (i = 0; i < e->size; ++i) {
+		if (e->dirs[i].path == NULL) {
+			continue;
+		}
+		j = e->dirs[i].hash & (size - 1);
+		while (dirs[j].path != NULL) {
+			j = (j + 1) & (size - 1);
+		}
+		dirs[j] = e->dirs[i];
+	}
+	free(e->dirs);
+	e->dirs = dirs;
+	e->size = size;
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * 64 bit FNV-1a hash.
+ **/
+static uint64_t
+fnv(const char *s, size_t len)
+{
+	size_t i = 0;
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (i = 0; i < len; ++i) {
+		h ^= (uint8_t)s[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return(h);
+}
+
+/**
+ * Make room for more bytes at the end of a buffer.
+ *
+ * \param[in,out] o  The buffer.
+ * \param[in]     n  Number of bytes.
+ *
+ * \retval p     Where they go, the length is not changed.
+ * \retval NULL  If there was no memory, the buffer error is set.
+ **/
+static uint8_t *
+room(struct obuf *o, size_t n)
+{
+	size_t size = o->size;
+	uint8_t *p = NULL;
+
+	if (o->len + n > o->size) {
+		size = size ? size : 4096;
+		while (o->len + n > size) {
+			size *= 2;
+		}
+		if ((p = realloc(o->p, size)) == NULL) {
+			o->error = 1;
+			return(NULL);
+		}
+		o->p = p;
+		o->size = size;
+	}
+
+	return(o->p + o->len);
+}
+
+/**
+ * Append bytes to a buffer.
+ **/
+static void
+bytes(struct obuf *o, const void *p, size_t n)
+{
+	uint8_t *q = NULL;
+
+	if ((q = room(o, n)) == NULL) {
+		return;
+	}
+	memcpy(q, p, n);
+	o->len += n;
+}
+
+/**
+ * Append an unsigned LEB128 varint to a buffer.
+ **/
+static void
+varint(struct obuf *o, uint64_t v)
+{
+	uint8_t *p = NULL;
+
+	if ((p = room(o, 10)) == NULL) {
+		return;
+	}
+	while (v >= 0x80) {
+		*p++ = (uint8_t)(v | 0x80);
+		v >>= 7;
+		++o->len;
+	}
+	*p = (uint8_t)v;
+	++o->len;
+}
+
+/**
+ * Append a 32 bit little endian integer to a buffer.
+ **/
+static void
+le32(struct obuf *o, uint32_t v)
+{
+	uint8_t *p = NULL;
+
+	if ((p = room(o, 4)) == NULL) {
+		return;
+	}
+	p[0] = (uint8_t)v;
+	p[1] = (uint8_t)(v >> 8);
+	p[2] = (uint8_t)(v >> 16);
+	p[3] = (uint8_t)(v >> 24);
+	o->len += 4;
+}
+
+/**
+ * Append a Thrift compact protocol field header.
+ *
+ * \param[out]    o     The buffer.
+ * \param[in,out] last  Last field id of the struct.
+ * \param[in]     id    Field id.
+ * \param[in]     type  Field type.
+ **/
+static void
+t_field(struct obuf *o, int16_t *last, int16_t id, int type)
+{
+	uint8_t b = 0;
+
+	if (id > *last && id - *last <= 15) {
+		b = (uint8_t)((id - *last) << 4 | type);
+		bytes(o, &b, 1);
+	} else {
+		b = (uint8_t)type;
+		bytes(o, &b, 1);
+		varint(o, ((uint64_t)id << 1) ^ (uint64_t)(id >> 15));
+	}
+	*last = id;
+}
+
+/**
+ * Append a Thrift compact protocol i32 field.
+ **/
+static void
+t_i32(struct obuf *o, int16_t *last, int16_t id, int32_t v)
+{
+
+	t_field(o, last, id, TC_I32);
+	varint(o, (uint32_t)((uint32_t)v << 1 ^ (uint32_t)(v >> 31)));
+}
+
+/**
+ * Append a Thrift compact protocol i64 field.
+ **/
+static void
+t_i64(struct obuf *o, int16_t *last, int16_t id, int64_t v)
+{
+
+	t_field(o, last, id, TC_I64);
+	varint(o, (uint64_t)v << 1 ^ (uint64_t)(v >> 63));
+}
+
+/**
+ * Append a Thrift compact protocol binary field.
+ **/
+static void
+t_bin(struct obuf *o, int16_t *last, int16_t id, const void *p, size_t n)
+{
+
+	t_field(o, last, id, TC_BINARY);
+	varint(o, n);
+	bytes(o, p, n);
+}
+
+/**
+ * Append a Thrift compact protocol list field header.
+ *
+ * \param[out]    o     The buffer.
+ * \param[in,out] last  Last field id of the struct.
+ * \param[in]     id    Field id.
+ * \param[in]     type  Element type.
+ * \param[in]     n     Number of elements, which follow.
+ **/
+static void
+t_list(struct obuf *o, int16_t *last, int16_t id, int type, size_t n)
+{
+	uint8_t b = 0;
+
+	t_field(o, last, id, TC_LIST);
+	if (n < 15) {
+		b = (uint8_t)(n << 4 | type);
+		bytes(o, &b, 1);
+	} else {
+		b = (uint8_t)(0xf0 | type);
+		bytes(o, &b, 1);
+		varint(o, n);
+	}
+}
+
+/**
+ * Write to an export, keeping the first error.
+ **/
+static void
+write_all(struct export *e, const void *p, size_t n)
+{
+	ssize_t w = 0;
+	const uint8_t *b = p;
+
+	while (n > 0 && e->error == 0) {
+		if ((w = write(e->fd, b, n)) < 0) {
+			if (errno != EINTR) {
+				e->error = errno;
+			}
+			continue;
+		}
+		b += w;
+		n -= w;
+	}
+}
+
+/**
+ * \}
+ **/
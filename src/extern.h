@@ -46,19 +46,9 @@ extern "C"
 {
 #endif
 
-/** Program command line options **/
-struct opts {
-	int verbose;
-	int atime_days;
-	uint32_t maxdepth;
-	time_t atime;
-	float cost;
-	char units[3];
-	char *path;
-};
-
 /** Extern declarations **/
-extern struct opts options;     /**< Program command line options **/
+extern struct tdu_opts options; /**< Program command line options **/
+extern uint32_t columns;        /**< Extra report columns (COL_) **/
 
 #ifdef __cplusplus
 }                               /* extern "C" */
@@ -0,0 +1,265 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file gentypes.c
+ * Build the perfect hash of the file type table.
+ *
+ * Run at build time as
+ *
+ *     gentypes types.txt > typehash.h
+ *
+ * Every extension and name of the table is packed into a key by
+ * type_key() and placed by the hash
+ *
+ *     (key * TYPE_MULT) >> (64 - TYPE_BITS)
+ *
+ * where the multiplier is searched for until no two keys share a slot.
+ * A file is then classified with one multiply and one compare.
+ *
+ * \ingroup type
+ * \{
+ **/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <err.h>
+#include <sysexits.h>
+
+#include "tdu.h"
+#include "type.h"
+
+/** Multipliers tried before the table is made larger **/
+#define TRIES           (1 << 20)
+
+/** Most keys in the table **/
+#define MAXKEYS         4096
+
+/* Internal functions */
+static uint64_t   next(uint64_t *);
+static int        fits(const uint64_t *, size_t, uint64_t, uint32_t);
+
+/**
+ * Generate the perfect hash of a type table.
+ *
+ * \param[in] argc  Number of command line arguments.
+ * \param[in] argv  The command line arguments.
+ *
+ * \retval 0 If there were no errors.
+ **/
+int
+main(int argc, char **argv)
+{
+	size_t i = 0;
+	size_t j = 0;
+	size_t nkey = 0;
+	size_t line = 0;
+	uint32_t bits = 1;
+	uint32_t ntype = 1;
+	uint32_t tries = 0;
+	uint64_t mult = 0;
+	uint64_t seed = 0;
+	uint64_t h = 0;
+	uint64_t k = 0;
+	uint64_t *keys = NULL;
+	uint8_t *types = NULL;
+	uint64_t *slot = NULL;
+	uint8_t *stype = NULL;
+	char *names[TDU_NTYPE] = {"other"};
+	char buf[4096];
+	char *w = NULL;
+	FILE *fp = NULL;
+
+	if (argc != 2) {
+		errx(EX_USAGE, "usage: gentypes table");
+	}
+	if ((fp = fopen(argv[1], "r")) == NULL) {
+		err(EX_NOINPUT, "unable to open %s", argv[1]);
+	}
+
+	keys = calloc(MAXKEYS, sizeof(uint64_t));
+	types = calloc(MAXKEYS, sizeof(uint8_t));
+	if (keys == NULL || types == NULL) {
+		err(EX_OSERR, "unable to allocate the keys");
+	}
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		++line;
+		buf[strcspn(buf, "#\n")] = '\0';
+		if ((w = strtok(buf, " \t")) == NULL) {
+			continue;
+		}
+		if (!type_valid(w) || ntype == TDU_NTYPE) {
+			errx(EX_DATAERR, "%s:%zu: bad or too many types",
+			     argv[1], line);
+		}
+		names[ntype] = strdup(w);
+		while ((w = strtok(NULL, " \t")) != NULL) {
+			if ((k = type_word(w)) == 0 || nkey == MAXKEYS) {
+				errx(EX_DATAERR, "%s:%zu: can not classify %s",
+				     argv[1], line, w);
+			}
+			for (i = 0; i < nkey; ++i) {
+				if (keys[i] == k) {
+					errx(EX_DATAERR, "%s:%zu: %s is repeated",
+					     argv[1], line, w);
+				}
+			}
+			keys[nkey] = k;
+			types[nkey] = ntype;
+			++nkey;
+		}
+		++ntype;
+	}
+	fclose(fp);
+
+	/* Keep the table at most half full */
+	while (((size_t)1 << bits) < 2 * nkey) {
+		++bits;
+	}
+	for (;;) {
+		for (tries = 0; tries < TRIES; ++tries) {
+			mult = next(&seed) | 1;
+			if (fits(keys, nkey, mult, bits)) {
+				break;
+			}
+		}
+		if (tries < TRIES) {
+			break;
+		}
+		++bits;
+	}
+
+	slot = calloc((size_t)1 << bits, sizeof(uint64_t));
+	stype = calloc((size_t)1 << bits, sizeof(uint8_t));
+	if (slot == NULL || stype == NULL) {
+		err(EX_OSERR, "unable to allocate the table");
+	}
+	for (i = 0; i < nkey; ++i) {
+		h = (keys[i] * mult) >> (64 - bits);
+		slot[h] = keys[i];
+		stype[h] = types[i];
+	}
+
+	printf("/* Generated by gentypes from %s, do not edit */\n\n",
+	       argv[1]);
+	printf("#define TYPE_BITS       %u\n", bits);
+	printf("#define TYPE_MULT       UINT64_C(0x%016llx)\n",
+	       (unsigned long long)mult);
+	printf("#define TYPE_NBUILTIN   %u\n\n", ntype);
+
+	printf("static const char *const type_builtin[TYPE_NBUILTIN] = {\n");
+	for (i = 0; i < ntype; ++i) {
+		printf("\t\"%s\",\n", names[i]);
+	}
+	printf("};\n\n");
+
+	printf("static const uint64_t type_keys[1 << TYPE_BITS] = {\n");
+	for (i = 0; i < ((size_t)1 << bits); i += 4) {
+		printf("\t");
+		for (j = i; j < i + 4 && j < ((size_t)1 << bits); ++j) {
+			printf("UINT64_C(0x%016llx),%s",
+			       (unsigned long long)slot[j],
+			       j + 1 < i + 4 ? " " : "\n");
+		}
+	}
+	printf("};\n\n");
+
+	printf("static const uint8_t type_types[1 << TYPE_BITS] = {\n");
+	for (i = 0; i < ((size_t)1 << bits); i += 16) {
+		printf("\t");
+		for (j = i; j < i + 16 && j < ((size_t)1 << bits); ++j) {
+			printf("%u,%s", stype[j], j + 1 < i + 16 ? " " : "\n");
+		}
+	}
+	printf("};\n");
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Next multiplier to try, from a fixed sequence so builds repeat.
+ *
+ * \param[in,out] state  The sequence state.
+ *
+ * \retval mult  The multiplier.
+ **/
+static uint64_t
+next(uint64_t *state)
+{
+	uint64_t z = (*state += UINT64_C(0x9e3779b97f4a7c15));
+
+	z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+	z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+
+	return(z ^ (z >> 31));
+}
+
+/**
+ * Check that a multiplier gives every key its own slot.
+ *
+ * \param[in] keys  The keys.
+ * \param[in] n     Number of keys.
+ * \param[in] mult  The multiplier.
+ * \param[in] bits  Bits of the table size.
+ *
+ * \retval 1 If no two keys share a slot.
+ * \retval 0 Otherwise.
+ **/
+static int
+fits(const uint64_t *keys, size_t n, uint64_t mult, uint32_t bits)
+{
+	size_t i = 0;
+	uint64_t h = 0;
+	static uint8_t used[1 << 16];
+
+	if (bits > 16) {
+		errx(EX_SOFTWARE, "no perfect hash of the table");
+	}
+	memset(used, 0, (size_t)1 << bits);
+	for (i = 0; i < n; ++i) {
+		h = (keys[i] * mult) >> (64 - bits);
+		if (used[h]) {
+			return(0);
+		}
+		used[h] = 1;
+	}
+
+	return(1);
+}
+
+/**
+ * \}
+ **/
@@ -0,0 +1,972 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file history.c
+ * Routines to keep and query a compact history of scans.
+ *
+ * A history store is a single append only file, a header followed
+ * by records of a type byte, a 32 bit little endian length and a
+ * payload. Integers within a payload are LEB128 varints, signed ones
+ * zigzag encoded.
+ *
+ *     'P'  count, then count (length, bytes) paths. Paths are given
+ *          ids in the order they were first added, by any run.
+ *     'R'  time, flags, file system size, file system used, count,
+ *          then count entries of (id delta << 1 | removed, total,
+ *          greater).
+ *
+ * A key run (flags bit 0) holds the absolute value of every path. The
+ * other runs hold only the paths that changed since the previous run,
+ * as differences, and mark the paths that went away. A key run is
+ * written every HISTORY_KEY runs, so any run is at most that many runs
+ * from one that can be decoded on its own.
+ *
+ * \ingroup history
+ * \{
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <search.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "extern.h"
+#include "mem.h"
+#include "history.h"
+
+#define HISTORY_MAGIC    "TDUH\001"
+#define HISTORY_MAGICLEN 5
+#define HISTORY_KEY      32
+#define HISTORY_DAYS     30
+#define HISTORY_TOP      20
+#define HISTORY_RUN      0x01
+
+/**
+ * A run held in a history store.
+ **/
+struct hrun {
+	time_t time;           /**< When the scan started **/
+	int key;               /**< Holds every path **/
+	uint64_t fssize;       /**< File system size in bytes **/
+	uint64_t fsused;       /**< File system bytes used **/
+	const uint8_t *p;      /**< First entry **/
+	const uint8_t *end;    /**< End of the entries **/
+	uint64_t n;            /**< Number of entries **/
+};
+
+/**
+ * A path by name, used when appending.
+ **/
+struct hpath {
+	char *path;            /**< The path **/
+	uint32_t id;           /**< Its id **/
+};
+
+/**
+ * An open history store and the decoded state of one of its runs.
+ **/
+struct hist {
+	int fd;                /**< The store **/
+	uint8_t *map;          /**< The store mapped **/
+	size_t size;           /**< Size of the store **/
+	size_t npaths;         /**< Number of paths **/
+	char **paths;          /**< Paths by id **/
+	size_t nruns;          /**< Number of runs **/
+	struct hrun *runs;     /**< The runs **/
+	size_t cur;            /**< The decoded run **/
+	uint64_t *total;       /**< Total bytes by id **/
+	uint64_t *greater;     /**< Old bytes by id **/
+	uint8_t *present;      /**< Path was found by id **/
+};
+
+/**
+ * Appending state.
+ **/
+struct happend {
+	struct hist *h;        /**< The store **/
+	void *byname;          /**< Paths by name **/
+	size_t nnew;           /**< Number of new paths **/
+	uint64_t *total;       /**< New total bytes by id **/
+	uint64_t *greater;     /**< New old bytes by id **/
+	uint8_t *present;      /**< Path was found by id **/
+	size_t cap;            /**< Size of the arrays **/
+};
+
+/**
+ * Trend of a path over the queried runs.
+ **/
+struct trend {
+	uint32_t id;           /**< The path **/
+	double growth;         /**< Growth in bytes **/
+	double rate;           /**< Least squares growth in bytes per day **/
+};
+
+/* Internal functions */
+static int32_t        hist_open(struct hist *, const char *, int);
+static void           hist_close(struct hist *);
+static int32_t        hist_seek(struct hist *, size_t);
+static int32_t        hist_decode(struct hist *, size_t);
+static void           hist_grow(struct hist *);
+static int            collect(const struct pinfo *, void *);
+static int            hpathcmp(const void *, const void *);
+static int            trendcmp(const void *, const void *);
+static double         slope(const double *);
+static void           fit(double *, double, double);
+static void           put(uint8_t **, size_t *, size_t *, uint64_t);
+static int            get(const uint8_t **, const uint8_t *, uint64_t *);
+static void           print_usage(void);
+static char          *date(time_t, char *, size_t);
+
+/**
+ * Append a scan to a history store, creating the store if needed.
+ *
+ * \param[in] file  The history store.
+ * \param[in] ctx   The scanned context.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted.
+ **/
+int32_t
+history_append(const char *file, struct tdu_ctx *ctx)
+{
+	size_t i = 0;
+	size_t n = 0;
+	size_t len = 0;
+	size_t cap = 0;
+	size_t count = 0;
+	size_t last = 0;
+	int key = 0;
+	int64_t dt = 0;
+	int64_t dg = 0;
+	uint8_t *buf = NULL;
+	uint8_t hdr[5] = {0};
+	struct hist h = {0};
+	struct happend a = {0};
+	struct hpath *hp = NULL;
+	struct statvfs vfs = {0};
+	uint64_t t = 0;
+	uint64_t g = 0;
+	int32_t rc = EXIT_FAILURE;
+
+	if (hist_open(&h, file, 1)) {
+		return(EXIT_FAILURE);
+	}
+
+	/* The last run is what the new one is a difference from */
+	if (h.nruns > 0 && hist_seek(&h, h.nruns - 1)) {
+		goto out;
+	}
+	hist_grow(&h);
+
+	a.h = &h;
+	a.cap = h.npaths + 1;
+	a.total = xmalloc(a.cap * sizeof(uint64_t));
+	a.greater = xmalloc(a.cap * sizeof(uint64_t));
+	a.present = xmalloc(a.cap);
+	memset(a.present, 0, a.cap);
+	for (i = 0; i < h.npaths; ++i) {
+		hp = xmalloc(sizeof(struct hpath));
+		hp->path = h.paths[i];
+		hp->id = i;
+		tsearch(hp, &a.byname, hpathcmp);
+	}
+	tdu_visit(ctx, collect, &a);
+
+	/* Any new paths first, they are given the next ids */
+	if (a.nnew > 0) {
+		put(&buf, &len, &cap, a.nnew);
+		for (i = h.npaths - a.nnew; i < h.npaths; ++i) {
+			n = strlen(h.paths[i]);
+			put(&buf, &len, &cap, n);
+			if (len + n > cap) {
+				cap = (len + n) * 2;
+				buf = xrealloc(buf, cap);
+			}
+			memcpy(buf + len, h.paths[i], n);
+			len += n;
+		}
+		hdr[0] = 'P';
+		hdr[1] = len & 0xff;
+		hdr[2] = (len >> 8) & 0xff;
+		hdr[3] = (len >> 16) & 0xff;
+		hdr[4] = (len >> 24) & 0xff;
+		if (write(h.fd, hdr, 5) != 5 ||
+		    write(h.fd, buf, len) != (ssize_t)len) {
+			warn(_("unable to write %s"), file);
+			goto out;
+		}
+		len = 0;
+	}
+
+	/* A key run every so often */
+	for (i = 0, last = 0; i < h.nruns; ++i) {
+		if (h.runs[i].key) {
+			last = i;
+		}
+	}
+	key = (h.nruns == 0 || h.nruns - last >= HISTORY_KEY);
+
+	if (statvfs(options.path, &vfs) != 0) {
+		memset(&vfs, 0, sizeof(vfs));
+	}
+
+	for (i = 0, count = 0; i < h.npaths; ++i) {
+		if (key ? a.present[i] :
+		    (a.present[i] != h.present[i] ||
+		     (a.present[i] && (a.total[i] != h.total[i] ||
+				       a.greater[i] != h.greater[i])))) {
+			++count;
+		}
+	}
+
+	put(&buf, &len, &cap, (uint64_t)tdu_scantime(ctx));
+	put(&buf, &len, &cap, key ? HISTORY_RUN : 0);
+	put(&buf, &len, &cap, (uint64_t)vfs.f_blocks * vfs.f_frsize);
+	put(&buf, &len, &cap,
+	    (uint64_t)(vfs.f_blocks - vfs.f_bfree) * vfs.f_frsize);
+	put(&buf, &len, &cap, count);
+
+	for (i = 0, n = 0; i < h.npaths; ++i) {
+		if (key && !a.present[i]) {
+			continue;
+		}
+		if (!key && a.present[i] == h.present[i] &&
+		    (!a.present[i] || (a.total[i] == h.total[i] &&
+				       a.greater[i] == h.greater[i]))) {
+			continue;
+		}
+
+		if (!a.present[i]) {
+			put(&buf, &len, &cap, ((i - n) << 1) | 1);
+		} else {
+			t = (key || !h.present[i]) ? 0 : h.total[i];
+			g = (key || !h.present[i]) ? 0 : h.greater[i];
+			dt = (int64_t)(a.total[i] - t);
+			dg = (int64_t)(a.greater[i] - g);
+			put(&buf, &len, &cap, (i - n) << 1);
+			put(&buf, &len, &cap, ((uint64_t)dt << 1) ^ (dt >> 63));
+			put(&buf, &len, &cap, ((uint64_t)dg << 1) ^ (dg >> 63));
+		}
+		n = i;
+	}
+
+	hdr[0] = 'R';
+	hdr[1] = len & 0xff;
+	hdr[2] = (len >> 8) & 0xff;
+	hdr[3] = (len >> 16) & 0xff;
+	hdr[4] = (len >> 24) & 0xff;
+	if (write(h.fd, hdr, 5) != 5 || write(h.fd, buf, len) != (ssize_t)len) {
+		warn(_("unable to write %s"), file);
+		goto out;
+	}
+
+	rc = EXIT_SUCCESS;
+out:
+#if HAVE_TDESTROY
+	tdestroy(a.byname, free);
+#else
+	while (a.byname != NULL) {
+		hp = *(struct hpath **)a.byname;
+		tdelete(hp, &a.byname, hpathcmp);
+		free(hp);
+	}
+#endif /* HAVE_TDESTROY */
+	free(a.total);
+	free(a.greater);
+	free(a.present);
+	free(buf);
+	hist_close(&h);
+
+	return(rc);
+}
+
+/**
+ * The history sub-command, reporting the growth of paths.
+ *
+ * \param[in]  argc     Number of command line arguments.
+ * \param[in]  argv     Reference to the pointer to the argument array list.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted.
+ **/
+int32_t
+history_main(int32_t argc, char **argv)
+{
+	int32_t opt = 0;
+	int32_t opt_index = 0;
+	uint32_t days = HISTORY_DAYS;
+	uint32_t top = HISTORY_TOP;
+	char *file = getenv("TDU_HISTORY");
+	char *prefix = NULL;
+	char *soptions = "hH:d:n:u:";		/* short options structure */
+	static struct option loptions[] = {	/* long options structure */
+		{"help",     no_argument,       NULL, 'h'},
+		{"history",  required_argument, NULL, 'H'},
+		{"days",     required_argument, NULL, 'd'},
+		{"top",      required_argument, NULL, 'n'},
+		{"units",    required_argument, NULL, 'u'},
+		{NULL,       0,                 NULL,  0}
+	};
+	size_t i = 0;
+	size_t j = 0;
+	size_t n = 0;
+	size_t plen = 0;
+	size_t first = 0;
+	double x = 0.0;
+	double scale = 0.0;
+	double fs[5] = {0};
+	double *acc = NULL;
+	double *start = NULL;
+	double fill = 0.0;
+	struct hist h = {0};
+	struct trend *tr = NULL;
+	struct hrun *end = NULL;
+	char d0[32];
+	char d1[32];
+	int32_t rc = EXIT_FAILURE;
+
+	while ((opt = getopt_long(argc, argv, soptions, loptions,
+			    &opt_index)) != -1) {
+		switch (opt) {
+			case 'H':
+				file = optarg;
+				break;
+			case 'd':
+				days = (uint32_t)strtoul(optarg, NULL, 10);
+				break;
+			case 'n':
+				top = (uint32_t)strtoul(optarg, NULL, 10);
+				break;
+			case 'u':
+				snprintf(options.units, sizeof(options.units),
+					 "%cB", optarg[0] == 'k' || optarg[0] == 'K' ?
+					 'k' : toupper((unsigned char)optarg[0]));
+				if (tdu_scale(options.units) == 0) {
+					warnx(_("unknown units: %s"), optarg);
+					print_usage();
+				}
+				break;
+			default:
+				print_usage();
+				break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (file == NULL || argc > 1) {
+		print_usage();
+	}
+	if (argc == 1) {
+		prefix = argv[0];
+		plen = strlen(prefix);
+		while (plen > 1 && prefix[plen-1] == '/') {
+			prefix[--plen] = '\0';
+		}
+		if (strcmp(prefix, "/") == 0) {
+			prefix = NULL;
+		}
+	}
+	scale = (double)tdu_scale(options.units);
+
+	if (hist_open(&h, file, 0)) {
+		return(EXIT_FAILURE);
+	}
+	if (h.nruns < 2) {
+		warnx(_("%s holds fewer than two runs"), file);
+		goto out;
+	}
+
+	/* The runs within the last days of the history */
+	end = &h.runs[h.nruns - 1];
+	for (first = 0; first < h.nruns - 1; ++first) {
+		if (h.runs[first].time >= end->time - (time_t)days * SECONDS_IN_DAY) {
+			break;
+		}
+	}
+	if (first == h.nruns - 1) {
+		--first;
+	}
+
+	if (hist_seek(&h, first)) {
+		goto out;
+	}
+
+	/* Least squares sums of each path over the runs */
+	acc = xmalloc(h.npaths * 5 * sizeof(double));
+	start = xmalloc(h.npaths * sizeof(double));
+	for (i = 0; i < h.npaths; ++i) {
+		start[i] = h.present[i] ? (double)h.total[i] : 0.0;
+	}
+	for (j = first; j < h.nruns; ++j) {
+		if (j > first && hist_decode(&h, j)) {
+			goto out;
+		}
+		x = (double)(h.runs[j].time - h.runs[first].time) / SECONDS_IN_DAY;
+		for (i = 0; i < h.npaths; ++i) {
+			fit(&acc[i * 5], x, h.present[i] ? (double)h.total[i] : 0.0);
+		}
+		fit(fs, x, (double)h.runs[j].fsused);
+	}
+
+	tr = xmalloc(h.npaths * sizeof(struct trend));
+	for (i = 0, n = 0; i < h.npaths; ++i) {
+		if (prefix != NULL &&
+		    (strncmp(h.paths[i], prefix, plen) != 0 ||
+		     (h.paths[i][plen] != '\0' && h.paths[i][plen] != '/'))) {
+			continue;
+		}
+		tr[n].id = i;
+		tr[n].growth = (h.present[i] ? (double)h.total[i] : 0.0) -
+			       start[i];
+		tr[n].rate = slope(&acc[i * 5]);
+		++n;
+	}
+	qsort(tr, n, sizeof(struct trend), trendcmp);
+
+	printf(_("%zu runs from %s to %s\n"), h.nruns - first,
+	       date(h.runs[first].time, d0, sizeof(d0)),
+	       date(end->time, d1, sizeof(d1)));
+	if (end->fssize > 0) {
+		printf(_("File system: %.2f of %.2f %s used, %.2f %s/day, "),
+		       end->fsused / scale, end->fssize / scale, options.units,
+		       slope(fs) / scale, options.units);
+		if (slope(fs) > 0.0) {
+			fill = (double)(end->fssize - end->fsused) / slope(fs);
+			printf(_("full by %s\n"), date(end->time +
+			       (time_t)(fill * SECONDS_IN_DAY), d0, sizeof(d0)));
+		} else {
+			printf(_("not filling\n"));
+		}
+	}
+
+	printf(_("Growth [%s]    Rate [%s/day]    Size [%s]    Directory\n"),
+	       options.units, options.units, options.units);
+	for (i = 0; i < n && i < top; ++i) {
+		j = tr[i].id;
+		printf(_("%12.2f  %14.4f  %12.2f    %s\n"),
+		       tr[i].growth / scale, tr[i].rate / scale,
+		       h.present[j] ? h.total[j] / scale : 0.0, h.paths[j]);
+	}
+
+	rc = EXIT_SUCCESS;
+out:
+	free(tr);
+	free(acc);
+	free(start);
+	hist_close(&h);
+
+	return(rc);
+}
+
+/**
+ * Open a history store and find its paths and runs.
+ *
+ * The store is locked for as long as it is open.
+ *
+ * \param[out] h       The history store.
+ * \param[in]  file    The file.
+ * \param[in]  create  Open for appending, creating the file if needed.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted.
+ **/
+static int32_t
+hist_open(struct hist *h, const char *file, int create)
+{
+	uint64_t i = 0;
+	uint64_t n = 0;
+	uint64_t v = 0;
+	uint32_t len = 0;
+	const uint8_t *p = NULL;
+	const uint8_t *q = NULL;
+	const uint8_t *end = NULL;
+	struct hrun *r = NULL;
+	struct stat sb = {0};
+
+	memset(h, 0, sizeof(struct hist));
+	h->fd = open(file, create ? O_RDWR | O_CREAT | O_APPEND : O_RDONLY,
+		     0644);
+	if (h->fd < 0 || flock(h->fd, create ? LOCK_EX : LOCK_SH) != 0 ||
+	    fstat(h->fd, &sb) != 0) {
+		warn(_("unable to open %s"), file);
+		return(EXIT_FAILURE);
+	}
+
+	if (sb.st_size == 0 && create) {
+		if (write(h->fd, HISTORY_MAGIC, HISTORY_MAGICLEN) !=
+		    HISTORY_MAGICLEN) {
+			warn(_("unable to write %s"), file);
+			return(EXIT_FAILURE);
+		}
+		return(EXIT_SUCCESS);
+	}
+
+	h->size = sb.st_size;
+	h->map = mmap(NULL, h->size, PROT_READ, MAP_SHARED, h->fd, 0);
+	if (h->map == MAP_FAILED) {
+		h->map = NULL;
+		warn(_("unable to read %s"), file);
+		return(EXIT_FAILURE);
+	}
+	if (h->size < HISTORY_MAGICLEN ||
+	    memcmp(h->map, HISTORY_MAGIC, HISTORY_MAGICLEN) != 0) {
+		warnx(_("%s is not a history store"), file);
+		return(EXIT_FAILURE);
+	}
+
+	p = h->map + HISTORY_MAGICLEN;
+	end = h->map + h->size;
+	while (p + 5 <= end) {
+		len = p[1] | (p[2] << 8) | (p[3] << 16) | ((uint32_t)p[4] << 24);
+		q = p + 5;
+		if (q + len > end) {
+			/* A torn append, ignore it */
+			break;
+		}
+
+		if (p[0] == 'P') {
+			if (get(&q, q + len, &n)) {
+				break;
+			}
+			h->paths = xrealloc(h->paths,
+			    (h->npaths + n) * sizeof(char *));
+			for (i = 0; i < n; ++i) {
+				if (get(&q, p + 5 + len, &v) ||
+				    q + v > p + 5 + len) {
+					break;
+				}
+				h->paths[h->npaths++] = strndup((const char *)q, v);
+				q += v;
+			}
+		} else if (p[0] == 'R') {
+			if (h->nruns % 64 == 0) {
+				h->runs = xrealloc(h->runs,
+				    (h->nruns + 64) * sizeof(struct hrun));
+			}
+			r = &h->runs[h->nruns];
+			if (get(&q, p + 5 + len, &v)) {
+				break;
+			}
+			r->time = (time_t)v;
+			if (get(&q, p + 5 + len, &v)) {
+				break;
+			}
+			r->key = (v & HISTORY_RUN) != 0;
+			if (get(&q, p + 5 + len, &r->fssize) ||
+			    get(&q, p + 5 + len, &r->fsused) ||
+			    get(&q, p + 5 + len, &r->n)) {
+				break;
+			}
+			r->p = q;
+			r->end = p + 5 + len;
+			++h->nruns;
+		}
+
+		p += 5 + len;
+	}
+
+	/* Nothing decoded yet */
+	h->cur = SIZE_MAX;
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Close a history store.
+ *
+ * \param[in] h  The history store.
+ **/
+static void
+hist_close(struct hist *h)
+{
+	size_t i = 0;
+
+	for (i = 0; i < h->npaths; ++i) {
+		free(h->paths[i]);
+	}
+	free(h->paths);
+	free(h->runs);
+	free(h->total);
+	free(h->greater);
+	free(h->present);
+	if (h->map != NULL) {
+		munmap(h->map, h->size);
+	}
+	if (h->fd >= 0) {
+		close(h->fd);
+	}
+}
+
+/**
+ * Decode the state of a run, from the key run before it.
+ *
+ * \param[in] h  The history store.
+ * \param[in] r  The run.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the store is corrupt.
+ **/
+static int32_t
+hist_seek(struct hist *h, size_t r)
+{
+	size_t i = r;
+
+	while (i > 0 && !h->runs[i].key) {
+		--i;
+	}
+
+	for (; i <= r; ++i) {
+		if (hist_decode(h, i)) {
+			return(EXIT_FAILURE);
+		}
+	}
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Apply a run to the decoded state.
+ *
+ * \param[in] h  The history store.
+ * \param[in] r  The run, either a key run or the one after the
+ *               currently decoded run.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the store is corrupt.
+ **/
+static int32_t
+hist_decode(struct hist *h, size_t r)
+{
+	uint64_t i = 0;
+	uint64_t id = 0;
+	uint64_t v = 0;
+	uint64_t t = 0;
+	uint64_t g = 0;
+	const uint8_t *p = h->runs[r].p;
+	const uint8_t *end = h->runs[r].end;
+
+	hist_grow(h);
+	if (h->runs[r].key) {
+		memset(h->present, 0, h->npaths);
+	}
+
+	for (i = 0; i < h->runs[r].n; ++i) {
+		if (get(&p, end, &v)) {
+			goto corrupt;
+		}
+		id += v >> 1;
+		if (id >= h->npaths) {
+			goto corrupt;
+		}
+		if (v & 1) {
+			h->present[id] = 0;
+			continue;
+		}
+		if (get(&p, end, &t) || get(&p, end, &g)) {
+			goto corrupt;
+		}
+		if (!h->present[id]) {
+			h->total[id] = 0;
+			h->greater[id] = 0;
+			h->present[id] = 1;
+		}
+		h->total[id] += (t >> 1) ^ -(t & 1);
+		h->greater[id] += (g >> 1) ^ -(g & 1);
+	}
+
+	h->cur = r;
+
+	return(EXIT_SUCCESS);
+corrupt:
+	warnx(_("corrupt history run %zu"), r);
+	return(EXIT_FAILURE);
+}
+
+/**
+ * Make sure the decoded state holds every path.
+ *
+ * \param[in] h  The history store.
+ **/
+static void
+hist_grow(struct hist *h)
+{
+
+	if (h->total == NULL) {
+		h->total = xmalloc((h->npaths + 1) * sizeof(uint64_t));
+		h->greater = xmalloc((h->npaths + 1) * sizeof(uint64_t));
+		h->present = xmalloc(h->npaths + 1);
+		memset(h->present, 0, h->npaths + 1);
+	}
+}
+
+/**
+ * Collect a scanned path when appending.
+ *
+ * \param[in] n    The scanned path.
+ * \param[in] arg  The appending state.
+ *
+ * \retval 0 Always, to visit every path.
+ **/
+static int
+collect(const struct pinfo *n, void *arg)
+{
+	struct happend *a = arg;
+	struct hist *h = a->h;
+	struct hpath key = {0};
+	struct hpath *hp = NULL;
+	void *found = NULL;
+	size_t cap = 0;
+
+	key.path = n->path;
+	if ((found = tfind(&key, &a->byname, hpathcmp)) != NULL) {
+		hp = *(struct hpath **)found;
+	} else {
+		h->paths = xrealloc(h->paths, (h->npaths + 1) * sizeof(char *));
+		hp = xmalloc(sizeof(struct hpath));
+		hp->path = h->paths[h->npaths] = strdup(n->path);
+		hp->id = h->npaths++;
+		tsearch(hp, &a->byname, hpathcmp);
+		++a->nnew;
+	}
+
+	if (h->npaths > a->cap) {
+		cap = h->npaths * 2;
+		a->total = xrealloc(a->total, cap * sizeof(uint64_t));
+		a->greater = xrealloc(a->greater, cap * sizeof(uint64_t));
+		a->present = xrealloc(a->present, cap);
+		memset(a->present + a->cap, 0, cap - a->cap);
+		a->cap = cap;
+	}
+	a->total[hp->id] = n->total;
+	a->greater[hp->id] = n->greater;
+	a->present[hp->id] = 1;
+
+	/* Paths added by this run were not in the previous one */
+	if (hp->id >= h->npaths - a->nnew) {
+		h->present = xrealloc(h->present, h->npaths);
+		h->total = xrealloc(h->total, h->npaths * sizeof(uint64_t));
+		h->greater = xrealloc(h->greater, h->npaths * sizeof(uint64_t));
+		h->present[hp->id] = 0;
+	}
+
+	return(0);
+}
+
+/**
+ * Compare two paths by name.
+ *
+ * \param[in] a  Path a.
+ * \param[in] b  Path b.
+ *
+ * \retval   Integer greater than, equal to, or less than 0.
+ **/
+static int
+hpathcmp(const void *a, const void *b)
+{
+
+	return(strcmp(((const struct hpath *)a)->path,
+		      ((const struct hpath *)b)->path));
+}
+
+/**
+ * Order trends by decreasing growth.
+ *
+ * \param[in] a  Trend a.
+ * \param[in] b  Trend b.
+ *
+ * \retval   Integer greater than, equal to, or less than 0.
+ **/
+static int
+trendcmp(const void *a, const void *b)
+{
+	const struct trend *x = a;
+	const struct trend *y = b;
+
+	return((x->growth < y->growth) - (x->growth > y->growth));
+}
+
+/**
+ * Add a point to least squares sums.
+ *
+ * \param[in] s  The sums n, x, y, xx and xy.
+ * \param[in] x  The point in days.
+ * \param[in] y  The value.
+ **/
+static void
+fit(double *s, double x, double y)
+{
+
+	s[0] += 1.0;
+	s[1] += x;
+	s[2] += y;
+	s[3] += x * x;
+	s[4] += x * y;
+}
+
+/**
+ * Least squares slope of sums.
+ *
+ * \param[in] s  The sums n, x, y, xx and xy.
+ *
+ * \retval m  The slope, 0 if it can not be found.
+ **/
+static double
+slope(const double *s)
+{
+	double d = s[0] * s[3] - s[1] * s[1];
+
+	if (d <= 0.0) {
+		return(0.0);
+	}
+
+	return((s[0] * s[4] - s[1] * s[2]) / d);
+}
+
+/**
+ * Append a varint to a buffer.
+ *
+ * \param[in,out] buf  The buffer.
+ * \param[in,out] len  Bytes used in the buffer.
+ * \param[in,out] cap  Size of the buffer.
+ * \param[in]     v    The value.
+ **/
+static void
+put(uint8_t **buf, size_t *len, size_t *cap, uint64_t v)
+{
+
+	if (*len + 10 > *cap) {
+		*cap = (*cap + 10) * 2;
+		*buf = xrealloc(*buf, *cap);
+	}
+
+	while (v >= 0x80) {
+		(*buf)[(*len)++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	(*buf)[(*len)++] = v;
+}
+
+/**
+ * Read a varint.
+ *
+ * \param[in,out] p    The position to read from.
+ * \param[in]     end  The end of the data.
+ * \param[out]    v    The value.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the varint runs past the end.
+ **/
+static int
+get(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while (*p < end && shift < 64) {
+		*v |= (uint64_t)(**p & 0x7f) << shift;
+		if ((*(*p)++ & 0x80) == 0) {
+			return(0);
+		}
+		shift += 7;
+	}
+
+	return(1);
+}
+
+/**
+ * Format a date.
+ *
+ * \param[in]  t    The time.
+ * \param[out] buf  Where to format it.
+ * \param[in]  n    Size of buf.
+ *
+ * \retval buf  The date.
+ **/
+static char *
+date(time_t t, char *buf, size_t n)
+{
+	struct tm tm = {0};
+
+	localtime_r(&t, &tm);
+	strftime(buf, n, "%Y-%m-%d", &tm);
+
+	return(buf);
+}
+
+/**
+ * Prints a short usage statement for the history sub-command.
+ **/
+static void
+print_usage(void)
+{
+	printf(_(\
+"usage: tdu history [-h] [-H file] [-d days] [-n count] [-u k|M|G|T|P|E] [path]\n\
+  -h, --help       display this help and exit.\n\
+  -H, --history    the history store, or $TDU_HISTORY.\n\
+  -d, --days       report on the last days of the history.\n\
+  -n, --top        the number of fastest growing paths to report.\n\
+  -u, --units      the units to report in.\n\
+  path             only report on paths below path.\n\
+"));
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * \}
+ **/
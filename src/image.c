@@ -0,0 +1,1271 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file image.c
+ * Routines to aggregate an ext4 file system image without mounting it.
+ *
+ * An image, such as one made by mkfs.ext4 -d, or a block device holding
+ * one, is only read, in passes that each follow the order of the blocks:
+ *
+ *   - the superblock and the group descriptors, to find the inode tables;
+ *   - every inode table, keeping the metadata of the inodes in use and
+ *     the blocks of each directory, from its extents or block map;
+ *   - the directory blocks, sorted by block, keeping their entries.
+ *
+ * The entries are then sorted by directory and walked from the root,
+ * each fed through the same aggregation as a walk of a mounted file
+ * system, with no system call per file. The top level path is the
+ * image, every other path is below it.
+ *
+ * Directories with their entries inline in the inode are read from the
+ * inode, entries that overflow into an extended attribute are not. A
+ * journal that needs recovery is not replayed. Damaged directories are
+ * skipped and counted, rather than failing the scan.
+ *
+ * \ingroup image
+ * \{
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "walk.h"
+#include "trace.h"
+#include "export.h"
+#include "agent.h"
+#include "image.h"
+
+#define EXT4_SB_OFFSET       1024   /**< Superblock offset in bytes **/
+#define EXT4_SB_SIZE         1024   /**< Superblock size in bytes **/
+#define EXT4_MAGIC           0xEF53 /**< Superblock magic **/
+#define EXT4_EXT_MAGIC       0xF30A /**< Extent tree node magic **/
+#define EXT4_ROOT_INO        2      /**< Inode of the root directory **/
+#define EXT4_IBLOCK          0x28   /**< Offset of the block map in an inode **/
+#define EXT4_IBLOCK_LEN      60     /**< Size of the block map **/
+#define EXT4_NDIRECT         12     /**< Direct blocks in a block map **/
+#define EXT4_DEPTH           5      /**< Deepest extent tree **/
+
+#define COMPAT_SPARSE_SUPER2    0x0200
+#define INCOMPAT_FILETYPE       0x0002
+#define INCOMPAT_RECOVER        0x0004
+#define INCOMPAT_META_BG        0x0010
+#define INCOMPAT_EXTENTS        0x0040
+#define INCOMPAT_64BIT          0x0080
+#define INCOMPAT_MMP            0x0100
+#define INCOMPAT_FLEX_BG        0x0200
+#define INCOMPAT_EA_INODE       0x0400
+#define INCOMPAT_CSUM_SEED      0x2000
+#define INCOMPAT_LARGEDIR       0x4000
+#define INCOMPAT_INLINE_DATA    0x8000
+#define INCOMPAT_CASEFOLD       0x20000
+#define RO_COMPAT_SPARSE_SUPER  0x0001
+#define RO_COMPAT_HUGE_FILE     0x0008
+#define RO_COMPAT_GDT_CSUM      0x0010
+#define RO_COMPAT_METADATA_CSUM 0x0400
+#define BG_INODE_UNINIT         0x0001
+#define INODE_HUGE_FILE_FL      0x40000
+#define INODE_EXTENTS_FL        0x80000
+#define INODE_INLINE_DATA_FL    0x10000000
+
+/** Incompatible features that do not change how the image is read **/
+#define INCOMPAT_KNOWN  (INCOMPAT_FILETYPE | INCOMPAT_RECOVER |          \
+			 INCOMPAT_META_BG | INCOMPAT_EXTENTS |            \
+			 INCOMPAT_64BIT | INCOMPAT_MMP | INCOMPAT_FLEX_BG | \
+			 INCOMPAT_EA_INODE | INCOMPAT_CSUM_SEED |         \
+			 INCOMPAT_LARGEDIR | INCOMPAT_INLINE_DATA |       \
+			 INCOMPAT_CASEFOLD)
+
+#define IMAGE_CHUNK     (1 << 20)   /**< Bytes read at once **/
+#define IMAGE_GROW      1024        /**< First allocation of an array **/
+
+/**
+ * An inode in use.
+ **/
+struct inode {
+	uint32_t ino;          /**< Inode number **/
+	uint16_t mode;         /**< Type and permissions **/
+	uint16_t nlink;        /**< Number of links **/
+	uint32_t uid;          /**< Owner **/
+	uint32_t gid;          /**< Group **/
+	uint32_t dir;          /**< Its directory, UINT32_MAX if not one **/
+	uint64_t size;         /**< Size in bytes **/
+	uint64_t blocks;       /**< Blocks allocated, in 512 byte units **/
+	int64_t atime;         /**< Last access time **/
+	int64_t mtime;         /**< Last modification time **/
+};
+
+/**
+ * A directory.
+ **/
+struct idir {
+	size_t first;          /**< Its first entry **/
+	size_t n;              /**< Number of its entries **/
+	int seen;              /**< Walked already **/
+};
+
+/**
+ * Consecutive blocks of a directory.
+ **/
+struct run {
+	uint64_t pblk;         /**< First block in the image **/
+	uint32_t len;          /**< Number of blocks **/
+	uint32_t dir;          /**< The directory **/
+	uint32_t lblk;         /**< First block in the directory **/
+};
+
+/**
+ * A directory entry.
+ **/
+struct dent {
+	uint32_t dir;          /**< The directory holding it **/
+	uint32_t ino;          /**< Its inode **/
+	uint64_t pos;          /**< Its offset in the directory **/
+	size_t name;           /**< Its name in the name pool **/
+	uint32_t len;          /**< Length of its name **/
+};
+
+/**
+ * A directory being walked.
+ **/
+struct frame {
+	size_t next;           /**< Its next entry **/
+	size_t end;            /**< Past its last entry **/
+	size_t plen;           /**< Length of its path **/
+};
+
+/**
+ * An image being read.
+ **/
+struct image {
+	int fd;                /**< The image **/
+	uint32_t bsize;        /**< Block size in bytes **/
+	uint32_t isize;        /**< Inode size in bytes **/
+	uint32_t dsize;        /**< Group descriptor size in bytes **/
+	uint32_t bpg;          /**< Blocks per group **/
+	uint32_t ipg;          /**< Inodes per group **/
+	uint32_t ngroups;      /**< Number of groups **/
+	uint32_t first;        /**< First data block **/
+	uint32_t meta;         /**< First meta block group **/
+	uint32_t backup[2];    /**< Groups holding backups with sparse_super2 **/
+	uint32_t compat;       /**< Compatible features **/
+	uint32_t incompat;     /**< Incompatible features **/
+	uint32_t ro_compat;    /**< Read only compatible features **/
+	uint64_t nblocks;      /**< Number of blocks **/
+	uint64_t bytes;        /**< Bytes read **/
+	uint64_t damaged;      /**< Damaged directory structures skipped **/
+	uint64_t missing;      /**< Entries naming inodes not in use **/
+	uint8_t *buf;          /**< Read buffer **/
+	struct inode *inodes;  /**< Inodes in use, by number **/
+	size_t ninode;         /**< Number of inodes **/
+	size_t ainode;         /**< Inodes allocated **/
+	struct idir *dirs;     /**< Directories **/
+	size_t ndir;           /**< Number of directories **/
+	size_t adir;           /**< Directories allocated **/
+	struct run *runs;      /**< Directory blocks **/
+	size_t nrun;           /**< Number of runs **/
+	size_t arun;           /**< Runs allocated **/
+	struct dent *dents;    /**< Directory entries **/
+	size_t ndent;          /**< Number of entries **/
+	size_t adent;          /**< Entries allocated **/
+	char *names;           /**< Name pool **/
+	size_t nname;          /**< Bytes of names **/
+	size_t aname;          /**< Bytes allocated **/
+	int nomem;             /**< Blocks or entries were left out **/
+};
+
+/* Internal functions */
+static int        rd(struct image *, void *, size_t, uint64_t);
+static void      *grow(void *, size_t *, size_t, size_t);
+static int        super(struct image *, const char *);
+static int        has_super(const struct image *, uint64_t);
+static int        groups(struct image *);
+static int        itable(struct image *, uint64_t, uint32_t, uint32_t);
+static int        inode(struct image *, const uint8_t *, uint32_t);
+static int        extents(struct image *, const uint8_t *, size_t,
+			  uint32_t, uint64_t, int);
+static int        indirect(struct image *, uint64_t, int, uint64_t,
+			   uint64_t, uint32_t);
+static void       addrun(struct image *, uint64_t, uint64_t, uint32_t,
+			 uint64_t);
+static int        dirblocks(struct image *);
+static void       dirents(struct image *, const uint8_t *, size_t,
+			  uint32_t, uint64_t);
+static void       entries(struct image *);
+static int        emit(struct tdu_ctx *, struct image *, uint64_t *);
+static const struct inode *lookup(const struct image *, uint32_t);
+static void       inode_stat(const struct image *, const struct inode *,
+			     struct stat *);
+static time_t     xtime(uint32_t, uint32_t);
+static int        run_cmp(const void *, const void *);
+static int        dent_cmp(const void *, const void *);
+static int        ino_cmp(const void *, const void *);
+
+/** Little endian 16 bit integer **/
+static inline uint32_t
+get16(const uint8_t *p)
+{
+
+	return(p[0] | (uint32_t)p[1] << 8);
+}
+
+/** Little endian 32 bit integer **/
+static inline uint32_t
+get32(const uint8_t *p)
+{
+
+	return(p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+	       (uint32_t)p[3] << 24);
+}
+
+/**
+ * Aggregate an ext4 image instead of scanning the context path.
+ *
+ * \param[in] ctx   The scan context.
+ * \param[in] path  The image file or block device.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+int32_t
+image_scan(struct tdu_ctx *ctx, const char *path)
+{
+	uint64_t n = 0;
+	uint64_t t0 = 0;
+	struct timespec ts = {0};
+	struct image img = {0};
+	int32_t rc = EXIT_FAILURE;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	t0 = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	if ((img.fd = open(path, O_RDONLY)) < 0) {
+		return(EXIT_FAILURE);
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(img.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	if ((img.buf = malloc(IMAGE_CHUNK)) == NULL) {
+		errno = ENOMEM;
+		goto fail;
+	}
+
+	if (super(&img, path) || groups(&img) || dirblocks(&img)) {
+		goto fail;
+	}
+	if (img.nomem) {
+		errno = ENOMEM;
+		goto fail;
+	}
+	entries(&img);
+
+	if ((ctx->now = time(NULL)) == (time_t)-1) {
+		goto fail;
+	}
+	/* A combination of features no call back supports */
+	if ((ctx->entry = entry_select(ctx)) == NULL) {
+		errno = EINVAL;
+		goto fail;
+	}
+	ctx->observe = tdu_observing(ctx);
+	if (ctx->trace != NULL) {
+		trace_begin(ctx);
+	}
+	if (ctx->export != NULL) {
+		export_begin(ctx);
+	}
+	if (ctx->agent != NULL) {
+		agent_begin(ctx);
+	}
+	if (emit(ctx, &img, &n)) {
+		goto fail;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	if (img.damaged > 0) {
+		warnx(_("skipped %llu damaged directory structures in %s"),
+		      (unsigned long long)img.damaged, path);
+	}
+	if (img.missing > 0) {
+		warnx(_("skipped %llu entries naming unused inodes in %s"),
+		      (unsigned long long)img.missing, path);
+	}
+	if (ctx->opts.verbose) {
+		warnx(_("read %llu inodes and %llu entries, %.1f MB of %s "
+			"in %.3f s"), (unsigned long long)img.ninode,
+		      (unsigned long long)n, img.bytes / 1e6, path,
+		      (ts.tv_sec * 1000000000ULL + ts.tv_nsec - t0) / 1e9);
+	}
+	rc = EXIT_SUCCESS;
+
+fail:
+	close(img.fd);
+	free(img.buf);
+	free(img.inodes);
+	free(img.dirs);
+	free(img.runs);
+	free(img.dents);
+	free(img.names);
+
+	return(rc);
+}
+
+/**
+ * Read from the image.
+ *
+ * \param[in]  img  The image.
+ * \param[out] buf  The buffer to read into.
+ * \param[in]  len  Bytes to read.
+ * \param[in]  off  Offset in the image.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the read failed or the image is too short, errno is set.
+ **/
+static int
+rd(struct image *img, void *buf, size_t len, uint64_t off)
+{
+	ssize_t r = 0;
+	size_t done = 0;
+
+	while (done < len) {
+		r = pread(img->fd, (char *)buf + done, len - done,
+			  (off_t)(off + done));
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			errno = r == 0 ? EINVAL : errno;
+			return(EXIT_FAILURE);
+		}
+		done += r;
+	}
+	img->bytes += len;
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Make room for one more element of an array.
+ *
+ * \param[in]     p     The array.
+ * \param[in,out] a     Elements allocated.
+ * \param[in]     n     Elements in use.
+ * \param[in]     size  Size of an element.
+ *
+ * \retval p     The array.
+ * \retval NULL  If there was no memory, the array is left as it was.
+ **/
+static void *
+grow(void *p, size_t *a, size_t n, size_t size)
+{
+	size_t m = *a == 0 ? IMAGE_GROW : 2 * *a;
+
+	if (n == *a && (p = realloc(p, m * size)) != NULL) {
+		*a = m;
+	}
+
+	return(p);
+}
+
+/**
+ * Read the superblock.
+ *
+ * \param[in,out] img   The image.
+ * \param[in]     path  Its path, to report on.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If it is not an ext4 image that can be read, errno is set.
+ **/
+static int
+super(struct image *img, const char *path)
+{
+	uint32_t log = 0;
+	uint64_t ninodes = 0;
+	uint8_t *sb = img->buf;
+
+	if (rd(img, sb, EXT4_SB_SIZE, EXT4_SB_OFFSET)) {
+		return(EXIT_FAILURE);
+	}
+	if (get16(sb + 0x38) != EXT4_MAGIC) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+	log = get32(sb + 0x18);
+	ninodes = get32(sb + 0x00);
+	img->first = get32(sb + 0x14);
+	img->bpg = get32(sb + 0x20);
+	img->ipg = get32(sb + 0x28);
+	img->isize = get32(sb + 0x4C) == 0 ? 128 : get16(sb + 0x58);
+	img->compat = get32(sb + 0x5C);
+	img->incompat = get32(sb + 0x60);
+	img->ro_compat = get32(sb + 0x64);
+	img->nblocks = get32(sb + 0x04);
+	img->dsize = 32;
+	if (img->incompat & INCOMPAT_64BIT) {
+		img->nblocks |= (uint64_t)get32(sb + 0x150) << 32;
+		img->dsize = get16(sb + 0xFE);
+	}
+	img->meta = get32(sb + 0x104);
+	img->backup[0] = get32(sb + 0x24C);
+	img->backup[1] = get32(sb + 0x250);
+
+	if (img->incompat & ~INCOMPAT_KNOWN) {
+		warnx(_("%s uses unsupported ext4 features %#x"), path,
+		      img->incompat & ~INCOMPAT_KNOWN);
+		errno = ENOTSUP;
+		return(EXIT_FAILURE);
+	}
+	if (log > 6) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+	img->bsize = 1024U << log;
+	if (img->bpg == 0 || img->ipg == 0 || img->first >= img->nblocks ||
+	    img->isize < 128 || img->isize > img->bsize ||
+	    (img->isize & (img->isize - 1)) != 0 || img->dsize < 32 ||
+	    img->dsize > img->bsize || (img->dsize & (img->dsize - 1)) != 0) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+	img->ngroups = (img->nblocks - img->first + img->bpg - 1) / img->bpg;
+	if ((uint64_t)img->ngroups * img->ipg < ninodes) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+	if (img->incompat & INCOMPAT_RECOVER) {
+		warnx(_("the journal of %s needs recovery, "
+			"the results may be out of date"), path);
+	}
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Whether a group starts with a copy of the superblock.
+ *
+ * \param[in] img  The image.
+ * \param[in] g    The group.
+ *
+ * \retval 1 If it does.
+ * \retval 0 Otherwise.
+ **/
+static int
+has_super(const struct image *img, uint64_t g)
+{
+	uint64_t p = 0;
+	uint64_t x = 0;
+
+	if (g == 0) {
+		return(1);
+	}
+	if (img->compat & COMPAT_SPARSE_SUPER2) {
+		return(g == img->backup[0] || g == img->backup[1]);
+	}
+	if (g == 1 || !(img->ro_compat & RO_COMPAT_SPARSE_SUPER)) {
+		return(1);
+	}
+	for (p = 3; p <= 7; p += 2) {
+		x = p;
+		while (x < g) {
+			x *= p;
+		}
+		if (x == g) {
+			return(1);
+		}
+	}
+
+	return(0);
+}
+
+/**
+ * Read the group descriptors, then the inode table of each group.
+ *
+ * \param[in,out] img  The image.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+static int
+groups(struct image *img)
+{
+	int csum = (img->ro_compat &
+		    (RO_COMPAT_GDT_CSUM | RO_COMPAT_METADATA_CSUM)) != 0;
+	uint32_t g = 0;
+	uint32_t flags = 0;
+	uint32_t unused = 0;
+	uint64_t i = 0;
+	uint64_t blk = 0;
+	uint64_t table = 0;
+	uint64_t per = img->bsize / img->dsize;
+	uint64_t nblk = (img->ngroups + per - 1) / per;
+	uint8_t *tbl = NULL;
+	const uint8_t *d = NULL;
+	int rc = EXIT_FAILURE;
+
+	/* The descriptors follow the superblock, or start each meta group */
+	if ((tbl = malloc(nblk * img->bsize)) == NULL) {
+		errno = ENOMEM;
+		goto fail;
+	}
+	for (i = 0; i < nblk; ++i) {
+		if (!(img->incompat & INCOMPAT_META_BG) || i < img->meta) {
+			blk = img->first + 1 + i;
+		} else {
+			blk = img->first + i * per * img->bpg +
+				has_super(img, i * per);
+		}
+		if (blk >= img->nblocks) {
+			errno = EINVAL;
+			goto fail;
+		}
+		if (rd(img, tbl + i * img->bsize, img->bsize,
+		       blk * img->bsize)) {
+			goto fail;
+		}
+	}
+
+	for (g = 0; g < img->ngroups; ++g) {
+		d = tbl + (uint64_t)g * img->dsize;
+		table = get32(d + 0x08);
+		flags = get16(d + 0x12);
+		unused = get16(d + 0x1C);
+		if (img->dsize >= 64) {
+			table |= (uint64_t)get32(d + 0x28) << 32;
+			unused |= get16(d + 0x32) << 16;
+		}
+		if (!csum) {
+			unused = 0;
+		} else if (flags & BG_INODE_UNINIT) {
+			continue;
+		}
+		if (unused > img->ipg) {
+			errno = EINVAL;
+			goto fail;
+		}
+		if (itable(img, table, g, img->ipg - unused)) {
+			goto fail;
+		}
+	}
+	rc = EXIT_SUCCESS;
+
+fail:
+	free(tbl);
+
+	return(rc);
+}
+
+/**
+ * Read the inodes in use from the inode table of a group.
+ *
+ * \param[in,out] img    The image.
+ * \param[in]     table  The first block of the table.
+ * \param[in]     g      The group.
+ * \param[in]     n      Number of inodes that may be in use.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+static int
+itable(struct image *img, uint64_t table, uint32_t g, uint32_t n)
+{
+	uint32_t i = 0;
+	uint32_t j = 0;
+	uint32_t k = 0;
+	uint32_t per = IMAGE_CHUNK / img->isize;
+	uint64_t len = (uint64_t)n * img->isize;
+
+	if (table >= img->nblocks ||
+	    (len + img->bsize - 1) / img->bsize > img->nblocks - table) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+	for (i = 0; i < n; i += k) {
+		k = n - i < per ? n - i : per;
+		if (rd(img, img->buf, (size_t)k * img->isize,
+		       table * img->bsize + (uint64_t)i * img->isize)) {
+			return(EXIT_FAILURE);
+		}
+		for (j = 0; j < k; ++j) {
+			if (inode(img, img->buf + (size_t)j * img->isize,
+				  g * img->ipg + i + j + 1)) {
+				return(EXIT_FAILURE);
+			}
+		}
+	}
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Keep an inode if it is in use, and the blocks of a directory.
+ *
+ * \param[in,out] img  The image.
+ * \param[in]     in   The inode.
+ * \param[in]     ino  Its number.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+static int
+inode(struct image *img, const uint8_t *in, uint32_t ino)
+{
+	uint32_t d = 0;
+	uint32_t extra = 0;
+	uint32_t flags = get32(in + 0x20);
+	uint64_t nl = 0;
+	uint64_t l = 0;
+	uint64_t span = 1;
+	uint64_t per = img->bsize / 4;
+	int level = 0;
+	struct inode *p = NULL;
+	struct idir *dirs = NULL;
+
+	if (get16(in) == 0 || get16(in + 0x1A) == 0) {
+		return(EXIT_SUCCESS);
+	}
+
+	if ((p = grow(img->inodes, &img->ainode, img->ninode,
+		      sizeof(struct inode))) == NULL) {
+		errno = ENOMEM;
+		return(EXIT_FAILURE);
+	}
+	img->inodes = p;
+	p = &img->inodes[img->ninode++];
+	extra = img->isize > 128 ? get16(in + 0x80) : 0;
+	p->ino = ino;
+	p->mode = get16(in);
+	p->nlink = get16(in + 0x1A);
+	p->uid = get16(in + 0x02) | get16(in + 0x78) << 16;
+	p->gid = get16(in + 0x18) | get16(in + 0x7A) << 16;
+	p->size = get32(in + 0x04) | (uint64_t)get32(in + 0x6C) << 32;
+	p->blocks = get32(in + 0x1C);
+	if (img->ro_compat & RO_COMPAT_HUGE_FILE) {
+		p->blocks |= (uint64_t)get16(in + 0x74) << 32;
+		if (flags & INODE_HUGE_FILE_FL) {
+			p->blocks *= img->bsize / 512;
+		}
+	}
+	p->atime = xtime(get32(in + 0x08), extra >= 0x10 ?
+			 get32(in + 0x8C) : 0);
+	p->mtime = xtime(get32(in + 0x10), extra >= 0x0C ?
+			 get32(in + 0x88) : 0);
+	p->dir = UINT32_MAX;
+	if (!S_ISDIR(p->mode)) {
+		return(EXIT_SUCCESS);
+	}
+
+	/* A directory, find its blocks */
+	if (img->ndir >= UINT32_MAX) {
+		errno = EOVERFLOW;
+		return(EXIT_FAILURE);
+	}
+	if ((dirs = grow(img->dirs, &img->adir, img->ndir,
+			 sizeof(struct idir))) == NULL) {
+		errno = ENOMEM;
+		return(EXIT_FAILURE);
+	}
+	img->dirs = dirs;
+	d = img->ndir++;
+	img->dirs[d].first = 0;
+	img->dirs[d].n = 0;
+	img->dirs[d].seen = 0;
+	p->dir = d;
+	nl = (p->size + img->bsize - 1) / img->bsize;
+
+	if (flags & INODE_INLINE_DATA_FL) {
+		/* The parent inode, then entries */
+		dirents(img, in + EXT4_IBLOCK + 4, EXT4_IBLOCK_LEN - 4, d, 0);
+		return(EXIT_SUCCESS);
+	}
+	if (flags & INODE_EXTENTS_FL) {
+		return(extents(img, in + EXT4_IBLOCK, EXT4_IBLOCK_LEN, d, nl,
+			       0));
+	}
+	for (l = 0; l < EXT4_NDIRECT && l < nl; ++l) {
+		addrun(img, get32(in + EXT4_IBLOCK + 4 * l), 1, d, l);
+	}
+	for (level = 1; level <= 3 && l < nl; ++level) {
+		span *= per;
+		if (indirect(img, get32(in + EXT4_IBLOCK +
+					4 * (EXT4_NDIRECT + level - 1)),
+			     level, l, nl, d)) {
+			return(EXIT_FAILURE);
+		}
+		l += span;
+	}
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Add the blocks of a node of an extent tree.
+ *
+ * \param[in,out] img    The image.
+ * \param[in]     node   The node.
+ * \param[in]     len    Size of the node.
+ * \param[in]     d      The directory.
+ * \param[in]     nl     Number of blocks of the directory.
+ * \param[in]     depth  Depth of the node.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the image could not be read, errno is set.
+ **/
+static int
+extents(struct image *img, const uint8_t *node, size_t len, uint32_t d,
+	uint64_t nl, int depth)
+{
+	uint32_t i = 0;
+	uint32_t n = 0;
+	uint32_t l = 0;
+	uint32_t elen = 0;
+	uint64_t blk = 0;
+	const uint8_t *e = NULL;
+	uint8_t *b = NULL;
+	int rc = EXIT_SUCCESS;
+
+	if (len < 12 || get16(node) != EXT4_EXT_MAGIC ||
+	    12 + 12 * (size_t)get16(node + 2) > len ||
+	    get16(node + 6) > EXT4_DEPTH || depth > EXT4_DEPTH) {
+		++img->damaged;
+		return(EXIT_SUCCESS);
+	}
+	n = get16(node + 2);
+
+	for (i = 0; i < n; ++i) {
+		e = node + 12 + 12 * i;
+		if (get16(node + 6) == 0) {
+			/* A leaf, uninitialised extents read as zeros */
+			l = get32(e);
+			elen = get16(e + 4);
+			blk = (uint64_t)get16(e + 6) << 32 | get32(e + 8);
+			if (elen > 32768 || l >= nl) {
+				continue;
+			}
+			if (elen > nl - l) {
+				elen = nl - l;
+			}
+			addrun(img, blk, elen, d, l);
+			continue;
+		}
+		blk = (uint64_t)get16(e + 8) << 32 | get32(e + 4);
+		if (blk >= img->nblocks) {
+			++img->damaged;
+			continue;
+		}
+		if (b == NULL && (b = malloc(img->bsize)) == NULL) {
+			errno = ENOMEM;
+			rc = EXIT_FAILURE;
+			break;
+		}
+		if (rd(img, b, img->bsize, blk * img->bsize) ||
+		    extents(img, b, img->bsize, d, nl, depth + 1)) {
+			rc = EXIT_FAILURE;
+			break;
+		}
+	}
+	free(b);
+
+	return(rc);
+}
+
+/**
+ * Add the blocks of an indirect block of a block map.
+ *
+ * \param[in,out] img    The image.
+ * \param[in]     blk    The indirect block, 0 for a hole.
+ * \param[in]     level  1 for an indirect, 2 for a double indirect and
+ *                       3 for a triple indirect block.
+ * \param[in]     l      The first directory block it maps.
+ * \param[in]     nl     Number of blocks of the directory.
+ * \param[in]     d      The directory.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the image could not be read, errno is set.
+ **/
+static int
+indirect(struct image *img, uint64_t blk, int level, uint64_t l,
+	 uint64_t nl, uint32_t d)
+{
+	int k = 0;
+	uint64_t i = 0;
+	uint64_t per = img->bsize / 4;
+	uint64_t span = 1;
+	uint8_t *b = NULL;
+	int rc = EXIT_SUCCESS;
+
+	if (blk == 0) {
+		return(EXIT_SUCCESS);
+	}
+	if (blk >= img->nblocks) {
+		++img->damaged;
+		return(EXIT_SUCCESS);
+	}
+	for (k = 1; k < level; ++k) {
+		span *= per;
+	}
+	if ((b = malloc(img->bsize)) == NULL) {
+		errno = ENOMEM;
+		return(EXIT_FAILURE);
+	}
+	if (rd(img, b, img->bsize, blk * img->bsize)) {
+		free(b);
+		return(EXIT_FAILURE);
+	}
+	for (i = 0; i < per && l + i * span < nl; ++i) {
+		if (level == 1) {
+			addrun(img, get32(b + 4 * i), 1, d, l + i);
+		} else if (indirect(img, get32(b + 4 * i), level - 1,
+				    l + i * span, nl, d)) {
+			rc = EXIT_FAILURE;
+			break;
+		}
+	}
+	free(b);
+
+	return(rc);
+}
+
+/**
+ * Add blocks of a directory, joining them to the previous ones when
+ * they follow on.
+ *
+ * \param[in,out] img  The image.
+ * \param[in]     blk  The first block, 0 for a hole.
+ * \param[in]     len  Number of blocks.
+ * \param[in]     d    The directory.
+ * \param[in]     l    The first directory block.
+ **/
+static void
+addrun(struct image *img, uint64_t blk, uint64_t len, uint32_t d,
+       uint64_t l)
+{
+	struct run *r = NULL;
+
+	if (blk == 0 || len == 0) {
+		return;
+	}
+	if (blk >= img->nblocks || len > img->nblocks - blk ||
+	    l + len > UINT32_MAX) {
+		++img->damaged;
+		return;
+	}
+	r = img->nrun > 0 ? &img->runs[img->nrun - 1] : NULL;
+	if (r != NULL && r->dir == d && r->pblk + r->len == blk &&
+	    r->lblk + r->len == l && r->len + len <= UINT32_MAX) {
+		r->len += len;
+		return;
+	}
+	if ((r = grow(img->runs, &img->arun, img->nrun,
+		      sizeof(struct run))) == NULL) {
+		img->nomem = 1;
+		return;
+	}
+	img->runs = r;
+	r = &img->runs[img->nrun++];
+	r->pblk = blk;
+	r->len = len;
+	r->dir = d;
+	r->lblk = l;
+}
+
+/**
+ * Read the directory blocks in the order they are in the image.
+ *
+ * \param[in,out] img  The image.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the image could not be read, errno is set.
+ **/
+static int
+dirblocks(struct image *img)
+{
+	size_t i = 0;
+	uint32_t j = 0;
+	uint32_t k = 0;
+	uint32_t c = 0;
+	uint32_t per = IMAGE_CHUNK / img->bsize;
+	const struct run *r = NULL;
+
+	qsort(img->runs, img->nrun, sizeof(struct run), run_cmp);
+
+	for (i = 0; i < img->nrun; ++i) {
+		r = &img->runs[i];
+		for (k = 0; k < r->len; k += c) {
+			c = r->len - k < per ? r->len - k : per;
+			if (rd(img, img->buf, (size_t)c * img->bsize,
+			       (r->pblk + k) * img->bsize)) {
+				return(EXIT_FAILURE);
+			}
+			for (j = 0; j < c; ++j) {
+				dirents(img, img->buf + (size_t)j * img->bsize,
+					img->bsize, r->dir,
+					(uint64_t)(r->lblk + k + j) *
+					img->bsize);
+			}
+		}
+	}
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Keep the entries of a directory block.
+ *
+ * Directory index blocks read as a single empty entry, and the
+ * checksum at the end of a block as a short one.
+ *
+ * \param[in,out] img  The image.
+ * \param[in]     b    The block.
+ * \param[in]     len  Its size.
+ * \param[in]     d    The directory.
+ * \param[in]     pos  Its offset in the directory.
+ **/
+static void
+dirents(struct image *img, const uint8_t *b, size_t len, uint32_t d,
+	uint64_t pos)
+{
+	size_t off = 0;
+	size_t rl = 0;
+	size_t a = 0;
+	uint32_t ino = 0;
+	uint32_t nlen = 0;
+	char *p = NULL;
+	const char *name = NULL;
+	struct dent *e = NULL;
+
+	for (off = 0; off + 8 <= len; off += rl) {
+		ino = get32(b + off);
+		rl = get16(b + off + 4);
+		rl = rl == 0 || rl == 65535 ? 65536 :
+			(rl & 65532) | ((rl & 3) << 16);
+		nlen = b[off + 6];
+		name = (const char *)b + off + 8;
+		if (rl < 8 || rl > len - off || 8 + nlen > rl) {
+			++img->damaged;
+			return;
+		}
+		if (ino == 0 || nlen == 0 ||
+		    (nlen == 1 && name[0] == '.') ||
+		    (nlen == 2 && name[0] == '.' && name[1] == '.')) {
+			continue;
+		}
+		if (memchr(name, '/', nlen) != NULL ||
+		    memchr(name, '\0', nlen) != NULL) {
+			++img->damaged;
+			continue;
+		}
+
+		for (a = img->aname; img->nname + nlen > a;) {
+			a = a == 0 ? IMAGE_CHUNK : 2 * a;
+		}
+		if (a != img->aname) {
+			if ((p = realloc(img->names, a)) == NULL) {
+				img->nomem = 1;
+				return;
+			}
+			img->names = p;
+			img->aname = a;
+		}
+		if ((e = grow(img->dents, &img->adent, img->ndent,
+			      sizeof(struct dent))) == NULL) {
+			img->nomem = 1;
+			return;
+		}
+		img->dents = e;
+		e = &img->dents[img->ndent++];
+		e->dir = d;
+		e->ino = ino;
+		e->pos = pos + off;
+		e->name = img->nname;
+		e->len = nlen;
+		memcpy(img->names + img->nname, name, nlen);
+		img->nname += nlen;
+	}
+}
+
+/**
+ * Sort the entries by directory, in the order they are held.
+ *
+ * \param[in,out] img  The image.
+ **/
+static void
+entries(struct image *img)
+{
+	size_t i = 0;
+	struct idir *d = NULL;
+
+	qsort(img->dents, img->ndent, sizeof(struct dent), dent_cmp);
+
+	for (i = 0; i < img->ndent; ++i) {
+		d = &img->dirs[img->dents[i].dir];
+		if (d->n++ == 0) {
+			d->first = i;
+		}
+	}
+}
+
+/**
+ * Walk the directories from the root, aggregating every entry.
+ *
+ * \param[in]     ctx  The scan context.
+ * \param[in,out] img  The image.
+ * \param[out]    n    Number of entries.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the image has no root directory or there was no
+ *           memory, errno is set.
+ **/
+static int
+emit(struct tdu_ctx *ctx, struct image *img, uint64_t *n)
+{
+	int rc = EXIT_FAILURE;
+	int tflag = 0;
+	size_t l = 0;
+	size_t nframe = 0;
+	size_t aframe = 0;
+	size_t alen = 0;
+	char *p = NULL;
+	char *path = NULL;
+	struct stat sb = {0};
+	struct frame *f = NULL;
+	struct frame *frames = NULL;
+	const struct dent *e = NULL;
+	const struct idir *d = NULL;
+	const struct inode *ip = NULL;
+
+	if ((ip = lookup(img, EXT4_ROOT_INO)) == NULL ||
+	    ip->dir == UINT32_MAX) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+	alen = ctx->plen + NAME_MAX + 2;
+	if ((path = malloc(alen)) == NULL ||
+	    (frames = grow(frames, &aframe, nframe,
+			   sizeof(struct frame))) == NULL) {
+		errno = ENOMEM;
+		goto fail;
+	}
+	memcpy(path, ctx->opts.path, ctx->plen);
+
+	inode_stat(img, ip, &sb);
+	if (ctx->observe) {
+		tdu_observe(ctx, ctx->opts.path, &sb, FTW_D, 0);
+	}
+	ctx->entry(ctx, ctx->opts.path, &sb, FTW_D, 0);
+	*n = 1;
+
+	d = &img->dirs[ip->dir];
+	img->dirs[ip->dir].seen = 1;
+	frames[nframe++] = (struct frame){d->first, d->first + d->n,
+					  ctx->plen};
+
+	while (nframe > 0) {
+		f = &frames[nframe - 1];
+		if (f->next == f->end) {
+			--nframe;
+			continue;
+		}
+		e = &img->dents[f->next++];
+		if ((ip = lookup(img, e->ino)) == NULL) {
+			++img->missing;
+			continue;
+		}
+
+		l = f->plen + 1 + e->len;
+		if (l + 1 > alen) {
+			if ((p = realloc(path, 2 * (l + 1))) == NULL) {
+				errno = ENOMEM;
+				goto fail;
+			}
+			path = p;
+			alen = 2 * (l + 1);
+		}
+		path[f->plen] = '/';
+		memcpy(path + f->plen + 1, img->names + e->name, e->len);
+		path[l] = '\0';
+
+		tflag = S_ISDIR(ip->mode) ? FTW_D :
+			S_ISLNK(ip->mode) ? FTW_SL : FTW_F;
+		inode_stat(img, ip, &sb);
+		if (ctx->observe) {
+			tdu_observe(ctx, path, &sb, tflag, nframe);
+		}
+		ctx->entry(ctx, path, &sb, tflag, nframe);
+		++*n;
+
+		/* A directory is walked once, even if damage links it twice */
+		if (ip->dir != UINT32_MAX && !img->dirs[ip->dir].seen) {
+			img->dirs[ip->dir].seen = 1;
+			d = &img->dirs[ip->dir];
+			if ((f = grow(frames, &aframe, nframe,
+				      sizeof(struct frame))) == NULL) {
+				errno = ENOMEM;
+				goto fail;
+			}
+			frames = f;
+			frames[nframe++] = (struct frame){d->first,
+							  d->first + d->n, l};
+		}
+	}
+	rc = EXIT_SUCCESS;
+
+fail:
+	free(frames);
+	free(path);
+
+	return(rc);
+}
+
+/**
+ * Find an inode in use.
+ *
+ * \param[in] img  The image.
+ * \param[in] ino  The inode number.
+ *
+ * \retval p     The inode.
+ * \retval NULL  If it is not in use.
+ **/
+static const struct inode *
+lookup(const struct image *img, uint32_t ino)
+{
+	struct inode key = {0};
+
+	key.ino = ino;
+
+	return(bsearch(&key, img->inodes, img->ninode, sizeof(struct inode),
+		       ino_cmp));
+}
+
+/**
+ * Fill a stat buffer from an inode.
+ *
+ * \param[in]  img  The image.
+ * \param[in]  ip   The inode.
+ * \param[out] sb   The stat buffer.
+ **/
+static void
+inode_stat(const struct image *img, const struct inode *ip, struct stat *sb)
+{
+
+	memset(sb, 0, sizeof(struct stat));
+	sb->st_ino = ip->ino;
+	sb->st_mode = ip->mode;
+	sb->st_nlink = ip->nlink;
+	sb->st_uid = ip->uid;
+	sb->st_gid = ip->gid;
+	sb->st_size = ip->size;
+	sb->st_blksize = img->bsize;
+	sb->st_blocks = ip->blocks;
+	sb->st_atime = ip->atime;
+	sb->st_mtime = ip->mtime;
+}
+
+/**
+ * Decode an inode time.
+ *
+ * \param[in] lo     The signed seconds since the epoch.
+ * \param[in] extra  The extra time field, its two low bits extend the
+ *                   seconds past 2038.
+ *
+ * \retval t  The time.
+ **/
+static time_t
+xtime(uint32_t lo, uint32_t extra)
+{
+
+	return((time_t)((int64_t)(int32_t)lo + ((int64_t)(extra & 3) << 32)));
+}
+
+/**
+ * Compare two runs by their block in the image.
+ **/
+static int
+run_cmp(const void *a, const void *b)
+{
+	const struct run *x = a;
+	const struct run *y = b;
+
+	return((x->pblk > y->pblk) - (x->pblk < y->pblk));
+}
+
+/**
+ * Compare two entries by directory then offset.
+ **/
+static int
+dent_cmp(const void *a, const void *b)
+{
+	const struct dent *x = a;
+	const struct dent *y = b;
+
+	if (x->dir != y->dir) {
+		return(x->dir < y->dir ? -1 : 1);
+	}
+
+	return((x->pos > y->pos) - (x->pos < y->pos));
+}
+
+/**
+ * Compare two inodes by number.
+ **/
+static int
+ino_cmp(const void *a, const void *b)
+{
+	const struct inode *x = a;
+	const struct inode *y = b;
+
+	return((x->ino > y->ino) - (x->ino < y->ino));
+}
+
+/**
+ * \}
+ **/
@@ -0,0 +1,330 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file kernbench.c
+ * Measure the batch kernels against aggregating entry by entry.
+ *
+ * Built on request with make kernbench, and run as
+ *
+ *     kernbench [-a] [-n records]
+ *
+ * A million records by default are made up with sizes spread over
+ * every size bucket and access times over five years, in batches as
+ * the threaded walk passes them on. They are aggregated one entry at a
+ * time, as the serial walk does, and by each kernel the processor
+ * runs, gathering the batch from the stat records as the walk does.
+ * With -a the access age histogram is kept as well. Each result is
+ * checked against aggregating entry by entry.
+ *
+ * \ingroup kernel
+ * \{
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <err.h>
+#include <ftw.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "walk.h"
+#include "kernel.h"
+
+#define BENCH_RUNS       5      /**< Runs of each, the fastest is kept **/
+
+/* Internal functions */
+static double     now_s(void);
+static double     per_entry(struct tdu_ctx *, const struct stat *, size_t,
+			    struct pinfo **);
+static double     batched(kernel_t, const struct kedges *,
+			  const struct stat *, size_t, struct pinfo *);
+static int        same(const struct pinfo *, const struct pinfo *);
+
+/**
+ * Measure the kernels.
+ *
+ * \param[in] argc  Number of arguments.
+ * \param[in] argv  The arguments.
+ *
+ * \retval 0 If every kernel gave the same results.
+ * \retval 1 Otherwise.
+ **/
+int
+main(int argc, char **argv)
+{
+	int opt = 0;
+	int ages = 0;
+	int rc = EXIT_SUCCESS;
+	size_t i = 0;
+	size_t n = 1000000;
+	uint64_t seed = 88172645463325252ULL;
+	time_t now = time(NULL);
+	double base = 0.0;
+	double t = 0.0;
+	kernel_t fns[3];
+	size_t nfn = 0;
+	struct stat *sb = NULL;
+	struct pinfo *ref = NULL;
+	struct pinfo got = {0};
+	struct kedges e;
+	struct tdu_opts opts = {0};
+	struct tdu_ctx *ctx = NULL;
+
+	while ((opt = getopt(argc, argv, "an:")) != -1) {
+		switch (opt) {
+			case 'a':
+				ages = 1;
+				break;
+			case 'n':
+				n = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-a] [-n records]\n",
+					argv[0]);
+				return(EX_USAGE);
+		}
+	}
+	if (n == 0) {
+		errx(EX_USAGE, "the number of records must be positive");
+	}
+
+	/* Sizes spread over the buckets, times over five years */
+	sb = calloc(n, sizeof(struct stat));
+	if (sb == NULL) {
+		err(EX_OSERR, "unable to allocate %zu records", n);
+	}
+	for (i = 0; i < n; ++i) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		sb[i].st_mode = (seed & 15) == 0 ? S_IFLNK | 0777 :
+			S_IFREG | 0644;
+		sb[i].st_size = (seed >> 8) >> (seed % 64);
+		sb[i].st_atime = now - (time_t)((seed >> 16) %
+						(5 * 365 * SECONDS_IN_DAY));
+	}
+
+	opts.path = "/b";
+	opts.maxdepth = 1;
+	opts.atime = now - 30 * SECONDS_IN_DAY;
+	opts.flags = ages ? TDU_F_AGES : 0;
+	strcpy(opts.units, "kB");
+	if ((ctx = tdu_create(&opts)) == NULL) {
+		err(EX_SOFTWARE, "unable to create a context");
+	}
+	ctx->now = now;
+	ctx->entry = entry_select(ctx);
+	kernel_edges(&e, now, opts.atime, ages);
+
+#if HAVE_X86_KERNELS
+	fns[nfn++] = kernel_avx512;
+	fns[nfn++] = kernel_avx2;
+#endif
+	fns[nfn++] = kernel_scalar;
+
+	printf("%zu records, %s\n", n, ages ? "with access ages" :
+	       "without access ages");
+	printf("%-10s %10s %10s %8s\n", "path", "ns/record", "Mrec/s",
+	       "speedup");
+
+	base = per_entry(ctx, sb, n, &ref);
+	printf("%-10s %10.2f %10.1f %8.2f\n", "entry", 1e9 * base / n,
+	       n / base / 1e6, 1.0);
+
+	for (i = 0; i < nfn; ++i) {
+		if (!kernel_runs(fns[i])) {
+			printf("%-10s %10s\n", kernel_name(fns[i]),
+			       "not supported");
+			continue;
+		}
+		t = batched(fns[i], &e, sb, n, &got);
+		printf("%-10s %10.2f %10.1f %8.2f%s\n",
+		       kernel_name(fns[i]), 1e9 * t / n, n / t / 1e6, base / t,
+		       same(ref, &got) ? "" : "  differs");
+		if (!same(ref, &got)) {
+			rc = EXIT_FAILURE;
+		}
+	}
+
+	tdu_destroy(ctx);
+	free(sb);
+
+	return(rc);
+}
+
+/**
+ * Monotonic time.
+ *
+ * \retval s  Seconds since an arbitrary point.
+ **/
+static double
+now_s(void)
+{
+	struct timespec ts = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/**
+ * Aggregate the records entry by entry.
+ *
+ * \param[in]  ctx  The scan context.
+ * \param[in]  sb   The records.
+ * \param[in]  n    Number of records.
+ * \param[out] ref  The node aggregated into.
+ *
+ * \retval s  Seconds taken by the fastest run.
+ **/
+static double
+per_entry(struct tdu_ctx *ctx, const struct stat *sb, size_t n,
+	  struct pinfo **ref)
+{
+	int r = 0;
+	size_t i = 0;
+	double t0 = 0.0;
+	double best = 0.0;
+	struct pinfo *p = NULL;
+
+	for (r = 0; r < BENCH_RUNS; ++r) {
+		if ((p = tdu_node(ctx, "/b/f", FTW_F, 1)) == NULL) {
+			errx(EX_OSERR, "unable to allocate a node");
+		}
+		memset(p->age, 0, sizeof(p->age));
+		memset(p->size, 0, sizeof(p->size));
+		p->total = p->greater = p->files = p->links = 0;
+
+		t0 = now_s();
+		for (i = 0; i < n; ++i) {
+			ctx->entry(ctx, "/b/f", &sb[i],
+				   S_ISLNK(sb[i].st_mode) ? FTW_SL : FTW_F, 1);
+		}
+		t0 = now_s() - t0;
+		if (r == 0 || t0 < best) {
+			best = t0;
+		}
+	}
+	*ref = p;
+
+	return(best);
+}
+
+/**
+ * Aggregate the records in batches, gathered as the walk does.
+ *
+ * \param[in]  fn   The kernel.
+ * \param[in]  e    The access times classified against.
+ * \param[in]  sb   The records.
+ * \param[in]  n    Number of records.
+ * \param[out] got  The node aggregated into.
+ *
+ * \retval s  Seconds taken by the fastest run.
+ **/
+static double
+batched(kernel_t fn, const struct kedges *e, const struct stat *sb, size_t n,
+	struct pinfo *got)
+{
+	int r = 0;
+	size_t i = 0;
+	size_t j = 0;
+	double t0 = 0.0;
+	double best = 0.0;
+	static struct kbatch kb;
+
+	for (r = 0; r < BENCH_RUNS; ++r) {
+		memset(got, 0, sizeof(struct pinfo));
+
+		t0 = now_s();
+		for (i = 0; i < n; i += KERNEL_BATCH) {
+			kb.n = 0;
+			kb.nreg = 0;
+			kb.links = 0;
+			for (j = i; j < n && j < i + KERNEL_BATCH; ++j) {
+				kb.size[kb.n] = sb[j].st_size;
+				kb.atime[kb.n++] = sb[j].st_atime;
+				if (S_ISREG(sb[j].st_mode)) {
+					kb.rsize[kb.nreg++] = sb[j].st_size;
+				}
+				kb.links += S_ISLNK(sb[j].st_mode) != 0;
+			}
+			fn(&kb, e, got);
+			got->files += kb.nreg;
+			got->links += kb.links;
+		}
+		t0 = now_s() - t0;
+		if (r == 0 || t0 < best) {
+			best = t0;
+		}
+	}
+
+	return(best);
+}
+
+/**
+ * Compare the counters of two nodes.
+ *
+ * \param[in] a  Node a.
+ * \param[in] b  Node b.
+ *
+ * \retval 1 If they are the same.
+ * \retval 0 Otherwise.
+ **/
+static int
+same(const struct pinfo *a, const struct pinfo *b)
+{
+
+	return(a->total == b->total && a->greater == b->greater &&
+	       a->files == b->files && a->links == b->links &&
+	       memcmp(a->age, b->age, sizeof(a->age)) == 0 &&
+	       memcmp(a->size, b->size, sizeof(a->size)) == 0);
+}
+
+/**
+ * \}
+ **/
@@ -0,0 +1,443 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file kernel.c
+ * Routines to aggregate a batch of entries at once.
+ *
+ * The entries of a directory, other than its subdirectories, are
+ * all aggregated under the same tree node. Gathered into arrays of
+ * sizes and access times, they are classified and summed with vector
+ * instructions, and the node is found and added to once per batch
+ * rather than once per entry.
+ *
+ * The vector kernels avoid a data dependent bucket per entry by
+ * summing, for each access age, the bytes at least that old: a
+ * compare and a masked add per age. The bytes of each bucket are the
+ * difference of neighbouring sums. File size buckets are the number
+ * of significant bits of the size, found with a leading zero count.
+ *
+ * The kernel is chosen when first needed, the fastest the processor
+ * runs. TDU_KERNEL may name another, to compare them.
+ *
+ * \ingroup kernel
+ * \{
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "kernel.h"
+
+/**
+ * A kernel by name.
+ **/
+struct kernel {
+	const char *name;      /**< Its name **/
+	kernel_t fn;           /**< The kernel **/
+};
+
+/** Kernels, fastest first **/
+static const struct kernel kernels[] = {
+#if HAVE_X86_KERNELS
+	{"avx512", kernel_avx512},
+	{"avx2",   kernel_avx2},
+#endif
+	{"scalar", kernel_scalar}
+};
+
+#define NKERNEL  (sizeof(kernels) / sizeof(kernels[0]))
+
+/* Internal functions */
+static void       sizes(const struct kbatch *, size_t, struct pinfo *);
+#if HAVE_X86_KERNELS
+static void       tail(const struct kbatch *, const struct kedges *, size_t,
+		       uint64_t *, uint64_t *, uint64_t *);
+static void       finish(const struct kedges *, uint64_t, uint64_t,
+			 uint64_t *, struct pinfo *);
+#endif /* HAVE_X86_KERNELS */
+
+/**
+ * Set the access times a batch is classified against.
+ *
+ * \param[out] e     The access times.
+ * \param[in]  now   Time the scan started.
+ * \param[in]  old   Entries accessed before this are old.
+ * \param[in]  ages  Keep the access age histogram.
+ **/
+void
+kernel_edges(struct kedges *e, time_t now, time_t old, int ages)
+{
+	uint32_t k = 0;
+
+	e->now = now;
+	e->old = old;
+	e->ages = ages;
+	e->age[0] = now;
+	for (k = 1; k < TDU_NAGE; ++k) {
+		e->age[k] = now - (int64_t)tdu_age_days[k] * SECONDS_IN_DAY;
+	}
+}
+
+/**
+ * The fastest kernel the processor runs, or the one named by
+ * TDU_KERNEL if it runs.
+ *
+ * \retval fn  The kernel.
+ **/
+kernel_t
+kernel_select(void)
+{
+	size_t i = 0;
+	const char *want = getenv("TDU_KERNEL");
+
+	for (i = 0; i < NKERNEL; ++i) {
+		if ((want == NULL || strcmp(want, kernels[i].name) == 0) &&
+		    kernel_runs(kernels[i].fn)) {
+			return(kernels[i].fn);
+		}
+	}
+
+	return(kernel_scalar);
+}
+
+/**
+ * Name of a kernel.
+ *
+ * \param[in] fn  The kernel.
+ *
+ * \retval name  Its name.
+ **/
+const char *
+kernel_name(kernel_t fn)
+{
+	size_t i = 0;
+
+	for (i = 0; i < NKERNEL; ++i) {
+		if (kernels[i].fn == fn) {
+			return(kernels[i].name);
+		}
+	}
+
+	return("unknown");
+}
+
+/**
+ * Aggregate a batch one entry at a time.
+ *
+ * \param[in]     b  The batch.
+ * \param[in]     e  The access times it is classified against.
+ * \param[in,out] n  The tree node added to.
+ **/
+void
+kernel_scalar(const struct kbatch *b, const struct kedges *e, struct pinfo *n)
+{
+	size_t i = 0;
+	uint64_t size = 0;
+	uint64_t total = 0;
+	uint64_t greater = 0;
+	uint32_t days = 0;
+
+	for (i = 0; i < b->n; ++i) {
+		size = b->size[i];
+		total += size;
+		greater += size & -(uint64_t)(b->atime[i] < e->old);
+		if (e->ages) {
+			days = b->atime[i] < e->now ?
+				(e->now - b->atime[i]) / SECONDS_IN_DAY : 0;
+			n->age[tdu_age_bucket(days)] += size;
+		}
+	}
+	n->total += total;
+	n->greater += greater;
+
+	sizes(b, 0, n);
+}
+
+#if HAVE_X86_KERNELS
+/**
+ * Aggregate a batch four entries at a time, with AVX2.
+ *
+ * \param[in]     b  The batch.
+ * \param[in]     e  The access times it is classified against.
+ * \param[in,out] n  The tree node added to.
+ **/
+__attribute__((target("avx2")))
+void
+kernel_avx2(const struct kbatch *b, const struct kedges *e, struct pinfo *n)
+{
+	size_t i = 0;
+	uint32_t k = 0;
+	uint32_t l = 0;
+	uint64_t total = 0;
+	uint64_t greater = 0;
+	uint64_t ge[TDU_NAGE + 1] = {0};
+	uint64_t lane[4];
+	__m256i s;
+	__m256i a;
+	__m256i tot = _mm256_setzero_si256();
+	__m256i grt = _mm256_setzero_si256();
+	__m256i old = _mm256_set1_epi64x(e->old);
+	__m256i cut[TDU_NAGE];
+	__m256i acc[TDU_NAGE];
+
+	for (k = 1; k < TDU_NAGE; ++k) {
+		cut[k] = _mm256_set1_epi64x(e->age[k]);
+		acc[k] = _mm256_setzero_si256();
+	}
+
+	for (i = 0; i + 4 <= b->n; i += 4) {
+		s = _mm256_loadu_si256((const __m256i *)&b->size[i]);
+		a = _mm256_loadu_si256((const __m256i *)&b->atime[i]);
+		tot = _mm256_add_epi64(tot, s);
+		grt = _mm256_add_epi64(grt, _mm256_and_si256(s,
+				       _mm256_cmpgt_epi64(old, a)));
+		if (e->ages) {
+			for (k = 1; k < TDU_NAGE; ++k) {
+				acc[k] = _mm256_add_epi64(acc[k],
+					 _mm256_andnot_si256(
+					 _mm256_cmpgt_epi64(a, cut[k]), s));
+			}
+		}
+	}
+
+	_mm256_storeu_si256((__m256i *)lane, tot);
+	total = lane[0] + lane[1] + lane[2] + lane[3];
+	_mm256_storeu_si256((__m256i *)lane, grt);
+	greater = lane[0] + lane[1] + lane[2] + lane[3];
+	for (k = 1; k < TDU_NAGE && e->ages; ++k) {
+		_mm256_storeu_si256((__m256i *)lane, acc[k]);
+		for (l = 0; l < 4; ++l) {
+			ge[k] += lane[l];
+		}
+	}
+
+	tail(b, e, i, &total, &greater, ge);
+	finish(e, total, greater, ge, n);
+	sizes(b, 0, n);
+}
+
+/**
+ * Aggregate a batch eight entries at a time, with AVX-512.
+ *
+ * The last entries are loaded under a mask, and the size buckets are
+ * found in vectors too.
+ *
+ * \param[in]     b  The batch.
+ * \param[in]     e  The access times it is classified against.
+ * \param[in,out] n  The tree node added to.
+ **/
+__attribute__((target("avx512f,avx512cd")))
+void
+kernel_avx512(const struct kbatch *b, const struct kedges *e, struct pinfo *n)
+{
+	size_t i = 0;
+	size_t j = 0;
+	size_t m = 0;
+	uint32_t k = 0;
+	uint64_t total = 0;
+	uint64_t greater = 0;
+	uint64_t ge[TDU_NAGE + 1] = {0};
+	uint64_t idx[8];
+	__mmask8 live;
+	__m512i s;
+	__m512i a;
+	__m512i tot = _mm512_setzero_si512();
+	__m512i grt = _mm512_setzero_si512();
+	__m512i old = _mm512_set1_epi64(e->old);
+	__m512i bits = _mm512_set1_epi64(64);
+	__m512i top = _mm512_set1_epi64(TDU_NSIZE - 1);
+	__m512i cut[TDU_NAGE];
+	__m512i acc[TDU_NAGE];
+
+	for (k = 1; k < TDU_NAGE; ++k) {
+		cut[k] = _mm512_set1_epi64(e->age[k]);
+		acc[k] = _mm512_setzero_si512();
+	}
+
+	for (i = 0; i < b->n; i += 8) {
+		m = b->n - i < 8 ? b->n - i : 8;
+		live = (__mmask8)((1u << m) - 1);
+		s = _mm512_maskz_loadu_epi64(live, &b->size[i]);
+		a = _mm512_maskz_loadu_epi64(live, &b->atime[i]);
+		tot = _mm512_add_epi64(tot, s);
+		grt = _mm512_mask_add_epi64(grt, _mm512_cmplt_epi64_mask(a, old),
+					    grt, s);
+		if (e->ages) {
+			for (k = 1; k < TDU_NAGE; ++k) {
+				acc[k] = _mm512_mask_add_epi64(acc[k],
+					 _mm512_cmple_epi64_mask(a, cut[k]),
+					 acc[k], s);
+			}
+		}
+	}
+
+	total = _mm512_reduce_add_epi64(tot);
+	greater = _mm512_reduce_add_epi64(grt);
+	for (k = 1; k < TDU_NAGE && e->ages; ++k) {
+		ge[k] = _mm512_reduce_add_epi64(acc[k]);
+	}
+	finish(e, total, greater, ge, n);
+
+	/* The bucket is the number of significant bits, at most the last */
+	for (i = 0; i + 8 <= b->nreg; i += 8) {
+		s = _mm512_loadu_si512(&b->rsize[i]);
+		s = _mm512_min_epu64(_mm512_sub_epi64(bits,
+				     _mm512_lzcnt_epi64(s)), top);
+		_mm512_storeu_si512(idx, s);
+		for (j = 0; j < 8; ++j) {
+			++n->size[idx[j]];
+		}
+	}
+	sizes(b, i, n);
+}
+#endif /* HAVE_X86_KERNELS */
+
+/**
+ * Check if the processor runs a kernel.
+ *
+ * \param[in] fn  The kernel.
+ *
+ * \retval 1 If it does.
+ * \retval 0 If it does not.
+ **/
+int
+kernel_runs(kernel_t fn)
+{
+
+#if HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (fn == kernel_avx512) {
+		return(__builtin_cpu_supports("avx512f") &&
+		       __builtin_cpu_supports("avx512cd"));
+	}
+	if (fn == kernel_avx2) {
+		return(__builtin_cpu_supports("avx2"));
+	}
+#endif /* HAVE_X86_KERNELS */
+
+	return(fn == kernel_scalar);
+}
+
+/**
+ * Count the regular files of a batch by size.
+ *
+ * \param[in]     b  The batch.
+ * \param[in]     i  The first regular file to count.
+ * \param[in,out] n  The tree node added to.
+ **/
+static void
+sizes(const struct kbatch *b, size_t i, struct pinfo *n)
+{
+
+	for (; i < b->nreg; ++i) {
+		++n->size[tdu_size_bucket(b->rsize[i])];
+	}
+}
+
+#if HAVE_X86_KERNELS
+/**
+ * Sum the entries of a batch left over by a vector loop.
+ *
+ * \param[in]     b        The batch.
+ * \param[in]     e        The access times it is classified against.
+ * \param[in]     i        The first entry left over.
+ * \param[in,out] total    Bytes of the entries.
+ * \param[in,out] greater  Old bytes of the entries.
+ * \param[in,out] ge       Bytes at least each access age.
+ **/
+static void
+tail(const struct kbatch *b, const struct kedges *e, size_t i,
+     uint64_t *total, uint64_t *greater, uint64_t *ge)
+{
+	uint32_t k = 0;
+
+	for (; i < b->n; ++i) {
+		*total += b->size[i];
+		*greater += b->size[i] & -(uint64_t)(b->atime[i] < e->old);
+		for (k = 1; k < TDU_NAGE && e->ages; ++k) {
+			ge[k] += b->size[i] &
+				-(uint64_t)(b->atime[i] <= e->age[k]);
+		}
+	}
+}
+
+/**
+ * Add the sums of a vector kernel to a tree node.
+ *
+ * \param[in]     e        The access times the batch was classified
+ *                         against.
+ * \param[in]     total    Bytes of the batch.
+ * \param[in]     greater  Old bytes of the batch.
+ * \param[in,out] ge       Bytes at least each access age, with room
+ *                         for one past the last.
+ * \param[in,out] n        The tree node added to.
+ **/
+static void
+finish(const struct kedges *e, uint64_t total, uint64_t greater,
+       uint64_t *ge, struct pinfo *n)
+{
+	uint32_t k = 0;
+
+	n->total += total;
+	n->greater += greater;
+	if (e->ages) {
+		ge[0] = total;
+		ge[TDU_NAGE] = 0;
+		for (k = 0; k < TDU_NAGE; ++k) {
+			n->age[k] += ge[k] - ge[k+1];
+		}
+	}
+}
+#endif /* HAVE_X86_KERNELS */
+
+/**
+ * \}
+ **/
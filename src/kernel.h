@@ -0,0 +1,112 @@
+/* BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file kernel.h
+ * Internal definitions for aggregating batches of entries at once.
+ *
+ * \ingroup kernel
+ * \{
+ **/
+
+#ifndef TDU_KERNEL_H
+#define TDU_KERNEL_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define KERNEL_BATCH     1024   /**< Entries in a batch **/
+
+/**
+ * Entries of a directory other than directories, as arrays.
+ **/
+struct kbatch {
+	size_t n;              /**< Number of entries **/
+	size_t nreg;           /**< Number of regular files **/
+	uint64_t links;        /**< Number of symbolic links **/
+	uint64_t size[KERNEL_BATCH];  /**< Size of each entry **/
+	int64_t atime[KERNEL_BATCH];  /**< Access time of each entry **/
+	uint64_t rsize[KERNEL_BATCH]; /**< Size of each regular file **/
+};
+
+/**
+ * Access times the entries of a batch are classified against.
+ **/
+struct kedges {
+	int64_t now;           /**< Time the scan started **/
+	int64_t old;           /**< Accessed before this is old **/
+	int64_t age[TDU_NAGE]; /**< Accessed at or before this is at least
+				    each access age, the first is unused **/
+	int ages;              /**< Keep the access age histogram **/
+};
+
+/**
+ * Aggregates a batch into a tree node.
+ **/
+typedef void (*kernel_t)(const struct kbatch *, const struct kedges *,
+			 struct pinfo *);
+
+/* Set the access times a batch is classified against */
+void kernel_edges(struct kedges *, time_t, time_t, int);
+
+/* The fastest kernel the processor runs */
+kernel_t kernel_select(void);
+
+/* Check if the processor runs a kernel */
+int kernel_runs(kernel_t);
+
+/* Name of a kernel */
+const char *kernel_name(kernel_t);
+
+/* Aggregate a batch one entry at a time */
+void kernel_scalar(const struct kbatch *, const struct kedges *,
+		   struct pinfo *);
+
+#if HAVE_X86_KERNELS
+/* Aggregate a batch four entries at a time */
+void kernel_avx2(const struct kbatch *, const struct kedges *,
+		 struct pinfo *);
+
+/* Aggregate a batch eight entries at a time */
+void kernel_avx512(const struct kbatch *, const struct kedges *,
+		   struct pinfo *);
+#endif /* HAVE_X86_KERNELS */
+
+#ifdef __cplusplus
+}                               /* extern "C" */
+#endif
+
+#endif                          /* TDU_KERNEL_H */
+/**
+ * \}
+ **/
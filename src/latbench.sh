@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# Measure the entries scanned per second against the latency added by
+# latency.so, for the serial walk and the high latency walk.
+#
+# usage: latbench.sh [-j n] [-q depth] directory [latency[,jitter] ...]
+#
+# Run from the build directory after make latency.so. Latencies are in
+# microseconds, the jitter defaults to half the latency. The depth is
+# the number of calls the simulated storage handles at once, unlimited
+# by default.
+#
+
+jobs=64
+depth=0
+while getopts "j:q:" opt; do
+	case $opt in
+		j) jobs=$OPTARG ;;
+		q) depth=$OPTARG ;;
+		*) exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -lt 1 ]; then
+	echo "usage: $0 [-j n] [-q depth] directory [latency[,jitter] ...]" >&2
+	exit 1
+fi
+dir=$1
+shift
+[ $# -gt 0 ] || set -- 0 100 500 2000
+
+here=$(dirname "$0")
+tdu=$here/tdu
+shim=$(cd "$here" && pwd)/latency.so
+if [ ! -x "$tdu" ] || [ ! -f "$shim" ]; then
+	echo "$0: build tdu and latency.so first" >&2
+	exit 1
+fi
+
+entries=$(find "$dir" -xdev | wc -l)
+
+# Seconds a scan of dir takes
+scan() {
+	env=$1
+	shift
+	start=$(date +%s.%N)
+	TDU_LATENCY=$env LD_PRELOAD=$shim "$tdu" "$@" -m 1 "$dir" >/dev/null
+	end=$(date +%s.%N)
+	echo "$start $end" | awk '{ printf "%.3f", $2 - $1 }'
+}
+
+printf "%s: %d entries, %d threads\n" "$dir" "$entries" "$jobs"
+printf "%10s %10s %14s %14s\n" "latency" "jitter" "nftw [1/s]" "-L [1/s]"
+for l in "$@"; do
+	lat=${l%%,*}
+	jit=$((lat / 2))
+	[ "$l" = "$lat" ] || jit=${l#*,}
+	s=$(scan "$lat,$jit,$depth" -a 0)
+	p=$(scan "$lat,$jit,$depth" -a 0 -L -j "$jobs")
+	echo "$lat $jit $s $p $entries" | awk '{
+		printf "%10d %10d %14.0f %14.0f\n", $1, $2, $5 / $3, $5 / $4 }'
+done
@@ -0,0 +1,374 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file latency.c
+ * A preload library adding latency to file system calls.
+ *
+ * Scans of network and parallel file systems see every stat take
+ * milliseconds. Preloading this library into tdu makes a local file
+ * system behave the same way:
+ *
+ *     TDU_LATENCY=2000,1000,32 LD_PRELOAD=./latency.so tdu -L /usr
+ *
+ * TDU_LATENCY is the mean latency in microseconds, the jitter, each
+ * call taking a uniformly chosen time within mean +- jitter, and the
+ * number of calls the simulated server handles at once, unlimited
+ * when missing or 0.
+ *
+ * The stat, open and directory read calls are delayed. nftw() makes
+ * its calls within the C library where they can not be intercepted,
+ * so it is wrapped instead: each entry it hands on is delayed by one
+ * call, and each directory by another for opening and reading it.
+ *
+ * \ingroup latency
+ * \{
+ **/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * The simulated server.
+ **/
+struct server {
+	int ready;             /**< The settings have been read **/
+	long mean;             /**< Mean latency in us **/
+	long jitter;           /**< Jitter in us **/
+	long depth;            /**< Calls handled at once, 0 unlimited **/
+	long busy;             /**< Calls being handled **/
+	pthread_mutex_t lock;  /**< Protects busy **/
+	pthread_cond_t done;   /**< A call was handled **/
+};
+
+static struct server srv = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER
+};
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+/* The nftw() call back of the calling thread */
+static __thread int (*user)(const char *, const struct stat *, int,
+			    struct FTW *) = NULL;
+
+/* Internal functions */
+static void       setup(void);
+static void       delay(void);
+static int        entry(const char *, const struct stat *, int,
+			struct FTW *);
+
+/**
+ * Find the next definition of a function.
+ **/
+#define REAL(name)                                                      \
+	static __typeof__(name) *real = NULL;                           \
+	if (real == NULL) {                                             \
+		real = (__typeof__(name) *)dlsym(RTLD_NEXT, #name);     \
+	}
+
+/**
+ * Read the settings from the environment.
+ **/
+static void
+setup(void)
+{
+	const char *env = NULL;
+
+	if ((env = getenv("TDU_LATENCY")) != NULL) {
+		sscanf(env, "%ld,%ld,%ld", &srv.mean, &srv.jitter, &srv.depth);
+	}
+	if (srv.jitter > srv.mean) {
+		srv.jitter = srv.mean;
+	}
+	srv.ready = 1;
+}
+
+/**
+ * Wait as long as the simulated server takes to handle a call.
+ **/
+static void
+delay(void)
+{
+	static __thread uint64_t seed = 0;
+	long us = 0;
+	struct timespec ts = {0};
+
+	pthread_once(&once, setup);
+	if (srv.mean <= 0) {
+		return;
+	}
+
+	/* xorshift, seeded differently in each thread */
+	if (seed == 0) {
+		seed = (uint64_t)(uintptr_t)&seed ^ (uint64_t)time(NULL) ^
+			0x9e3779b97f4a7c15ULL;
+	}
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+
+	us = srv.mean;
+	if (srv.jitter > 0) {
+		us += (long)(seed % (uint64_t)(2 * srv.jitter + 1)) - srv.jitter;
+	}
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+
+	if (srv.depth > 0) {
+		pthread_mutex_lock(&srv.lock);
+		while (srv.busy >= srv.depth) {
+			pthread_cond_wait(&srv.done, &srv.lock);
+		}
+		++srv.busy;
+		pthread_mutex_unlock(&srv.lock);
+	}
+
+	nanosleep(&ts, NULL);
+
+	if (srv.depth > 0) {
+		pthread_mutex_lock(&srv.lock);
+		--srv.busy;
+		pthread_cond_signal(&srv.done);
+		pthread_mutex_unlock(&srv.lock);
+	}
+}
+
+int
+stat(const char *path, struct stat *sb)
+{
+	REAL(stat);
+
+	delay();
+	return(real(path, sb));
+}
+
+int
+lstat(const char *path, struct stat *sb)
+{
+	REAL(lstat);
+
+	delay();
+	return(real(path, sb));
+}
+
+int
+fstatat(int fd, const char *path, struct stat *sb, int flags)
+{
+	REAL(fstatat);
+
+	delay();
+	return(real(fd, path, sb, flags));
+}
+
+int
+stat64(const char *path, struct stat64 *sb)
+{
+	REAL(stat64);
+
+	delay();
+	return(real(path, sb));
+}
+
+int
+lstat64(const char *path, struct stat64 *sb)
+{
+	REAL(lstat64);
+
+	delay();
+	return(real(path, sb));
+}
+
+int
+fstatat64(int fd, const char *path, struct stat64 *sb, int flags)
+{
+	REAL(fstatat64);
+
+	delay();
+	return(real(fd, path, sb, flags));
+}
+
+#ifdef STATX_BASIC_STATS
+int
+statx(int fd, const char *path, int flags, unsigned int mask,
+      struct statx *sb)
+{
+	REAL(statx);
+
+	delay();
+	return(real(fd, path, flags, mask, sb));
+}
+#endif
+
+int
+open(const char *path, int flags, ...)
+{
+	va_list ap;
+	mode_t mode = 0;
+	REAL(open);
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	delay();
+	return(real(path, flags, mode));
+}
+
+int
+open64(const char *path, int flags, ...)
+{
+	va_list ap;
+	mode_t mode = 0;
+	REAL(open64);
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	delay();
+	return(real(path, flags, mode));
+}
+
+int
+openat(int fd, const char *path, int flags, ...)
+{
+	va_list ap;
+	mode_t mode = 0;
+	REAL(openat);
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	delay();
+	return(real(fd, path, flags, mode));
+}
+
+int
+openat64(int fd, const char *path, int flags, ...)
+{
+	va_list ap;
+	mode_t mode = 0;
+	REAL(openat64);
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	delay();
+	return(real(fd, path, flags, mode));
+}
+
+ssize_t
+getdents64(int fd, void *buf, size_t n)
+{
+	REAL(getdents64);
+
+	delay();
+	return(real(fd, buf, n));
+}
+
+DIR *
+opendir(const char *path)
+{
+	REAL(opendir);
+
+	/* Opening and the first read of the names */
+	delay();
+	delay();
+	return(real(path));
+}
+
+/**
+ * Delay an entry found by nftw() before handing it on.
+ **/
+static int
+entry(const char *path, const struct stat *sb, int tflag, struct FTW *ftw)
+{
+
+	delay();
+	if (tflag == FTW_D || tflag == FTW_DP) {
+		delay();
+	}
+
+	return(user(path, sb, tflag, ftw));
+}
+
+int
+nftw(const char *path, int (*fn)(const char *, const struct stat *, int,
+				 struct FTW *), int nfd, int flags)
+{
+	int rc = 0;
+	REAL(nftw);
+
+	user = fn;
+	rc = real(path, entry, nfd, flags);
+	user = NULL;
+
+	return(rc);
+}
+
+int
+nftw64(const char *path, int (*fn)(const char *, const struct stat64 *, int,
+				   struct FTW *), int nfd, int flags)
+{
+	int rc = 0;
+	REAL(nftw64);
+
+	user = (int (*)(const char *, const struct stat *, int,
+			struct FTW *))fn;
+	rc = real(path, (int (*)(const char *, const struct stat64 *, int,
+				 struct FTW *))entry, nfd, flags);
+	user = NULL;
+
+	return(rc);
+}
+
+/**
+ * \}
+ **/
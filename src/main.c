@@ -42,6 +42,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <limits.h>
 #include <getopt.h>
 #include <locale.h>
@@ -50,6 +51,9 @@
 #include <sysexits.h>
 #include <assert.h>
 #include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -57,11 +61,15 @@
 
 #include "gettext.h"
 #include "defs.h"
+#include "tdu.h"
 #include "extern.h"
-#include "walk.h"
+#include "mem.h"
+#include "report.h"
+#include "client.h"
+#include "history.h"
+#include "collect.h"
 
 #define DEFAULT_ATIME    45
-#define SECONDS_IN_DAY   60 * 60 * 24
 
 /* Internal functions */
 static void              print_usage(void);
@@ -69,8 +77,31 @@ static void              print_version(void);
 static const char       *program_name(void);
 static int32_t           parse_argv(int32_t , char **);
 static int32_t           set_defaults();
+static int32_t           watching(struct tdu_ctx *);
+static int32_t           exploring(struct tdu_ctx *);
+static void              on_signal(int);
 
-struct opts options = {0}; /**< Program options */
+struct tdu_opts options = {0}; /**< Program options */
+uint32_t columns = 0;          /**< Extra report columns */
+static char *sockpath = NULL;  /**< Daemon socket to query */
+static char *histpath = NULL;  /**< History store to append to */
+static char *coldpath = NULL;  /**< Cold file list to write */
+static char *recpath = NULL;   /**< Trace to record */
+static char *pqpath = NULL;    /**< Parquet file to export to */
+static char *agentaddr = NULL; /**< Collector to stream the scans to */
+static char *agentname = NULL; /**< Name to stream them under */
+static char *playpath = NULL;  /**< Trace to replay instead of walking */
+static char *imgpath = NULL;   /**< Image to read instead of walking */
+static uint64_t coldmin = 0;   /**< Smallest cold file to list */
+static uint64_t memlimit = 0;  /**< Memory the paths may use, 0 for any */
+static uint64_t zbudget = 0;   /**< Bytes read to estimate compression */
+static char *where = NULL;     /**< Expression selecting old entries */
+static uint32_t coldsplit = 1; /**< Number of cold file lists */
+static uint32_t watch = 0;     /**< Seconds between watch reports */
+static int dups = 0;           /**< Find duplicates, 2 to compare them */
+static int explore = 0;        /**< Report again on request */
+static volatile sig_atomic_t wanted = 0;  /**< Report requested */
+static volatile sig_atomic_t done = 0;    /**< Stop watching */
 
 /**
  * The main entry point of the program.
@@ -85,7 +116,8 @@ int32_t
 main(int32_t argc, char **argv)
 {
 
-	uint32_t verbose = 0;   /**< Program verbosity **/
+	int32_t rc = EXIT_SUCCESS;   /**< Program return code **/
+	struct tdu_ctx *ctx = NULL;  /**< Scan context **/
 
 	/* initialise gettext */
 #ifdef HAVE_SETLOCALE
@@ -99,19 +131,249 @@ main(int32_t argc, char **argv)
 	/* set defaults */
 	set_defaults();
 
+	/* Report on a history store */
+	if (argc > 1 && strcmp(argv[1], "history") == 0) {
+		return(history_main(argc - 1, argv + 1));
+	}
+
+	/* Merge the scans streamed by agents */
+	if (argc > 1 && strcmp(argv[1], "collect") == 0) {
+		return(collect_main(argc - 1, argv + 1));
+	}
+
 	/* parse command line arguments */
 	if (parse_argv(argc, argv)) {
 		exit(EXIT_FAILURE);
 	}
 
-	/* Walk the directory tree */
-	if (walk()) {
-		return(EXIT_FAILURE);
+	/* Ask a daemon instead of walking */
+	if (sockpath != NULL) {
+		return(client(sockpath));
+	}
+
+	if ((ctx = tdu_create(&options)) == NULL) {
+		err(EX_SOFTWARE, _("unable to create a scan of %s"),
+		    options.path);
+	}
+
+	if (coldpath != NULL &&
+	    tdu_emit_cold(ctx, coldpath, coldmin, coldsplit)) {
+		err(EX_CANTCREAT, _("unable to write %s"), coldpath);
+	}
+
+	if (recpath != NULL && tdu_record(ctx, recpath)) {
+		err(EX_CANTCREAT, _("unable to write %s"), recpath);
+	}
+
+	if (pqpath != NULL && tdu_export(ctx, pqpath)) {
+		err(EX_CANTCREAT, _("unable to write %s"), pqpath);
+	}
+
+	if (agentaddr != NULL && tdu_agent(ctx, agentaddr, agentname)) {
+		err(EX_UNAVAILABLE, _("unable to stream to %s"), agentaddr);
+	}
+
+	if (memlimit > 0 && tdu_spill(ctx, memlimit, NULL)) {
+		err(EX_CANTCREAT, _("unable to use the scratch directory"));
+	}
+
+	if (dups > 0 && tdu_dups(ctx, dups > 1)) {
+		err(EX_SOFTWARE, _("unable to find duplicates"));
+	}
+
+	if (where != NULL && tdu_where(ctx, where)) {
+		errx(EX_USAGE, _("unable to use the expression %s"), where);
+	}
+
+	if (zbudget > 0 && tdu_compress(ctx, zbudget)) {
+		err(EX_SOFTWARE, _("unable to estimate compression"));
+	}
+
+	if (watch > 0 && tdu_watch(ctx)) {
+		err(EX_OSERR, _("unable to watch %s"), options.path);
+	}
+
+	/* Walk the directory tree, replay one or read it from an image */
+	if (playpath != NULL && tdu_replay(ctx, playpath)) {
+		warn(_("replaying %s failed"), playpath);
+		rc = EXIT_FAILURE;
+	} else if (imgpath != NULL && tdu_image(ctx, imgpath)) {
+		warn(_("reading the image %s failed"), imgpath);
+		rc = EXIT_FAILURE;
+	} else if (playpath == NULL && imgpath == NULL && tdu_scan(ctx)) {
+		warnx(_("walking %s failed."), options.path);
+		rc = EXIT_FAILURE;
+	} else {
+		options.path = (char *)tdu_path(ctx);
+		summary(ctx);
+		if (columns & COL_TYPES) {
+			types(ctx);
+		}
+		if ((options.flags & TDU_F_MOUNTS) && mounts(ctx)) {
+			rc = EXIT_FAILURE;
+		}
+		if (histpath != NULL && history_append(histpath, ctx)) {
+			rc = EXIT_FAILURE;
+		}
+		if (watch > 0) {
+			rc = watching(ctx);
+		}
+		if (explore) {
+			rc = exploring(ctx);
+		}
+	}
+
+	tdu_destroy(ctx);
+
+	return(rc);
+}
+
+/**
+ * Keep the scan current, printing a report every watch interval
+ * in which there were changes and whenever SIGUSR1 is received.
+ *
+ * \param[in] ctx  The scanned context.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted.
+ **/
+static int32_t
+watching(struct tdu_ctx *ctx)
+{
+	int64_t n = 0;
+	int64_t changes = 0;
+	time_t now = 0;
+	time_t next = 0;
+	struct pollfd pfd = {0};
+	struct sigaction sa = {0};
+
+	sa.sa_handler = on_signal;
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	pfd.fd = tdu_watch_fd(ctx);
+	pfd.events = POLLIN;
+	next = time(NULL) + watch;
+
+	while (!done) {
+		now = time(NULL);
+		if (poll(&pfd, 1, now < next ? (next - now) * 1000 : 0) > 0) {
+			if ((n = tdu_watch_update(ctx)) < 0) {
+				warn(_("watching %s failed"), options.path);
+				return(EXIT_FAILURE);
+			}
+			changes += n;
+		}
+
+		if (wanted || (changes > 0 && time(NULL) >= next)) {
+			/* Old is relative to each report, as for a scan */
+			tdu_watch_age(ctx, time(NULL));
+			printf("\n");
+			summary(ctx);
+			fflush(stdout);
+			wanted = 0;
+			changes = 0;
+		}
+		if (time(NULL) >= next) {
+			next = time(NULL) + watch;
+		}
+	}
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Read report requests from standard input until its end.
+ *
+ * Each line is an optional depth followed by an optional path, which
+ * is taken relative to the scanned directory unless it is absolute.
+ * A missing depth keeps the last one and a missing path reports on
+ * the scanned directory.
+ *
+ * \param[in] ctx  The scanned context, scanned with TDU_F_TREE.
+ *
+ * \retval 0 If there were no errors.
+ **/
+static int32_t
+exploring(struct tdu_ctx *ctx)
+{
+	int tty = 0;
+	size_t n = 0;
+	size_t size = 0;
+	ssize_t len = 0;
+	uint32_t depth = 0;
+	char *p = NULL;
+	char *end = NULL;
+	char *line = NULL;
+	char *path = NULL;
+
+	tty = isatty(STDIN_FILENO);
+	depth = options.maxdepth;
+
+	for (;;) {
+		if (tty) {
+			fprintf(stderr, "depth [path]> ");
+		}
+		if ((len = getline(&line, &size, stdin)) < 0) {
+			break;
+		}
+		while (len > 0 && strchr(" \t\r\n", line[len-1]) != NULL) {
+			line[--len] = '\0';
+		}
+
+		for (p = line; *p == ' ' || *p == '\t'; ++p) {
+		}
+		if (*p >= '0' && *p <= '9') {
+			depth = (uint32_t)strtoul(p, &end, 10);
+			for (p = end; *p == ' ' || *p == '\t'; ++p) {
+			}
+		}
+		if (depth == 0) {
+			warnx(_("the depth must be positive"));
+			depth = options.maxdepth;
+			continue;
+		}
+
+		if (*p == '\0' || *p == '/') {
+			path = strdup(*p == '\0' ? options.path : p);
+		} else {
+			n = strlen(options.path);
+			while (n > 1 && options.path[n-1] == '/') {
+				--n;
+			}
+			path = xmalloc(n + strlen(p) + 2);
+			sprintf(path, "%.*s/%s", (int)n, options.path, p);
+		}
+
+		if (subtree(ctx, path, depth)) {
+			warn(_("unable to report on %s"), path);
+		}
+		fflush(stdout);
+		free(path);
 	}
 
+	free(line);
+
 	return(EXIT_SUCCESS);
 }
 
+/**
+ * Signal handler while watching.
+ *
+ * \param[in] sig  The signal.
+ **/
+static void
+on_signal(int sig)
+{
+
+	if (sig == SIGUSR1) {
+		wanted = 1;
+	} else {
+		done = 1;
+	}
+}
+
 /**
  * Set the default options.
  *
@@ -144,19 +406,45 @@ set_defaults()
 static int32_t
 parse_argv(int32_t argc, char **argv)
 {
-	int32_t i = 0;
 	int32_t opt = 0;
 	int32_t opt_index = 0;
 	uint32_t atime = UINT32_MAX;
-	char *soptions = "hVva:c:m:u:";		/* short options structure */
+	uint64_t scale = 0;
+	char *end = NULL;
+	char *soptions = "hVvfiCDLMStA:H:I:N:P:R:T:X:a:c:e:j:l:m:n:r:s:u:w:z:W:";		/* short options structure */
 	static struct option loptions[] = {	/* long options structure */
 		{"help",     no_argument,       NULL, 'h'},
 		{"version",  no_argument,       NULL, 'V'},
 		{"verbose",  no_argument,       NULL, 'v'},
+		{"files",    no_argument,       NULL, 'f'},
+		{"history",  required_argument, NULL, 'H'},
+		{"interactive",no_argument,     NULL, 'i'},
+		{"high-latency",no_argument,    NULL, 'L'},
+		{"mounts",   no_argument,       NULL, 'M'},
+		{"subtree",  no_argument,       NULL, 'S'},
+		{"duplicates",no_argument,      NULL, 'D'},
+		{"compare",  no_argument,       NULL, 'C'},
+		{"types",    no_argument,       NULL, 't'},
+		{"type-table",required_argument,NULL, 'T'},
+		{"record",   required_argument, NULL, 'R'},
+		{"parquet",  required_argument, NULL, 'P'},
+		{"agent",    required_argument, NULL, 'A'},
+		{"name",     required_argument, NULL, 'N'},
+		{"replay",   required_argument, NULL, 'r'},
+		{"image",    required_argument, NULL, 'I'},
+		{"memory-limit",required_argument,NULL, 'X'},
+		{"compress", required_argument, NULL, 'z'},
+		{"where",    required_argument, NULL, 'W'},
 		{"atime",    required_argument, NULL, 'a'},
 		{"cost",     required_argument, NULL, 'c'},
+		{"emit-cold",required_argument, NULL, 'e'},
+		{"jobs",     required_argument, NULL, 'j'},
+		{"cold-min", required_argument, NULL, 'l'},
 		{"maxdepth", required_argument, NULL, 'm'},
+		{"cold-split",required_argument,NULL, 'n'},
+		{"socket",   required_argument, NULL, 's'},
 		{"units",    required_argument, NULL, 'u'},
+		{"watch",    required_argument, NULL, 'w'},
 		{NULL,       0,                 NULL,  0}
 	};
 	time_t now = {0};
@@ -182,6 +470,119 @@ parse_argv(int32_t argc, char **argv)
 			case 'm':
 				options.maxdepth = (uint32_t)strtoul(optarg, NULL, 10);
 				break;
+			case 'f':
+				columns |= COL_FILES;
+				break;
+			case 'H':
+				histpath = optarg;
+				break;
+			case 'i':
+				explore = 1;
+				break;
+			case 'L':
+				options.flags |= TDU_F_LATENCY;
+				break;
+			case 'M':
+				options.flags |= TDU_F_MOUNTS;
+				break;
+			case 'S':
+				columns |= COL_SUBTREE;
+				break;
+			case 'C':
+				dups = 2;
+				columns |= COL_DUPS;
+				break;
+			case 'D':
+				dups = dups > 0 ? dups : 1;
+				columns |= COL_DUPS;
+				break;
+			case 'R':
+				recpath = optarg;
+				break;
+			case 'P':
+				pqpath = optarg;
+				break;
+			case 'A':
+				agentaddr = optarg;
+				break;
+			case 'N':
+				agentname = optarg;
+				break;
+			case 'r':
+				playpath = optarg;
+				break;
+			case 'I':
+				imgpath = optarg;
+				break;
+			case 'T':
+				if (tdu_type_load(optarg)) {
+					err(EX_DATAERR, _("unable to load types from %s"),
+					    optarg);
+				}
+				/* FALLTHROUGH */
+			case 't':
+				options.flags |= TDU_F_TYPES;
+				columns |= COL_TYPES;
+				break;
+			case 'e':
+				coldpath = optarg;
+				break;
+			case 'j':
+				options.jobs = (uint32_t)strtoul(optarg, NULL, 10);
+				break;
+			case 'l':
+				coldmin = strtoull(optarg, &end, 10);
+				if (*end != '\0') {
+					if ((scale = tdu_scale(end)) == 0) {
+						warnx(_("unknown units: %s"), end);
+						print_usage();
+					}
+					coldmin *= scale;
+				}
+				break;
+			case 'X':
+				memlimit = strtoull(optarg, &end, 10);
+				if (*end != '\0') {
+					if ((scale = tdu_scale(end)) == 0) {
+						warnx(_("unknown units: %s"), end);
+						print_usage();
+					}
+					memlimit *= scale;
+				}
+				if (memlimit == 0) {
+					warnx(_("the memory limit must be positive"));
+					print_usage();
+				}
+				break;
+			case 'W':
+				where = optarg;
+				columns |= COL_WHERE;
+				break;
+			case 'z':
+				zbudget = strtoull(optarg, &end, 10);
+				if (*end != '\0') {
+					if ((scale = tdu_scale(end)) == 0) {
+						warnx(_("unknown units: %s"), end);
+						print_usage();
+					}
+					zbudget *= scale;
+				}
+				if (zbudget < 65536) {
+					warnx(_("the read budget must be at least 64k"));
+					print_usage();
+				}
+				columns |= COL_COMPRESS;
+				break;
+			case 'n':
+				coldsplit = (uint32_t)strtoul(optarg, NULL, 10);
+				if (coldsplit == 0) {
+					warnx(_("the number of cold file lists must be positive"));
+					print_usage();
+				}
+				break;
+			case 's':
+				sockpath = optarg;
+				break;
 			case 'u':
 				if (optarg[0] == 'k' ||
 				    optarg[0] == 'K') {
@@ -206,6 +607,13 @@ parse_argv(int32_t argc, char **argv)
 					print_usage();
 				}
 				break;
+			case 'w':
+				watch = (uint32_t)strtoul(optarg, NULL, 10);
+				if (watch == 0) {
+					warnx(_("the watch interval must be positive"));
+					print_usage();
+				}
+				break;
 			default:
 				print_usage();
 				break;
@@ -214,7 +622,23 @@ parse_argv(int32_t argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
-	if (argc != 1) {
+	if (playpath != NULL) {
+		/* The path is the one recorded in the trace */
+		if (argc != 0 || watch > 0 || sockpath != NULL ||
+		    imgpath != NULL) {
+			warnx(_("error: -r takes no directory, -I, -s or -w"));
+			print_usage();
+		}
+		options.path = playpath;
+	} else if (imgpath != NULL) {
+		/* The image is the top level path */
+		if (argc != 0 || watch > 0 || sockpath != NULL ||
+		    (options.flags & TDU_F_MOUNTS)) {
+			warnx(_("error: -I takes no directory, -M, -s or -w"));
+			print_usage();
+		}
+		options.path = imgpath;
+	} else if (argc != 1) {
 		warnx(_("error: must specify a destination"));
 		print_usage();
 	} else {
@@ -223,10 +647,67 @@ parse_argv(int32_t argc, char **argv)
 	assert(options.path != NULL);
 	assert(options.maxdepth > 0);
 
-	/* Remove a trailing / from the path */
-	i = strlen(options.path);
-	if (options.path[i-1] == '/') {
-		options.path[i-1] = '\0';
+	/* A collector merges the scans of many hosts by absolute path */
+	if (agentaddr != NULL && playpath == NULL && imgpath == NULL &&
+	    (options.path = realpath(options.path, NULL)) == NULL) {
+		err(EX_NOINPUT, _("unable to resolve %s"), argv[0]);
+	}
+
+	if ((options.flags & TDU_F_LATENCY) && options.jobs == 0) {
+		options.jobs = LATENCY_JOBS;
+	}
+
+	if ((options.flags & TDU_F_MOUNTS) && watch > 0) {
+		warnx(_("error: -M and -w can not be used together"));
+		print_usage();
+	}
+	if (memlimit > 0 &&
+	    (watch > 0 || explore || (columns & COL_SUBTREE))) {
+		warnx(_("error: -X can not be used with -i, -S or -w"));
+		print_usage();
+	}
+	if (dups > 0 && (watch > 0 || explore || playpath != NULL ||
+			 imgpath != NULL || sockpath != NULL)) {
+		warnx(_("error: -D can not be used with -i, -I, -r, -s or -w"));
+		print_usage();
+	}
+	if (zbudget > 0 && (watch > 0 || explore || playpath != NULL ||
+			    imgpath != NULL || sockpath != NULL)) {
+		warnx(_("error: -z can not be used with -i, -I, -r, -s or -w"));
+		print_usage();
+	}
+	if (pqpath != NULL && (watch > 0 || sockpath != NULL)) {
+		warnx(_("error: -P can not be used with -s or -w"));
+		print_usage();
+	}
+	if (agentname != NULL && agentaddr == NULL) {
+		warnx(_("error: -N needs -A"));
+		print_usage();
+	}
+	if (agentaddr != NULL &&
+	    (explore || memlimit > 0 || sockpath != NULL)) {
+		warnx(_("error: -A can not be used with -i, -s or -X"));
+		print_usage();
+	}
+	if (where != NULL && (watch > 0 || sockpath != NULL)) {
+		warnx(_("error: -W can not be used with -s or -w"));
+		print_usage();
+	}
+	if ((options.flags & TDU_F_TYPES) && (watch > 0 || explore)) {
+		warnx(_("error: -t can not be used with -i or -w"));
+		print_usage();
+	}
+
+	/* Keep every directory so any depth can be reported afterwards */
+	if (explore) {
+		if (watch > 0) {
+			warnx(_("error: -i and -w can not be used together"));
+			print_usage();
+		}
+		options.flags |= TDU_F_TREE;
+		if (columns & COL_FILES) {
+			options.flags |= TDU_F_SIZES;
+		}
 	}
 
 	if (atime != UINT32_MAX) {
@@ -251,16 +732,54 @@ static void
 print_usage(void)
 {
 	printf(_(\
-"usage: %s [-h] [-V] [-v] [-a] [-m] [-u k|M|G|T|P|E] directory\n\
+"usage: %s [-h] [-V] [-v] [-f] [-i] [-D] [-C] [-L] [-M] [-S] [-t] [-T file] [-R trace] [-P file] [-A address [-N name]] [-X size] [-z size] [-W expr] [-H file] [-a] [-e file [-l size] [-n n]] [-j n] [-m] [-s socket] [-u k|M|G|T|P|E] [-w n] directory\n\
   -h, --help       display this help and exit.\n\
   -V, --version    display version information and exit.\n\
   -v, --verbose    verbose mode.\n\
+  -f, --files      report entry counts and the file size distribution.\n\
+  -i, --interactive keep every directory and report again at the depth\n\
+                   and path read from each line of standard input.\n\
+  -L, --high-latency walk tuned for storage with a high latency.\n\
+  -M, --mounts     cross mount points, reporting each file system.\n\
+  -S, --subtree    report the cumulative totals of each subtree.\n\
+  -D, --duplicates report the bytes of duplicate files that could be freed.\n\
+  -C, --compare    compare duplicates byte by byte, implies -D.\n\
+  -t, --types      break the usage down by file type.\n\
+  -T, --type-table add the file types of a table, implies -t.\n\
+  -R, --record     record the metadata of the walk to a trace.\n\
+  -r, --replay     report on a recorded trace instead of a directory.\n\
+  -P, --parquet    export every entry of the walk to a Parquet file.\n\
+  -A, --agent      stream the scan to tdu collect listening on address,\n\
+                   a TCP host:port or a UNIX socket path.\n\
+  -N, --name       the name to stream under, the host name by default.\n\
+  -I, --image      report on an ext4 image instead of a directory.\n\
+  -X, --memory-limit spill the paths to TMPDIR beyond size, e.g. 1G.\n\
+  -z, --compress   estimate the compressed size reading at most size,\n\
+                   e.g. 64M.\n\
+  -W, --where      count the entries matching expr as old, instead of\n\
+                   those older than the access time.\n\
+  -H, --history    append the scan to a history store.\n\
   -a, --atime      last access time in days.\n\
   -c, --cost       the cost to store 1 unit of data for 1 day.\n\
+  -e, --emit-cold  write the files older than the access time to file.\n\
+  -l, --cold-min   the smallest cold file to write, e.g. 10M.\n\
+  -n, --cold-split spread the cold files over n files.\n\
+  -j, --jobs       walk with at most n threads.\n\
   -m, --maxdepth   maximum depth to report on.\n\
+  -s, --socket     query the tdud daemon on socket.\n\
   -u, --units      the units to report in.\n\
+  -w, --watch      stay watching, reporting changes every n seconds.\n\
   directory        the directory to report on.\n\
-"), program_name());
+       %s [options] -r trace\n\
+  report on a recorded trace, naming each path by a hash of its name.\n\
+       %s [options] -I image\n\
+  report on an ext4 file system image without mounting it.\n\
+       %s history [-h] [-H file] [-d days] [-n count] [-u units] [path]\n\
+  report the growth recorded in a history store.\n\
+       %s collect [-h] [-v] [-s socket] [-T file] address\n\
+  merge the scans streamed by agents, answering tdu -s on socket.\n\
+"), program_name(), program_name(), program_name(), program_name(),
+	   program_name());
 	exit(EXIT_FAILURE);
 }
 
@@ -81,6 +81,31 @@ xmalloc(size_t n)
 	return NULL;
 }
 
+/**
+ * Resize a block of memory.
+ * If there is an error in obtaining the memory err()
+ * is called, terminating the program.
+ *
+ * \param[in] ptr The existing block, or NULL.
+ * \param[in] n   The new size in bytes.
+ *
+ * \return A pointer to the resized memory.
+ **/
+ATT_MSIZE(2)
+void *
+xrealloc(void *ptr, size_t n)
+{
+	void *nptr = NULL;	/* New pointer to memory location */
+
+	nptr = realloc(ptr, n);
+	if (nptr == NULL && n > 0) {
+		errx(EX_SOFTWARE,
+		     _("out of memory (unable to allocate %ld bytes)"), n);
+	}
+
+	return nptr;
+}
+
 /**
  * \}
  **/
@@ -48,6 +48,9 @@ extern "C"
 /* Allocate a block of memory */
 void * xmalloc(size_t);
 
+/* Resize a block of memory */
+void * xrealloc(void *, size_t);
+
 #ifdef __cplusplus
 }                               /* extern "C" */
 #endif
@@ -0,0 +1,1667 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file pwalk.c
+ * Routines to walk a file system with several threads.
+ *
+ * The walk is a pipeline of three stages:
+ *
+ *     readdir  -- names -->  stat  -- records -->  aggregate
+ *
+ * Readers take directories from a shared stack and read their names
+ * in batches. Stat workers stat the names of a batch relative to the
+ * open directory, push the directories they find back onto the stack
+ * and pass batches of records on. A single aggregator adds the records
+ * to the tree, which needs no lock as no other thread touches it.
+ *
+ * Unless the entries are watched, listed as cold files, kept in the
+ * full tree or typed by name, the records of a batch other than
+ * directories are aggregated together by a vector kernel, as they all
+ * belong to the same directory.
+ *
+ * When nothing needs the entries one at a time, as watching, listing
+ * cold files, the full tree, mounts and traces do, there is no
+ * aggregator. Each stat worker adds its records to a private shard of
+ * the tree instead, aligned to a cache line so that the workers write
+ * to no memory in common. The shards are merged into the tree in a
+ * fixed order once the walk is done. Every counter is an integer, so
+ * the result is that of a serial walk whatever the number of threads.
+ *
+ * The stages are connected by bounded lock free queues. A stage that
+ * finds its output full waits for it to drain, so a slow stage holds
+ * back the ones before it rather than letting memory grow. The
+ * directory stack is not bounded, as the stat stage must always be
+ * able to hand directories back to the readers.
+ *
+ * The number of stat workers allowed to run at once is tuned while
+ * the walk runs, in the manner of TCP congestion control. Every control
+ * interval the entry rate and the mean stat latency are measured. The
+ * limit doubles while the latency stays near the lowest seen (slow
+ * start), then grows by one worker while the rate keeps improving,
+ * and is halved whenever the latency climbs well above its floor,
+ * which is where more outstanding requests only queue in the storage.
+ *
+ * Each stage accounts the time its threads are busy, starved of input,
+ * blocked on a full output and held back by the controller, and the occupancy of the queues is
+ * sampled every control interval. With verbose output these show which
+ * stage limits the walk.
+ *
+ * When mounts are crossed (TDU_F_MOUNTS) every file system found gets
+ * its own directory stack, names queue and controller, so each device
+ * has its own limit. Readers prefer devices whose queue has room, and
+ * stat workers take batches from any device below its limit, so a
+ * slow mount can not hold the workers or the readers away from the
+ * fast ones.
+ *
+ * Storage with a high latency (TDU_F_LATENCY), such as NFS, is given
+ * as many readers as stat workers, so directories are opened and read
+ * well ahead of the stat workers. Names go out in small batches to
+ * spread even small directories over the workers. The walk starts
+ * with every stat worker running, as each waits for its reply
+ * rather than loading the storage.
+ *
+ * \ingroup walk
+ * \{
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <search.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "walk.h"
+#include "kernel.h"
+
+#define PWALK_BATCH      1024   /**< Names in a batch **/
+#define PWALK_LATBATCH   32     /**< Names in a batch, high latency **/
+#define PWALK_DENTS      (64 << 10)/**< Directory read buffer **/
+#define PWALK_HUGE       (1 << 20)/**< Size of a huge directory **/
+#define PWALK_HUGEDENTS  (4 << 20)/**< Read buffer of a huge directory **/
+#define PWALK_QUEUE      64     /**< Batches a queue holds **/
+#define PWALK_SPIN       64     /**< Polls before a waiting thread sleeps **/
+#define PWALK_NAP        20000  /**< Sleep of a waiting thread in ns **/
+#define PWALK_INTERVAL   100    /**< Control interval in ms **/
+#define PWALK_CONGESTED  2.0    /**< Latency over its floor that halves **/
+#define PWALK_DECAY      1.02   /**< Growth of the latency floor **/
+#define PWALK_MAXDEV     64     /**< Devices scheduled apart **/
+#define PWALK_LINE       64     /**< Size of a cache line **/
+
+_Static_assert(PWALK_BATCH <= KERNEL_BATCH, "a batch must fit a kernel");
+
+#if HAVE_GETDENTS64
+#define GETDENTS(fd, buf, n)  getdents64(fd, buf, n)
+#else
+#define GETDENTS(fd, buf, n)  syscall(SYS_getdents64, fd, buf, n)
+#endif
+
+/**
+ * Pipeline stages.
+ **/
+enum stage {
+	READDIR,
+	STAT,
+	AGGREGATE,
+	NSTAGE
+};
+
+/**
+ * Time accounts of a stage, in ns.
+ **/
+enum account {
+	BUSY,                  /**< Working **/
+	STARVED,               /**< Waiting for input **/
+	BLOCKED,               /**< Waiting for room in the output **/
+	THROTTLED,             /**< Held back by the controller **/
+	NACCOUNT
+};
+
+struct device;
+
+/**
+ * An open directory, shared by the batches of its names.
+ **/
+struct dir {
+	struct device *dev;    /**< The device it is on **/
+	char *path;            /**< The directory **/
+	size_t len;            /**< Length of the path **/
+	int fd;                /**< The open directory **/
+	int level;             /**< Its level below the top level path **/
+	off_t size;            /**< Size of the directory in bytes **/
+	atomic_uint refs;      /**< Batches and readers using it **/
+	struct dir *next;      /**< The next directory on the stack **/
+};
+
+/**
+ * A batch of names or of records.
+ *
+ * The names are packed into a buffer. Records carry the full path
+ * of each entry and its status.
+ **/
+struct batch {
+	struct dir *dir;       /**< The directory of the names **/
+	int level;             /**< Level of the entries **/
+	size_t n;              /**< Number of entries **/
+	size_t used;           /**< Bytes used in buf **/
+	size_t size;           /**< Size of buf **/
+	char *buf;             /**< The packed names or paths **/
+	size_t off[PWALK_BATCH];/**< Offset of each name in buf **/
+	struct stat sb[];      /**< Status of each record **/
+};
+
+/**
+ * A cell of a bounded queue.
+ **/
+struct cell {
+	atomic_size_t seq;     /**< Sequence of the cell **/
+	struct batch *b;       /**< The batch held **/
+};
+
+/**
+ * A bounded lock free multi producer, multi consumer queue.
+ **/
+struct queue {
+	struct cell cells[PWALK_QUEUE];       /**< The cells **/
+	_Alignas(64) atomic_size_t head;      /**< Next cell to take **/
+	_Alignas(64) atomic_size_t tail;      /**< Next cell to fill **/
+	_Alignas(64) atomic_uint_fast64_t occupancy;/**< Sum of sampled fill **/
+};
+
+/**
+ * Controller state.
+ **/
+struct control {
+	uint64_t last;         /**< Time of the last control, ns **/
+	double floor;          /**< Lowest mean latency seen, ns **/
+	double rate;           /**< Entry rate of the last interval **/
+	int slow;              /**< In slow start **/
+};
+
+/**
+ * A file system being walked, scheduled apart from the others.
+ **/
+struct device {
+	dev_t dev;             /**< The device **/
+	char *path;            /**< Where it was found **/
+	struct dir *stack;     /**< Directories waiting to be read **/
+	struct queue names;    /**< Readers to stat workers **/
+	atomic_uint limit;     /**< Stat workers allowed to run **/
+	atomic_uint active;    /**< Stat workers running **/
+	struct control c;      /**< Its controller **/
+	atomic_uint_fast64_t found;  /**< Entries found **/
+	atomic_uint_fast64_t entries;/**< Entries since the last control **/
+	atomic_uint_fast64_t latency;/**< Stat time since the last control **/
+	atomic_uint_fast64_t nstat;  /**< Stats since the last control **/
+};
+
+/**
+ * A private tree a stat worker aggregates into.
+ **/
+struct shard {
+	_Alignas(PWALK_LINE) struct tdu_ctx ctx;/**< Its own scan context **/
+};
+
+/**
+ * Walk state shared by the threads.
+ **/
+struct pwalk {
+	struct tdu_ctx *ctx;   /**< The scan context **/
+	struct queue recs;     /**< Stat workers to the aggregator **/
+	atomic_uint_fast64_t inflight;/**< Directories and batches not done **/
+	atomic_int done;       /**< Every entry has been aggregated **/
+	atomic_int error;      /**< errno of the first entry not kept **/
+	pthread_mutex_t lock;  /**< Protects the stacks and devices **/
+	pthread_cond_t dirs;   /**< A directory was pushed **/
+	pthread_cond_t idle;   /**< The walk is done **/
+	struct device *devs[PWALK_MAXDEV];/**< The devices **/
+	atomic_uint ndev;      /**< Number of devices **/
+	uint32_t nthread[NSTAGE];/**< Threads of each stage **/
+	size_t batch;          /**< Names in a batch **/
+	struct shard *shards;  /**< Stat worker trees, or NULL **/
+	uint32_t nshard;       /**< Number of shards **/
+	atomic_uint next;      /**< Next shard to hand out **/
+	uint64_t merge;        /**< Time to merge the shards, ns **/
+	uint64_t samples;      /**< Occupancy samples taken **/
+	atomic_uint_fast64_t time[NSTAGE][NACCOUNT];/**< Stage accounts **/
+};
+
+/* Internal functions */
+static void      *reader(void *);
+static void      *stater(void *);
+static void      *aggregator(void *);
+static void       readdir_one(struct pwalk *, struct dir *, char **,
+			      size_t *);
+static struct batch *gather(struct pwalk *, struct dir *, struct batch *,
+			    const char *, uint64_t *, uint64_t *);
+static void       stat_one(struct pwalk *, struct batch *,
+			   struct tdu_ctx *);
+static void       add(struct tdu_ctx *, struct batch *);
+static struct shard *shards_new(struct tdu_ctx *, uint32_t);
+static void       shards_merge(struct pwalk *);
+static void       merge_one(const void *, VISIT, int);
+static int32_t    push_dir(struct pwalk *, struct device *, const char *,
+			   size_t, int, off_t);
+static struct device *device(struct pwalk *, dev_t, const char *, size_t);
+static struct dir *pick(struct pwalk *, uint32_t *);
+static struct batch *take(struct pwalk *, struct device **, uint32_t *);
+static void       put_dir(struct dir *);
+static void       finish(struct pwalk *);
+static void       fail(struct pwalk *, int);
+static struct batch *batch_new(int);
+static int32_t    batch_add(struct batch *, const char *, size_t);
+static int32_t    batch_grow(struct batch *, size_t);
+static void       batch_free(struct batch *);
+static void       q_init(struct queue *);
+static int        q_push(struct queue *, struct batch *);
+static struct batch *q_pop(struct queue *);
+static size_t     q_size(struct queue *);
+static void       send(struct pwalk *, struct queue *, struct batch *,
+		       enum stage);
+static struct batch *receive(struct pwalk *, struct queue *, enum stage);
+static void       control(struct pwalk *);
+static void       adjust(struct pwalk *, struct device *, size_t, size_t);
+static void       report(struct pwalk *, double);
+static uint64_t   now_ns(void);
+
+/*
+ * twalk() has no user data argument, so the context the shards are
+ * merged into is handed to the call back through here.
+ */
+static __thread struct tdu_ctx *into = NULL;
+
+/**
+ * Walk a file system with several threads.
+ *
+ * An entry a thread has no memory for is left out of the scan, and
+ * the failure recorded in the context, as the serial walk does.
+ *
+ * \param[in] ctx  The scan context.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted.
+ **/
+int32_t
+tdu_pwalk(struct tdu_ctx *ctx)
+{
+	uint32_t i = 0;
+	uint32_t n = 0;
+	uint32_t s = 0;
+	uint64_t start = 0;
+	struct stat sb = {0};
+	struct dir *d = NULL;
+	struct pwalk *pw = NULL;
+	struct device *v = NULL;
+	struct timespec ts = {0};
+	pthread_t *threads = NULL;
+	void *(*fn[NSTAGE])(void *) = {reader, stater, aggregator};
+	int32_t rc = EXIT_SUCCESS;
+
+	if (lstat(ctx->opts.path, &sb) != 0) {
+		return(EXIT_FAILURE);
+	}
+	if (ctx->observe) {
+		tdu_observe(ctx, ctx->opts.path, &sb,
+			    S_ISDIR(sb.st_mode) ? FTW_D : FTW_F, 0);
+	}
+	ctx->entry(ctx, ctx->opts.path, &sb, S_ISDIR(sb.st_mode) ? FTW_D : FTW_F, 0);
+	if (!S_ISDIR(sb.st_mode)) {
+		return(EXIT_SUCCESS);
+	}
+
+	if ((pw = calloc(1, sizeof(struct pwalk))) == NULL) {
+		return(EXIT_FAILURE);
+	}
+	pw->ctx = ctx;
+	q_init(&pw->recs);
+	pthread_mutex_init(&pw->lock, NULL);
+	pthread_cond_init(&pw->dirs, NULL);
+	pthread_cond_init(&pw->idle, NULL);
+
+	/* Reading names is cheap next to statting them */
+	pw->nthread[READDIR] = (ctx->opts.jobs + 3) / 4;
+	pw->batch = PWALK_BATCH;
+	pw->nthread[STAT] = ctx->opts.jobs;
+	pw->nthread[AGGREGATE] = 1;
+
+	/* The files of a batch need nothing but their counters */
+	ctx->kernel = NULL;
+	if (ctx->watch == NULL && ctx->emit == NULL && ctx->tree == NULL &&
+	    ctx->where == NULL && !(ctx->opts.flags & TDU_F_TYPES)) {
+		ctx->kernel = kernel_select();
+	}
+
+	/* Nothing needs the entries in turn, so the workers aggregate */
+	if (ctx->watch == NULL && ctx->emit == NULL && ctx->tree == NULL &&
+	    ctx->spill == NULL && !ctx->observe &&
+	    (pw->shards = shards_new(ctx, pw->nthread[STAT])) != NULL) {
+		pw->nshard = pw->nthread[STAT];
+		pw->nthread[AGGREGATE] = 0;
+	}
+
+	/* Waiting on the storage is cheap, keep many requests out */
+	if (ctx->opts.flags & TDU_F_LATENCY) {
+		pw->nthread[READDIR] = ctx->opts.jobs;
+		pw->batch = PWALK_LATBATCH;
+	}
+
+	/* Without the top level directory no thread would ever finish */
+	threads = malloc((pw->nthread[READDIR] + pw->nthread[STAT] + 1) *
+			 sizeof(pthread_t));
+	pthread_mutex_lock(&pw->lock);
+	v = device(pw, sb.st_dev, ctx->opts.path, strlen(ctx->opts.path));
+	pthread_mutex_unlock(&pw->lock);
+	if (threads == NULL || v == NULL ||
+	    push_dir(pw, v, ctx->opts.path, strlen(ctx->opts.path), 0,
+		     sb.st_size)) {
+		free(threads);
+		threads = NULL;
+		pw->nthread[READDIR] = 0;
+		pw->nthread[STAT] = 0;
+		pw->nthread[AGGREGATE] = 0;
+		atomic_store(&pw->done, 1);
+		fail(pw, ENOMEM);
+	}
+
+	start = now_ns();
+	for (s = 0; s < NSTAGE; ++s) {
+		for (i = 0; i < pw->nthread[s]; ++i) {
+			if (pthread_create(&threads[n], NULL, fn[s], pw) != 0) {
+				/* Every stage needs a thread to finish */
+				if (i == 0) {
+					finish(pw);
+					rc = EXIT_FAILURE;
+				}
+				break;
+			}
+			++n;
+		}
+		pw->nthread[s] = i;
+	}
+
+	pthread_mutex_lock(&pw->lock);
+	while (!atomic_load(&pw->done)) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += PWALK_INTERVAL * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_nsec -= 1000000000L;
+			++ts.tv_sec;
+		}
+		pthread_cond_timedwait(&pw->idle, &pw->lock, &ts);
+		if (!atomic_load(&pw->done)) {
+			control(pw);
+		}
+	}
+	pthread_mutex_unlock(&pw->lock);
+
+	for (i = 0; i < n; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	shards_merge(pw);
+	if (atomic_load(&pw->error) != 0) {
+		tdu_fail(ctx, atomic_load(&pw->error));
+	}
+
+	if (ctx->opts.verbose) {
+		report(pw, (now_ns() - start) / 1e9);
+	}
+
+	for (i = 0; i < atomic_load(&pw->ndev); ++i) {
+		v = pw->devs[i];
+		/* Left over by a failed start */
+		while ((d = v->stack) != NULL) {
+			v->stack = d->next;
+			put_dir(d);
+		}
+		free(v->path);
+		free(v);
+	}
+
+	pthread_mutex_destroy(&pw->lock);
+	pthread_cond_destroy(&pw->dirs);
+	pthread_cond_destroy(&pw->idle);
+	free(pw);
+
+	return(rc);
+}
+
+/**
+ * A reader, reading directories until the walk is done.
+ *
+ * \param[in] arg  The walk state.
+ *
+ * \retval NULL  Always.
+ **/
+static void *
+reader(void *arg)
+{
+	size_t size = 0;
+	uint32_t next = 0;
+	uint64_t t0 = 0;
+	char *buf = NULL;
+	struct dir *d = NULL;
+	struct pwalk *pw = arg;
+
+	for (;;) {
+		t0 = now_ns();
+		d = NULL;
+		pthread_mutex_lock(&pw->lock);
+		while (!atomic_load(&pw->done) &&
+		       (d = pick(pw, &next)) == NULL) {
+			pthread_cond_wait(&pw->dirs, &pw->lock);
+		}
+		pthread_mutex_unlock(&pw->lock);
+		atomic_fetch_add(&pw->time[READDIR][STARVED], now_ns() - t0);
+
+		if (d == NULL) {
+			break;
+		}
+
+		readdir_one(pw, d, &buf, &size);
+		put_dir(d);
+		if (atomic_fetch_sub(&pw->inflight, 1) == 1) {
+			finish(pw);
+		}
+	}
+	free(buf);
+
+	return(NULL);
+}
+
+/**
+ * Read the names of a directory into batches for the stat workers.
+ *
+ * On Linux the names are read with getdents64() into a buffer of the
+ * reader, which is enlarged for a huge directory so its millions of
+ * names take few system calls. The batches of a huge directory are
+ * spread over every stat worker like those of any other directory,
+ * so it is statted in parallel.
+ *
+ * \param[in]     pw    The walk state.
+ * \param[in]     d     The directory.
+ * \param[in,out] buf   The read buffer of the reader.
+ * \param[in,out] size  Size of the read buffer.
+ **/
+static void
+readdir_one(struct pwalk *pw, struct dir *d, char **buf, size_t *size)
+{
+	uint64_t t0 = 0;
+	uint64_t busy = 0;
+	uint64_t calls = 0;
+	struct batch *b = NULL;
+#if defined(__linux__) && defined(SYS_getdents64)
+	long n = 0;
+	long off = 0;
+	size_t want = 0;
+	struct dirent64 *de = NULL;
+#else
+	int fd = -1;
+	DIR *dir = NULL;
+	struct dirent *de = NULL;
+#endif
+
+	t0 = now_ns();
+	if ((d->fd = open(d->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) < 0) {
+		return;
+	}
+
+#if defined(__linux__) && defined(SYS_getdents64)
+	want = d->size >= PWALK_HUGE ? PWALK_HUGEDENTS : PWALK_DENTS;
+	if (*size < want) {
+		free(*buf);
+		*size = 0;
+		if ((*buf = malloc(want)) == NULL) {
+			fail(pw, ENOMEM);
+			return;
+		}
+		*size = want;
+	}
+
+	/* The offset of the descriptor is not used by the stat workers */
+	while ((n = GETDENTS(d->fd, *buf, *size)) > 0) {
+		++calls;
+		for (off = 0; off < n; off += de->d_reclen) {
+			de = (struct dirent64 *)(*buf + off);
+			b = gather(pw, d, b, de->d_name, &t0, &busy);
+		}
+	}
+#else
+	/* The stat workers keep using the directory after it is read */
+	if ((fd = dup(d->fd)) < 0 || (dir = fdopendir(fd)) == NULL) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		b = gather(pw, d, b, de->d_name, &t0, &busy);
+	}
+	closedir(dir);
+#endif
+	busy += now_ns() - t0;
+
+	if (b != NULL) {
+		atomic_fetch_add(&pw->inflight, 1);
+		send(pw, &d->dev->names, b, READDIR);
+	}
+	atomic_fetch_add(&pw->time[READDIR][BUSY], busy);
+
+	if (pw->ctx->opts.verbose && d->size >= PWALK_HUGE) {
+		warnx(_("huge directory %s read in %llu calls"), d->path,
+		      (unsigned long long)calls);
+	}
+}
+
+/**
+ * Add a name to the batch being filled, sending it on when full.
+ *
+ * \param[in]     pw    The walk state.
+ * \param[in]     d     The directory of the name.
+ * \param[in]     b     The batch being filled, or NULL.
+ * \param[in]     name  The name.
+ * \param[in,out] t0    Start of the busy time being accounted.
+ * \param[in,out] busy  Busy time accounted so far.
+ *
+ * \retval b  The batch being filled, or NULL.
+ **/
+static struct batch *
+gather(struct pwalk *pw, struct dir *d, struct batch *b, const char *name,
+       uint64_t *t0, uint64_t *busy)
+{
+
+	if (name[0] == '.' && (name[1] == '\0' ||
+	    (name[1] == '.' && name[2] == '\0'))) {
+		return(b);
+	}
+	if (b == NULL) {
+		if ((b = batch_new(0)) == NULL) {
+			fail(pw, ENOMEM);
+			return(NULL);
+		}
+		b->dir = d;
+		b->level = d->level + 1;
+		atomic_fetch_add(&d->refs, 1);
+	}
+	if (batch_add(b, name, strlen(name))) {
+		fail(pw, ENOMEM);
+	}
+	if (b->n == pw->batch) {
+		*busy += now_ns() - *t0;
+		atomic_fetch_add(&pw->inflight, 1);
+		send(pw, &d->dev->names, b, READDIR);
+		b = NULL;
+		*t0 = now_ns();
+	}
+
+	return(b);
+}
+
+/**
+ * A stat worker, statting batches of names until the walk is done.
+ *
+ * \param[in] arg  The walk state.
+ *
+ * \retval NULL  Always.
+ **/
+static void *
+stater(void *arg)
+{
+	uint32_t next = 0;
+	struct batch *b = NULL;
+	struct device *v = NULL;
+	struct tdu_ctx *shard = NULL;
+	struct pwalk *pw = arg;
+
+	if (pw->shards != NULL) {
+		shard = &pw->shards[atomic_fetch_add(&pw->next, 1)].ctx;
+	}
+
+	while ((b = take(pw, &v, &next)) != NULL) {
+		stat_one(pw, b, shard);
+		atomic_fetch_sub(&v->active, 1);
+
+		if (atomic_fetch_sub(&pw->inflight, 1) == 1) {
+			finish(pw);
+		}
+	}
+
+	return(NULL);
+}
+
+/**
+ * Stat a batch of names and pass the records on.
+ *
+ * \param[in] pw     The walk state.
+ * \param[in] b      The names, released.
+ * \param[in] shard  The tree of the worker, or NULL to pass the
+ *                   records to the aggregator.
+ **/
+static void
+stat_one(struct pwalk *pw, struct batch *b, struct tdu_ctx *shard)
+{
+	int rc = 0;
+	size_t i = 0;
+	size_t len = 0;
+	uint64_t t0 = 0;
+	uint64_t t1 = 0;
+	uint64_t lat = 0;
+	uint64_t found = 0;
+	struct dir *d = b->dir;
+	struct device *v = d->dev;
+	struct device *nv = NULL;
+	struct batch *r = NULL;
+	const char *name = NULL;
+	int cross = (pw->ctx->opts.flags & TDU_F_MOUNTS) != 0;
+
+	t0 = now_ns();
+	if ((r = batch_new(1)) == NULL) {
+		fail(pw, ENOMEM);
+		put_dir(d);
+		batch_free(b);
+		return;
+	}
+	r->level = b->level;
+
+	for (i = 0; i < b->n; ++i) {
+		name = b->buf + b->off[i];
+
+		t1 = now_ns();
+		rc = fstatat(d->fd, name, &r->sb[r->n], AT_SYMLINK_NOFOLLOW);
+		lat += now_ns() - t1;
+
+		/* Like FTW_MOUNT, entries of other file systems are skipped */
+		if (rc != 0 || (r->sb[r->n].st_dev != v->dev && !cross)) {
+			continue;
+		}
+
+		/* The record is the full path of the entry */
+		len = strlen(name);
+		r->off[r->n] = r->used;
+		if (batch_grow(r, d->len + len + 2)) {
+			fail(pw, ENOMEM);
+			continue;
+		}
+		memcpy(r->buf + r->used, d->path, d->len);
+		r->used += d->len;
+		if (d->path[d->len-1] != '/') {
+			r->buf[r->used++] = '/';
+		}
+		memcpy(r->buf + r->used, name, len + 1);
+		r->used += len + 1;
+
+		if (S_ISDIR(r->sb[r->n].st_mode)) {
+			nv = v;
+			if (r->sb[r->n].st_dev != v->dev) {
+				pthread_mutex_lock(&pw->lock);
+				nv = device(pw, r->sb[r->n].st_dev,
+					    r->buf + r->off[r->n],
+					    r->used - r->off[r->n] - 1);
+				pthread_mutex_unlock(&pw->lock);
+			}
+			push_dir(pw, nv, r->buf + r->off[r->n],
+				 r->used - r->off[r->n] - 1, b->level,
+				 r->sb[r->n].st_size);
+		}
+		++r->n;
+		++found;
+	}
+
+	atomic_fetch_add(&v->found, found);
+	atomic_fetch_add(&v->entries, found);
+	atomic_fetch_add(&v->latency, lat);
+	atomic_fetch_add(&v->nstat, b->n);
+
+	put_dir(d);
+	batch_free(b);
+
+	if (shard != NULL) {
+		add(shard, r);
+		batch_free(r);
+		atomic_fetch_add(&pw->time[STAT][BUSY], now_ns() - t0);
+		return;
+	}
+
+	atomic_fetch_add(&pw->time[STAT][BUSY], now_ns() - t0);
+	if (r->n > 0) {
+		atomic_fetch_add(&pw->inflight, 1);
+		send(pw, &pw->recs, r, STAT);
+	} else {
+		batch_free(r);
+	}
+}
+
+/**
+ * The aggregator, adding records to the tree until the walk is done.
+ *
+ * \param[in] arg  The walk state.
+ *
+ * \retval NULL  Always.
+ **/
+static void *
+aggregator(void *arg)
+{
+	uint64_t t0 = 0;
+	struct batch *b = NULL;
+	struct pwalk *pw = arg;
+
+	while ((b = receive(pw, &pw->recs, AGGREGATE)) != NULL) {
+		t0 = now_ns();
+		add(pw->ctx, b);
+		batch_free(b);
+		atomic_fetch_add(&pw->time[AGGREGATE][BUSY], now_ns() - t0);
+
+		if (atomic_fetch_sub(&pw->inflight, 1) == 1) {
+			finish(pw);
+		}
+	}
+
+	return(NULL);
+}
+
+/**
+ * Add a batch of records to a tree.
+ *
+ * With a kernel, the records other than directories are gathered
+ * and aggregated together under the node of their directory.
+ *
+ * \param[in] ctx  The scan context or shard to add to.
+ * \param[in] b    The records.
+ **/
+static void
+add(struct tdu_ctx *ctx, struct batch *b)
+{
+	size_t i = 0;
+	size_t first = 0;
+	int tflag = 0;
+	mode_t mode = 0;
+	struct pinfo *n = NULL;
+	struct kedges e;
+	struct kbatch kb;
+
+	kb.n = 0;
+	kb.nreg = 0;
+	kb.links = 0;
+	for (i = 0; i < b->n; ++i) {
+		mode = b->sb[i].st_mode;
+		tflag = S_ISDIR(mode) ? FTW_D : S_ISLNK(mode) ? FTW_SL : FTW_F;
+		if (ctx->observe) {
+			tdu_observe(ctx, b->buf + b->off[i], &b->sb[i], tflag,
+				    b->level);
+		}
+		if (ctx->kernel == NULL || tflag == FTW_D) {
+			ctx->entry(ctx, b->buf + b->off[i], &b->sb[i], tflag,
+				   b->level);
+			continue;
+		}
+		if (kb.n == 0) {
+			first = i;
+		}
+		kb.size[kb.n] = b->sb[i].st_size;
+		kb.atime[kb.n++] = b->sb[i].st_atime;
+		if (S_ISREG(mode)) {
+			kb.rsize[kb.nreg++] = b->sb[i].st_size;
+		}
+		kb.links += S_ISLNK(mode) != 0;
+	}
+
+	if (kb.n > 0) {
+		kernel_edges(&e, ctx->now, ctx->opts.atime,
+			     (ctx->opts.flags & TDU_F_AGES) != 0);
+		if ((n = tdu_node(ctx, b->buf + b->off[first], FTW_F,
+				  b->level)) == NULL) {
+			return;
+		}
+		ctx->kernel(&kb, &e, n);
+		n->files += kb.nreg;
+		n->links += kb.links;
+	}
+}
+
+/**
+ * Create a shard for each stat worker.
+ *
+ * A shard is a copy of the scan context with an empty tree of its
+ * own. Each is aligned to a cache line and fills whole lines, so the
+ * node caches of neighbouring workers do not share one.
+ *
+ * A shard keeps the tsearch() tree of a context rather than a hash
+ * table of its own, so that the workers aggregate through the same
+ * call backs as a serial walk, the last node cache already takes most
+ * lookups and tdu_merge() folds the shards in without a second way
+ * of finding a node.
+ *
+ * \param[in] ctx  The scan context.
+ * \param[in] n    Number of shards.
+ *
+ * \retval sh    The shards.
+ * \retval NULL  If there was no memory for them.
+ **/
+static struct shard *
+shards_new(struct tdu_ctx *ctx, uint32_t n)
+{
+	uint32_t i = 0;
+	void *sh = NULL;
+	struct shard *s = NULL;
+
+	if (posix_memalign(&sh, PWALK_LINE, n * sizeof(struct shard)) != 0) {
+		return(NULL);
+	}
+	s = sh;
+	memset(s, 0, n * sizeof(struct shard));
+	for (i = 0; i < n; ++i) {
+		s[i].ctx = *ctx;
+		s[i].ctx.root = NULL;
+		s[i].ctx.last = NULL;
+		s[i].ctx.pbuf = NULL;
+		s[i].ctx.pbufsize = 0;
+	}
+
+	return(s);
+}
+
+/**
+ * Merge the shards into the tree of the scan and release them.
+ *
+ * \param[in] pw  The walk state.
+ **/
+static void
+shards_merge(struct pwalk *pw)
+{
+	uint32_t i = 0;
+	uint64_t t0 = 0;
+
+	if (pw->shards == NULL) {
+		return;
+	}
+
+	t0 = now_ns();
+	into = pw->ctx;
+	for (i = 0; i < pw->nshard; ++i) {
+		twalk(pw->shards[i].ctx.root, merge_one);
+		if (pw->shards[i].ctx.error != 0) {
+			tdu_fail(pw->ctx, pw->shards[i].ctx.error);
+		}
+		tdu_nodes_free(&pw->shards[i].ctx.root);
+		free(pw->shards[i].ctx.pbuf);
+	}
+	into = NULL;
+	free(pw->shards);
+	pw->shards = NULL;
+	pw->merge = now_ns() - t0;
+}
+
+/**
+ * Merge a node of a shard, called back by twalk().
+ *
+ * \param[in] nodep  The node.
+ * \param[in] v      Which visit of the node this is.
+ * \param[in] depth  Depth of the node in the binary tree.
+ **/
+static void
+merge_one(const void *nodep, VISIT v, int depth)
+{
+
+	(void)depth;
+	if (v == postorder || v == leaf) {
+		tdu_merge(into, *(struct pinfo *const *)nodep);
+	}
+}
+
+/**
+ * Push a directory for the readers.
+ *
+ * \param[in] pw     The walk state.
+ * \param[in] v      The device it is on.
+ * \param[in] path   The directory.
+ * \param[in] len    Length of the path.
+ * \param[in] level  Its level below the top level path.
+ * \param[in] size   Its size in bytes.
+ *
+ * \retval 0 If the directory was pushed.
+ * \retval 1 If there was no memory, it is recorded in the walk state.
+ **/
+static int32_t
+push_dir(struct pwalk *pw, struct device *v, const char *path, size_t len,
+	 int level, off_t size)
+{
+	struct dir *d = NULL;
+
+	if ((d = calloc(1, sizeof(struct dir))) == NULL ||
+	    (d->path = strndup(path, len)) == NULL) {
+		free(d);
+		fail(pw, ENOMEM);
+		return(EXIT_FAILURE);
+	}
+	d->len = len;
+	d->fd = -1;
+	d->level = level;
+	d->size = size;
+	d->dev = v;
+	atomic_init(&d->refs, 1);
+
+	atomic_fetch_add(&pw->inflight, 1);
+	pthread_mutex_lock(&pw->lock);
+	d->next = v->stack;
+	v->stack = d;
+	pthread_cond_signal(&pw->dirs);
+	pthread_mutex_unlock(&pw->lock);
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Find the scheduling state of a device, adding it when first found.
+ *
+ * Called with the walk lock held. Once PWALK_MAXDEV devices are known,
+ * or there is no memory for another, the rest share the state of the
+ * top level device.
+ *
+ * \param[in] pw    The walk state.
+ * \param[in] dev   The device.
+ * \param[in] path  Where it was found.
+ * \param[in] len   Length of the path.
+ *
+ * \retval v     The device.
+ * \retval NULL  If there was no memory for the top level device.
+ **/
+static struct device *
+device(struct pwalk *pw, dev_t dev, const char *path, size_t len)
+{
+	uint32_t i = 0;
+	uint32_t n = atomic_load(&pw->ndev);
+	struct device *v = NULL;
+
+	for (i = 0; i < n; ++i) {
+		if (pw->devs[i]->dev == dev) {
+			return(pw->devs[i]);
+		}
+	}
+	if (n == PWALK_MAXDEV) {
+		return(pw->devs[0]);
+	}
+
+	if ((v = calloc(1, sizeof(struct device))) == NULL ||
+	    (v->path = strndup(path, len)) == NULL) {
+		free(v);
+		return(n > 0 ? pw->devs[0] : NULL);
+	}
+	v->dev = dev;
+	q_init(&v->names);
+	v->c.last = now_ns();
+	v->c.slow = 1;
+	atomic_init(&v->limit, 1);
+	if (pw->ctx->opts.flags & TDU_F_LATENCY) {
+		v->c.slow = 0;
+		atomic_init(&v->limit, pw->nthread[STAT]);
+	}
+
+	pw->devs[n] = v;
+	atomic_store(&pw->ndev, n + 1);
+
+	return(v);
+}
+
+/**
+ * Take a directory for a reader.
+ *
+ * Called with the walk lock held. Devices are visited in turn from
+ * where the reader last took one, preferring a device whose names
+ * queue has room so a reader is not held up by a slow device.
+ *
+ * \param[in]     pw    The walk state.
+ * \param[in,out] next  The device the reader visits first.
+ *
+ * \retval d     The directory.
+ * \retval NULL  If no directory is waiting.
+ **/
+static struct dir *
+pick(struct pwalk *pw, uint32_t *next)
+{
+	uint32_t i = 0;
+	uint32_t n = atomic_load(&pw->ndev);
+	struct device *v = NULL;
+	struct device *full = NULL;
+	struct dir *d = NULL;
+
+	for (i = 0; i < n; ++i) {
+		v = pw->devs[(*next + i) % n];
+		if (v->stack == NULL) {
+			continue;
+		}
+		if (q_size(&v->names) < PWALK_QUEUE) {
+			break;
+		}
+		if (full == NULL) {
+			full = v;
+		}
+		v = NULL;
+	}
+	if (i == n) {
+		v = full;
+	}
+	if (v == NULL) {
+		return(NULL);
+	}
+
+	d = v->stack;
+	v->stack = d->next;
+	*next = (*next + i + 1) % n;
+
+	return(d);
+}
+
+/**
+ * Take a batch of names for a stat worker.
+ *
+ * Devices are visited in turn from where the worker last took one,
+ * and a batch is only taken from a device below its limit. The time
+ * spent waiting is throttled when there were names held back by a
+ * limit, and starved otherwise.
+ *
+ * \param[in]     pw    The walk state.
+ * \param[out]    vp    The device of the batch, a slot of which is held.
+ * \param[in,out] next  The device the worker visits first.
+ *
+ * \retval b     The batch.
+ * \retval NULL  If the walk is done.
+ **/
+static struct batch *
+take(struct pwalk *pw, struct device **vp, uint32_t *next)
+{
+	int got = 0;
+	int held = 0;
+	uint32_t i = 0;
+	uint32_t n = 0;
+	uint32_t a = 0;
+	uint32_t spins = 0;
+	uint64_t t0 = 0;
+	struct device *v = NULL;
+	struct batch *b = NULL;
+	struct timespec nap = {0, PWALK_NAP};
+
+	for (;;) {
+		n = atomic_load(&pw->ndev);
+		held = 0;
+		for (i = 0; i < n; ++i) {
+			v = pw->devs[(*next + i) % n];
+			if (q_size(&v->names) == 0) {
+				continue;
+			}
+			got = 0;
+			a = atomic_load(&v->active);
+			while (!got && a < atomic_load(&v->limit)) {
+				got = atomic_compare_exchange_weak(&v->active,
+								   &a, a + 1);
+			}
+			if (!got) {
+				held = 1;
+				continue;
+			}
+			if ((b = q_pop(&v->names)) != NULL) {
+				*vp = v;
+				*next = (*next + i + 1) % n;
+				return(b);
+			}
+			atomic_fetch_sub(&v->active, 1);
+		}
+
+		if (atomic_load(&pw->done)) {
+			return(NULL);
+		}
+
+		t0 = now_ns();
+		if (++spins < PWALK_SPIN) {
+			sched_yield();
+		} else {
+			nanosleep(&nap, NULL);
+		}
+		atomic_fetch_add(&pw->time[STAT][held ? THROTTLED : STARVED],
+				 now_ns() - t0);
+	}
+}
+
+/**
+ * Release a reference to a directory.
+ *
+ * \param[in] d  The directory.
+ **/
+static void
+put_dir(struct dir *d)
+{
+
+	if (atomic_fetch_sub(&d->refs, 1) == 1) {
+		if (d->fd >= 0) {
+			close(d->fd);
+		}
+		free(d->path);
+		free(d);
+	}
+}
+
+/**
+ * Mark the walk as done and wake every thread.
+ *
+ * \param[in] pw  The walk state.
+ **/
+static void
+finish(struct pwalk *pw)
+{
+
+	pthread_mutex_lock(&pw->lock);
+	atomic_store(&pw->done, 1);
+	pthread_cond_broadcast(&pw->dirs);
+	pthread_cond_signal(&pw->idle);
+	pthread_mutex_unlock(&pw->lock);
+}
+
+/**
+ * Record the first failure of the walk.
+ *
+ * \param[in] pw     The walk state.
+ * \param[in] error  The errno of the failure.
+ **/
+static void
+fail(struct pwalk *pw, int error)
+{
+	int none = 0;
+
+	atomic_compare_exchange_strong(&pw->error, &none, error);
+}
+
+/**
+ * Allocate an empty batch.
+ *
+ * \param[in] recs  The batch holds records.
+ *
+ * \retval b     The batch.
+ * \retval NULL  If there was no memory.
+ **/
+static struct batch *
+batch_new(int recs)
+{
+	struct batch *b = NULL;
+
+	if ((b = calloc(1, sizeof(struct batch) +
+			(recs ? PWALK_BATCH * sizeof(struct stat) : 0))) == NULL) {
+		return(NULL);
+	}
+	b->size = PWALK_BATCH * 32;
+	if ((b->buf = malloc(b->size)) == NULL) {
+		free(b);
+		return(NULL);
+	}
+
+	return(b);
+}
+
+/**
+ * Add a name to a batch.
+ *
+ * \param[in] b     The batch.
+ * \param[in] name  The name.
+ * \param[in] len   Length of the name.
+ *
+ * \retval 0 If the name was added.
+ * \retval 1 If there was no memory.
+ **/
+static int32_t
+batch_add(struct batch *b, const char *name, size_t len)
+{
+
+	if (batch_grow(b, len + 1)) {
+		return(EXIT_FAILURE);
+	}
+	b->off[b->n++] = b->used;
+	memcpy(b->buf + b->used, name, len);
+	b->buf[b->used + len] = '\0';
+	b->used += len + 1;
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Make room in a batch.
+ *
+ * \param[in] b     The batch.
+ * \param[in] need  Bytes needed.
+ *
+ * \retval 0 If there is room.
+ * \retval 1 If there was no memory, the batch is left as it was.
+ **/
+static int32_t
+batch_grow(struct batch *b, size_t need)
+{
+	size_t size = 0;
+	char *buf = NULL;
+
+	if (b->used + need > b->size) {
+		size = b->size * 2 > b->used + need ?
+			b->size * 2 : b->used + need;
+		if ((buf = realloc(b->buf, size)) == NULL) {
+			return(EXIT_FAILURE);
+		}
+		b->buf = buf;
+		b->size = size;
+	}
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Release a batch.
+ *
+ * \param[in] b  The batch.
+ **/
+static void
+batch_free(struct batch *b)
+{
+
+	free(b->buf);
+	free(b);
+}
+
+/**
+ * Initialise a queue.
+ *
+ * \param[in] q  The queue.
+ **/
+static void
+q_init(struct queue *q)
+{
+	size_t i = 0;
+
+	for (i = 0; i < PWALK_QUEUE; ++i) {
+		atomic_init(&q->cells[i].seq, i);
+	}
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+}
+
+/**
+ * Add a batch to a queue.
+ *
+ * Each cell carries a sequence number that tells a producer whether
+ * the cell is free for the position it claimed and a consumer whether
+ * it has been filled, so neither needs a lock.
+ *
+ * \param[in] q  The queue.
+ * \param[in] b  The batch.
+ *
+ * \retval 1 If the batch was added.
+ * \retval 0 If the queue is full.
+ **/
+static int
+q_push(struct queue *q, struct batch *b)
+{
+	size_t pos = 0;
+	intptr_t dif = 0;
+	struct cell *c = NULL;
+
+	pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	for (;;) {
+		c = &q->cells[pos % PWALK_QUEUE];
+		dif = (intptr_t)atomic_load_explicit(&c->seq,
+		    memory_order_acquire) - (intptr_t)pos;
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&q->tail,
+			    &pos, pos + 1, memory_order_relaxed,
+			    memory_order_relaxed)) {
+				break;
+			}
+		} else if (dif < 0) {
+			return(0);
+		} else {
+			pos = atomic_load_explicit(&q->tail,
+			    memory_order_relaxed);
+		}
+	}
+
+	c->b = b;
+	atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+
+	return(1);
+}
+
+/**
+ * Take a batch from a queue.
+ *
+ * \param[in] q  The queue.
+ *
+ * \retval b     The batch.
+ * \retval NULL  If the queue is empty.
+ **/
+static struct batch *
+q_pop(struct queue *q)
+{
+	size_t pos = 0;
+	intptr_t dif = 0;
+	struct cell *c = NULL;
+	struct batch *b = NULL;
+
+	pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+	for (;;) {
+		c = &q->cells[pos % PWALK_QUEUE];
+		dif = (intptr_t)atomic_load_explicit(&c->seq,
+		    memory_order_acquire) - (intptr_t)(pos + 1);
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&q->head,
+			    &pos, pos + 1, memory_order_relaxed,
+			    memory_order_relaxed)) {
+				break;
+			}
+		} else if (dif < 0) {
+			return(NULL);
+		} else {
+			pos = atomic_load_explicit(&q->head,
+			    memory_order_relaxed);
+		}
+	}
+
+	b = c->b;
+	atomic_store_explicit(&c->seq, pos + PWALK_QUEUE,
+			      memory_order_release);
+
+	return(b);
+}
+
+/**
+ * Approximate number of batches in a queue.
+ *
+ * \param[in] q  The queue.
+ *
+ * \retval n  The number of batches.
+ **/
+static size_t
+q_size(struct queue *q)
+{
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+	return(tail > head ? tail - head : 0);
+}
+
+/**
+ * Send a batch to the next stage, waiting while its queue is full.
+ *
+ * \param[in] pw  The walk state.
+ * \param[in] q   The queue.
+ * \param[in] b   The batch.
+ * \param[in] s   The sending stage.
+ **/
+static void
+send(struct pwalk *pw, struct queue *q, struct batch *b, enum stage s)
+{
+	uint32_t spins = 0;
+	uint64_t t0 = 0;
+	struct timespec nap = {0, PWALK_NAP};
+
+	if (q_push(q, b)) {
+		return;
+	}
+
+	t0 = now_ns();
+	while (!q_push(q, b)) {
+		if (++spins < PWALK_SPIN) {
+			sched_yield();
+		} else {
+			nanosleep(&nap, NULL);
+		}
+	}
+	atomic_fetch_add(&pw->time[s][BLOCKED], now_ns() - t0);
+}
+
+/**
+ * Receive a batch from the previous stage, waiting while its queue
+ * is empty.
+ *
+ * \param[in] pw  The walk state.
+ * \param[in] q   The queue.
+ * \param[in] s   The receiving stage.
+ *
+ * \retval b     The batch.
+ * \retval NULL  If the walk is done.
+ **/
+static struct batch *
+receive(struct pwalk *pw, struct queue *q, enum stage s)
+{
+	uint32_t spins = 0;
+	uint64_t t0 = 0;
+	struct batch *b = NULL;
+	struct timespec nap = {0, PWALK_NAP};
+
+	if ((b = q_pop(q)) != NULL) {
+		return(b);
+	}
+
+	t0 = now_ns();
+	while ((b = q_pop(q)) == NULL && !atomic_load(&pw->done)) {
+		if (++spins < PWALK_SPIN) {
+			sched_yield();
+		} else {
+			nanosleep(&nap, NULL);
+		}
+	}
+	atomic_fetch_add(&pw->time[s][STARVED], now_ns() - t0);
+
+	return(b);
+}
+
+/**
+ * Adjust the number of stat workers allowed to run on each device.
+ *
+ * Called with the walk lock held.
+ *
+ * \param[in] pw  The walk state.
+ **/
+static void
+control(struct pwalk *pw)
+{
+	uint32_t i = 0;
+	uint32_t n = atomic_load(&pw->ndev);
+	size_t qn = 0;
+	size_t qr = q_size(&pw->recs);
+
+	atomic_fetch_add(&pw->recs.occupancy, qr);
+	++pw->samples;
+
+	for (i = 0; i < n; ++i) {
+		qn = q_size(&pw->devs[i]->names);
+		atomic_fetch_add(&pw->devs[i]->names.occupancy, qn);
+		adjust(pw, pw->devs[i], qn, qr);
+	}
+}
+
+/**
+ * Adjust the number of stat workers allowed to run on a device.
+ *
+ * \param[in] pw  The walk state.
+ * \param[in] v   The device.
+ * \param[in] qn  Batches of names queued for the device.
+ * \param[in] qr  Batches of records queued for the aggregator.
+ **/
+static void
+adjust(struct pwalk *pw, struct device *v, size_t qn, size_t qr)
+{
+	double dt = 0.0;
+	double rate = 0.0;
+	double lat = 0.0;
+	uint64_t now = 0;
+	uint64_t nstat = 0;
+	uint32_t limit = atomic_load(&v->limit);
+	uint32_t max = pw->nthread[STAT];
+	struct control *c = &v->c;
+	const char *why = NULL;
+
+	now = now_ns();
+	dt = (now - c->last) / 1e9;
+	if (dt <= 0.0 || (nstat = atomic_load(&v->nstat)) == 0) {
+		return;
+	}
+	c->last = now;
+
+	rate = atomic_exchange(&v->entries, 0) / dt;
+	lat = (double)atomic_exchange(&v->latency, 0) / nstat;
+	atomic_fetch_sub(&v->nstat, nstat);
+
+	/* The floor drifts up so a lasting change of storage is followed */
+	if (c->floor == 0.0 || lat < c->floor) {
+		c->floor = lat;
+	} else {
+		c->floor *= PWALK_DECAY;
+	}
+
+	if (lat > PWALK_CONGESTED * c->floor && limit > 1) {
+		limit /= 2;
+		c->slow = 0;
+		why = _("latency rising");
+	} else if (c->slow && limit < max) {
+		limit = limit * 2 < max ? limit * 2 : max;
+		why = _("slow start");
+	} else if (rate >= c->rate && limit < max && qn > 0) {
+		limit += 1;
+		why = _("rate rising");
+	}
+	c->rate = rate;
+
+	if (pw->ctx->opts.verbose) {
+		warnx(_("%s%s%u of %u stat workers, %.0f entries/s, "
+			"stat %.1f us (floor %.1f us), queued %zu names "
+			"%zu records%s%s"),
+		      atomic_load(&pw->ndev) > 1 ? v->path : "",
+		      atomic_load(&pw->ndev) > 1 ? ": " : "",
+		      atomic_load(&v->limit), max, rate, lat / 1e3,
+		      c->floor / 1e3, qn, qr,
+		      why ? ": " : "", why ? why : "");
+	}
+
+	atomic_store(&v->limit, limit);
+}
+
+/**
+ * Report where each stage spent its time.
+ *
+ * \param[in] pw       The walk state.
+ * \param[in] elapsed  Duration of the walk in seconds.
+ **/
+static void
+report(struct pwalk *pw, double elapsed)
+{
+	uint32_t i = 0;
+	uint32_t s = 0;
+	double total = 0.0;
+	struct device *v = NULL;
+	const char *name[NSTAGE] = {"readdir", "stat", "aggregate"};
+
+	for (s = 0; s < NSTAGE; ++s) {
+		total = pw->nthread[s] * elapsed * 1e9;
+		if (total <= 0.0) {
+			continue;
+		}
+		warnx(_("%-9s %3u threads, busy %3.0f%%, starved %3.0f%%, "
+			"blocked %3.0f%%, throttled %3.0f%%"), name[s],
+		      pw->nthread[s],
+		      100.0 * atomic_load(&pw->time[s][BUSY]) / total,
+		      100.0 * atomic_load(&pw->time[s][STARVED]) / total,
+		      100.0 * atomic_load(&pw->time[s][BLOCKED]) / total,
+		      100.0 * atomic_load(&pw->time[s][THROTTLED]) / total);
+	}
+	if (pw->samples > 0) {
+		for (i = 0; i < atomic_load(&pw->ndev); ++i) {
+			v = pw->devs[i];
+			warnx(_("%s: %llu entries, %u stat workers, queued "
+				"on average %.1f of %d name batches"), v->path,
+			      (unsigned long long)atomic_load(&v->found),
+			      atomic_load(&v->limit),
+			      (double)atomic_load(&v->names.occupancy) /
+			      pw->samples, PWALK_QUEUE);
+		}
+		if (pw->nthread[AGGREGATE] > 0) {
+			warnx(_("queued on average %.1f of %d record "
+				"batches"),
+			      (double)atomic_load(&pw->recs.occupancy) /
+			      pw->samples, PWALK_QUEUE);
+		}
+	}
+	if (pw->nshard > 0) {
+		warnx(_("aggregated in %u shards, merged in %.1f ms"),
+		      pw->nshard, pw->merge / 1e6);
+	}
+	if (pw->ctx->kernel != NULL) {
+		warnx(_("files aggregated in batches by the %s kernel"),
+		      kernel_name(pw->ctx->kernel));
+	}
+}
+
+/**
+ * Monotonic time.
+ *
+ * \retval ns  Nanoseconds since an arbitrary point.
+ **/
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/**
+ * \}
+ **/
@@ -0,0 +1,518 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file report.c
+ * Routines to print a tree like disk usage report.
+ *
+ * \ingroup report
+ * \{
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "extern.h"
+#include "mem.h"
+#include "report.h"
+
+/* Internal functions */
+static int        action(const struct pinfo *, void *);
+static int        combine(const struct pinfo *, void *);
+static int        add_types(const struct pinfo *, void *);
+static int        tcmp(const void *, const void *);
+static char      *ppath(const char *, uint32_t);
+static char      *human(uint64_t, char *, size_t);
+
+/** Old bytes to the reported size or cost, set with the headings **/
+static double factor = 0.0;
+
+/** The path whose types are being sorted **/
+static const struct pinfo *sorting = NULL;
+
+/**
+ * Print a summary of the scan.
+ *
+ * \param[in] ctx  The scan context.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted.
+ **/
+int32_t
+summary(struct tdu_ctx *ctx)
+{
+
+	report_header();
+
+	return(tdu_visit(ctx, action, NULL));
+}
+
+/**
+ * Print a summary of a subtree of a scan at a depth.
+ *
+ * \param[in] ctx    The scan context, scanned with TDU_F_TREE.
+ * \param[in] path   The subtree.
+ * \param[in] depth  The depth below path to report on.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+int32_t
+subtree(struct tdu_ctx *ctx, const char *path, uint32_t depth)
+{
+
+	report_header();
+
+	return(tdu_render(ctx, path, depth, action, NULL));
+}
+
+/**
+ * Print the usage of each file system of a scan and their total.
+ *
+ * \param[in] ctx  The scan context, scanned with TDU_F_MOUNTS.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+int32_t
+mounts(struct tdu_ctx *ctx)
+{
+	int32_t rc = EXIT_SUCCESS;
+	struct pinfo total = {0};
+
+	printf("\n");
+	report_header();
+
+	rc = tdu_mounts(ctx, combine, &total);
+
+	/* The file systems are disjoint */
+	total.sub_greater = total.greater;
+	total.sub_total = total.total;
+	total.sub_files = total.files;
+	total.sub_dirs = total.dirs;
+	total.sub_links = total.links;
+	total.path = (char *)_("total");
+	report_node(&total);
+
+	return(rc);
+}
+
+/**
+ * Print the breakdown by file type of a whole scan.
+ *
+ * \param[in] ctx  The scan context, scanned with TDU_F_TYPES.
+ **/
+void
+types(struct tdu_ctx *ctx)
+{
+	struct pinfo all = {0};
+
+	tdu_visit(ctx, add_types, &all);
+	report_types(&all);
+}
+
+/**
+ * Add the file types of a path into a combined usage.
+ *
+ * \param[in]     n    The path.
+ * \param[in,out] all  The combined usage.
+ **/
+void
+report_add_types(const struct pinfo *n, struct pinfo *all)
+{
+	uint32_t i = 0;
+
+	for (i = 0; i < TDU_NTYPE; ++i) {
+		all->type_total[i] += n->type_total[i];
+		all->type_greater[i] += n->type_greater[i];
+	}
+}
+
+/**
+ * Print the breakdown by file type of a path.
+ *
+ * The types are listed by the old bytes they hold, types with no
+ * files are left out.
+ *
+ * \param[in] n  The path.
+ **/
+void
+report_types(const struct pinfo *n)
+{
+	uint32_t i = 0;
+	uint32_t k = 0;
+	uint32_t order[TDU_NTYPE];
+
+	/* Sort by old bytes, then by the type for a stable report */
+	for (i = 0; i < tdu_type_count(); ++i) {
+		if (n->type_total[i] > 0) {
+			order[k++] = i;
+		}
+	}
+	sorting = n;
+	qsort(order, k, sizeof(uint32_t), tcmp);
+	sorting = NULL;
+
+	printf("\n");
+	if (columns & COL_WHERE) {
+		printf(_("Size [%s]      Where[%%]       %s [%s]       Type\n"),
+		       options.units, options.cost > 0.0 ? _("Cost") : _("Old"),
+		       options.cost > 0.0 ? "$" : options.units);
+	} else if (options.cost > 0.0) {
+		printf(_("Size [%s]      >%d days[%%]    Cost [$]       Type\n"),
+		       options.units, options.atime_days);
+	} else {
+		printf(_("Size [%s]      >%d days[%%]    Old [%s]       Type\n"),
+		       options.units, options.atime_days, options.units);
+	}
+	for (i = 0; i < k; ++i) {
+		printf(_("%12.2f  %12.0f    %12.2f    %s\n"),
+		       (double)n->type_total[order[i]] /
+		       (double)tdu_scale(options.units),
+		       100.0 * n->type_greater[order[i]] /
+		       n->type_total[order[i]],
+		       n->type_greater[order[i]] * factor,
+		       tdu_type_name(order[i]));
+	}
+}
+
+/**
+ * Print the report column headings.
+ **/
+void
+report_header(void)
+{
+
+	/* Cost overrides size */
+	factor = 1.0 / (double)tdu_scale(options.units);
+	if (options.cost > 0.0) {
+		factor *= options.cost * options.atime_days;
+	}
+
+	if (columns & COL_WHERE) {
+		printf(_("%s [%s]      Where[%%]       "),
+		       options.cost > 0.0 ? _("Cost") : _("Size"),
+		       options.cost > 0.0 ? "$" : options.units);
+	} else if (options.cost > 0.0) {
+		printf(ngettext("Cost [$]       >%d day[%%]     ",
+				"Cost [$]       >%d days[%%]    ",
+				options.atime_days),
+		       options.atime_days);
+	} else {
+		printf(ngettext("Size [%s]      >%d day[%%]     ",
+				"Size [%s]      >%d days[%%]    ",
+				options.atime_days),
+		       options.units, options.atime_days);
+	}
+	if (columns & COL_DUPS) {
+		printf(_("Dup [%s]        "), options.units);
+	}
+	if (columns & COL_COMPRESS) {
+		printf(_("Compr [%s]      Saved[%%]    "), options.units);
+	}
+	if (columns & COL_SUBTREE) {
+		if (options.cost > 0.0) {
+			printf(_("Subtree [$]    Old[%%]   Tree files    "));
+		} else {
+			printf(_("Subtree [%s]    Old[%%]   Tree files    "),
+			       options.units);
+		}
+	}
+	if (columns & COL_FILES) {
+		printf(_("    Files     Dirs    Links   Median  <4kB[%%]    "));
+	}
+	if (columns & COL_TYPES) {
+		printf(_("Old type      [%%]    "));
+	}
+	printf(_("Directory\n"));
+}
+
+/**
+ * Print a single report line.
+ *
+ * \param[in] n  The path to print.
+ **/
+void
+report_node(const struct pinfo *n)
+{
+	uint32_t i = 0;
+	uint32_t t = 0;
+	float size = 0.0;
+	float percentage = 0.0;
+	char *path = NULL;
+	char median[16];
+
+	size = (float)(n->greater * factor);
+	percentage = n->total > 0 ?
+		(float)(n->greater / (float)n->total) * 100.0 : 0.0;
+	path = ppath(n->path, n->level);
+
+	printf(_("%12.2f  %12.0f    "), size, percentage);
+	if (columns & COL_DUPS) {
+		printf(_("%12.2f    "),
+		       (double)n->dup / (double)tdu_scale(options.units));
+	}
+	if (columns & COL_COMPRESS && n->comp_samples == 0) {
+		printf(_("%12s  %10s    "), "-", "-");
+	} else if (columns & COL_COMPRESS) {
+		/* Other bytes are not compressed */
+		printf(_("%12.2f  %5.0f ±%4.0f    "),
+		       (double)(n->total - n->comp_bytes + n->comp_total) /
+		       (double)tdu_scale(options.units),
+		       n->total > 0 ? 100.0 * (n->comp_bytes - n->comp_total) /
+		       n->total : 0.0,
+		       n->total > 0 ? 50.0 * (n->comp_high - n->comp_low) /
+		       n->total : 0.0);
+	}
+	if (columns & COL_SUBTREE) {
+		printf(_("%12.2f  %5.0f  %13llu    "),
+		       (double)(n->sub_greater * factor),
+		       n->sub_total > 0 ?
+		       100.0 * n->sub_greater / n->sub_total : 0.0,
+		       (unsigned long long)n->sub_files);
+	}
+	if (columns & COL_FILES) {
+		printf(_("%9llu%9llu%9llu%9s%9.0f    "),
+		       (unsigned long long)n->files,
+		       (unsigned long long)n->dirs,
+		       (unsigned long long)n->links,
+		       human(tdu_size_median(n), median, sizeof(median)),
+		       n->files > 0 ? 100.0 *
+		       tdu_size_below(n, SMALL_FILE) / n->files : 0.0);
+	}
+	if (columns & COL_TYPES) {
+		for (i = 1, t = 0; i < tdu_type_count(); ++i) {
+			if (n->type_greater[i] > n->type_greater[t]) {
+				t = i;
+			}
+		}
+		printf(_("%-10s%7.0f    "),
+		       n->type_greater[t] > 0 ? tdu_type_name(t) : "-",
+		       n->greater > 0 ?
+		       100.0 * n->type_greater[t] / n->greater : 0.0);
+	}
+	printf("%s\n", path);
+}
+
+/**
+ * Format a size with the largest unit that keeps it above one.
+ *
+ * \param[in]  bytes  The size in bytes.
+ * \param[out] buf    Where to format it.
+ * \param[in]  n      Size of buf.
+ *
+ * \retval buf  The formatted size.
+ **/
+static char *
+human(uint64_t bytes, char *buf, size_t n)
+{
+	const char *units[] = {"kB", "MB", "GB", "TB", "PB", "EB"};
+	int i = 0;
+
+	if (bytes < kB) {
+		snprintf(buf, n, "%lluB", (unsigned long long)bytes);
+		return(buf);
+	}
+	for (i = 5; i > 0 && bytes < tdu_scale(units[i]); --i) {
+	}
+	snprintf(buf, n, "%.1f%c", (double)bytes / tdu_scale(units[i]),
+		 units[i][0]);
+
+	return(buf);
+}
+
+/**
+ * Action to be taken for each aggregated path.
+ *
+ * \param[in] n     The current path.
+ * \param[in] arg   Unused.
+ *
+ * \retval 0 Always, to visit every path.
+ */
+static int
+action(const struct pinfo *n, void *arg)
+{
+
+	(void)arg;
+	report_node(n);
+
+	return(0);
+}
+
+/**
+ * Print a file system and add it to the combined usage.
+ *
+ * \param[in] n     The file system.
+ * \param[in] arg   The combined usage.
+ *
+ * \retval 0 Always, to visit every file system.
+ */
+static int
+combine(const struct pinfo *n, void *arg)
+{
+	uint32_t i = 0;
+	struct pinfo *t = arg;
+
+	report_node(n);
+
+	t->greater += n->greater;
+	t->total += n->total;
+	t->files += n->files;
+	t->dirs += n->dirs;
+	t->links += n->links;
+	t->dup += n->dup;
+	t->comp_bytes += n->comp_bytes;
+	t->comp_total += n->comp_total;
+	t->comp_low += n->comp_low;
+	t->comp_high += n->comp_high;
+	t->comp_samples += n->comp_samples;
+	for (i = 0; i < TDU_NAGE; ++i) {
+		t->age[i] += n->age[i];
+	}
+	for (i = 0; i < TDU_NSIZE; ++i) {
+		t->size[i] += n->size[i];
+	}
+	report_add_types(n, t);
+
+	return(0);
+}
+
+/**
+ * Add the file types of each aggregated path.
+ *
+ * \param[in] n     The current path.
+ * \param[in] arg   The combined usage.
+ *
+ * \retval 0 Always, to visit every path.
+ */
+static int
+add_types(const struct pinfo *n, void *arg)
+{
+
+	report_add_types(n, arg);
+
+	return(0);
+}
+
+/**
+ * Compare two file types by the old bytes they hold, most first.
+ *
+ * \param[in] a  Type a.
+ * \param[in] b  Type b.
+ *
+ * \retval   Integer greater than, equal to, or less than 0.
+ **/
+static int
+tcmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	uint64_t gx = sorting->type_greater[x];
+	uint64_t gy = sorting->type_greater[y];
+
+	if (gx != gy) {
+		return(gx > gy ? -1 : 1);
+	}
+
+	return((x > y) - (x < y));
+}
+
+/**
+ * Pretty print a path.
+ *
+ * \param[in] path     The path to print.
+ * \param[in] level    The path level under the top-level.
+ * \param[out] ppath   The pretty printed path.
+ * \param[out] pad     The amount of extra padding added.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted.
+ **/
+static char *
+ppath(const char *path, uint32_t level)
+{
+	uint32_t n = 0;
+	size_t bsize = 0;
+	const char indent[] = u8"│  ";
+	const char tofile[] = u8"├──";
+	const char last[]   = u8"└──";
+	char *ptr = NULL;
+	static char *tmp = NULL;
+
+
+	bsize = pathconf(".", _PC_PATH_MAX);
+	if (tmp == NULL) {
+		tmp = xmalloc(bsize);
+	} else {
+		memset(tmp, 0, bsize);
+	}
+
+	if (level == 0) {
+		strcpy(tmp, path);
+		return(tmp);
+	}
+
+	for (n = 1; n < level; ++n) {
+		strcat(tmp, indent);
+	}
+
+	strcat(tmp, tofile);
+
+	ptr = strdup(path);
+	strcat(tmp, basename(ptr));
+
+	if (ptr != NULL) {
+		free(ptr);
+		ptr = NULL;
+	}
+
+	return(tmp);
+}
+
+/**
+ * \}
+ **/
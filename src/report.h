@@ -0,0 +1,79 @@
+/* BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file report.h
+ * Definitions for printing a disk usage report.
+ *
+ * \ingroup report
+ * \{
+ **/
+
+#ifndef TDU_REPORT_H
+#define TDU_REPORT_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Print a summary of a scan */
+int32_t summary(struct tdu_ctx *);
+
+/* Print a summary of a subtree of a scan at a depth */
+int32_t subtree(struct tdu_ctx *, const char *, uint32_t);
+
+/* Print the usage of each file system of a scan and their total */
+int32_t mounts(struct tdu_ctx *);
+
+/* Print the breakdown by file type of a whole scan */
+void types(struct tdu_ctx *);
+
+/* Add the file types of a path into a combined usage */
+void report_add_types(const struct pinfo *, struct pinfo *);
+
+/* Print the breakdown by file type of a path */
+void report_types(const struct pinfo *);
+
+/* Print the report column headings */
+void report_header(void);
+
+/* Print a single report line */
+void report_node(const struct pinfo *);
+
+#ifdef __cplusplus
+}                               /* extern "C" */
+#endif
+
+#endif                          /* TDU_REPORT_H */
+/**
+ * \}
+ **/
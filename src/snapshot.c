@@ -0,0 +1,449 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file snapshot.c
+ * Routines to hold and query an in-memory snapshot of a scan.
+ *
+ * A query reply is a status line followed by one line per path:
+ *
+ *     ok <scan time> <age> <atime days> <rows>
+ *     <level>\t<total>\t<greater>\t<value>\t<files>\t<dirs>\t<links>\t<sizes>\t<types>\t<path>
+ *
+ * where age is the number of seconds since the scan started, atime
+ * days is the access age that was applied (rounded down to a histogram
+ * edge), value is greater in the requested units or cost, sizes is the
+ * file size histogram as comma separated bucket:count pairs (- when
+ * empty), types is the breakdown by file type as comma separated
+ * type:total:greater triples (- when not kept), where greater is at
+ * the access age the daemon scans with rather than the query's, and
+ * the path is always the last field.
+ *
+ * \ingroup snapshot
+ * \{
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "mem.h"
+#include "snapshot.h"
+
+/**
+ * A path matched by a query, truncated to the query depth.
+ **/
+struct row {
+	const char *path;      /**< The full path **/
+	size_t len;            /**< Length of the truncated path **/
+	int level;             /**< Level below the query path **/
+	uint64_t total;        /**< Total number of bytes **/
+	uint64_t greater;      /**< Bytes older than the query atime **/
+	uint64_t files;        /**< Number of regular files **/
+	uint64_t dirs;         /**< Number of directories **/
+	uint64_t links;        /**< Number of symbolic links **/
+	uint64_t size[TDU_NSIZE];/**< Regular files by size **/
+	uint64_t type_total[TDU_NTYPE];/**< Bytes by file type **/
+	uint64_t type_greater[TDU_NTYPE];/**< Old bytes by file type **/
+};
+
+/* Internal functions */
+static int        copy(const struct pinfo *, void *);
+static int        rowcmp(const void *, const void *);
+static size_t     lower(const struct snapshot *, const char *);
+
+/**
+ * Take a snapshot of a scanned context.
+ *
+ * \param[in] ctx       The scanned context.
+ * \param[in] duration  How long the scan took in seconds.
+ *
+ * \retval snap  The new snapshot.
+ **/
+struct snapshot *
+snapshot_take(struct tdu_ctx *ctx, time_t duration)
+{
+	struct snapshot *snap = NULL;
+
+	snap = xmalloc(sizeof(struct snapshot));
+	snap->scantime = tdu_scantime(ctx);
+	snap->duration = duration;
+
+	tdu_visit(ctx, copy, snap);
+
+	if (snap->n > 0) {
+		snap->root = snap->nodes[0].path;
+	}
+
+	return(snap);
+}
+
+/**
+ * Release a snapshot.
+ *
+ * \param[in] snap  The snapshot.
+ **/
+void
+snapshot_free(struct snapshot *snap)
+{
+	size_t i = 0;
+
+	if (snap == NULL) {
+		return;
+	}
+
+	for (i = 0; i < snap->n; ++i) {
+		free(snap->nodes[i].path);
+	}
+	free(snap->nodes);
+	free(snap);
+}
+
+/**
+ * Check if a path lies within a snapshot.
+ *
+ * \param[in] snap  The snapshot.
+ * \param[in] path  The path.
+ *
+ * \retval 1 If the path is the snapshot root or below it.
+ * \retval 0 Otherwise.
+ **/
+int
+snapshot_covers(const struct snapshot *snap, const char *path)
+{
+	size_t n = 0;
+
+	if (snap == NULL || snap->root == NULL) {
+		return(0);
+	}
+
+	n = strlen(snap->root);
+	return(strncmp(snap->root, path, n) == 0 &&
+	       (path[n] == '\0' || path[n] == '/'));
+}
+
+/**
+ * Parse the keys of a query request.
+ *
+ *     [depth=n] [units=u] [cost=c] [atime=n] path=<path>
+ *
+ * The path must be the last key, it extends to the end of the request
+ * and loses any trailing /. Keys not given keep their value.
+ *
+ * \param[in,out] q    The query.
+ * \param[in]     req  The request keys, changed.
+ * \param[in]     out  Where to write an error reply.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the request is malformed, the reply was written.
+ **/
+int32_t
+snapshot_parse(struct query *q, char *req, FILE *out)
+{
+	size_t i = 0;
+	char *key = NULL;
+	char *val = NULL;
+
+	q->path = NULL;
+	while (req != NULL && *req != '\0' && q->path == NULL) {
+		key = req;
+		if ((val = strchr(key, '=')) == NULL) {
+			break;
+		}
+		*val++ = '\0';
+		if (strcmp(key, "path") == 0) {
+			q->path = val;
+			break;
+		}
+		if ((req = strchr(val, ' ')) != NULL) {
+			*req++ = '\0';
+		}
+
+		if (strcmp(key, "depth") == 0) {
+			q->depth = (uint32_t)strtoul(val, NULL, 10);
+		} else if (strcmp(key, "atime") == 0) {
+			q->atime_days = (uint32_t)strtoul(val, NULL, 10);
+		} else if (strcmp(key, "cost") == 0) {
+			q->cost = strtof(val, NULL);
+		} else if (strcmp(key, "units") == 0 && tdu_scale(val) != 0) {
+			snprintf(q->units, sizeof(q->units), "%s", val);
+		} else {
+			fprintf(out, "error %s %s\n", _("bad key"), key);
+			return(EXIT_FAILURE);
+		}
+	}
+
+	if (q->path == NULL) {
+		fprintf(out, "error %s\n", _("no path given"));
+		return(EXIT_FAILURE);
+	}
+
+	/* Remove a trailing / from the path */
+	i = strlen(q->path);
+	if (i > 1 && q->path[i-1] == '/') {
+		q->path[i-1] = '\0';
+	}
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Answer a query on a snapshot.
+ *
+ * Paths deeper than the query depth are added into their ancestor
+ * at the query depth, as a scan at that depth would have done.
+ *
+ * \param[in] snap  The snapshot.
+ * \param[in] q     The query.
+ * \param[in] out   Where to write the reply.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the path was not found.
+ **/
+int32_t
+snapshot_query(const struct snapshot *snap, const struct query *q, FILE *out)
+{
+	size_t i = 0;
+	size_t j = 0;
+	size_t k = 0;
+	size_t n = 0;
+	size_t qlen = 0;
+	uint32_t age = 0;
+	const char *p = NULL;
+	const char *sep = NULL;
+	struct row *rows = NULL;
+	double value = 0.0;
+
+	qlen = strlen(q->path);
+	age = tdu_age_bucket(q->atime_days);
+
+	for (i = lower(snap, q->path); i < snap->n; ++i) {
+		p = snap->nodes[i].path;
+		if (strncmp(p, q->path, qlen) != 0) {
+			break;
+		}
+		if (qlen > 1 && p[qlen] != '\0' && p[qlen] != '/') {
+			continue;
+		}
+		if (n % 1024 == 0) {
+			rows = xrealloc(rows, (n + 1024) * sizeof(struct row));
+		}
+
+		/* The / of the root also separates it from its children */
+		rows[n].path = p;
+		rows[n].level = 0;
+		rows[n].len = strlen(p);
+		for (j = qlen - (qlen == 1); p[j] != '\0' && p[1] != '\0'; ++j) {
+			if (p[j] == '/') {
+				if (rows[n].level == q->depth) {
+					rows[n].len = j > 0 ? j : 1;
+					break;
+				}
+				++rows[n].level;
+			}
+		}
+		rows[n].total = snap->nodes[i].total;
+		rows[n].files = snap->nodes[i].files;
+		rows[n].dirs = snap->nodes[i].dirs;
+		rows[n].links = snap->nodes[i].links;
+		memcpy(rows[n].size, snap->nodes[i].size, sizeof(rows[n].size));
+		memcpy(rows[n].type_total, snap->nodes[i].type_total,
+		       sizeof(rows[n].type_total));
+		memcpy(rows[n].type_greater, snap->nodes[i].type_greater,
+		       sizeof(rows[n].type_greater));
+		rows[n].greater = 0;
+		for (k = age; k < TDU_NAGE; ++k) {
+			rows[n].greater += snap->nodes[i].age[k];
+		}
+		++n;
+	}
+
+	if (n == 0) {
+		fprintf(out, "error %s\n", _("path not found"));
+		return(EXIT_FAILURE);
+	}
+
+	/* Merge the paths that truncate to the same ancestor */
+	qsort(rows, n, sizeof(struct row), rowcmp);
+	for (i = 0, j = 1; j < n; ++j) {
+		if (rowcmp(&rows[i], &rows[j]) == 0) {
+			rows[i].total += rows[j].total;
+			rows[i].greater += rows[j].greater;
+			rows[i].files += rows[j].files;
+			rows[i].dirs += rows[j].dirs;
+			rows[i].links += rows[j].links;
+			for (k = 0; k < TDU_NSIZE; ++k) {
+				rows[i].size[k] += rows[j].size[k];
+			}
+			for (k = 0; k < TDU_NTYPE; ++k) {
+				rows[i].type_total[k] += rows[j].type_total[k];
+				rows[i].type_greater[k] +=
+					rows[j].type_greater[k];
+			}
+		} else {
+			rows[++i] = rows[j];
+		}
+	}
+	n = i + 1;
+
+	fprintf(out, "ok %lld %lld %u %zu\n", (long long)snap->scantime,
+		(long long)(time(NULL) - snap->scantime),
+		tdu_age_days[age], n);
+
+	for (i = 0; i < n; ++i) {
+		value = (double)rows[i].greater / (double)tdu_scale(q->units);
+		if (q->cost > 0.0) {
+			value *= q->cost * tdu_age_days[age];
+		}
+		fprintf(out, "%d\t%llu\t%llu\t%.2f\t%llu\t%llu\t%llu\t",
+			rows[i].level, (unsigned long long)rows[i].total,
+			(unsigned long long)rows[i].greater, value,
+			(unsigned long long)rows[i].files,
+			(unsigned long long)rows[i].dirs,
+			(unsigned long long)rows[i].links);
+		for (k = 0, sep = ""; k < TDU_NSIZE; ++k) {
+			if (rows[i].size[k] > 0) {
+				fprintf(out, "%s%zu:%llu", sep, k,
+					(unsigned long long)rows[i].size[k]);
+				sep = ",";
+			}
+		}
+		fprintf(out, "%s\t", *sep == '\0' ? "-" : "");
+		for (k = 0, sep = ""; k < tdu_type_count(); ++k) {
+			if (rows[i].type_total[k] > 0) {
+				fprintf(out, "%s%s:%llu:%llu", sep,
+					tdu_type_name(k),
+					(unsigned long long)rows[i].type_total[k],
+					(unsigned long long)rows[i].type_greater[k]);
+				sep = ",";
+			}
+		}
+		fprintf(out, "%s\t%.*s\n", *sep == '\0' ? "-" : "",
+			(int)rows[i].len, rows[i].path);
+	}
+
+	free(rows);
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Copy an aggregated path into a snapshot.
+ *
+ * \param[in] n    The aggregated path.
+ * \param[in] arg  The snapshot.
+ *
+ * \retval 0 Always, to visit every path.
+ **/
+static int
+copy(const struct pinfo *n, void *arg)
+{
+	struct snapshot *snap = arg;
+
+	if (snap->n % 1024 == 0) {
+		snap->nodes = xrealloc(snap->nodes,
+		    (snap->n + 1024) * sizeof(struct pinfo));
+	}
+
+	snap->nodes[snap->n] = *n;
+	snap->nodes[snap->n].path = strdup(n->path);
+	++snap->n;
+
+	return(0);
+}
+
+/**
+ * Compare two truncated rows.
+ *
+ * \param[in] a  Row a.
+ * \param[in] b  Row b.
+ *
+ * \retval   Integer greater than, equal to, or less than 0.
+ **/
+static int
+rowcmp(const void *a, const void *b)
+{
+	const struct row *x = a;
+	const struct row *y = b;
+	int rc = 0;
+
+	rc = memcmp(x->path, y->path, x->len < y->len ? x->len : y->len);
+	if (rc == 0) {
+		rc = (x->len > y->len) - (x->len < y->len);
+	}
+
+	return(rc);
+}
+
+/**
+ * Find the first path not lexically less than a key.
+ *
+ * \param[in] snap  The snapshot.
+ * \param[in] key   The key.
+ *
+ * \retval i  The index of the path.
+ **/
+static size_t
+lower(const struct snapshot *snap, const char *key)
+{
+	size_t lo = 0;
+	size_t hi = snap->n;
+	size_t mid = 0;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(snap->nodes[mid].path, key) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return(lo);
+}
+
+/**
+ * \}
+ **/
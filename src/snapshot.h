@@ -0,0 +1,97 @@
+/* BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file snapshot.h
+ * Definitions for an in-memory snapshot of a scan.
+ *
+ * A snapshot is an immutable copy of the aggregated paths of a scan,
+ * held in lexical path order so that any path prefix is a contiguous
+ * range. It may be queried at any depth up to the depth it was
+ * scanned at, in any units and for any access age.
+ *
+ * \ingroup snapshot
+ * \{
+ **/
+
+#ifndef TDU_SNAPSHOT_H
+#define TDU_SNAPSHOT_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * An in-memory snapshot of a scan.
+ **/
+struct snapshot {
+	char *root;            /**< Top level path **/
+	time_t scantime;       /**< When the scan started **/
+	time_t duration;       /**< How long the scan took in seconds **/
+	size_t n;              /**< Number of paths **/
+	struct pinfo *nodes;   /**< Paths in lexical order **/
+};
+
+/**
+ * A query on a snapshot.
+ **/
+struct query {
+	char *path;            /**< Path prefix to report on **/
+	uint32_t depth;        /**< Depth below the path to report **/
+	uint32_t atime_days;   /**< Access age in days to consider old **/
+	float cost;            /**< Cost per unit per day **/
+	char units[3];         /**< Reporting units **/
+};
+
+/* Take a snapshot of a scanned context */
+struct snapshot *snapshot_take(struct tdu_ctx *, time_t);
+
+/* Release a snapshot */
+void snapshot_free(struct snapshot *);
+
+/* Check if a path lies within a snapshot */
+int snapshot_covers(const struct snapshot *, const char *);
+
+/* Parse the keys of a query request */
+int32_t snapshot_parse(struct query *, char *, FILE *);
+
+/* Answer a query on a snapshot */
+int32_t snapshot_query(const struct snapshot *, const struct query *, FILE *);
+
+#ifdef __cplusplus
+}                               /* extern "C" */
+#endif
+
+#endif                          /* TDU_SNAPSHOT_H */
+/**
+ * \}
+ **/
@@ -0,0 +1,577 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file spill.c
+ * Routines to aggregate a scan in a bounded amount of memory.
+ *
+ * At full depth a large file system has more directories than fit in
+ * memory. With a memory limit, the tree is written out as a sorted run
+ * whenever the estimated size of its nodes reaches the limit, and the
+ * scan carries on with an empty tree. A path may then be in several
+ * runs, each holding part of its counters.
+ *
+ * The runs are unlinked scratch files, so nothing is left behind. A
+ * run is the nodes in lexical order, each its counters followed by the
+ * length of its path and the path:
+ *
+ *     struct pinfo, uint32_t length, path
+ *
+ * The results are visited by a k-way merge of the runs through a heap,
+ * adding the counters of a path found in several runs, so only one
+ * node of each run is held at a time. To keep the number of open runs
+ * bounded, every SPILL_FANIN runs are merged into one.
+ *
+ * \ingroup spill
+ * \{
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <search.h>
+#include <unistd.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "walk.h"
+#include "spill.h"
+
+#define SPILL_FANIN      64         /**< Runs merged at once **/
+#define SPILL_BUF        (64 << 10) /**< Buffer of each run **/
+#define SPILL_OVERHEAD   64         /**< Bytes of a node beyond its data **/
+
+/**
+ * A sorted run, and the node it is at while being merged.
+ **/
+struct run {
+	FILE *fp;              /**< The unlinked scratch file **/
+	struct pinfo cur;      /**< The node read last **/
+	size_t size;           /**< Size of the path buffer of cur **/
+	uint64_t n;            /**< Nodes written **/
+};
+
+/**
+ * Spill state of a context.
+ **/
+struct spill {
+	uint64_t limit;        /**< Bytes the tree may use **/
+	uint64_t used;         /**< Estimated bytes used by the tree **/
+	char *dir;             /**< Scratch directory **/
+	struct run *runs[SPILL_FANIN];/**< The runs **/
+	uint32_t nruns;        /**< Number of runs **/
+	uint64_t spilled;      /**< Nodes written to runs **/
+	int error;             /**< First error **/
+};
+
+/* Internal functions */
+static struct run *run_new(struct spill *);
+static void       run_free(struct run *);
+static int        run_next(struct spill *, struct run *);
+static int        run_write(const struct pinfo *, void *);
+static void       spill(struct tdu_ctx *);
+static void       spill_one(const void *, VISIT, int);
+static int32_t    merge_runs(struct spill *, tdu_visit_t, void *);
+static void       sift(struct run **, size_t, size_t);
+
+/*
+ * twalk() has no user data argument, so the run being written by
+ * the calling thread is handed to the call back through here.
+ */
+static __thread struct run *wrun = NULL;
+
+/**
+ * Aggregate the next scan of a context within a memory limit.
+ *
+ * \param[in] ctx    The scan context, not watched or keeping the
+ *                   full tree.
+ * \param[in] limit  Bytes the aggregated paths may use.
+ * \param[in] dir    Directory to spill to, NULL for TMPDIR or /tmp.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+int32_t
+tdu_spill(struct tdu_ctx *ctx, uint64_t limit, const char *dir)
+{
+
+	if (ctx == NULL || limit == 0 || ctx->spill != NULL ||
+	    ctx->watch != NULL || (ctx->opts.flags & TDU_F_TREE)) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+	if (dir == NULL && (dir = getenv("TMPDIR")) == NULL) {
+		dir = "/tmp";
+	}
+	if (access(dir, W_OK | X_OK) != 0) {
+		return(EXIT_FAILURE);
+	}
+
+	if ((ctx->spill = calloc(1, sizeof(struct spill))) == NULL ||
+	    (ctx->spill->dir = strdup(dir)) == NULL) {
+		free(ctx->spill);
+		ctx->spill = NULL;
+		errno = ENOMEM;
+		return(EXIT_FAILURE);
+	}
+	ctx->spill->limit = limit;
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Account a node about to be created, spilling the tree when full.
+ *
+ * The tree is spilled before the node is created, so the nodes the
+ * caller holds are not released.
+ *
+ * \param[in] ctx  The scan context.
+ * \param[in] len  Length of the path of the node.
+ **/
+void
+spill_check(struct tdu_ctx *ctx, size_t len)
+{
+	struct spill *s = ctx->spill;
+	uint64_t need = sizeof(struct pinfo) + len + 1 + SPILL_OVERHEAD;
+
+	if (s->used + need > s->limit && ctx->root != NULL) {
+		spill(ctx);
+	}
+	s->used += need;
+}
+
+/**
+ * Number of runs spilled by the scan.
+ *
+ * \param[in] ctx  The scan context.
+ *
+ * \retval n  The number of runs, 0 when the tree holds every path.
+ **/
+uint32_t
+spill_runs(const struct tdu_ctx *ctx)
+{
+
+	return(ctx->spill != NULL ? ctx->spill->nruns : 0);
+}
+
+/**
+ * Visit the spilled runs and the tree merged in lexical order.
+ *
+ * What is left in the tree is spilled first, so the tree is empty
+ * afterwards and the runs can be visited again.
+ *
+ * \param[in] ctx  The scan context.
+ * \param[in] fn   The visitor.
+ * \param[in] arg  Data passed through to the visitor.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the visitor stopped, or a run could not be written or
+ *           read, when errno is set.
+ **/
+int32_t
+spill_visit(struct tdu_ctx *ctx, tdu_visit_t fn, void *arg)
+{
+	struct spill *s = ctx->spill;
+
+	if (ctx->root != NULL) {
+		spill(ctx);
+	}
+	if (s->error != 0) {
+		errno = s->error;
+		return(EXIT_FAILURE);
+	}
+
+	return(merge_runs(s, fn, arg));
+}
+
+/**
+ * Drop the runs of the last scan.
+ *
+ * \param[in] ctx  The scan context.
+ **/
+void
+spill_clear(struct tdu_ctx *ctx)
+{
+	struct spill *s = ctx->spill;
+
+	if (s == NULL) {
+		return;
+	}
+	while (s->nruns > 0) {
+		run_free(s->runs[--s->nruns]);
+	}
+	s->used = 0;
+	s->spilled = 0;
+	s->error = 0;
+}
+
+/**
+ * Release the spill state of a context.
+ *
+ * \param[in] ctx  The scan context.
+ **/
+void
+spill_free(struct tdu_ctx *ctx)
+{
+
+	if (ctx->spill == NULL) {
+		return;
+	}
+	spill_clear(ctx);
+	free(ctx->spill->dir);
+	free(ctx->spill);
+	ctx->spill = NULL;
+}
+
+/**
+ * Create an empty run.
+ *
+ * \param[in] s  The spill state.
+ *
+ * \retval r     The run.
+ * \retval NULL  If the scratch file could not be created, the error
+ *               is kept in the spill state.
+ **/
+static struct run *
+run_new(struct spill *s)
+{
+	int fd = -1;
+	char *path = NULL;
+	FILE *fp = NULL;
+	struct run *r = NULL;
+
+	if ((path = malloc(strlen(s->dir) + sizeof("/tdu.XXXXXX"))) == NULL) {
+		if (s->error == 0) {
+			s->error = ENOMEM;
+		}
+		return(NULL);
+	}
+	sprintf(path, "%s/tdu.XXXXXX", s->dir);
+	if ((fd = mkstemp(path)) < 0 || unlink(path) != 0 ||
+	    (fp = fdopen(fd, "w+")) == NULL) {
+		if (s->error == 0) {
+			s->error = errno;
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+		free(path);
+		return(NULL);
+	}
+	free(path);
+
+	if ((r = calloc(1, sizeof(struct run))) == NULL) {
+		if (s->error == 0) {
+			s->error = ENOMEM;
+		}
+		fclose(fp);
+		return(NULL);
+	}
+	r->fp = fp;
+	setvbuf(r->fp, NULL, _IOFBF, SPILL_BUF);
+
+	return(r);
+}
+
+/**
+ * Release a run, removing its scratch file.
+ *
+ * \param[in] r  The run.
+ **/
+static void
+run_free(struct run *r)
+{
+
+	fclose(r->fp);
+	free(r->cur.path);
+	free(r);
+}
+
+/**
+ * Read the next node of a run.
+ *
+ * \param[in] s  The spill state, keeping a lack of memory.
+ * \param[in] r  The run.
+ *
+ * \retval 1 If a node was read into cur.
+ * \retval 0 At the end of the run, or on an error.
+ **/
+static int
+run_next(struct spill *s, struct run *r)
+{
+	char *path = r->cur.path;
+	char *p = NULL;
+	uint32_t len = 0;
+
+	if (fread(&r->cur, sizeof(struct pinfo), 1, r->fp) != 1 ||
+	    fread(&len, sizeof(len), 1, r->fp) != 1) {
+		r->cur.path = path;
+		return(0);
+	}
+	if (len + 1 > r->size) {
+		if ((p = realloc(path, 2 * (len + 1))) == NULL) {
+			r->cur.path = path;
+			if (s->error == 0) {
+				s->error = ENOMEM;
+			}
+			return(0);
+		}
+		path = p;
+		r->size = 2 * (len + 1);
+	}
+	r->cur.path = path;
+	if (fread(r->cur.path, 1, len, r->fp) != len) {
+		return(0);
+	}
+	r->cur.path[len] = '\0';
+
+	return(1);
+}
+
+/**
+ * Write a node to a run, as a visitor.
+ *
+ * \param[in] n    The node.
+ * \param[in] arg  The run.
+ *
+ * \retval 0 Always, to visit every node.
+ **/
+static int
+run_write(const struct pinfo *n, void *arg)
+{
+	struct run *r = arg;
+	struct pinfo rec = *n;
+	uint32_t len = strlen(n->path);
+
+	rec.path = NULL;
+	fwrite(&rec, sizeof(struct pinfo), 1, r->fp);
+	fwrite(&len, sizeof(len), 1, r->fp);
+	fwrite(n->path, 1, len, r->fp);
+	++r->n;
+
+	return(0);
+}
+
+/**
+ * Write the tree out as a run and empty it.
+ *
+ * \param[in] ctx  The scan context.
+ **/
+static void
+spill(struct tdu_ctx *ctx)
+{
+	struct spill *s = ctx->spill;
+	struct run *r = NULL;
+	struct run *m = NULL;
+
+	if ((r = run_new(s)) != NULL) {
+		wrun = r;
+		twalk(ctx->root, spill_one);
+		wrun = NULL;
+		if (fflush(r->fp) != 0 && s->error == 0) {
+			s->error = errno;
+		}
+		s->spilled += r->n;
+		s->runs[s->nruns++] = r;
+	}
+	if (ctx->opts.verbose) {
+		warnx(_("spilled %llu paths, %u runs"),
+		      (unsigned long long)s->spilled, s->nruns);
+	}
+	tdu_nodes_free(&ctx->root);
+	ctx->last = NULL;
+	s->used = 0;
+
+	/* Keep the runs open at once bounded */
+	if (s->nruns == SPILL_FANIN && (m = run_new(s)) != NULL) {
+		merge_runs(s, run_write, m);
+		if (fflush(m->fp) != 0 && s->error == 0) {
+			s->error = errno;
+		}
+		while (s->nruns > 0) {
+			run_free(s->runs[--s->nruns]);
+		}
+		s->runs[s->nruns++] = m;
+	}
+}
+
+/**
+ * Write a node of the tree to the run being spilled, called back by
+ * twalk().
+ *
+ * \param[in] nodep  The node.
+ * \param[in] v      Which visit of the node this is.
+ * \param[in] depth  Depth of the node in the binary tree.
+ **/
+static void
+spill_one(const void *nodep, VISIT v, int depth)
+{
+
+	(void)depth;
+	if (v == postorder || v == leaf) {
+		run_write(*(struct pinfo *const *)nodep, wrun);
+	}
+}
+
+/**
+ * Merge the runs in lexical order.
+ *
+ * The runs are read from their start, the one at the smallest path
+ * being at the top of a heap. Counters of the same path in several
+ * runs are added before the path is visited.
+ *
+ * \param[in] s    The spill state.
+ * \param[in] fn   The visitor.
+ * \param[in] arg  Data passed through to the visitor.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the visitor stopped, or a run could not be read, when
+ *           errno is set.
+ **/
+static int32_t
+merge_runs(struct spill *s, tdu_visit_t fn, void *arg)
+{
+	int stop = 0;
+	int have = 0;
+	size_t i = 0;
+	size_t k = 0;
+	size_t len = 0;
+	size_t size = 0;
+	char *p = NULL;
+	char *path = NULL;
+	struct run *r = NULL;
+	struct run *heap[SPILL_FANIN];
+	struct pinfo acc = {0};
+
+	for (i = 0; i < s->nruns; ++i) {
+		r = s->runs[i];
+		rewind(r->fp);
+		if (run_next(s, r)) {
+			heap[k++] = r;
+		}
+	}
+	for (i = k / 2; i-- > 0;) {
+		sift(heap, k, i);
+	}
+
+	while (k > 0 && !stop && s->error == 0) {
+		r = heap[0];
+		if (have && strcmp(acc.path, r->cur.path) == 0) {
+			tdu_node_add(&acc, &r->cur);
+		} else {
+			if (have) {
+				stop = fn(&acc, arg);
+			}
+			len = strlen(r->cur.path);
+			if (len + 1 > size) {
+				if ((p = realloc(path, 2 * (len + 1))) == NULL) {
+					if (s->error == 0) {
+						s->error = ENOMEM;
+					}
+					have = 0;
+					break;
+				}
+				path = p;
+				size = 2 * (len + 1);
+			}
+			memcpy(path, r->cur.path, len + 1);
+			acc = r->cur;
+			acc.path = path;
+			have = 1;
+		}
+
+		if (!run_next(s, r)) {
+			heap[0] = heap[--k];
+		}
+		sift(heap, k, 0);
+	}
+	if (have && !stop) {
+		stop = fn(&acc, arg);
+	}
+	free(path);
+
+	for (i = 0; i < s->nruns; ++i) {
+		if (ferror(s->runs[i]->fp) && s->error == 0) {
+			s->error = EIO;
+		}
+	}
+	if (s->error != 0) {
+		errno = s->error;
+		return(EXIT_FAILURE);
+	}
+
+	return(stop ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/**
+ * Restore the heap order below a run.
+ *
+ * \param[in,out] heap  The runs, by the path they are at.
+ * \param[in]     n     Number of runs.
+ * \param[in]     i     The run that may be out of order.
+ **/
+static void
+sift(struct run **heap, size_t n, size_t i)
+{
+	size_t c = 0;
+	struct run *r = NULL;
+
+	while ((c = 2 * i + 1) < n) {
+		if (c + 1 < n &&
+		    strcmp(heap[c+1]->cur.path, heap[c]->cur.path) < 0) {
+			++c;
+		}
+		if (strcmp(heap[i]->cur.path, heap[c]->cur.path) <= 0) {
+			break;
+		}
+		r = heap[i];
+		heap[i] = heap[c];
+		heap[c] = r;
+		i = c;
+	}
+}
+
+/**
+ * \}
+ **/
@@ -0,0 +1,832 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file tdu.c
+ * Public library interface for scanning a directory tree.
+ *
+ * \ingroup libtdu
+ * \{
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <search.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "walk.h"
+#include "watch.h"
+#include "emit.h"
+#include "tree.h"
+#include "trace.h"
+#include "export.h"
+#include "agent.h"
+#include "spill.h"
+#include "image.h"
+#include "dups.h"
+#include "compress.h"
+#include "where.h"
+#include "type.h"
+
+/**
+ * The nodes of a tree, gathered in lexical order by the tree walk.
+ **/
+struct gather {
+	struct pinfo **nodes;  /**< The nodes **/
+	size_t n;              /**< Number of nodes **/
+	size_t cap;            /**< Room in nodes **/
+	int error;             /**< There was no memory for a node **/
+};
+
+/* Internal functions */
+static void       action(const void *, VISIT, int);
+static int        relate(const char *, const char *);
+static void       rollup(struct pinfo *, const struct pinfo *);
+static int        mcmp(const void *, const void *);
+static void       tclear(struct tdu_ctx *);
+static int32_t    finish(struct tdu_ctx *, int32_t);
+static void       typing(const struct tdu_ctx *, int);
+
+/** Lower edge in days of each access age bucket **/
+const uint32_t tdu_age_days[TDU_NAGE] = {
+	0, 1, 7, 14, 30, 45, 60, 90, 180, 365, 730, 1825
+};
+
+/*
+ * twalk() has no user data argument, so the nodes being gathered
+ * by the calling thread are handed to the call back through here.
+ */
+static __thread struct gather *gstate = NULL;
+
+/**
+ * Create a scan context.
+ *
+ * \param[in] opts  The scan options, these are copied.
+ *
+ * \retval ctx  The new scan context.
+ * \retval NULL If the options were invalid, errno is set to EINVAL, or
+ *              there was no memory, errno is set to ENOMEM.
+ **/
+struct tdu_ctx *
+tdu_create(const struct tdu_opts *opts)
+{
+	size_t n = 0;
+	struct tdu_ctx *ctx = NULL;
+
+	if (opts == NULL || opts->path == NULL || opts->maxdepth == 0 ||
+	    tdu_scale(opts->units) == 0) {
+		errno = EINVAL;
+		return(NULL);
+	}
+
+	if ((ctx = calloc(1, sizeof(struct tdu_ctx))) == NULL) {
+		return(NULL);
+	}
+	ctx->opts = *opts;
+	if ((ctx->opts.path = strdup(opts->path)) == NULL) {
+		free(ctx);
+		return(NULL);
+	}
+
+	/* Remove a trailing / from the path */
+	n = strlen(ctx->opts.path);
+	if (n > 1 && ctx->opts.path[n-1] == '/') {
+		ctx->opts.path[--n] = '\0';
+	}
+	ctx->plen = n;
+
+	return(ctx);
+}
+
+/**
+ * Scan the context path, aggregating the disk usage.
+ *
+ * A context may be scanned more than once, each scan replaces
+ * the previous results.
+ *
+ * \param[in] ctx  The scan context.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+int32_t
+tdu_scan(struct tdu_ctx *ctx)
+{
+
+	if (ctx == NULL) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+
+	tclear(ctx);
+
+	if ((ctx->opts.flags & TDU_F_TREE) &&
+	    (ctx->tree = tree_new(ctx->opts.path,
+				  (ctx->opts.flags & TDU_F_SIZES) != 0)) == NULL) {
+		return(EXIT_FAILURE);
+	}
+
+	typing(ctx, 1);
+	return(finish(ctx, tdu_walk(ctx)));
+}
+
+/**
+ * Aggregate a recorded trace instead of scanning the context path.
+ *
+ * The results are those of a scan of the recorded top level path,
+ * which becomes the context path, with every other path named by the
+ * hash of its name. Replaying while recording writes the trace again.
+ *
+ * \param[in] ctx   The scan context, not being watched or finding
+ *                  duplicates.
+ * \param[in] path  The trace written by tdu_record().
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+int32_t
+tdu_replay(struct tdu_ctx *ctx, const char *path)
+{
+
+	if (ctx == NULL || path == NULL || ctx->watch != NULL ||
+	    ctx->dups != NULL || ctx->compress != NULL) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+
+	tclear(ctx);
+
+	typing(ctx, 1);
+	return(finish(ctx, trace_replay(ctx, path)));
+}
+
+/**
+ * Aggregate an ext4 file system image instead of scanning.
+ *
+ * The image is read without mounting it, the results are those of a
+ * scan of its root with the context path as the top level path.
+ *
+ * \param[in] ctx   The scan context, not being watched or finding
+ *                  duplicates.
+ * \param[in] path  The image file or block device.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+int32_t
+tdu_image(struct tdu_ctx *ctx, const char *path)
+{
+
+	if (ctx == NULL || path == NULL || ctx->watch != NULL ||
+	    ctx->dups != NULL || ctx->compress != NULL) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+
+	tclear(ctx);
+
+	if ((ctx->opts.flags & TDU_F_TREE) &&
+	    (ctx->tree = tree_new(ctx->opts.path,
+				  (ctx->opts.flags & TDU_F_SIZES) != 0)) == NULL) {
+		return(EXIT_FAILURE);
+	}
+
+	typing(ctx, 1);
+	return(finish(ctx, image_scan(ctx, path)));
+}
+
+/**
+ * Finish a scan, replay or image read.
+ *
+ * \param[in] ctx  The scan context.
+ * \param[in] rc   How the aggregation finished.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+static int32_t
+finish(struct tdu_ctx *ctx, int32_t rc)
+{
+
+	if (ctx->error != 0 && rc == EXIT_SUCCESS) {
+		errno = ctx->error;
+		rc = EXIT_FAILURE;
+	}
+	if (ctx->tree != NULL) {
+		if (ctx->opts.verbose) {
+			tree_stats(ctx->tree);
+		}
+		if (tree_check(ctx->tree) && rc == EXIT_SUCCESS) {
+			rc = EXIT_FAILURE;
+		}
+	}
+	if (dups_finish(ctx) && rc == EXIT_SUCCESS) {
+		rc = EXIT_FAILURE;
+	}
+	if (compress_finish(ctx) && rc == EXIT_SUCCESS) {
+		rc = EXIT_FAILURE;
+	}
+
+	/* A cold file list, a trace and an export are only kept for one scan */
+	if (emit_finish(ctx) && rc == EXIT_SUCCESS) {
+		rc = EXIT_FAILURE;
+	}
+	if (trace_finish(ctx) && rc == EXIT_SUCCESS) {
+		rc = EXIT_FAILURE;
+	}
+	if (export_finish(ctx) && rc == EXIT_SUCCESS) {
+		rc = EXIT_FAILURE;
+	}
+	agent_finish(ctx, rc);
+	typing(ctx, -1);
+
+	return(rc);
+}
+
+/**
+ * Count a scan that breaks the usage down by type in or out.
+ *
+ * \param[in] ctx   The scan context.
+ * \param[in] sign  1 when the scan starts, -1 when it finishes.
+ **/
+static void
+typing(const struct tdu_ctx *ctx, int sign)
+{
+
+	if (ctx->opts.flags & TDU_F_TYPES) {
+		type_scanning(sign);
+	}
+}
+
+/**
+ * Visit the aggregated results.
+ *
+ * The subtree totals of every path are filled in before the visit.
+ *
+ * \param[in] ctx  The scan context.
+ * \param[in] fn   The visitor.
+ * \param[in] arg  Data passed through to the visitor.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the visitor stopped the walk, or there was an error
+ *           and errno is set.
+ **/
+int32_t
+tdu_visit(struct tdu_ctx *ctx, tdu_visit_t fn, void *arg)
+{
+	size_t i = 0;
+	int stop = 0;
+	struct gather g = {0};
+
+	if (ctx == NULL || fn == NULL) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+
+	if (ctx->tree != NULL) {
+		return(tree_render(ctx->tree, ctx->opts.path,
+				   ctx->opts.maxdepth, fn, arg));
+	}
+
+	/* Too many paths to hold, so they are visited as they are merged */
+	if (spill_runs(ctx) > 0) {
+		return(spill_visit(ctx, fn, arg));
+	}
+
+	gstate = &g;
+	twalk(ctx->root, action);
+	gstate = NULL;
+	if (g.error || tdu_rollup(g.nodes, g.n)) {
+		free(g.nodes);
+		errno = ENOMEM;
+		return(EXIT_FAILURE);
+	}
+
+	/*
+	 * The top level path is a prefix of every other, so it sorts
+	 * first and is always visited first.
+	 */
+	for (i = 0; i < g.n && !stop; ++i) {
+		stop = fn(g.nodes[i], arg);
+	}
+	free(g.nodes);
+
+	return(stop ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/**
+ * Visit the results of a subtree at a depth.
+ *
+ * Only a context scanned with TDU_F_TREE keeps what is needed, it
+ * may be rendered any number of times at any depth. The access age
+ * histogram is not kept in the tree.
+ *
+ * \param[in] ctx    The scan context.
+ * \param[in] path   The subtree, the top level path or a path below it.
+ * \param[in] depth  The depth below path to aggregate at.
+ * \param[in] fn     The visitor.
+ * \param[in] arg    Data passed through to the visitor.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the visitor stopped the walk, or there was an error
+ *           and errno is set.
+ **/
+int32_t
+tdu_render(struct tdu_ctx *ctx, const char *path, uint32_t depth,
+	   tdu_visit_t fn, void *arg)
+{
+
+	if (ctx == NULL || ctx->tree == NULL || path == NULL ||
+	    depth == 0 || fn == NULL) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+
+	return(tree_render(ctx->tree, path, depth, fn, arg));
+}
+
+/**
+ * Visit the results of each file system.
+ *
+ * A context scanned with TDU_F_MOUNTS keeps the usage of each file
+ * system found below the top level path. Each is visited once, in
+ * order of the path it is mounted on, the level is not set.
+ *
+ * \param[in] ctx  The scan context.
+ * \param[in] fn   The visitor.
+ * \param[in] arg  Data passed through to the visitor.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the visitor stopped the walk, or there was an error
+ *           and errno is set.
+ **/
+int32_t
+tdu_mounts(struct tdu_ctx *ctx, tdu_visit_t fn, void *arg)
+{
+	size_t i = 0;
+	int stop = 0;
+	struct pinfo **nodes = NULL;
+
+	if (ctx == NULL || !(ctx->opts.flags & TDU_F_MOUNTS) || fn == NULL) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+
+	qsort(ctx->mounts, ctx->nmounts, sizeof(struct mount), mcmp);
+	ctx->mlast = 0;
+
+	/* A file system mounted below another is part of its subtree */
+	if ((nodes = malloc((ctx->nmounts + 1) *
+			    sizeof(struct pinfo *))) == NULL) {
+		return(EXIT_FAILURE);
+	}
+	for (i = 0; i < ctx->nmounts; ++i) {
+		nodes[i] = &ctx->mounts[i].usage;
+	}
+	if (tdu_rollup(nodes, ctx->nmounts)) {
+		free(nodes);
+		return(EXIT_FAILURE);
+	}
+	free(nodes);
+
+	for (i = 0; i < ctx->nmounts && !stop; ++i) {
+		stop = fn(&ctx->mounts[i].usage, arg);
+	}
+
+	return(stop ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/**
+ * Release a scan context and all of its results.
+ *
+ * \param[in] ctx  The scan context.
+ **/
+void
+tdu_destroy(struct tdu_ctx *ctx)
+{
+
+	if (ctx == NULL) {
+		return;
+	}
+
+	tclear(ctx);
+	watch_free(ctx);
+	emit_finish(ctx);
+	trace_finish(ctx);
+	export_finish(ctx);
+	agent_free(ctx);
+	spill_free(ctx);
+	dups_free(ctx);
+	compress_free(ctx);
+	where_free(ctx->where);
+	free(ctx->pbuf);
+	free(ctx->opts.path);
+	free(ctx);
+}
+
+/**
+ * Scale factor for a units string.
+ *
+ * \param[in] units  The units, only the first character is used.
+ *
+ * \retval scale  The number of bytes per unit.
+ * \retval 0      If the units are unknown.
+ **/
+uint64_t
+tdu_scale(const char *units)
+{
+
+	switch (units[0]) {
+		case 'k':
+			return(kB);
+		case 'M':
+			return(MB);
+		case 'G':
+			return(GB);
+		case 'T':
+			return(TB);
+		case 'P':
+			return(PB);
+		case 'E':
+			return(EB);
+	}
+
+	return(0);
+}
+
+/**
+ * Time the last scan of a context started.
+ *
+ * \param[in] ctx  The scan context.
+ *
+ * \retval now  The scan start time.
+ * \retval 0    If the context has not been scanned.
+ **/
+time_t
+tdu_scantime(const struct tdu_ctx *ctx)
+{
+
+	return(ctx->now);
+}
+
+/**
+ * Top level path of a context.
+ *
+ * \param[in] ctx  The scan context.
+ *
+ * \retval path  The path scanned, or replayed.
+ **/
+const char *
+tdu_path(const struct tdu_ctx *ctx)
+{
+
+	return(ctx->opts.path);
+}
+
+/**
+ * Access age histogram bucket.
+ *
+ * \param[in] days  The number of days since last access.
+ *
+ * \retval n  The last bucket whose lower edge is at most days.
+ **/
+uint32_t
+tdu_age_bucket(uint32_t days)
+{
+	uint32_t lo = 0;
+	uint32_t hi = TDU_NAGE - 1;
+	uint32_t mid = 0;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (tdu_age_days[mid] <= days) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return(lo);
+}
+
+/**
+ * File size histogram bucket.
+ *
+ * \param[in] size  The file size in bytes.
+ *
+ * \retval n  The bucket, the number of significant bits in size.
+ **/
+uint32_t
+tdu_size_bucket(uint64_t size)
+{
+	uint32_t n = 0;
+
+#if defined(__GNUC__)
+	n = size == 0 ? 0 : 64 - __builtin_clzll(size);
+#else
+	while (size != 0) {
+		++n;
+		size >>= 1;
+	}
+#endif
+
+	return(n < TDU_NSIZE ? n : TDU_NSIZE - 1);
+}
+
+/**
+ * Estimate the median regular file size of a path.
+ *
+ * The median is interpolated within its size histogram bucket.
+ *
+ * \param[in] n  The path.
+ *
+ * \retval size  The estimated median size in bytes.
+ **/
+uint64_t
+tdu_size_median(const struct pinfo *n)
+{
+	uint32_t i = 0;
+	uint64_t seen = 0;
+	uint64_t half = 0;
+	double lo = 0.0;
+
+	if (n->files == 0 || n->size[0] * 2 >= n->files) {
+		return(0);
+	}
+
+	half = (n->files + 1) / 2;
+	for (i = 0; i < TDU_NSIZE - 1; ++i) {
+		if (seen + n->size[i] >= half) {
+			break;
+		}
+		seen += n->size[i];
+	}
+
+	lo = (double)(1ULL << (i - 1));
+	if (n->size[i] == 0) {
+		return((uint64_t)lo);
+	}
+
+	return((uint64_t)(lo + lo * (half - seen - 0.5) / n->size[i]));
+}
+
+/**
+ * Count the regular files of a path below a size.
+ *
+ * \param[in] n      The path.
+ * \param[in] bytes  The size, a power of two.
+ *
+ * \retval count  The number of files smaller than bytes.
+ **/
+uint64_t
+tdu_size_below(const struct pinfo *n, uint64_t bytes)
+{
+	uint32_t i = 0;
+	uint32_t b = 0;
+	uint64_t count = 0;
+
+	b = tdu_size_bucket(bytes);
+	for (i = 0; i < b; ++i) {
+		count += n->size[i];
+	}
+
+	return(count);
+}
+
+/**
+ * Total the subtree of each path of a list.
+ *
+ * The paths below a path sort together right after it, only preceded
+ * by the paths that extend its name with a character before /. One
+ * pass keeps a stack of the paths whose subtree is still to come, a
+ * path is complete once a path sorts past its subtree and is then
+ * added into its closest ancestor on the list, lower on the stack.
+ *
+ * \param[in,out] nodes  The paths, sorted by tdu_cmp().
+ * \param[in]     n      Number of paths.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If there was no memory, errno is set to ENOMEM.
+ **/
+int32_t
+tdu_rollup(struct pinfo **nodes, size_t n)
+{
+	size_t i = 0;
+	size_t k = 0;
+	size_t top = 0;
+	size_t *stack = NULL;
+	size_t *up = NULL;
+
+	for (i = 0; i < n; ++i) {
+		nodes[i]->sub_greater = nodes[i]->greater;
+		nodes[i]->sub_total = nodes[i]->total;
+		nodes[i]->sub_files = nodes[i]->files;
+		nodes[i]->sub_dirs = nodes[i]->dirs;
+		nodes[i]->sub_links = nodes[i]->links;
+	}
+
+	stack = malloc((n + 1) * sizeof(size_t));
+	up = malloc((n + 1) * sizeof(size_t));
+	if (stack == NULL || up == NULL) {
+		free(stack);
+		free(up);
+		return(EXIT_FAILURE);
+	}
+	for (i = 0; i < n; ++i) {
+		while (top > 0 &&
+		       relate(nodes[i]->path, nodes[stack[top - 1]]->path) > 0) {
+			--top;
+			if (up[top] != SIZE_MAX) {
+				rollup(nodes[up[top]], nodes[stack[top]]);
+			}
+		}
+
+		/* The closest ancestor, under the paths it sorts between */
+		for (k = top; k > 0 &&
+		     relate(nodes[i]->path, nodes[stack[k - 1]]->path) != 0; --k) {
+			;
+		}
+		up[top] = k > 0 ? stack[k - 1] : SIZE_MAX;
+		stack[top++] = i;
+	}
+	while (top-- > 0) {
+		if (up[top] != SIZE_MAX) {
+			rollup(nodes[up[top]], nodes[stack[top]]);
+		}
+	}
+
+	free(stack);
+	free(up);
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Place a path against the subtree of a path sorting before it.
+ *
+ * \param[in] path  The path.
+ * \param[in] a     The path before it.
+ *
+ * \retval 0   If path is below a.
+ * \retval <0  If path sorts before the subtree of a.
+ * \retval >0  If path sorts after the subtree of a.
+ **/
+static int
+relate(const char *path, const char *a)
+{
+	size_t len = strlen(a);
+	int rc = strncmp(path, a, len);
+
+	if (rc != 0) {
+		return(rc);
+	}
+
+	/* The root keeps its /, which is also that of its children */
+	if (len == 1 && a[0] == '/') {
+		return(path[1] != '\0' ? 0 : -1);
+	}
+	if (path[len] == '/') {
+		return(0);
+	}
+
+	return(path[len] == '\0' ? -1 : (unsigned char)path[len] - '/');
+}
+
+/**
+ * Action to be taken for each tree element.
+ *
+ * \param[in] node  The current node.
+ * \param[in] v     The traversal type.
+ * \param[in] level The current node level.
+ */
+static void
+action(const void *node, VISIT v, int level)
+{
+	size_t cap = 0;
+	struct pinfo **nodes = NULL;
+	struct gather *g = gstate;
+
+	(void)level;
+	if ((v == postorder || v == leaf) && !g->error) {
+		if (g->n == g->cap) {
+			cap = g->cap ? 2 * g->cap : 1024;
+			if ((nodes = realloc(g->nodes,
+			    cap * sizeof(struct pinfo *))) == NULL) {
+				g->error = 1;
+				return;
+			}
+			g->nodes = nodes;
+			g->cap = cap;
+		}
+		g->nodes[g->n++] = *(struct pinfo * const *)node;
+	}
+}
+
+/**
+ * Add the subtree totals of a path into those of its ancestor.
+ *
+ * \param[in,out] up  The ancestor.
+ * \param[in]     n   The path.
+ **/
+static void
+rollup(struct pinfo *up, const struct pinfo *n)
+{
+
+	up->sub_greater += n->sub_greater;
+	up->sub_total += n->sub_total;
+	up->sub_files += n->sub_files;
+	up->sub_dirs += n->sub_dirs;
+	up->sub_links += n->sub_links;
+}
+
+/**
+ * Remove all of the aggregated results from a context.
+ *
+ * \param[in] ctx  The scan context.
+ **/
+static void
+tclear(struct tdu_ctx *ctx)
+{
+
+	watch_clear(ctx);
+	ctx->error = 0;
+	ctx->last = NULL;
+	tree_free(ctx->tree);
+	ctx->tree = NULL;
+
+	while (ctx->nmounts > 0) {
+		free(ctx->mounts[--ctx->nmounts].usage.path);
+	}
+	free(ctx->mounts);
+	ctx->mounts = NULL;
+	ctx->mlast = 0;
+
+	tdu_nodes_free(&ctx->root);
+	spill_clear(ctx);
+}
+
+/**
+ * Compare two mounts by the path they are mounted on.
+ *
+ * \param[in] a  The first mount.
+ * \param[in] b  The second mount.
+ *
+ * \retval <0 If a is mounted before b.
+ * \retval 0  If they are mounted on the same path.
+ * \retval >0 If a is mounted after b.
+ **/
+static int
+mcmp(const void *a, const void *b)
+{
+	const struct mount *x = a;
+	const struct mount *y = b;
+
+	return(strcmp(x->usage.path, y->usage.path));
+}
+
+/**
+ * \}
+ **/
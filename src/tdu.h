@@ -0,0 +1,251 @@
+/* BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file tdu.h
+ * Public interface to the tree disk usage library.
+ *
+ * A scan is described by a context created from a set of options.
+ * Every context owns its own aggregation tree, so several contexts
+ * may be scanned concurrently from different threads. The file types
+ * are shared by every context: tdu_type_load() fails with EBUSY while
+ * any TDU_F_TYPES scan is running. Results are
+ * handed to a caller supplied visitor; the library never writes to
+ * standard output.
+ *
+ * \ingroup libtdu
+ * \{
+ **/
+
+#ifndef TDU_H
+#define TDU_H
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * Scan option flags.
+ **/
+#define TDU_F_AGES      0x01    /**< Keep an access age histogram **/
+#define TDU_F_TREE      0x02    /**< Keep every directory, see tdu_render() **/
+#define TDU_F_SIZES     0x04    /**< Keep the file size histogram in the tree **/
+#define TDU_F_LATENCY   0x08    /**< Tune the threaded walk for high latency **/
+#define TDU_F_MOUNTS    0x10    /**< Cross mount points, see tdu_mounts() **/
+#define TDU_F_TYPES     0x20    /**< Break regular files down by type **/
+
+/**
+ * Number of access age histogram buckets.
+ **/
+#define TDU_NAGE        12
+
+/** Lower edge in days of each access age bucket **/
+extern const uint32_t tdu_age_days[TDU_NAGE];
+
+/**
+ * Number of file size histogram buckets.
+ *
+ * Bucket 0 holds empty files, bucket n files of at least 2^(n-1)
+ * and less than 2^n bytes, and the last bucket everything larger.
+ **/
+#define TDU_NSIZE       42
+
+/**
+ * Most file types, including type 0 for files of no other type.
+ *
+ * The types are built in from types.txt and may be extended with
+ * tdu_type_load(). They are not kept by a TDU_F_TREE scan.
+ **/
+#define TDU_NTYPE       32
+
+/**
+ * Scan options.
+ **/
+struct tdu_opts {
+	int verbose;           /**< Verbosity level **/
+	uint32_t flags;        /**< Scan option flags (TDU_F_) **/
+	int atime_days;        /**< Access time window in days **/
+	uint32_t maxdepth;     /**< Maximum depth to aggregate at **/
+	uint32_t jobs;         /**< Most concurrent walkers, 0 walks serially **/
+	time_t atime;          /**< Files accessed before this are old **/
+	float cost;            /**< Cost per unit per day **/
+	char units[3];         /**< Reporting units (kB ... EB) **/
+	char *path;            /**< Top level path to scan **/
+};
+
+/**
+ * Structure store the toplevel path and sizes.
+ **/
+struct pinfo {
+	int level;             /**< The path level **/
+	uint64_t greater;      /**< Bytes that are older than atime **/
+	uint64_t total;        /**< Total number of bytes in the path **/
+	uint64_t files;        /**< Number of regular files **/
+	uint64_t dirs;         /**< Number of directories **/
+	uint64_t links;        /**< Number of symbolic links **/
+	uint64_t dup;          /**< Reclaimable bytes of duplicate files **/
+	uint64_t comp_bytes;   /**< Bytes of the compression estimate **/
+	uint64_t comp_total;   /**< Estimated compressed comp_bytes **/
+	uint64_t comp_low;     /**< Low bound of comp_total **/
+	uint64_t comp_high;    /**< High bound of comp_total **/
+	uint64_t comp_samples; /**< Blocks the estimate is from **/
+	uint64_t age[TDU_NAGE];/**< Bytes by access age (TDU_F_AGES) **/
+	uint64_t size[TDU_NSIZE];/**< Regular files by size **/
+	uint64_t type_total[TDU_NTYPE];/**< Bytes by file type (TDU_F_TYPES) **/
+	uint64_t type_greater[TDU_NTYPE];/**< Old bytes by file type **/
+	uint64_t sub_greater;  /**< Old bytes in the subtree **/
+	uint64_t sub_total;    /**< Bytes in the subtree **/
+	uint64_t sub_files;    /**< Regular files in the subtree **/
+	uint64_t sub_dirs;     /**< Directories in the subtree **/
+	uint64_t sub_links;    /**< Symbolic links in the subtree **/
+	char *path;            /**< Path string **/
+};
+
+/** Opaque scan context **/
+struct tdu_ctx;
+
+/**
+ * Visitor called once per aggregated path.
+ *
+ * The top level path is visited first, followed by every other
+ * path in lexical order. A non zero return stops the visit.
+ **/
+typedef int (*tdu_visit_t)(const struct pinfo *, void *);
+
+/* Create a scan context */
+struct tdu_ctx *tdu_create(const struct tdu_opts *);
+
+/* Scan the context path */
+int32_t tdu_scan(struct tdu_ctx *);
+
+/* Visit the aggregated results */
+int32_t tdu_visit(struct tdu_ctx *, tdu_visit_t, void *);
+
+/* Visit the results of a subtree at a depth (TDU_F_TREE) */
+int32_t tdu_render(struct tdu_ctx *, const char *, uint32_t,
+		   tdu_visit_t, void *);
+
+/* Visit the results of each file system (TDU_F_MOUNTS) */
+int32_t tdu_mounts(struct tdu_ctx *, tdu_visit_t, void *);
+
+/* Total the subtree of each path of a lexically sorted list */
+int32_t tdu_rollup(struct pinfo **, size_t);
+
+/* Release a scan context */
+void tdu_destroy(struct tdu_ctx *);
+
+/* Scale factor in bytes for a units string */
+uint64_t tdu_scale(const char *);
+
+/* Time the last scan started */
+time_t tdu_scantime(const struct tdu_ctx *);
+
+/* Top level path of a context */
+const char *tdu_path(const struct tdu_ctx *);
+
+/* Access age histogram bucket for a number of days */
+uint32_t tdu_age_bucket(uint32_t);
+
+/* File size histogram bucket for a number of bytes */
+uint32_t tdu_size_bucket(uint64_t);
+
+/* Estimated median regular file size of a path */
+uint64_t tdu_size_median(const struct pinfo *);
+
+/* Number of regular files of a path smaller than a power of two */
+uint64_t tdu_size_below(const struct pinfo *, uint64_t);
+
+/* Add file types from a table, while no TDU_F_TYPES scan runs */
+int32_t tdu_type_load(const char *);
+
+/* Number of file types */
+uint32_t tdu_type_count(void);
+
+/* Name of a file type */
+const char *tdu_type_name(uint32_t);
+
+/* Find a file type by name */
+int32_t tdu_type_find(const char *);
+
+/* Start watching a context for changes, before it is scanned */
+int32_t tdu_watch(struct tdu_ctx *);
+
+/* Descriptor that becomes readable when there are changes */
+int tdu_watch_fd(const struct tdu_ctx *);
+
+/* Apply pending changes to the aggregated results */
+int64_t tdu_watch_update(struct tdu_ctx *);
+
+/* Move the access time window of a watched context to a time */
+int64_t tdu_watch_age(struct tdu_ctx *, time_t);
+
+/* List the cold files found by the next scan */
+int32_t tdu_emit_cold(struct tdu_ctx *, const char *, uint64_t, uint32_t);
+
+/* Aggregate the next scan within a memory limit */
+int32_t tdu_spill(struct tdu_ctx *, uint64_t, const char *);
+
+/* Find the duplicate files of every following scan */
+int32_t tdu_dups(struct tdu_ctx *, int);
+
+/* Estimate the compressed size of every following scan */
+int32_t tdu_compress(struct tdu_ctx *, uint64_t);
+
+/* Count the entries matching an expression as old */
+int32_t tdu_where(struct tdu_ctx *, const char *);
+
+/* Record the metadata of the next scan to a trace */
+int32_t tdu_record(struct tdu_ctx *, const char *);
+
+/* Export the entries of the next scan as a Parquet file */
+int32_t tdu_export(struct tdu_ctx *, const char *);
+
+/* Stream every following scan to a collector */
+int32_t tdu_agent(struct tdu_ctx *, const char *, const char *);
+
+/* Aggregate a recorded trace instead of scanning */
+int32_t tdu_replay(struct tdu_ctx *, const char *);
+
+/* Aggregate an ext4 image instead of scanning */
+int32_t tdu_image(struct tdu_ctx *, const char *);
+
+#ifdef __cplusplus
+}                               /* extern "C" */
+#endif
+
+#endif                          /* TDU_H */
+/**
+ * \}
+ **/
@@ -0,0 +1,544 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file tdud.c
+ * Tree disk usage daemon.
+ *
+ * The daemon scans a set of directories on a schedule, holds the
+ * results in memory and answers queries on them over a local UNIX
+ * socket. Each connection carries a single request line:
+ *
+ *     query [depth=n] [units=u] [cost=c] [atime=n] path=<path>
+ *     status
+ *
+ * The path must be the last key, it extends to the end of the line.
+ * A status reply is a status line followed by one line per root:
+ *
+ *     ok <roots>
+ *     <scan time>\t<age>\t<duration>\t<paths>\t<root>
+ *
+ * A root that has not yet been scanned has a scan time of 0. Any
+ * failure is replied to with a single "error <message>" line.
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+#include <locale.h>
+#include <errno.h>
+#include <err.h>
+#include <signal.h>
+#include <sysexits.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "snapshot.h"
+
+#define DEFAULT_INTERVAL 3600
+#define DEFAULT_MAXDEPTH 8
+#define REQUEST_MAX      (PATH_MAX + 128)
+
+/**
+ * A scanned directory.
+ **/
+struct root {
+	char *path;              /**< The directory **/
+	pthread_t tid;           /**< Scanning thread **/
+	struct snapshot *snap;   /**< Latest results, under lock **/
+};
+
+/* Internal functions */
+static void              print_usage(void);
+static void              print_version(void);
+static const char       *program_name(void);
+static int32_t           parse_argv(int32_t , char **);
+static void             *scanner(void *);
+static int               listen_on(const char *);
+static void              serve(int);
+static void              query(FILE *, char *);
+static void              status(FILE *);
+static void              stop(int);
+
+static struct tdu_opts options = {0};  /**< Scan options **/
+static uint32_t interval = DEFAULT_INTERVAL; /**< Seconds between scans **/
+static char *sockpath = TDUD_SOCKET;   /**< Socket to listen on **/
+static size_t nroots = 0;              /**< Number of roots **/
+static struct root *roots = NULL;      /**< Scanned roots **/
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+static volatile sig_atomic_t done = 0; /**< Set on termination **/
+
+/**
+ * The main entry point of the daemon.
+ *
+ * \param argc   Number of command line arguments.
+ * \param argv  Reference to the pointer to the argument array list.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted.
+ **/
+int32_t
+main(int32_t argc, char **argv)
+{
+	int fd = -1;
+	size_t i = 0;
+	struct sigaction sa = {0};
+	struct pollfd pfd = {0};
+
+	/* initialise gettext */
+#ifdef HAVE_SETLOCALE
+	setlocale(LC_ALL, "");
+#endif
+#ifdef ENABLE_NLS
+	bindtextdomain(PACKAGE, LOCALEDIR);
+	textdomain(PACKAGE);
+#endif
+
+	options.maxdepth = DEFAULT_MAXDEPTH;
+	options.atime_days = 45;
+	options.flags = TDU_F_AGES;
+	strcpy(options.units, "GB");
+
+	if (parse_argv(argc, argv)) {
+		exit(EXIT_FAILURE);
+	}
+
+	sa.sa_handler = stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	if ((fd = listen_on(sockpath)) < 0) {
+		exit(EX_OSERR);
+	}
+
+	for (i = 0; i < nroots; ++i) {
+		if (pthread_create(&roots[i].tid, NULL, scanner, &roots[i])) {
+			errx(EX_OSERR, _("unable to start a scan of %s"),
+			     roots[i].path);
+		}
+		pthread_detach(roots[i].tid);
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (!done) {
+		if (poll(&pfd, 1, 1000) > 0) {
+			serve(fd);
+		}
+	}
+
+	close(fd);
+	unlink(sockpath);
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Parse the command line arguments.
+ *
+ * \param[in]  argc     Number of command line arguments.
+ * \param[in]  argv     Reference to the pointer to the argument array list.
+ *
+ * \retval 0 If there were no errors.
+ **/
+static int32_t
+parse_argv(int32_t argc, char **argv)
+{
+	int32_t i = 0;
+	int32_t opt = 0;
+	int32_t opt_index = 0;
+	char *soptions = "hVvLtT:i:j:m:s:";		/* short options structure */
+	static struct option loptions[] = {	/* long options structure */
+		{"help",     no_argument,       NULL, 'h'},
+		{"version",  no_argument,       NULL, 'V'},
+		{"verbose",  no_argument,       NULL, 'v'},
+		{"high-latency",no_argument,    NULL, 'L'},
+		{"types",    no_argument,       NULL, 't'},
+		{"type-table",required_argument,NULL, 'T'},
+		{"interval", required_argument, NULL, 'i'},
+		{"jobs",     required_argument, NULL, 'j'},
+		{"maxdepth", required_argument, NULL, 'm'},
+		{"socket",   required_argument, NULL, 's'},
+		{NULL,       0,                 NULL,  0}
+	};
+
+	while ((opt = getopt_long(argc, argv, soptions, loptions,
+			    &opt_index)) != -1) {
+		switch (opt) {
+			case 'V':
+				print_version();
+				break;
+			case 'h':
+				print_usage();
+				break;
+			case 'v':
+				options.verbose = 1;
+				break;
+			case 'L':
+				options.flags |= TDU_F_LATENCY;
+				break;
+			case 'T':
+				if (tdu_type_load(optarg)) {
+					err(EX_DATAERR, _("unable to load types from %s"),
+					    optarg);
+				}
+				/* FALLTHROUGH */
+			case 't':
+				options.flags |= TDU_F_TYPES;
+				break;
+			case 'i':
+				interval = (uint32_t)strtoul(optarg, NULL, 10);
+				break;
+			case 'j':
+				options.jobs = (uint32_t)strtoul(optarg, NULL, 10);
+				break;
+			case 'm':
+				options.maxdepth = (uint32_t)strtoul(optarg, NULL, 10);
+				break;
+			case 's':
+				sockpath = optarg;
+				break;
+			default:
+				print_usage();
+				break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1) {
+		warnx(_("error: must specify a directory"));
+		print_usage();
+	}
+	if (interval == 0 || options.maxdepth == 0) {
+		warnx(_("error: the interval and maxdepth must be positive"));
+		print_usage();
+	}
+	if ((options.flags & TDU_F_LATENCY) && options.jobs == 0) {
+		options.jobs = LATENCY_JOBS;
+	}
+
+	nroots = argc;
+	roots = calloc(nroots, sizeof(struct root));
+	for (i = 0; i < argc; ++i) {
+		if ((roots[i].path = realpath(argv[i], NULL)) == NULL) {
+			err(EX_IOERR, _("unable to resolve %s"), argv[i]);
+		}
+	}
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Scan a root on a schedule, publishing each completed scan.
+ *
+ * \param[in] arg  The root.
+ *
+ * \retval NULL Never returns.
+ **/
+static void *
+scanner(void *arg)
+{
+	struct root *r = arg;
+	struct tdu_opts opts = options;
+	struct tdu_ctx *ctx = NULL;
+	struct snapshot *snap = NULL;
+	struct snapshot *old = NULL;
+	time_t start = 0;
+
+	opts.path = r->path;
+
+	for (;;) {
+		start = time(NULL);
+		/* Only the file types need the old bytes at scan time */
+		opts.atime = start - (time_t)opts.atime_days * SECONDS_IN_DAY;
+		if ((ctx = tdu_create(&opts)) == NULL || tdu_scan(ctx)) {
+			warn(_("walking %s failed."), r->path);
+		} else {
+			snap = snapshot_take(ctx, time(NULL) - start);
+			if (options.verbose) {
+				warnx(_("scanned %s in %lld s, %zu paths"),
+				      r->path, (long long)snap->duration,
+				      snap->n);
+			}
+
+			pthread_rwlock_wrlock(&lock);
+			old = r->snap;
+			r->snap = snap;
+			pthread_rwlock_unlock(&lock);
+
+			snapshot_free(old);
+			old = NULL;
+		}
+		tdu_destroy(ctx);
+
+		sleep(interval);
+	}
+
+	return(NULL);
+}
+
+/**
+ * Create, bind and listen on a UNIX socket.
+ *
+ * \param[in] path  The socket path, any stale socket is removed.
+ *
+ * \retval fd  The listening socket.
+ * \retval -1  If there was an error.
+ **/
+static int
+listen_on(const char *path)
+{
+	int fd = -1;
+	struct sockaddr_un sun = {0};
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		warnx(_("socket path %s is too long"), path);
+		return(-1);
+	}
+
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		warn(_("unable to create a socket"));
+		return(-1);
+	}
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		warn(_("unable to listen on %s"), path);
+		close(fd);
+		return(-1);
+	}
+
+	return(fd);
+}
+
+/**
+ * Accept a connection and answer its request.
+ *
+ * \param[in] fd  The listening socket.
+ **/
+static void
+serve(int fd)
+{
+	int cfd = -1;
+	size_t n = 0;
+	char *buf = NULL;
+	FILE *in = NULL;
+	FILE *fp = NULL;
+	struct timeval tv = {1, 0};
+
+	if ((cfd = accept(fd, NULL, NULL)) < 0) {
+		return;
+	}
+
+	/* A client may not hold up the other clients */
+	setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if ((in = fdopen(cfd, "r")) == NULL) {
+		close(cfd);
+		return;
+	}
+	if ((fp = fdopen(dup(cfd), "w")) == NULL) {
+		fclose(in);
+		return;
+	}
+
+	if (getline(&buf, &n, in) > 0 && strlen(buf) < REQUEST_MAX) {
+		buf[strcspn(buf, "\r\n")] = '\0';
+		if (strncmp(buf, "query ", 6) == 0) {
+			query(fp, buf + 6);
+		} else if (strcmp(buf, "status") == 0) {
+			status(fp);
+		} else {
+			fprintf(fp, "error %s\n", _("unknown request"));
+		}
+	}
+
+	free(buf);
+	fclose(fp);
+	fclose(in);
+}
+
+/**
+ * Answer a query request.
+ *
+ * \param[in] fp   The client connection.
+ * \param[in] req  The request keys.
+ **/
+static void
+query(FILE *fp, char *req)
+{
+	size_t i = 0;
+	struct query q = {0};
+	struct snapshot *snap = NULL;
+
+	q.depth = options.maxdepth;
+	q.atime_days = options.atime_days;
+	strcpy(q.units, options.units);
+	if (snapshot_parse(&q, req, fp)) {
+		return;
+	}
+
+	pthread_rwlock_rdlock(&lock);
+	for (i = 0; i < nroots; ++i) {
+		if (snapshot_covers(roots[i].snap, q.path) &&
+		    (snap == NULL || strlen(roots[i].path) > strlen(snap->root))) {
+			snap = roots[i].snap;
+		}
+	}
+	if (snap != NULL) {
+		snapshot_query(snap, &q, fp);
+	} else {
+		fprintf(fp, "error %s\n", _("path not scanned"));
+	}
+	pthread_rwlock_unlock(&lock);
+}
+
+/**
+ * Answer a status request.
+ *
+ * \param[in] fp   The client connection.
+ **/
+static void
+status(FILE *fp)
+{
+	size_t i = 0;
+	time_t now = time(NULL);
+	struct snapshot *s = NULL;
+
+	pthread_rwlock_rdlock(&lock);
+	fprintf(fp, "ok %zu\n", nroots);
+	for (i = 0; i < nroots; ++i) {
+		if ((s = roots[i].snap) == NULL) {
+			fprintf(fp, "0\t0\t0\t0\t%s\n", roots[i].path);
+		} else {
+			fprintf(fp, "%lld\t%lld\t%lld\t%zu\t%s\n",
+				(long long)s->scantime,
+				(long long)(now - s->scantime),
+				(long long)s->duration, s->n, roots[i].path);
+		}
+	}
+	pthread_rwlock_unlock(&lock);
+}
+
+/**
+ * Signal handler to terminate the daemon.
+ *
+ * \param[in] sig  The signal.
+ **/
+static void
+stop(int sig)
+{
+
+	(void)sig;
+	done = 1;
+}
+
+/**
+ * Prints a short program usage statement, explaining the
+ * command line arguments and flags expected.
+ **/
+static void
+print_usage(void)
+{
+	printf(_(\
+"usage: %s [-h] [-V] [-v] [-L] [-t] [-T file] [-i] [-j n] [-m] [-s socket] directory ...\n\
+  -h, --help       display this help and exit.\n\
+  -V, --version    display version information and exit.\n\
+  -v, --verbose    verbose mode.\n\
+  -L, --high-latency walk tuned for storage with a high latency.\n\
+  -t, --types      break the usage down by file type.\n\
+  -T, --type-table add the file types of a table, implies -t.\n\
+  -i, --interval   seconds between scans.\n\
+  -j, --jobs       walk with at most n threads.\n\
+  -m, --maxdepth   maximum depth to hold.\n\
+  -s, --socket     the socket to listen on.\n\
+  directory        the directories to scan.\n\
+"), program_name());
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * Prints the program version number and compile date.
+ **/
+static void
+print_version(void)
+{
+	printf(_("%s: %s %s\n"), program_name(), PACKAGE, VERSION);
+	printf(_("Compiled on %s at %s.\n\n"), __DATE__, __TIME__);
+
+	exit(EXIT_SUCCESS);
+}
+
+/**
+ * Obtain the program name.
+ **/
+static const char *
+program_name(void)
+{
+#if HAVE_GETPROGNAME
+	return(getprogname());
+#else
+#if HAVE_PROGRAM_INVOCATION_SHORT_NAME
+	return(program_invocation_short_name);
+#else
+	return("unknown");
+#endif /* HAVE_PROGRAM_INVOCATION_SHORT_NAME */
+#endif /* HAVE_GETPROGNAME */
+}
@@ -0,0 +1,817 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file trace.c
+ * Routines to record the metadata of a scan and replay it.
+ *
+ * A trace holds the shape of a scan without its names, so it can be
+ * shared and replayed through the aggregation and reports at the same
+ * scale without touching a file system. It is a header followed by
+ * one record per entry in the order the walk found them. Integers are
+ * LEB128 varints, signed ones zigzag encoded, as in a history store.
+ *
+ *     header  "TDUT\001", scan time, root length, root path
+ *     record  flag byte, parent delta, [id delta], name hash (8 bytes
+ *             little endian), mode, size, scan time - atime,
+ *             scan time - mtime, uid
+ *
+ * The flag is the nftw() type flag of the entry. Directories have ids,
+ * the top level path 0 and the others in the order they were first
+ * seen, which with several threads may be through one of their
+ * entries. The parent is the id of the containing directory, and a
+ * directory record also carries its own id, both as differences from
+ * the previous record. The name hash is a 64 bit FNV-1a hash of the
+ * name, replays name each entry by its hash in hex below the top
+ * level path.
+ *
+ * \ingroup trace
+ * \{
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "walk.h"
+#include "tree.h"
+#include "trace.h"
+#include "export.h"
+#include "agent.h"
+
+#define TRACE_MAGIC     "TDUT\001"
+#define TRACE_MAGICLEN  5
+#define TRACE_BUF       (1 << 20)
+
+/** Signed to zigzag encoded **/
+#define ZIGZAG(x)       (((uint64_t)(x) << 1) ^ (uint64_t)((int64_t)(x) >> 63))
+
+/** Zigzag encoded to signed **/
+#define UNZIGZAG(v)     ((int64_t)((v) >> 1) ^ -(int64_t)((v) & 1))
+
+/**
+ * A directory by path, used when recording.
+ **/
+struct tdir {
+	uint64_t hash;         /**< Hash of the path **/
+	uint32_t id;           /**< Its id **/
+	char *path;            /**< The path, NULL when the slot is empty **/
+};
+
+/**
+ * A trace being recorded.
+ **/
+struct trace {
+	int fd;                /**< The trace **/
+	int error;             /**< First write error **/
+	uint8_t *buf;          /**< Records not yet written **/
+	size_t len;            /**< Bytes used in buf **/
+	time_t now;            /**< Time the scan started **/
+	uint64_t n;            /**< Number of records **/
+	uint32_t nid;          /**< Next directory id **/
+	uint32_t parent;       /**< Parent of the previous record **/
+	uint32_t id;           /**< Id of the previous directory record **/
+	struct tdir *dirs;     /**< Directories by path **/
+	size_t ndirs;          /**< Number of directories **/
+	size_t size;           /**< Slots in dirs **/
+	char *lpath;           /**< Path of the last parent **/
+	size_t llen;           /**< Length of lpath **/
+	uint32_t lid;          /**< Id of the last parent **/
+};
+
+/**
+ * A directory of a trace being replayed.
+ **/
+struct rdir {
+	uint32_t parent;       /**< Its parent **/
+	uint32_t level;        /**< Its level below the top level path **/
+	uint64_t hash;         /**< Hash of its name **/
+};
+
+/* Internal functions */
+static uint32_t   dirid(struct trace *, const char *, size_t);
+static int32_t    grow(struct trace *);
+static void       put(struct trace *, uint64_t);
+static void       flush(struct trace *);
+static int        get(const uint8_t **, const uint8_t *, uint64_t *);
+static int        record(const uint8_t **, const uint8_t *, int *,
+			 int64_t *, int64_t *, uint64_t *, struct stat *,
+			 time_t);
+static size_t     rpath(char **, size_t *, const char *,
+			const struct rdir *, uint32_t);
+static uint64_t   fnv(const char *, size_t);
+
+/**
+ * Record the metadata of the next scan of a context.
+ *
+ * \param[in] ctx   The scan context.
+ * \param[in] path  The trace to write.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+int32_t
+tdu_record(struct tdu_ctx *ctx, const char *path)
+{
+	int fd = -1;
+
+	if (ctx == NULL || path == NULL || ctx->trace != NULL) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		return(EXIT_FAILURE);
+	}
+
+	if ((ctx->trace = calloc(1, sizeof(struct trace))) == NULL ||
+	    (ctx->trace->buf = malloc(TRACE_BUF)) == NULL) {
+		free(ctx->trace);
+		ctx->trace = NULL;
+		close(fd);
+		errno = ENOMEM;
+		return(EXIT_FAILURE);
+	}
+	ctx->trace->fd = fd;
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Write the header of a trace, when the scan starts.
+ *
+ * \param[in] ctx  The scan context.
+ **/
+void
+trace_begin(struct tdu_ctx *ctx)
+{
+	struct trace *t = ctx->trace;
+	size_t n = strlen(ctx->opts.path);
+
+	t->now = ctx->now;
+	t->nid = 1;
+	memcpy(t->buf, TRACE_MAGIC, TRACE_MAGICLEN);
+	t->len = TRACE_MAGICLEN;
+	put(t, (uint64_t)t->now);
+	put(t, n);
+	flush(t);
+	if (write(t->fd, ctx->opts.path, n) != (ssize_t)n && t->error == 0) {
+		t->error = errno ? errno : EIO;
+	}
+}
+
+/**
+ * Record an entry found by a walk.
+ *
+ * \param[in] ctx    The scan context.
+ * \param[in] fpath  Name of the entry.
+ * \param[in] sb     Stat buffer of the entry.
+ * \param[in] tflag  File type flags.
+ * \param[in] level  Level of the entry below the top level path.
+ **/
+void
+trace_record(struct tdu_ctx *ctx, const char *fpath, const struct stat *sb,
+	     int tflag, int level)
+{
+	uint32_t i = 0;
+	uint32_t id = 0;
+	uint32_t parent = 0;
+	uint64_t h = 0;
+	const char *name = NULL;
+	struct trace *t = ctx->trace;
+
+	if (level > 0) {
+		name = strrchr(fpath, '/') + 1;
+		h = fnv(name, strlen(name));
+		if (level > 1) {
+			parent = dirid(t, fpath, name - fpath - 1);
+		}
+	}
+
+	if (t->len + 80 > TRACE_BUF) {
+		flush(t);
+	}
+	t->buf[t->len++] = (uint8_t)tflag;
+	put(t, ZIGZAG((int64_t)parent - (int64_t)t->parent));
+	t->parent = parent;
+	if (tflag == FTW_D || tflag == FTW_DNR) {
+		id = level > 0 ? dirid(t, fpath, strlen(fpath)) : 0;
+		put(t, ZIGZAG((int64_t)id - (int64_t)t->id));
+		t->id = id;
+	}
+	for (i = 0; i < 8; ++i) {
+		t->buf[t->len++] = (uint8_t)(h >> (8 * i));
+	}
+	put(t, sb->st_mode);
+	put(t, sb->st_size);
+	put(t, ZIGZAG((int64_t)(t->now - sb->st_atime)));
+	put(t, ZIGZAG((int64_t)(t->now - sb->st_mtime)));
+	put(t, sb->st_uid);
+	++t->n;
+}
+
+/**
+ * Finish the trace of a scan.
+ *
+ * \param[in] ctx  The scan context.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the trace could not be written, errno is set.
+ **/
+int32_t
+trace_finish(struct tdu_ctx *ctx)
+{
+	int error = 0;
+	size_t i = 0;
+	struct trace *t = ctx->trace;
+
+	if (t == NULL) {
+		return(EXIT_SUCCESS);
+	}
+
+	flush(t);
+	error = t->error;
+	if (close(t->fd) != 0 && error == 0) {
+		error = errno;
+	}
+	if (ctx->opts.verbose) {
+		warnx(_("recorded %llu entries, %zu directories"),
+		      (unsigned long long)t->n, t->ndirs);
+	}
+
+	for (i = 0; i < t->size; ++i) {
+		free(t->dirs[i].path);
+	}
+	free(t->dirs);
+	free(t->lpath);
+	free(t->buf);
+	free(t);
+	ctx->trace = NULL;
+
+	if (error != 0) {
+		errno = error;
+		return(EXIT_FAILURE);
+	}
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Aggregate a recorded trace instead of scanning.
+ *
+ * The entries are aggregated as a scan of the recorded top level path
+ * would have, in the order they were recorded, with their times moved
+ * to now. Every other entry is named by the hash of its name. The
+ * context path becomes the recorded top level path.
+ *
+ * \param[in] ctx   The scan context, not being watched.
+ * \param[in] path  The trace.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+int32_t
+trace_replay(struct tdu_ctx *ctx, const char *path)
+{
+	int fd = -1;
+	int tflag = 0;
+	uint32_t nrdir = 0;
+	uint64_t v = 0;
+	uint64_t n = 0;
+	uint64_t h = 0;
+	int64_t parent = 0;
+	int64_t id = 0;
+	size_t bsize = 0;
+	size_t plen = 0;
+	size_t size = 0;
+	int64_t last = -1;
+	uint32_t level = 0;
+	time_t then = 0;
+	uint8_t *map = NULL;
+	const uint8_t *p = NULL;
+	const uint8_t *end = NULL;
+	const uint8_t *first = NULL;
+	char *buf = NULL;
+	char *root = NULL;
+	struct rdir *r = NULL;
+	struct rdir *rdirs = NULL;
+	struct stat sb = {0};
+	uint64_t t0 = 0;
+	struct timespec ts = {0};
+	int32_t rc = EXIT_FAILURE;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return(EXIT_FAILURE);
+	}
+	if (fstat(fd, &sb) != 0) {
+		close(fd);
+		return(EXIT_FAILURE);
+	}
+	size = sb.st_size;
+	if (size < TRACE_MAGICLEN ||
+	    (map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+	    MAP_FAILED) {
+		close(fd);
+		errno = size < TRACE_MAGICLEN ? EINVAL : errno;
+		return(EXIT_FAILURE);
+	}
+	close(fd);
+	madvise(map, size, MADV_SEQUENTIAL);
+	p = map;
+	end = map + size;
+
+	if (memcmp(p, TRACE_MAGIC, TRACE_MAGICLEN) != 0) {
+		goto bad;
+	}
+	p += TRACE_MAGICLEN;
+	if (get(&p, end, &v)) {
+		goto bad;
+	}
+	then = (time_t)v;
+	if (get(&p, end, &v) || v == 0 || v > (uint64_t)(end - p)) {
+		goto bad;
+	}
+	if ((root = strndup((const char *)p, v)) == NULL) {
+		goto fail;
+	}
+	p += v;
+	first = p;
+
+	/* First find every directory so entries may precede their parent */
+	if ((rdirs = calloc(1, sizeof(struct rdir))) == NULL) {
+		goto fail;
+	}
+	nrdir = 1;
+	for (n = 0; p < end; ++n) {
+		if (record(&p, end, &tflag, &parent, &id, &h, &sb, 0)) {
+			goto bad;
+		}
+		if ((tflag == FTW_D || tflag == FTW_DNR) && n > 0) {
+			if (id <= 0 || id > UINT32_MAX) {
+				goto bad;
+			}
+			if ((uint64_t)id >= nrdir) {
+				if ((r = realloc(rdirs,
+				    (id + 1) * sizeof(struct rdir))) == NULL) {
+					goto fail;
+				}
+				rdirs = r;
+				memset(rdirs + nrdir, 0,
+				       (id + 1 - nrdir) * sizeof(struct rdir));
+				nrdir = id + 1;
+			}
+			rdirs[id].parent = parent;
+			rdirs[id].hash = h;
+			rdirs[id].level = UINT32_MAX;
+		}
+	}
+	for (id = 1; id < nrdir; ++id) {
+		for (v = id, level = 0; v != 0 && level <= nrdir;
+		     v = rdirs[v].parent, ++level) {
+			if (v >= nrdir || rdirs[v].level == 0) {
+				goto bad;
+			}
+		}
+		if (v != 0) {
+			goto bad;
+		}
+		rdirs[id].level = level;
+	}
+
+	/* Replay as a scan of the recorded top level path */
+	free(ctx->opts.path);
+	ctx->opts.path = root;
+	ctx->plen = strlen(root);
+	root = NULL;
+	if ((ctx->now = time(NULL)) == (time_t)-1) {
+		goto fail;
+	}
+	if ((ctx->opts.flags & TDU_F_TREE) &&
+	    (ctx->tree = tree_new(ctx->opts.path,
+				  (ctx->opts.flags & TDU_F_SIZES) != 0)) == NULL) {
+		goto fail;
+	}
+	/* A combination of features no call back supports */
+	if ((ctx->entry = entry_select(ctx)) == NULL) {
+		errno = EINVAL;
+		goto fail;
+	}
+	ctx->observe = tdu_observing(ctx);
+	if (ctx->trace != NULL) {
+		trace_begin(ctx);
+	}
+	if (ctx->export != NULL) {
+		export_begin(ctx);
+	}
+	if (ctx->agent != NULL) {
+		agent_begin(ctx);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	t0 = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	parent = 0;
+	id = 0;
+	for (p = first, n = 0; p < end; ++n) {
+		record(&p, end, &tflag, &parent, &id, &h, &sb, ctx->now);
+		if (n == 0) {
+			if (ctx->observe) {
+				tdu_observe(ctx, ctx->opts.path, &sb, tflag, 0);
+			}
+			ctx->entry(ctx, ctx->opts.path, &sb, tflag, 0);
+			continue;
+		}
+		if (parent < 0 || parent >= nrdir) {
+			goto bad;
+		}
+		if (parent != last) {
+			if ((plen = rpath(&buf, &bsize, ctx->opts.path, rdirs,
+					  parent)) == SIZE_MAX) {
+				goto fail;
+			}
+			last = parent;
+		}
+		snprintf(buf + plen, bsize - plen, "/%016llx",
+			 (unsigned long long)h);
+		level = (parent > 0 ? rdirs[parent].level : 0) + 1;
+		if (ctx->observe) {
+			tdu_observe(ctx, buf, &sb, tflag, level);
+		}
+		ctx->entry(ctx, buf, &sb, tflag, level);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	if (ctx->opts.verbose) {
+		warnx(_("replayed %llu entries recorded at %lld in %.3f s"),
+		      (unsigned long long)n, (long long)then,
+		      (ts.tv_sec * 1000000000ULL + ts.tv_nsec - t0) / 1e9);
+	}
+	rc = EXIT_SUCCESS;
+	goto fail;
+
+bad:
+	errno = EINVAL;
+fail:
+	free(buf);
+	free(root);
+	free(rdirs);
+	munmap(map, size);
+
+	return(rc);
+}
+
+/**
+ * Read a record of a trace.
+ *
+ * \param[in,out] p       The position to read from.
+ * \param[in]     end     The end of the trace.
+ * \param[out]    tflag   File type flags.
+ * \param[in,out] parent  Parent of the record, of the previous on entry.
+ * \param[in,out] id      Id of the record, of the previous directory
+ *                        on entry.
+ * \param[out]    h       Hash of the name.
+ * \param[out]    sb      Stat buffer of the entry.
+ * \param[in]     now     Time to move the scan time to.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the record runs past the end.
+ **/
+static int
+record(const uint8_t **p, const uint8_t *end, int *tflag, int64_t *parent,
+       int64_t *id, uint64_t *h, struct stat *sb, time_t now)
+{
+	int i = 0;
+	uint64_t v = 0;
+
+	*tflag = *(*p)++;
+	if (get(p, end, &v)) {
+		return(1);
+	}
+	*parent += UNZIGZAG(v);
+	if (*tflag == FTW_D || *tflag == FTW_DNR) {
+		if (get(p, end, &v)) {
+			return(1);
+		}
+		*id += UNZIGZAG(v);
+	}
+	if (end - *p < 8) {
+		return(1);
+	}
+	for (i = 0, *h = 0; i < 8; ++i) {
+		*h |= (uint64_t)*(*p)++ << (8 * i);
+	}
+
+	memset(sb, 0, sizeof(struct stat));
+	if (get(p, end, &v)) {
+		return(1);
+	}
+	sb->st_mode = v;
+	if (get(p, end, &v)) {
+		return(1);
+	}
+	sb->st_size = v;
+	if (get(p, end, &v)) {
+		return(1);
+	}
+	sb->st_atime = now - UNZIGZAG(v);
+	if (get(p, end, &v)) {
+		return(1);
+	}
+	sb->st_mtime = now - UNZIGZAG(v);
+	if (get(p, end, &v)) {
+		return(1);
+	}
+	sb->st_uid = v;
+
+	return(0);
+}
+
+/**
+ * Build the replayed path of a directory.
+ *
+ * \param[in,out] buf    The path buffer.
+ * \param[in,out] bsize  Size of buf.
+ * \param[in]     root   The top level path.
+ * \param[in]     rdirs  The directories.
+ * \param[in]     id     The directory.
+ *
+ * \retval len       Length of the path.
+ * \retval SIZE_MAX  If there was no memory, errno is set to ENOMEM.
+ **/
+static size_t
+rpath(char **buf, size_t *bsize, const char *root, const struct rdir *rdirs,
+      uint32_t id)
+{
+	size_t len = 0;
+	size_t need = 0;
+	size_t rlen = 0;
+	int i = 0;
+	char *q = NULL;
+	char *p = NULL;
+	uint32_t level = id > 0 ? rdirs[id].level : 0;
+	static const char hex[] = "0123456789abcdef";
+
+	/* Entries of / are /name, not //name */
+	rlen = strcmp(root, "/") == 0 ? 0 : strlen(root);
+
+	/* Each level is a slash and 16 hex digits, with room for a name */
+	need = rlen + 17 * (level + 1) + 1;
+	if (need > *bsize) {
+		if ((p = realloc(*buf, need * 2)) == NULL) {
+			return(SIZE_MAX);
+		}
+		*buf = p;
+		*bsize = need * 2;
+	}
+
+	len = rlen + 17 * level;
+	memcpy(*buf, root, rlen);
+	for (; id > 0; id = rdirs[id].parent) {
+		q = *buf + rlen + 17 * (rdirs[id].level - 1);
+		*q++ = '/';
+		for (i = 60; i >= 0; i -= 4) {
+			*q++ = hex[(rdirs[id].hash >> i) & 0xf];
+		}
+	}
+	(*buf)[len] = '\0';
+
+	return(len);
+}
+
+/**
+ * Find or give an id to a directory.
+ *
+ * \param[in] t     The trace.
+ * \param[in] path  The path of the directory.
+ * \param[in] len   Length of the path.
+ *
+ * \retval id  The id of the directory, 0 when the trace has failed.
+ **/
+static uint32_t
+dirid(struct trace *t, const char *path, size_t len)
+{
+	size_t i = 0;
+	uint64_t h = 0;
+	char *lpath = NULL;
+
+	/* A failed trace is abandoned, and its table may be full */
+	if (t->error != 0) {
+		return(0);
+	}
+
+	/* Entries of a directory mostly arrive together */
+	if (len == t->llen && t->lpath != NULL &&
+	    memcmp(path, t->lpath, len) == 0) {
+		return(t->lid);
+	}
+
+	if (2 * (t->ndirs + 1) > t->size && grow(t)) {
+		t->error = ENOMEM;
+		return(0);
+	}
+	h = fnv(path, len);
+	for (i = h & (t->size - 1); t->dirs[i].path != NULL;
+	     i = (i + 1) & (t->size - 1)) {
+		if (t->dirs[i].hash == h &&
+		    strncmp(t->dirs[i].path, path, len) == 0 &&
+		    t->dirs[i].path[len] == '\0') {
+			break;
+		}
+	}
+	if (t->dirs[i].path == NULL) {
+		if ((t->dirs[i].path = strndup(path, len)) == NULL) {
+			t->error = ENOMEM;
+			return(0);
+		}
+		t->dirs[i].hash = h;
+		t->dirs[i].id = t->nid++;
+		++t->ndirs;
+	}
+
+	/* Without room the last parent is only not remembered */
+	if ((lpath = realloc(t->lpath, len + 1)) == NULL) {
+		return(t->dirs[i].id);
+	}
+	t->lpath = lpath;
+	memcpy(t->lpath, path, len);
+	t->lpath[len] = '\0';
+	t->llen = len;
+	t->lid = t->dirs[i].id;
+
+	return(t->lid);
+}
+
+/**
+ * Double the directory table of a trace.
+ *
+ * \param[in] t  The trace.
+ *
+ * \retval 0 If the table was grown.
+ * \retval 1 If there was no memory, the table is left as it was.
+ **/
+static int32_t
+grow(struct trace *t)
+{
+	size_t i = 0;
+	size_t j = 0;
+	size_t size = t->size ? t->size * 2 : 1024;
+	struct tdir *dirs = NULL;
+
+	if ((dirs = calloc(size, sizeof(struct tdir))) == NULL) {
+		return(EXIT_FAILURE);
+	}
+	for (i = 0; i < t->size; ++i) {
+		if (t->dirs[i].path == NULL) {
+			continue;
+		}
+		for (j = t->dirs[i].hash & (size - 1); dirs[j].path != NULL;
+		     j = (j + 1) & (size - 1)) {
+		}
+		dirs[j] = t->dirs[i];
+	}
+	free(t->dirs);
+	t->dirs = dirs;
+	t->size = size;
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Append a varint to the records not yet written.
+ *
+ * \param[in] t  The trace.
+ * \param[in] v  The value.
+ **/
+static void
+put(struct trace *t, uint64_t v)
+{
+
+	while (v >= 0x80) {
+		t->buf[t->len++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	t->buf[t->len++] = v;
+}
+
+/**
+ * Write the records not yet written.
+ *
+ * \param[in] t  The trace.
+ **/
+static void
+flush(struct trace *t)
+{
+	size_t off = 0;
+	ssize_t n = 0;
+
+	while (off < t->len && t->error == 0) {
+		if ((n = write(t->fd, t->buf + off, t->len - off)) < 0) {
+			if (errno != EINTR) {
+				t->error = errno;
+			}
+			continue;
+		}
+		off += n;
+	}
+	t->len = 0;
+}
+
+/**
+ * Read a varint.
+ *
+ * \param[in,out] p    The position to read from.
+ * \param[in]     end  The end of the data.
+ * \param[out]    v    The value.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the varint runs past the end.
+ **/
+static int
+get(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while (*p < end && shift < 64) {
+		*v |= (uint64_t)(**p & 0x7f) << shift;
+		if ((*(*p)++ & 0x80) == 0) {
+			return(0);
+		}
+		shift += 7;
+	}
+
+	return(1);
+}
+
+/**
+ * 64 bit FNV-1a hash.
+ *
+ * \param[in] s  The bytes.
+ * \param[in] n  Number of bytes.
+ *
+ * \retval h  The hash.
+ **/
+static uint64_t
+fnv(const char *s, size_t n)
+{
+	size_t i = 0;
+	uint64_t h = UINT64_C(0xcbf29ce484222325);
+
+	for (i = 0; i < n; ++i) {
+		h ^= (unsigned char)s[i];
+		h *= UINT64_C(0x100000001b3);
+	}
+
+	return(h);
+}
+
+/**
+ * \}
+ **/
@@ -0,0 +1,902 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file tree.c
+ * Routines to keep every directory of a scan in a compact tree.
+ *
+ * A scan normally aggregates at its maximum depth, so a report at
+ * another depth needs another scan. The tree instead keeps the entries
+ * counted directly in each directory, and any depth of any subtree is
+ * rendered afterwards by adding each directory below the depth into
+ * its ancestor at the depth.
+ *
+ * Directories are numbered with 32 bit ids in the order they are
+ * found, the root being 0. Each counter is an array indexed by id.
+ * A directory holds its parent, its first child and next sibling,
+ * and the offset of its name, as every name is stored only once in
+ * a shared pool. Children are found through a hash of the parent id
+ * and name offset. Without the size histogram a directory costs about
+ * 60 bytes plus its share of the name pool.
+ *
+ * \ingroup tree
+ * \{
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "walk.h"
+#include "emit.h"
+#include "tree.h"
+
+#define TREE_MINSIZE     1024
+
+/**
+ * The full depth tree.
+ **/
+struct tree {
+	char *top;             /**< Top level path **/
+	size_t plen;           /**< Length of the top level path **/
+	uint32_t n;            /**< Number of directories **/
+	uint32_t cap;          /**< Room in the arrays **/
+	uint32_t *parent;      /**< Parent of each directory **/
+	uint32_t *name;        /**< Offset of each name in the pool **/
+	uint32_t *child;       /**< First child, 0 for none **/
+	uint32_t *sibling;     /**< Next sibling, 0 for none **/
+	uint64_t *total;       /**< Bytes of the entries in each directory **/
+	uint64_t *greater;     /**< Bytes older than atime **/
+	uint32_t *files;       /**< Number of regular files **/
+	uint32_t *dirs;        /**< Number of directories **/
+	uint32_t *links;       /**< Number of symbolic links **/
+	uint32_t *size;        /**< Files by size, TDU_NSIZE per id **/
+	uint32_t *slots;       /**< Child hash, id + 1 or 0 when free **/
+	uint32_t nslots;       /**< Size of the child hash **/
+	char *pool;            /**< Every name, NUL terminated **/
+	size_t plsize;         /**< Bytes used in the pool **/
+	size_t plcap;          /**< Size of the pool **/
+	uint32_t *names;       /**< Name hash, offset + 1 or 0 when free **/
+	uint32_t nnames;       /**< Number of names **/
+	uint32_t nnslots;      /**< Size of the name hash **/
+	char *last;            /**< Last directory looked up **/
+	size_t lastlen;        /**< Length of last **/
+	size_t lastcap;        /**< Size of last **/
+	uint32_t lastid;       /**< Id of last **/
+	int error;             /**< errno of the first entry not kept **/
+};
+
+/**
+ * A directory waiting to be rendered.
+ **/
+struct pending {
+	uint32_t id;           /**< The directory **/
+	uint32_t level;        /**< Level below the rendered path **/
+	size_t row;            /**< Row it is added into **/
+};
+
+/* Internal functions */
+static void      *grow(void *, size_t, size_t, size_t);
+static int32_t    expand(struct tree *);
+static uint64_t   hash(const char *, size_t);
+static uint64_t   mix(uint32_t, uint32_t);
+static uint32_t   intern(struct tree *, const char *, size_t, int);
+static uint32_t   child(struct tree *, uint32_t, const char *, size_t, int);
+static uint32_t   lookup(struct tree *, const char *, size_t, int);
+static void       rehash(struct tree *);
+static void       rehash_names(struct tree *);
+
+/**
+ * Create an empty tree below a top level path.
+ *
+ * \param[in] top    The top level path, without a trailing /.
+ * \param[in] sizes  Keep the file size histogram of each directory.
+ *
+ * \retval t     The new tree.
+ * \retval NULL  If there was no memory, errno is set to ENOMEM.
+ **/
+struct tree *
+tree_new(const char *top, int sizes)
+{
+	struct tree *t = NULL;
+
+	if ((t = calloc(1, sizeof(struct tree))) == NULL) {
+		return(NULL);
+	}
+	t->top = strdup(top);
+	t->plen = strlen(top);
+	t->cap = TREE_MINSIZE;
+	t->parent = calloc(t->cap, sizeof(uint32_t));
+	t->name = calloc(t->cap, sizeof(uint32_t));
+	t->child = calloc(t->cap, sizeof(uint32_t));
+	t->sibling = calloc(t->cap, sizeof(uint32_t));
+	t->total = calloc(t->cap, sizeof(uint64_t));
+	t->greater = calloc(t->cap, sizeof(uint64_t));
+	t->files = calloc(t->cap, sizeof(uint32_t));
+	t->dirs = calloc(t->cap, sizeof(uint32_t));
+	t->links = calloc(t->cap, sizeof(uint32_t));
+	if (sizes) {
+		t->size = calloc((size_t)t->cap * TDU_NSIZE, sizeof(uint32_t));
+	}
+	t->nslots = 2 * TREE_MINSIZE;
+	t->slots = calloc(t->nslots, sizeof(uint32_t));
+	t->plcap = 16 * TREE_MINSIZE;
+	t->pool = calloc(1, t->plcap);
+	t->nnslots = 2 * TREE_MINSIZE;
+	t->names = calloc(t->nnslots, sizeof(uint32_t));
+	if (t->top == NULL || t->parent == NULL || t->name == NULL ||
+	    t->child == NULL || t->sibling == NULL || t->total == NULL ||
+	    t->greater == NULL || t->files == NULL || t->dirs == NULL ||
+	    t->links == NULL || (sizes && t->size == NULL) ||
+	    t->slots == NULL || t->pool == NULL || t->names == NULL) {
+		tree_free(t);
+		errno = ENOMEM;
+		return(NULL);
+	}
+
+	/* The root is named by the whole top level path */
+	t->name[0] = intern(t, top, t->plen, 1);
+	t->n = 1;
+
+	return(t);
+}
+
+/**
+ * Release a tree.
+ *
+ * \param[in] t  The tree.
+ **/
+void
+tree_free(struct tree *t)
+{
+
+	if (t == NULL) {
+		return;
+	}
+
+	free(t->top);
+	free(t->parent);
+	free(t->name);
+	free(t->child);
+	free(t->sibling);
+	free(t->total);
+	free(t->greater);
+	free(t->files);
+	free(t->dirs);
+	free(t->links);
+	free(t->size);
+	free(t->slots);
+	free(t->pool);
+	free(t->names);
+	free(t->last);
+	free(t);
+}
+
+/**
+ * Add an entry found by a walk to its directory.
+ *
+ * A file or link is counted in the directory holding it, anything
+ * else in a directory of its own name, as aggregation at a depth does.
+ *
+ * \param[in] ctx    The scan context.
+ * \param[in] fpath  Name of the entry.
+ * \param[in] sb     Stat buffer of the entry.
+ * \param[in] tflag  File type flags.
+ * \param[in] level  Level of the entry below the top level path.
+ * \param[in] emit   List the entry if it is a cold file.
+ **/
+static inline void
+add(struct tdu_ctx *ctx, const char *fpath, const struct stat *sb,
+    int tflag, int level, int emit)
+{
+	struct tree *t = ctx->tree;
+	size_t len = strlen(fpath);
+	uint32_t id = 0;
+	uint32_t isreg = S_ISREG(sb->st_mode);
+	uint64_t old = -(uint64_t)tdu_is_old(ctx, fpath, sb, level);
+
+	if (tflag == FTW_F || tflag == FTW_SL) {
+		while (len > 0 && fpath[len-1] != '/') {
+			--len;
+		}
+		if (len > 1) {
+			--len;
+		}
+	}
+
+	if ((id = lookup(t, fpath, len, 1)) == UINT32_MAX) {
+		return;
+	}
+	t->total[id] += sb->st_size;
+	t->greater[id] += sb->st_size & old;
+	t->files[id] += isreg;
+	t->dirs[id] += S_ISDIR(sb->st_mode);
+	t->links[id] += S_ISLNK(sb->st_mode);
+	if (t->size != NULL) {
+		t->size[(size_t)id * TDU_NSIZE +
+			(tdu_size_bucket(sb->st_size) & -isreg)] += isreg;
+	}
+
+	if (emit && isreg && old) {
+		emit_file(ctx->emit, fpath, sb->st_size);
+	}
+}
+
+/**
+ * Entry call back of a scan into a tree.
+ **/
+static void
+entry_tree(struct tdu_ctx *ctx, const char *fpath, const struct stat *sb,
+	   int tflag, int level)
+{
+
+	add(ctx, fpath, sb, tflag, level, 0);
+}
+
+/**
+ * Entry call back of a scan into a tree listing cold files.
+ **/
+static void
+entry_tree_e(struct tdu_ctx *ctx, const char *fpath, const struct stat *sb,
+	     int tflag, int level)
+{
+
+	add(ctx, fpath, sb, tflag, level, 1);
+}
+
+/**
+ * Select the entry call back that aggregates into the tree.
+ *
+ * \param[in] ctx  The scan context.
+ *
+ * \retval fn  The call back.
+ **/
+entry_t
+tree_select(const struct tdu_ctx *ctx)
+{
+
+	return(ctx->emit != NULL ? entry_tree_e : entry_tree);
+}
+
+/**
+ * Check every entry of a scan was kept in the tree.
+ *
+ * \param[in] t  The tree.
+ *
+ * \retval 0 If every entry was kept.
+ * \retval 1 If the tree ran out of ids or name offsets, when errno is
+ *           set to EOVERFLOW, or of memory, when it is set to ENOMEM.
+ **/
+int32_t
+tree_check(const struct tree *t)
+{
+
+	if (t->error != 0) {
+		errno = t->error;
+		return(EXIT_FAILURE);
+	}
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Render a subtree of the tree at a depth.
+ *
+ * Every directory of the subtree down to depth is visited, and the
+ * directories deeper than that are added into their ancestor at
+ * depth. The subtree path is visited first, followed by every other
+ * path in lexical order, as a scan at that depth would be.
+ *
+ * \param[in] t      The tree.
+ * \param[in] path   The path of the subtree.
+ * \param[in] depth  The depth below path to render.
+ * \param[in] fn     The visitor.
+ * \param[in] arg    Data passed through to the visitor.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If the visitor stopped, the path is not in the tree, when
+ *           errno is set to ENOENT, the scan did not fit in the
+ *           tree, when errno is set to EOVERFLOW, or there was no
+ *           memory, when errno is set to ENOMEM.
+ **/
+int32_t
+tree_render(const struct tree *t, const char *path, uint32_t depth,
+	    tdu_visit_t fn, void *arg)
+{
+	int stop = 0;
+	size_t i = 0;
+	size_t k = 0;
+	size_t len = 0;
+	size_t nrows = 0;
+	size_t nstack = 0;
+	size_t capstack = TREE_MINSIZE;
+	uint32_t id = 0;
+	uint32_t c = 0;
+	const char *name = NULL;
+	const char *ppath = NULL;
+	void *p = NULL;
+	struct pinfo *r = NULL;
+	struct pinfo *rows = NULL;
+	struct pinfo **order = NULL;
+	struct pending e = {0};
+	struct pending *stack = NULL;
+
+	if (tree_check(t)) {
+		return(EXIT_FAILURE);
+	}
+
+	len = strlen(path);
+	while (len > 1 && path[len-1] == '/') {
+		--len;
+	}
+	if ((id = lookup((struct tree *)t, path, len, 0)) == UINT32_MAX) {
+		errno = ENOENT;
+		return(EXIT_FAILURE);
+	}
+
+	if ((stack = calloc(capstack, sizeof(struct pending))) == NULL) {
+		return(EXIT_FAILURE);
+	}
+	stack[nstack].id = id;
+	++nstack;
+
+	while (nstack > 0) {
+		e = stack[--nstack];
+		if (e.level <= depth) {
+			if (nrows % TREE_MINSIZE == 0) {
+				if ((p = realloc(rows, (nrows + TREE_MINSIZE) *
+						 sizeof(struct pinfo))) == NULL) {
+					goto fail;
+				}
+				rows = p;
+			}
+			r = &rows[nrows];
+			memset(r, 0, sizeof(struct pinfo));
+			r->level = e.level;
+			if (e.level == 0) {
+				r->path = strndup(path, len);
+			} else {
+				ppath = rows[e.row].path;
+				name = t->pool + t->name[e.id];
+				r->path = malloc(strlen(ppath) + strlen(name) + 2);
+				if (r->path != NULL) {
+					sprintf(r->path, "%s%s%s", ppath,
+						ppath[strlen(ppath)-1] == '/' ?
+						"" : "/", name);
+				}
+			}
+			if (r->path == NULL) {
+				goto fail;
+			}
+			e.row = nrows++;
+		}
+
+		r = &rows[e.row];
+		r->total += t->total[e.id];
+		r->greater += t->greater[e.id];
+		r->files += t->files[e.id];
+		r->dirs += t->dirs[e.id];
+		r->links += t->links[e.id];
+		if (t->size != NULL) {
+			for (k = 0; k < TDU_NSIZE; ++k) {
+				r->size[k] += t->size[(size_t)e.id *
+						      TDU_NSIZE + k];
+			}
+		}
+
+		for (c = t->child[e.id]; c != 0; c = t->sibling[c]) {
+			if (nstack == capstack) {
+				if ((p = realloc(stack, 2 * capstack *
+						 sizeof(struct pending))) == NULL) {
+					goto fail;
+				}
+				stack = p;
+				capstack *= 2;
+			}
+			stack[nstack].id = c;
+			stack[nstack].level = e.level > depth ?
+				e.level : e.level + 1;
+			stack[nstack].row = e.row;
+			++nstack;
+		}
+	}
+	free(stack);
+	stack = NULL;
+
+	qsort(rows + 1, nrows - 1, sizeof(struct pinfo), tdu_cmp);
+	if ((order = malloc(nrows * sizeof(struct pinfo *))) == NULL) {
+		goto fail;
+	}
+	for (i = 0; i < nrows; ++i) {
+		order[i] = &rows[i];
+	}
+	if (tdu_rollup(order, nrows)) {
+		free(order);
+		goto fail;
+	}
+	free(order);
+
+	for (i = 0; i < nrows && !stop; ++i) {
+		stop = fn(&rows[i], arg);
+	}
+
+	for (i = 0; i < nrows; ++i) {
+		free(rows[i].path);
+	}
+	free(rows);
+
+	return(stop ? EXIT_FAILURE : EXIT_SUCCESS);
+
+fail:
+	for (i = 0; i < nrows; ++i) {
+		free(rows[i].path);
+	}
+	free(rows);
+	free(stack);
+	errno = ENOMEM;
+
+	return(EXIT_FAILURE);
+}
+
+/**
+ * Report the size of the tree.
+ *
+ * \param[in] t  The tree.
+ **/
+void
+tree_stats(const struct tree *t)
+{
+	size_t bytes = 0;
+
+	bytes = (size_t)t->cap * (7 * sizeof(uint32_t) + 2 * sizeof(uint64_t));
+	if (t->size != NULL) {
+		bytes += (size_t)t->cap * TDU_NSIZE * sizeof(uint32_t);
+	}
+	bytes += t->nslots * sizeof(uint32_t);
+	bytes += t->plcap + t->nnslots * sizeof(uint32_t);
+
+	warnx(_("tree: %u directories, %u names in %zu bytes, "
+		"%zu bytes in all, %.1f per directory"),
+	      t->n, t->nnames, t->plsize, bytes, (double)bytes / t->n);
+}
+
+/**
+ * Grow an array, clearing the new elements.
+ *
+ * \param[in] ptr   The array.
+ * \param[in] size  Size of an element.
+ * \param[in] n     Old number of elements.
+ * \param[in] m     New number of elements.
+ *
+ * \retval ptr   The grown array.
+ * \retval NULL  If there was no memory, ptr is left as it was.
+ **/
+static void *
+grow(void *ptr, size_t size, size_t n, size_t m)
+{
+
+	if ((ptr = realloc(ptr, m * size)) != NULL) {
+		memset((char *)ptr + n * size, 0, (m - n) * size);
+	}
+
+	return(ptr);
+}
+
+/**
+ * Double the room in the arrays of a tree.
+ *
+ * An array grown before a later one fails is kept, it is only larger
+ * than the room recorded.
+ *
+ * \param[in] t  The tree.
+ *
+ * \retval 0 If the arrays were grown.
+ * \retval 1 If there was no memory.
+ **/
+static int32_t
+expand(struct tree *t)
+{
+	void *p = NULL;
+	size_t n = t->cap;
+	size_t m = 2 * n;
+
+	if ((p = grow(t->parent, sizeof(uint32_t), n, m)) == NULL) {
+		return(EXIT_FAILURE);
+	}
+	t->parent = p;
+	if ((p = grow(t->name, sizeof(uint32_t), n, m)) == NULL) {
+		return(EXIT_FAILURE);
+	}
+	t->name = p;
+	if ((p = grow(t->child, sizeof(uint32_t), n, m)) == NULL) {
+		return(EXIT_FAILURE);
+	}
+	t->child = p;
+	if ((p = grow(t->sibling, sizeof(uint32_t), n, m)) == NULL) {
+		return(EXIT_FAILURE);
+	}
+	t->sibling = p;
+	if ((p = grow(t->total, sizeof(uint64_t), n, m)) == NULL) {
+		return(EXIT_FAILURE);
+	}
+	t->total = p;
+	if ((p = grow(t->greater, sizeof(uint64_t), n, m)) == NULL) {
+		return(EXIT_FAILURE);
+	}
+	t->greater = p;
+	if ((p = grow(t->files, sizeof(uint32_t), n, m)) == NULL) {
+		return(EXIT_FAILURE);
+	}
+	t->files = p;
+	if ((p = grow(t->dirs, sizeof(uint32_t), n, m)) == NULL) {
+		return(EXIT_FAILURE);
+	}
+	t->dirs = p;
+	if ((p = grow(t->links, sizeof(uint32_t), n, m)) == NULL) {
+		return(EXIT_FAILURE);
+	}
+	t->links = p;
+	if (t->size != NULL) {
+		if ((p = grow(t->size, TDU_NSIZE * sizeof(uint32_t),
+			      n, m)) == NULL) {
+			return(EXIT_FAILURE);
+		}
+		t->size = p;
+	}
+	t->cap = m;
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Hash a name.
+ *
+ * \param[in] s    The name.
+ * \param[in] len  Length of the name.
+ *
+ * \retval h  The FNV-1a hash of the name.
+ **/
+static uint64_t
+hash(const char *s, size_t len)
+{
+	size_t i = 0;
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (i = 0; i < len; ++i) {
+		h ^= (unsigned char)s[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return(h);
+}
+
+/**
+ * Hash a parent id and name offset.
+ *
+ * \param[in] parent  The parent id.
+ * \param[in] name    The name offset.
+ *
+ * \retval h  The hash.
+ **/
+static uint64_t
+mix(uint32_t parent, uint32_t name)
+{
+	uint64_t h = ((uint64_t)parent << 32) | name;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return(h);
+}
+
+/**
+ * Find the pool offset of a name, adding it to the pool.
+ *
+ * \param[in] t       The tree.
+ * \param[in] s       The name.
+ * \param[in] len     Length of the name.
+ * \param[in] create  Add the name when it is not in the pool.
+ *
+ * \retval off         The offset of the name.
+ * \retval UINT32_MAX  If the name is not in the pool, or it could not
+ *                     be added, when the tree error is set.
+ **/
+static uint32_t
+intern(struct tree *t, const char *s, size_t len, int create)
+{
+	uint32_t i = 0;
+	uint32_t off = 0;
+	uint32_t mask = t->nnslots - 1;
+	size_t cap = t->plcap;
+	char *pool = NULL;
+
+	for (i = hash(s, len) & mask; t->names[i] != 0; i = (i + 1) & mask) {
+		off = t->names[i] - 1;
+		if (memcmp(t->pool + off, s, len) == 0 &&
+		    t->pool[off + len] == '\0') {
+			return(off);
+		}
+	}
+
+	/* After a failure the hashes may be full, so nothing is added */
+	if (!create || t->error != 0) {
+		return(UINT32_MAX);
+	}
+
+	if (t->plsize + len + 1 >= UINT32_MAX) {
+		t->error = EOVERFLOW;
+		return(UINT32_MAX);
+	}
+	if (t->plsize + len + 1 > t->plcap) {
+		while (t->plsize + len + 1 > cap) {
+			cap *= 2;
+		}
+		if ((pool = realloc(t->pool, cap)) == NULL) {
+			t->error = ENOMEM;
+			return(UINT32_MAX);
+		}
+		t->pool = pool;
+		t->plcap = cap;
+	}
+	off = t->plsize;
+	memcpy(t->pool + off, s, len);
+	t->pool[off + len] = '\0';
+	t->plsize += len + 1;
+
+	t->names[i] = off + 1;
+	if (++t->nnames * 2 > t->nnslots) {
+		rehash_names(t);
+	}
+
+	return(off);
+}
+
+/**
+ * Find a child of a directory, adding it to the tree.
+ *
+ * \param[in] t       The tree.
+ * \param[in] parent  The directory.
+ * \param[in] s       Name of the child.
+ * \param[in] len     Length of the name.
+ * \param[in] create  Add the child when it is not in the tree.
+ *
+ * \retval id          The id of the child.
+ * \retval UINT32_MAX  If the child is not in the tree, or it could not
+ *                     be added, when the tree error is set.
+ **/
+static uint32_t
+child(struct tree *t, uint32_t parent, const char *s, size_t len,
+      int create)
+{
+	uint32_t i = 0;
+	uint32_t id = 0;
+	uint32_t name = 0;
+	uint32_t mask = t->nslots - 1;
+
+	if ((name = intern(t, s, len, create)) == UINT32_MAX) {
+		return(UINT32_MAX);
+	}
+
+	for (i = mix(parent, name) & mask; t->slots[i] != 0;
+	     i = (i + 1) & mask) {
+		id = t->slots[i] - 1;
+		if (t->parent[id] == parent && t->name[id] == name) {
+			return(id);
+		}
+	}
+
+	if (!create || t->error != 0) {
+		return(UINT32_MAX);
+	}
+
+	if (t->n == UINT32_MAX - 1) {
+		t->error = EOVERFLOW;
+		return(UINT32_MAX);
+	}
+	if (t->n == t->cap && expand(t)) {
+		t->error = ENOMEM;
+		return(UINT32_MAX);
+	}
+
+	id = t->n++;
+	t->parent[id] = parent;
+	t->name[id] = name;
+	t->sibling[id] = t->child[parent];
+	t->child[parent] = id;
+
+	t->slots[i] = id + 1;
+	if ((uint64_t)t->n * 2 > t->nslots) {
+		rehash(t);
+	}
+
+	return(id);
+}
+
+/**
+ * Find the directory of a path, adding it to the tree.
+ *
+ * Entries arrive grouped by directory, so the last directory found
+ * is remembered, and a path below it is looked up from there.
+ *
+ * \param[in] t       The tree.
+ * \param[in] path    The path.
+ * \param[in] len     Length of the path.
+ * \param[in] create  Add the directories that are not in the tree.
+ *
+ * \retval id          The id of the directory.
+ * \retval UINT32_MAX  If the path is not in the tree.
+ **/
+static uint32_t
+lookup(struct tree *t, const char *path, size_t len, int create)
+{
+	size_t i = 0;
+	size_t j = 0;
+	uint32_t id = 0;
+	char *last = NULL;
+
+	if (len == t->lastlen && t->last != NULL &&
+	    memcmp(path, t->last, len) == 0) {
+		return(t->lastid);
+	}
+
+	if (t->last != NULL && len > t->lastlen && path[t->lastlen] == '/' &&
+	    memcmp(path, t->last, t->lastlen) == 0) {
+		id = t->lastid;
+		i = t->lastlen;
+	} else if (len <= t->plen) {
+		/* The top level path, or a file given as the path */
+		return(len == t->plen && memcmp(path, t->top, len) == 0 ?
+		       0 : create ? 0 : UINT32_MAX);
+	} else if (memcmp(path, t->top, t->plen) != 0 ||
+		   (path[t->plen] != '/' && t->top[t->plen-1] != '/')) {
+		return(create ? 0 : UINT32_MAX);
+	} else {
+		i = t->plen;
+	}
+
+	while (i < len && id != UINT32_MAX) {
+		while (i < len && path[i] == '/') {
+			++i;
+		}
+		for (j = i; j < len && path[j] != '/'; ++j) {
+		}
+		if (j > i) {
+			id = child(t, id, path + i, j - i, create);
+		}
+		i = j;
+	}
+
+	if (create && id != UINT32_MAX) {
+		if (len + 1 > t->lastcap) {
+			/* Without room the next lookup starts from the top */
+			if ((last = realloc(t->last, 2 * (len + 1))) == NULL) {
+				return(id);
+			}
+			t->last = last;
+			t->lastcap = 2 * (len + 1);
+		}
+		memcpy(t->last, path, len);
+		t->lastlen = len;
+		t->lastid = id;
+	}
+
+	return(id);
+}
+
+/**
+ * Grow the child hash.
+ *
+ * Without memory the hash is kept, and the tree error set so that
+ * nothing more is added to it.
+ *
+ * \param[in] t  The tree.
+ **/
+static void
+rehash(struct tree *t)
+{
+	uint32_t i = 0;
+	uint32_t id = 0;
+	uint32_t mask = 0;
+	uint32_t *slots = NULL;
+
+	if ((slots = calloc(2 * (size_t)t->nslots, sizeof(uint32_t))) == NULL) {
+		t->error = ENOMEM;
+		return;
+	}
+	free(t->slots);
+	t->slots = slots;
+	t->nslots *= 2;
+	mask = t->nslots - 1;
+
+	for (id = 1; id < t->n; ++id) {
+		for (i = mix(t->parent[id], t->name[id]) & mask;
+		     t->slots[i] != 0; i = (i + 1) & mask) {
+		}
+		t->slots[i] = id + 1;
+	}
+}
+
+/**
+ * Grow the name hash.
+ *
+ * Without memory the hash is kept, as rehash() does.
+ *
+ * \param[in] t  The tree.
+ **/
+static void
+rehash_names(struct tree *t)
+{
+	uint32_t i = 0;
+	uint32_t mask = 0;
+	uint32_t *names = NULL;
+	size_t off = 0;
+	size_t len = 0;
+
+	if ((names = calloc(2 * (size_t)t->nnslots,
+			    sizeof(uint32_t))) == NULL) {
+		t->error = ENOMEM;
+		return;
+	}
+	free(t->names);
+	t->names = names;
+	t->nnslots *= 2;
+	mask = t->nnslots - 1;
+
+	for (off = 0; off < t->plsize; off += len + 1) {
+		len = strlen(t->pool + off);
+		for (i = hash(t->pool + off, len) & mask; t->names[i] != 0;
+		     i = (i + 1) & mask) {
+		}
+		t->names[i] = off + 1;
+	}
+}
+
+/**
+ * \}
+ **/
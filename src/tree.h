@@ -0,0 +1,76 @@
+/* BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file tree.h
+ * Internal definitions for the full depth directory tree.
+ *
+ * \ingroup tree
+ * \{
+ **/
+
+#ifndef TDU_TREE_H
+#define TDU_TREE_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+struct tree;
+
+/* Create an empty tree below a top level path */
+struct tree *tree_new(const char *, int);
+
+/* Release a tree */
+void tree_free(struct tree *);
+
+/* Select the entry call back that aggregates into the tree */
+entry_t tree_select(const struct tdu_ctx *);
+
+/* Check every entry of a scan was kept in the tree */
+int32_t tree_check(const struct tree *);
+
+/* Render a subtree of the tree at a depth */
+int32_t tree_render(const struct tree *, const char *, uint32_t,
+		    tdu_visit_t, void *);
+
+/* Report the size of the tree */
+void tree_stats(const struct tree *);
+
+#ifdef __cplusplus
+}                               /* extern "C" */
+#endif
+
+#endif                          /* TDU_TREE_H */
+/**
+ * \}
+ **/
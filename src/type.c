@@ -0,0 +1,385 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file type.c
+ * Routines to classify files by type.
+ *
+ * The built in types are a perfect hash generated from types.txt by
+ * gentypes, so a file is classified by looking back from the end of
+ * its name for the extension, packing it into a key and one multiply
+ * and compare, without copying the name. Types added at run time by
+ * tdu_type_load() go in a small open addressed table that is looked
+ * in first.
+ *
+ * \ingroup type
+ * \{
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <err.h>
+#include <pthread.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "type.h"
+#include "typehash.h"
+
+/** Bits of the slots of the table of added extensions and names **/
+#define TYPE_USERBITS   10
+
+/** Slots of the table of added extensions and names **/
+#define TYPE_NUSER      (1 << TYPE_USERBITS)
+
+/**
+ * An added extension or name.
+ **/
+struct user {
+	uint64_t key;          /**< The key, 0 when empty **/
+	uint32_t type;         /**< Its type **/
+};
+
+/* Internal functions */
+static int32_t    load(const char *);
+static uint32_t   lookup(uint64_t);
+static int        numeric(const char *, const char *);
+
+/** Names of the types, the built in ones first **/
+static const char *names[TDU_NTYPE];
+
+/** Number of types **/
+static uint32_t ntype = TYPE_NBUILTIN;
+
+/** Added extensions and names **/
+static struct user *user = NULL;
+
+/** Number of added extensions and names **/
+static uint32_t nuser = 0;
+
+/** Number of scans classifying files **/
+static uint32_t scans = 0;
+
+/** Serialises adding types with starting scans **/
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Add file types from a table.
+ *
+ * The table is read as types.txt is, a type name followed by its
+ * extensions and names on each line. A type may be new or a built in
+ * one, and an extension or name given again takes the latest type.
+ * The types are shared by every context, so they can not be added
+ * while a TDU_F_TYPES scan is running.
+ *
+ * \param[in] path  The table.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set, EBUSY if a
+ *           scan is classifying files.
+ **/
+int32_t
+tdu_type_load(const char *path)
+{
+	int32_t rc = EXIT_FAILURE;
+
+	if (path == NULL) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+
+	pthread_mutex_lock(&lock);
+	if (scans > 0) {
+		errno = EBUSY;
+	} else {
+		rc = load(path);
+	}
+	pthread_mutex_unlock(&lock);
+
+	return(rc);
+}
+
+/**
+ * Count a scan that classifies files in or out.
+ *
+ * A scan is counted in before it reads the types and out once it
+ * has finished, tdu_type_load() fails in between.
+ *
+ * \param[in] sign  1 when the scan starts, -1 when it finishes.
+ **/
+void
+type_scanning(int sign)
+{
+
+	pthread_mutex_lock(&lock);
+	scans += sign;
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Add file types from a table, with no scan running.
+ *
+ * \param[in] path  The table.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+static int32_t
+load(const char *path)
+{
+	size_t line = 0;
+	int32_t t = 0;
+	uint64_t k = 0;
+	uint64_t h = 0;
+	char buf[4096];
+	char *w = NULL;
+	FILE *fp = NULL;
+
+	if (user == NULL &&
+	    (user = calloc(TYPE_NUSER, sizeof(struct user))) == NULL) {
+		return(EXIT_FAILURE);
+	}
+	if ((fp = fopen(path, "r")) == NULL) {
+		return(EXIT_FAILURE);
+	}
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		++line;
+		buf[strcspn(buf, "#\n")] = '\0';
+		if ((w = strtok(buf, " \t")) == NULL) {
+			continue;
+		}
+		if (!type_valid(w)) {
+			warnx(_("%s:%zu: bad type name %s"), path, line, w);
+			goto bad;
+		}
+		if ((t = tdu_type_find(w)) < 0) {
+			if (ntype == TDU_NTYPE) {
+				warnx(_("%s:%zu: more than %d types"), path,
+				      line, TDU_NTYPE - 1);
+				goto bad;
+			}
+			if ((names[ntype] = strdup(w)) == NULL) {
+				fclose(fp);
+				errno = ENOMEM;
+				return(EXIT_FAILURE);
+			}
+			t = ntype++;
+		}
+		while ((w = strtok(NULL, " \t")) != NULL) {
+			if ((k = type_word(w)) == 0) {
+				warnx(_("%s:%zu: can not classify %s"), path,
+				      line, w);
+				goto bad;
+			}
+			h = (k * TYPE_MULT) >> (64 - TYPE_USERBITS);
+			for (; user[h].key != 0 &&
+			     user[h].key != k; h = (h + 1) & (TYPE_NUSER - 1)) {
+			}
+			if (user[h].key == 0) {
+				if (nuser == TYPE_NUSER / 2) {
+					warnx(_("%s:%zu: too many extensions"),
+					      path, line);
+					goto bad;
+				}
+				++nuser;
+			}
+			user[h].key = k;
+			user[h].type = t;
+		}
+	}
+	fclose(fp);
+
+	return(EXIT_SUCCESS);
+
+bad:
+	fclose(fp);
+	errno = EINVAL;
+	return(EXIT_FAILURE);
+}
+
+/**
+ * Number of file types.
+ *
+ * \retval n  The number of types, including type 0.
+ **/
+uint32_t
+tdu_type_count(void)
+{
+
+	return(ntype);
+}
+
+/**
+ * Name of a file type.
+ *
+ * \param[in] t  The type.
+ *
+ * \retval name  The name of the type.
+ * \retval NULL  If there is no such type.
+ **/
+const char *
+tdu_type_name(uint32_t t)
+{
+
+	if (t >= ntype) {
+		return(NULL);
+	}
+
+	return(t < TYPE_NBUILTIN ? type_builtin[t] : names[t]);
+}
+
+/**
+ * Find a file type by name.
+ *
+ * \param[in] name  The name of the type.
+ *
+ * \retval t   The type.
+ * \retval -1  If there is no such type.
+ **/
+int32_t
+tdu_type_find(const char *name)
+{
+	uint32_t t = 0;
+
+	for (t = 0; t < ntype; ++t) {
+		if (strcmp(tdu_type_name(t), name) == 0) {
+			return(t);
+		}
+	}
+
+	return(-1);
+}
+
+/**
+ * Classify a file by its name.
+ *
+ * The extension is looked up, then the whole name if there is none.
+ * A numeric extension, as in core.1234 or run.log.2, is dropped and
+ * the rest of the name looked up again.
+ *
+ * \param[in] fpath  Path of the file.
+ *
+ * \retval t  The type of the file, 0 if it has no other.
+ **/
+uint32_t
+tdu_type_of(const char *fpath)
+{
+	int again = 1;
+	uint32_t t = 0;
+	const char *p = NULL;
+	const char *end = NULL;
+
+	end = fpath + strlen(fpath);
+
+	for (;;) {
+		/* Anything longer than a key is of no type */
+		for (p = end; p > fpath && p[-1] != '.' && p[-1] != '/'; --p) {
+			if (end - p == TYPE_MAXLEN) {
+				return(0);
+			}
+		}
+		if (p == fpath || p[-1] == '/') {
+			return(lookup(type_key(p, end - p, TYPE_NAME)));
+		}
+		if ((t = lookup(type_key(p, end - p, TYPE_EXT))) != 0 ||
+		    !again || !numeric(p, end)) {
+			return(t);
+		}
+		again = 0;
+		end = p - 1;
+	}
+}
+
+/**
+ * Look a key up, the added extensions and names first.
+ *
+ * \param[in] k  The key.
+ *
+ * \retval t  Its type, 0 if it has none.
+ **/
+static uint32_t
+lookup(uint64_t k)
+{
+	uint64_t h = 0;
+
+	if (nuser > 0) {
+		h = (k * TYPE_MULT) >> (64 - TYPE_USERBITS);
+		for (; user[h].key != 0; h = (h + 1) & (TYPE_NUSER - 1)) {
+			if (user[h].key == k) {
+				return(user[h].type);
+			}
+		}
+	}
+
+	h = (k * TYPE_MULT) >> (64 - TYPE_BITS);
+	return(type_keys[h] == k ? type_types[h] : 0);
+}
+
+/**
+ * Check that a part of a name is a number.
+ *
+ * \param[in] p    Start of the part.
+ * \param[in] end  End of the part.
+ *
+ * \retval 1 If it is all digits.
+ * \retval 0 Otherwise.
+ **/
+static int
+numeric(const char *p, const char *end)
+{
+
+	for (; p < end; ++p) {
+		if (!isdigit((unsigned char)*p)) {
+			return(0);
+		}
+	}
+
+	return(1);
+}
+
+/**
+ * \}
+ **/
@@ -0,0 +1,149 @@
+/* BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file type.h
+ * Internal definitions for classifying files by type.
+ *
+ * \ingroup type
+ * \{
+ **/
+
+#ifndef TDU_TYPE_H
+#define TDU_TYPE_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** Longest extension or name that can be classified **/
+#define TYPE_MAXLEN     8
+
+/** Key tag of an extension **/
+#define TYPE_EXT        1
+
+/** Key tag of a whole name **/
+#define TYPE_NAME       2
+
+/**
+ * Key of an extension or a whole name.
+ *
+ * Up to eight ASCII characters are packed seven bits each below the
+ * tag, with letters folded to lower case, so a key is never 0.
+ *
+ * \param[in] s    The extension, without the dot, or the name.
+ * \param[in] n    Length of s.
+ * \param[in] tag  TYPE_EXT or TYPE_NAME.
+ *
+ * \retval key  The key.
+ * \retval 0    If s is empty, too long or not ASCII.
+ **/
+static inline uint64_t
+type_key(const char *s, size_t n, uint64_t tag)
+{
+	size_t i = 0;
+	uint64_t k = 0;
+	unsigned char c = 0;
+
+	if (n == 0 || n > TYPE_MAXLEN) {
+		return(0);
+	}
+	for (i = 0; i < n; ++i) {
+		c = (unsigned char)s[i];
+		if (c >= 0x80) {
+			return(0);
+		}
+		if (c >= 'A' && c <= 'Z') {
+			c |= 0x20;
+		}
+		k = (k << 7) | c;
+	}
+
+	return(k | (tag << 56));
+}
+
+/**
+ * Key of a word of a type table, .ext for an extension or a name.
+ *
+ * \param[in] w  The word.
+ *
+ * \retval key  The key.
+ * \retval 0    If the word can not be classified.
+ **/
+static inline uint64_t
+type_word(const char *w)
+{
+
+	if (w[0] == '.') {
+		return(type_key(w + 1, strlen(w + 1), TYPE_EXT));
+	}
+
+	return(type_key(w, strlen(w), TYPE_NAME));
+}
+
+/**
+ * Check a type name can be written into any report.
+ *
+ * \param[in] name  The type name.
+ *
+ * \retval 1 If it is made of letters, digits, - and _.
+ * \retval 0 Otherwise.
+ **/
+static inline int
+type_valid(const char *name)
+{
+	size_t i = 0;
+
+	for (i = 0; name[i] != '\0'; ++i) {
+		if (!isalnum((unsigned char)name[i]) &&
+		    name[i] != '-' && name[i] != '_') {
+			return(0);
+		}
+	}
+
+	return(i > 0);
+}
+
+/* Classify a file by its name */
+uint32_t tdu_type_of(const char *);
+
+/* Count a scan that classifies files in or out */
+void type_scanning(int);
+
+#ifdef __cplusplus
+}                               /* extern "C" */
+#endif
+
+#endif                          /* TDU_TYPE_H */
+/**
+ * \}
+ **/
@@ -44,17 +44,17 @@
 #include <stdint.h>
 #include <ftw.h>
 #include <err.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <poll.h>
 #include <time.h>
-#include <sysexits.h>
 #include <string.h>
+#include <ctype.h>
 #include <search.h>
 #include <unistd.h>
 #include <libgen.h>
-#include <sysexits.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -62,52 +62,107 @@
 
 #include "gettext.h"
 #include "defs.h"
-#include "extern.h"
-#include "mem.h"
+#include "tdu.h"
 #include "walk.h"
+#include "watch.h"
+#include "emit.h"
+#include "tree.h"
+#include "type.h"
+#include "trace.h"
+#include "export.h"
+#include "agent.h"
+#include "spill.h"
+#include "dups.h"
+#include "compress.h"
+#include "where.h"
 
 
 /* Internal functions */
-static void       action(const void *, VISIT, int);
-static int        cmp(const void *, const void *);
 static int        dir_size(const char *, const struct stat *, int, struct FTW *);
 static uint64_t   max_openfds(void);
 static char      *pabs(const char *);
-static char      *pname(const char *, int);
-static char      *ppath(const char *, uint32_t);
-static int        summary(void);
-static char      *tformat(uint64_t);
+static char      *pname(struct tdu_ctx *, const char *, int);
 
-/* Tree root node */
-void *root = NULL;
+/*
+ * nftw() has no user data argument, so the context being walked
+ * by the calling thread is handed to the call back through here.
+ */
+static __thread struct tdu_ctx *wctx = NULL;
 
 /**
  * Walk a file system
  *
+ * \param[in] ctx  The scan context.
+ *
  * \retval 0 If there were no errors.
  * \retval 1 If an error was encounted.
  **/
 int32_t
-walk()
+tdu_walk(struct tdu_ctx *ctx)
 {
 
+	int rc = 0;                     /**< nftw() return code **/
 	uint64_t nopenfd = 0;           /**< Max open files **/
-	char *adir = NULL;              /**< Absolute path **/
 
-	if ((nopenfd = max_openfds()) <= 0) {
+	if ((nopenfd = max_openfds()) == 0 || nopenfd == (uint64_t)-1) {
+		return(EXIT_FAILURE);
+	}
+
+	if ((ctx->now = time(NULL)) == (time_t)-1) {
 		return(EXIT_FAILURE);
 	}
 
-	if (nftw(options.path, dir_size, nopenfd, FTW_PHYS|FTW_MOUNT) != 0) {
-		warnx(_("walking %s failed."), options.path);
+	/* A combination of features no call back supports */
+	if ((ctx->entry = entry_select(ctx)) == NULL) {
+		errno = EINVAL;
 		return(EXIT_FAILURE);
 	}
+	ctx->observe = tdu_observing(ctx);
+	if (ctx->trace != NULL) {
+		trace_begin(ctx);
+	}
+	if (ctx->export != NULL) {
+		export_begin(ctx);
+	}
+	if (ctx->agent != NULL) {
+		agent_begin(ctx);
+	}
+
+	/* Walk with several threads when asked to */
+	if (ctx->opts.jobs > 0) {
+		return(tdu_pwalk(ctx));
+	}
+
+	wctx = ctx;
+	rc = nftw(ctx->opts.path, dir_size, nopenfd,
+		  (ctx->opts.flags & TDU_F_MOUNTS) ? FTW_PHYS : FTW_PHYS|FTW_MOUNT);
+	wctx = NULL;
 
-	summary();
+	if (rc != 0) {
+		return(EXIT_FAILURE);
+	}
 
 	return(EXIT_SUCCESS);
 }
 
+/**
+ * Record the first failure of a scan.
+ *
+ * A call back can not stop the walk, so the entry it failed on is
+ * left out and the scan fails once it is done.
+ *
+ * \param[in] ctx    The scan context.
+ * \param[in] error  The errno of the failure.
+ **/
+void
+tdu_fail(struct tdu_ctx *ctx, int error)
+{
+
+	if (ctx->error == 0) {
+		ctx->error = error;
+	}
+}
+
 /**
  * Calculte the maximum number of open file discriptors.
  *
@@ -128,7 +183,7 @@ max_openfds(void)
 	}
 
 	/* find out how many files are currently open */
-	if ((fds = xmalloc(rlp.rlim_cur * sizeof(struct pollfd))) == NULL) {
+	if ((fds = malloc(rlp.rlim_cur * sizeof(struct pollfd))) == NULL) {
 		warnx(_("unable to allocate polling file descriptors"));
 		return(-1);
 	}
@@ -168,287 +223,583 @@ max_openfds(void)
 static int
 dir_size(const char *fpath, const struct stat *sb, int tflag, struct FTW *ftwbuf)
 {
-	struct pinfo *cur = NULL;
-	struct pinfo **ptr = NULL;
-
-	cur = xmalloc(sizeof(struct pinfo));
-
-	cur->path = pname(fpath, tflag);
-	cur->level = -1;
 
-	ptr = tsearch(cur, &root, cmp);
-	(*ptr)->total += sb->st_size;
-	if ((*ptr)->level == -1) {
-		(*ptr)->level = ftwbuf->level;
-	}
-
-	if (difftime(sb->st_atime, options.atime) < 0.0) {
-		(*ptr)->greater += sb->st_size;
+	if (wctx->observe) {
+		tdu_observe(wctx, fpath, sb, tflag, ftwbuf->level);
 	}
+	wctx->entry(wctx, fpath, sb, tflag, ftwbuf->level);
 
 	return(EXIT_SUCCESS);
 }
 
 /**
- * Absolute path
+ * Add an entry to the counters of a tree node.
  *
- * Figure out the absolute path name when given a relative path.
+ * Written without branches on the entry, so the type and age of
+ * entries in a directory do not defeat branch prediction. When ages
+ * is a constant the histogram code is removed if it is off.
  *
- * \param[in] rel The relative path name.
+ * \param[in] ctx    The scan context.
+ * \param[in] n      The tree node.
+ * \param[in] mode   Mode of the entry.
+ * \param[in] size   Size of the entry in bytes.
+ * \param[in] atime  Last access time of the entry.
+ * \param[in] isold  1 if the entry is old.
+ * \param[in] sign   1 to add the entry, -1 to remove it.
+ * \param[in] ages   Keep the access age histogram.
+ **/
+static inline void
+tally(struct tdu_ctx *ctx, struct pinfo *n, mode_t mode, uint64_t size,
+      time_t atime, int isold, int sign, int ages)
+{
+	uint64_t isreg = S_ISREG(mode);
+	uint64_t old = -(uint64_t)isold;
+	uint32_t days = 0;
+
+	n->total += sign * size;
+	n->greater += sign * (size & old);
+	n->files += sign * isreg;
+	n->dirs += sign * (uint64_t)S_ISDIR(mode);
+	n->links += sign * (uint64_t)S_ISLNK(mode);
+	n->size[tdu_size_bucket(size) & -isreg] += sign * isreg;
+
+	if (ages) {
+		days = atime < ctx->now ?
+			(ctx->now - atime) / SECONDS_IN_DAY : 0;
+		n->age[tdu_age_bucket(days)] += sign * size;
+	}
+}
+
+/**
+ * Aggregate an entry found by a walk.
  *
- * \retval abs The absolute path name.
+ * Expanded once for each combination of the features that cost work
+ * per entry, which are constants within each expansion.
+ *
+ * \param[in] ctx    The scan context.
+ * \param[in] fpath  Name of the entry.
+ * \param[in] sb     Stat buffer of the entry.
+ * \param[in] tflag  File type flags.
+ * \param[in] level  Level of the entry below the top level path.
+ * \param[in] ages   Keep the access age histogram.
+ * \param[in] watch  Record the entry for watching.
+ * \param[in] emit   List the entry if it is a cold file.
+ * \param[in] types  Break regular files down by type.
  **/
-static char *
-pabs(const char *rel)
+static inline void
+aggregate(struct tdu_ctx *ctx, const char *fpath, const struct stat *sb,
+	  int tflag, int level, int ages, int watch, int emit, int types)
 {
+	uint32_t t = 0;
+	int old = tdu_is_old(ctx, fpath, sb, level);
+	struct pinfo *n = NULL;
 
-	size_t bsize = 0;
-	char *buf = NULL;
-	struct stat sbuf = {0};
+	if ((n = tdu_node(ctx, fpath, tflag, level)) == NULL) {
+		return;
+	}
+	tally(ctx, n, sb->st_mode, sb->st_size, sb->st_atime, old, 1, ages);
 
-	/* make sure we were given a relative path */
-	if (rel == NULL) {
-		return(NULL);
+	if (types && S_ISREG(sb->st_mode)) {
+		t = tdu_type_of(fpath);
+		n->type_total[t] += sb->st_size;
+		n->type_greater[t] += sb->st_size & -(uint64_t)old;
 	}
 
-	/* make sure relative path actually exists */
-	if (stat(rel, &sbuf) < 0) {
-		errx(EX_IOERR, _("unable to stat %s"), rel);
+	if (watch) {
+		watch_record(ctx, fpath, sb, n);
 	}
 
-	bsize = pathconf(".", _PC_PATH_MAX);
-	buf = (char *)xmalloc((bsize + 1) * sizeof(char));
+	if (emit && S_ISREG(sb->st_mode) && old) {
+		emit_file(ctx->emit, fpath, sb->st_size);
+	}
+}
 
-	/* find the absolute path */
-	if (realpath(rel, buf) == NULL) {
-		errx(EX_IOERR, _("unable to resolve %s an error occurred at %s"),
-		     rel, buf);
+#define ENTRY(name, ages, watch, emit, types)                           \
+static void                                                             \
+name(struct tdu_ctx *ctx, const char *fpath, const struct stat *sb,     \
+     int tflag, int level)                                              \
+{                                                                       \
+	aggregate(ctx, fpath, sb, tflag, level,                         \
+		  ages, watch, emit, types);                            \
+}
+
+ENTRY(entry_plain, 0, 0, 0, 0)
+ENTRY(entry_a,     1, 0, 0, 0)
+ENTRY(entry_w,     0, 1, 0, 0)
+ENTRY(entry_aw,    1, 1, 0, 0)
+ENTRY(entry_e,     0, 0, 1, 0)
+ENTRY(entry_ae,    1, 0, 1, 0)
+ENTRY(entry_we,    0, 1, 1, 0)
+ENTRY(entry_awe,   1, 1, 1, 0)
+ENTRY(entry_ty,    0, 0, 0, 1)
+ENTRY(entry_at,    1, 0, 0, 1)
+ENTRY(entry_et,    0, 0, 1, 1)
+ENTRY(entry_aet,   1, 0, 1, 1)
+
+/**
+ * Select the entry call back for the features of a scan.
+ *
+ * Types are not kept while watching, as a removal could not take the
+ * bytes back out of its type, and tdu_watch() refuses them.
+ *
+ * \param[in] ctx  The scan context.
+ *
+ * \retval fn    The call back.
+ * \retval NULL  If no call back supports the features.
+ **/
+entry_t
+entry_select(const struct tdu_ctx *ctx)
+{
+	static const entry_t entries[16] = {
+		entry_plain, entry_a, entry_w, entry_aw,
+		entry_e, entry_ae, entry_we, entry_awe,
+		entry_ty, entry_at, NULL, NULL,
+		entry_et, entry_aet, NULL, NULL
+	};
+
+	if (ctx->tree != NULL) {
+		return(tree_select(ctx));
 	}
 
-	return(buf);
+	return(entries[((ctx->opts.flags & TDU_F_AGES) ? 1 : 0) |
+		       (ctx->watch != NULL ? 2 : 0) |
+		       (ctx->emit != NULL ? 4 : 0) |
+		       ((ctx->opts.flags & TDU_F_TYPES) ? 8 : 0)]);
 }
 
 /**
- * Path name.
+ * Find or create the tree node an entry is aggregated under.
  *
- * Truncate a full path name down to the options
- * maxdepth path length.
+ * The level of a node follows from its path alone, so entries may be
+ * aggregated in any order.
  *
- * \param[in] path   The full path name
- * \param[in] tflag  The path type flag
- * \retval    str    The truncated path
+ * \param[in] ctx    The scan context.
+ * \param[in] fpath  Name of the entry.
+ * \param[in] tflag  File type flags.
+ * \param[in] level  Level of the entry below the top level path.
+ *
+ * \retval n     The tree node.
+ * \retval NULL  If there was no memory for it, the scan fails with
+ *               ENOMEM.
  **/
-static char *
-pname(const char *path, int tflag)
+struct pinfo *
+tdu_node(struct tdu_ctx *ctx, const char *fpath, int tflag, int level)
 {
-	int i = 0;
-	int j = 0;
-	int n = 0;
-	static int m = 0;
-	char *tmp = NULL;
-	char *dir = NULL;
-	char *str = NULL;
+	struct pinfo key = {0};
+	struct pinfo *cur = NULL;
+	struct pinfo **ptr = NULL;
 
-	if (m == 0) {
-		m = strlen(options.path);
+	if ((key.path = pname(ctx, fpath, tflag)) == NULL) {
+		tdu_fail(ctx, ENOMEM);
+		return(NULL);
 	}
 
-	tmp = strdup(path);
-	if (tflag == FTW_F || tflag == FTW_SL) {
-		dir = dirname(tmp);
-	} else {
-		dir = tmp;
+	/* Entries of a directory mostly arrive together */
+	if (ctx->last != NULL && strcmp(ctx->last->path, key.path) == 0) {
+		return(ctx->last);
+	}
+	if ((ptr = tfind(&key, &ctx->root, tdu_cmp)) != NULL) {
+		ctx->last = *ptr;
+		return(*ptr);
 	}
 
-	n = strlen(dir);
-	if (dir[n-1] == '/') {
-		dir[n-1] = '\0';
+	if (ctx->spill != NULL) {
+		spill_check(ctx, strlen(key.path));
 	}
+	if ((cur = calloc(1, sizeof(struct pinfo))) == NULL ||
+	    (cur->path = strdup(key.path)) == NULL ||
+	    (ptr = tsearch(cur, &ctx->root, tdu_cmp)) == NULL) {
+		if (cur != NULL) {
+			free(cur->path);
+			free(cur);
+		}
+		tdu_fail(ctx, ENOMEM);
+		return(NULL);
+	}
+	cur->level = -1;
 
-	for (i = m; i < n; ++i) {
-		if (dir[i] == '/') {
-			++j;
+	if ((*ptr)->level == -1) {
+		/* Files are aggregated under their directory */
+		if (tflag == FTW_F || tflag == FTW_SL) {
+			--level;
 		}
-		if (j > options.maxdepth) {
-			break;
+		if (level > (int)ctx->opts.maxdepth) {
+			level = ctx->opts.maxdepth;
 		}
+		(*ptr)->level = level > 0 ? level : 0;
 	}
+	ctx->last = *ptr;
+
+	return(*ptr);
+}
+
+/**
+ * Account an entry to a tree node.
+ *
+ * \param[in] ctx    The scan context.
+ * \param[in] n      The tree node.
+ * \param[in] mode   Mode of the entry.
+ * \param[in] size   Size of the entry in bytes.
+ * \param[in] atime  Last access time of the entry.
+ * \param[in] sign   1 to add the entry, -1 to remove an entry that
+ *                   was previously accounted.
+ **/
+void
+tdu_account(struct tdu_ctx *ctx, struct pinfo *n, mode_t mode,
+	    uint64_t size, time_t atime, int sign)
+{
 
+	tally(ctx, n, mode, size, atime, atime < ctx->opts.atime, sign,
+	      (ctx->opts.flags & TDU_F_AGES) != 0);
+}
 
-	str = xmalloc((i+1)*sizeof(char));
-	strncpy(str, dir, i);
+/**
+ * Whether an entry counts as old.
+ *
+ * An entry is old when it was last accessed before the access time
+ * window, or when it matches the expression of tdu_where().
+ *
+ * \param[in] ctx    The scan context.
+ * \param[in] fpath  Name of the entry.
+ * \param[in] sb     Stat buffer of the entry.
+ * \param[in] level  Level of the entry below the top level path.
+ *
+ * \retval 1 If it is old.
+ * \retval 0 Otherwise.
+ **/
+int
+tdu_is_old(const struct tdu_ctx *ctx, const char *fpath,
+	   const struct stat *sb, int level)
+{
 
-	if (tmp != NULL) {
-		free(tmp);
-		tmp = NULL;
+	if (ctx->where != NULL) {
+		return(where_match(ctx->where, fpath, sb, level, ctx->now));
 	}
 
-	return(str);
+	return(sb->st_atime < ctx->opts.atime);
 }
 
 /**
- * Binary tree comparison routine.
+ * Add the counters of a node aggregated elsewhere into a context.
  *
- * This uses strcmp on the struct pinfo path entry.
+ * The counters are integers, so nodes may be merged in any order and
+ * still give what a single walk would have.
  *
- * \param[in] a  Tree node a.
- * \param[in] b  Tree node b.
+ * \param[in] ctx   The scan context.
+ * \param[in] from  The node to add, which is not changed.
+ **/
+void
+tdu_merge(struct tdu_ctx *ctx, const struct pinfo *from)
+{
+
+	struct pinfo *n = NULL;
+
+	/* The path is already that of a node, at its level */
+	if ((n = tdu_node(ctx, from->path, FTW_D, from->level)) != NULL) {
+		tdu_node_add(n, from);
+	}
+}
+
+/**
+ * Add the counters of a node into another of the same path.
  *
- * \retval   Integer greater than, equal to, or less than 0.
+ * \param[in,out] n     The node added to.
+ * \param[in]     from  The node to add.
  **/
-static int
-cmp(const void *a, const void *b)
+void
+tdu_node_add(struct pinfo *n, const struct pinfo *from)
 {
-	struct pinfo *x = (struct pinfo *)a;
-	struct pinfo *y = (struct pinfo *)b;
+	uint32_t i = 0;
+
+	n->total += from->total;
+	n->greater += from->greater;
+	n->files += from->files;
+	n->dirs += from->dirs;
+	n->links += from->links;
+	n->dup += from->dup;
+	n->comp_bytes += from->comp_bytes;
+	n->comp_total += from->comp_total;
+	n->comp_low += from->comp_low;
+	n->comp_high += from->comp_high;
+	n->comp_samples += from->comp_samples;
+	for (i = 0; i < TDU_NAGE; ++i) {
+		n->age[i] += from->age[i];
+	}
+	for (i = 0; i < TDU_NSIZE; ++i) {
+		n->size[i] += from->size[i];
+	}
+	for (i = 0; i < TDU_NTYPE; ++i) {
+		n->type_total[i] += from->type_total[i];
+		n->type_greater[i] += from->type_greater[i];
+	}
+}
 
-	return(strcmp(x->path, y->path));
+/**
+ * Release a tree node.
+ *
+ * \param[in] node  The node to release.
+ **/
+static void
+release(void *node)
+{
+	struct pinfo *n = node;
+
+	free(n->path);
+	free(n);
 }
 
 /**
- * Walk the binary tree printing a summary.
+ * Release every node of a tree.
  *
- * \retval 0 If there were no errors.
- * \retval 1 If an error was encounted.
+ * \param[in,out] root  The root of the tree, left empty.
  **/
-static int32_t
-summary(void)
+void
+tdu_nodes_free(void **root)
 {
-	struct pinfo *cur = NULL;
-	struct pinfo **ptr = NULL;
 
-	if (options.cost > 0.0) {
-		printf(ngettext("Cost [$]       >%d day[%%]     Directory\n",
-				"Cost [$]       >%d days[%%]    Directory\n",
-				options.atime_days),
-		       options.atime_days);
-	} else {
-		printf(ngettext("Size [%s]      >%d day[%%]     Directory\n",
-				"Size [%s]      >%d days[%%]    Directory\n",
-				options.atime_days),
-		       options.units, options.atime_days);
+#if HAVE_TDESTROY
+	tdestroy(*root, release);
+	*root = NULL;
+#else
+	struct pinfo *n = NULL;
+
+	while (*root != NULL) {
+		n = *(struct pinfo **)*root;
+		tdelete(n, root, tdu_cmp);
+		release(n);
 	}
+#endif /* HAVE_TDESTROY */
+}
 
-	cur = xmalloc(sizeof(struct pinfo));
-	cur->path = options.path;
+/**
+ * Check if the entries of a scan need to be passed to tdu_observe().
+ *
+ * \param[in] ctx  The scan context.
+ *
+ * \retval 1 If they do.
+ * \retval 0 Otherwise.
+ **/
+int
+tdu_observing(const struct tdu_ctx *ctx)
+{
 
-	ptr = tfind(cur, &root, cmp);
-	action((void *)ptr, postorder, 0);
-	tdelete(cur, &root, cmp);
+	return((ctx->opts.flags & TDU_F_MOUNTS) || ctx->trace != NULL ||
+	       ctx->dups != NULL || ctx->compress != NULL ||
+	       ctx->export != NULL || ctx->agent != NULL);
+}
 
-	twalk(root, action);
+/**
+ * Pass an entry to what sees every entry, whatever its depth.
+ *
+ * \param[in] ctx    The scan context.
+ * \param[in] fpath  Name of the entry.
+ * \param[in] sb     Stat buffer of the entry.
+ * \param[in] tflag  File type flags.
+ * \param[in] level  Level of the entry below the top level path.
+ **/
+void
+tdu_observe(struct tdu_ctx *ctx, const char *fpath, const struct stat *sb,
+	    int tflag, int level)
+{
 
-	return(EXIT_SUCCESS);
+	if (ctx->opts.flags & TDU_F_MOUNTS) {
+		mount_account(ctx, fpath, sb, level);
+	}
+	if (ctx->trace != NULL) {
+		trace_record(ctx, fpath, sb, tflag, level);
+	}
+	if (ctx->export != NULL) {
+		export_record(ctx, fpath, sb, tflag, level);
+	}
+	if (ctx->dups != NULL && tflag == FTW_F) {
+		dups_file(ctx, fpath, sb, level);
+	}
+	if (ctx->compress != NULL && tflag == FTW_F) {
+		compress_file(ctx, fpath, sb, level);
+	}
+	if (ctx->agent != NULL) {
+		agent_observe(ctx);
+	}
 }
 
 /**
- * Action to be taken for each tree element.
+ * Account an entry to the file system it is on.
  *
- * \param[in] node  The current node.
- * \param[in] v     The traversal type.
- * \param[in] level The current node level.
+ * A file system is known by the path of the first entry found on it,
+ * replaced by any shorter directory, as the threaded walk may find
+ * entries below a mount point before the mount point itself.
  *
- * \retval 0 If there were no errors.
- * \retval 1 If an error was encounted.
- */
-static void
-action(const void *node, VISIT v, int level)
+ * \param[in] ctx    The scan context.
+ * \param[in] fpath  Name of the entry.
+ * \param[in] sb     Stat buffer of the entry.
+ * \param[in] level  Level of the entry below the top level path.
+ **/
+void
+mount_account(struct tdu_ctx *ctx, const char *fpath, const struct stat *sb,
+	      int level)
 {
-	struct pinfo *n = *(struct pinfo * const *)node;
-	int i = 0;
-	float size = 0.0;
-	float percentage = 0.0;
-	static size_t scale = 0;
+	size_t i = ctx->mlast;
 	char *path = NULL;
+	struct mount *m = NULL;
+	struct mount *mounts = NULL;
 
-	if (scale == 0) {
-		switch (options.units[0]) {
-			case 'k':
-				scale = kB;
-				break;
-			case 'M':
-				scale = MB;
-				break;
-			case 'G':
-				scale = GB;
-				break;
-			case 'T':
-				scale = TB;
-				break;
-			case 'P':
-				scale = PB;
-				break;
-			case 'E':
-				scale = EB;
+	if (i >= ctx->nmounts || ctx->mounts[i].dev != sb->st_dev) {
+		for (i = 0; i < ctx->nmounts; ++i) {
+			if (ctx->mounts[i].dev == sb->st_dev) {
 				break;
+			}
 		}
+		if (i == ctx->nmounts) {
+			if (ctx->nmounts % 16 == 0) {
+				if ((mounts = realloc(ctx->mounts,
+				    (ctx->nmounts + 16) *
+				    sizeof(struct mount))) == NULL) {
+					tdu_fail(ctx, ENOMEM);
+					return;
+				}
+				ctx->mounts = mounts;
+			}
+			if ((path = strdup(fpath)) == NULL) {
+				tdu_fail(ctx, ENOMEM);
+				return;
+			}
+			memset(&ctx->mounts[i], 0, sizeof(struct mount));
+			ctx->mounts[i].dev = sb->st_dev;
+			ctx->mounts[i].usage.path = path;
+			++ctx->nmounts;
+		}
+		ctx->mlast = i;
 	}
+	m = &ctx->mounts[i];
 
-	if (v == postorder || v == leaf) {
+	if (S_ISDIR(sb->st_mode) && strlen(fpath) < strlen(m->usage.path) &&
+	    (path = strdup(fpath)) != NULL) {
+		free(m->usage.path);
+		m->usage.path = path;
+	}
 
-		size = (float)n->greater / (float)scale;
-		/* Cost overrides size */
-		if (options.cost > 0.0) {
-			size *=  options.cost * options.atime_days;
-		}
-		percentage = (float)(n->greater / (float)n->total) * 100.0;
-		path = ppath(n->path, n->level);
+	tally(ctx, &m->usage, sb->st_mode, sb->st_size, sb->st_atime,
+	      tdu_is_old(ctx, fpath, sb, level), 1,
+	      (ctx->opts.flags & TDU_F_AGES) != 0);
+}
+
+/**
+ * Absolute path
+ *
+ * Figure out the absolute path name when given a relative path.
+ *
+ * \param[in] rel The relative path name.
+ *
+ * \retval abs   The absolute path name.
+ * \retval NULL  If it could not be resolved, errno is set.
+ **/
+static char *
+pabs(const char *rel)
+{
+
+	size_t bsize = 0;
+	char *buf = NULL;
+	struct stat sbuf = {0};
+
+	/* make sure we were given a relative path */
+	if (rel == NULL) {
+		return(NULL);
+	}
 
-		printf(_("%12.2f  %12.0f    %s\n"),
-		       size, percentage, path);
+	/* make sure relative path actually exists */
+	if (stat(rel, &sbuf) < 0) {
+		return(NULL);
+	}
+
+	bsize = pathconf(".", _PC_PATH_MAX);
+	if ((buf = malloc((bsize + 1) * sizeof(char))) == NULL) {
+		return(NULL);
+	}
 
+	/* find the absolute path */
+	if (realpath(rel, buf) == NULL) {
+		free(buf);
+		return(NULL);
 	}
 
+	return(buf);
 }
 
 /**
- * Pretty print a path.
+ * Path name.
  *
- * \param[in] path     The path to print.
- * \param[in] level    The path level under the top-level.
- * \param[out] ppath   The pretty printed path.
- * \param[out] pad     The amount of extra padding added.
+ * Truncate a full path name down to the options
+ * maxdepth path length.
  *
- * \retval 0 If there were no errors.
- * \retval 1 If an error was encounted.
+ * \param[in] ctx    The scan context.
+ * \param[in] path   The full path name
+ * \param[in] tflag  The path type flag
+ * \retval    str    The truncated path, valid until the next call
+ * \retval    NULL   If there was no memory for it
  **/
 static char *
-ppath(const char *path, uint32_t level)
+pname(struct tdu_ctx *ctx, const char *path, int tflag)
 {
-	uint32_t n = 0;
-	size_t bsize = 0;
-	const char indent[] = u8"│  ";
-	const char tofile[] = u8"├──";
-	const char last[]   = u8"└──";
-	char *ptr = NULL;
-	static char *tmp = NULL;
+	int i = 0;
+	int j = 0;
+	int n = 0;
+	int m = ctx->plen;
+	char *dir = NULL;
+	char *buf = NULL;
 
+	/* Only a node that is created needs a copy of its own */
+	n = strlen(path) + 1;
+	if ((size_t)n > ctx->pbufsize) {
+		if ((buf = realloc(ctx->pbuf, n * 2)) == NULL) {
+			return(NULL);
+		}
+		ctx->pbuf = buf;
+		ctx->pbufsize = n * 2;
+	}
+	memcpy(ctx->pbuf, path, n);
 
-	bsize = pathconf(".", _PC_PATH_MAX);
-	if (tmp == NULL) {
-		tmp = xmalloc(bsize);
+	if (tflag == FTW_F || tflag == FTW_SL) {
+		dir = dirname(ctx->pbuf);
 	} else {
-		memset(tmp, 0, bsize);
+		dir = ctx->pbuf;
 	}
 
-	if (level == 0) {
-		strcpy(tmp, path);
-		return(tmp);
+	n = strlen(dir);
+	if (dir[n-1] == '/') {
+		dir[n-1] = '\0';
 	}
 
-	for (n = 1; n < level; ++n) {
-		strcat(tmp, indent);
+	for (i = m; i < n; ++i) {
+		if (dir[i] == '/') {
+			++j;
+		}
+		if (j > ctx->opts.maxdepth) {
+			break;
+		}
 	}
 
-	strcat(tmp, tofile);
+	if (i < n) {
+		dir[i] = '\0';
+	}
 
-	ptr = strdup(path);
-	strcat(tmp, basename(ptr));
+	return(dir);
+}
 
-	if (ptr != NULL) {
-		free(ptr);
-		ptr = NULL;
-	}
+/**
+ * Binary tree comparison routine.
+ *
+ * This uses strcmp on the struct pinfo path entry.
+ *
+ * \param[in] a  Tree node a.
+ * \param[in] b  Tree node b.
+ *
+ * \retval   Integer greater than, equal to, or less than 0.
+ **/
+int
+tdu_cmp(const void *a, const void *b)
+{
+	struct pinfo *x = (struct pinfo *)a;
+	struct pinfo *y = (struct pinfo *)b;
 
-	return(tmp);
+	return(strcmp(x->path, y->path));
 }
@@ -45,18 +45,100 @@ extern "C"
 {
 #endif
 
+struct stat;
+
+/**
+ * Call back aggregating an entry found by a walk.
+ **/
+typedef void (*entry_t)(struct tdu_ctx *, const char *, const struct stat *,
+			int, int);
+
+struct kbatch;
+struct kedges;
+
 /**
- * Structure store the toplevel path and sizes.
+ * Usage of a file system found by a scan crossing mounts.
  **/
-struct pinfo {
-	int level;             /**< The path level **/
-	uint64_t greater;      /**< Bytes that are older than atime **/
-	uint64_t total;        /**< Total number of bytes in the path **/
-	char *path;            /**< Path string **/
+struct mount {
+	dev_t dev;             /**< The device **/
+	struct pinfo usage;    /**< Its usage, the path is where it is mounted **/
+};
+
+/**
+ * Scan context.
+ **/
+struct tdu_ctx {
+	struct tdu_opts opts;  /**< Scan options **/
+	size_t plen;           /**< Length of the top level path **/
+	time_t now;            /**< Time the scan started **/
+	void *root;            /**< Tree root node **/
+	struct watch *watch;   /**< Change watching state **/
+	struct emit *emit;     /**< Cold file list of the next scan **/
+	struct tree *tree;     /**< Full depth tree (TDU_F_TREE) **/
+	struct mount *mounts;  /**< File systems found (TDU_F_MOUNTS) **/
+	size_t nmounts;        /**< Number of mounts **/
+	size_t mlast;          /**< Mount of the last entry **/
+	struct trace *trace;   /**< Trace recorded by the next scan **/
+	struct spill *spill;   /**< Runs spilled over the memory limit **/
+	struct dups *dups;     /**< Duplicate file candidates **/
+	struct compress *compress;/**< Compression estimate samples **/
+	struct where *where;   /**< Selects the old entries, or NULL **/
+	struct export *export; /**< Entries exported by the next scan **/
+	struct agent *agent;   /**< Streams the scans to a collector **/
+	int error;             /**< errno of the first failure of a scan **/
+	int observe;           /**< Entries are passed to tdu_observe() **/
+	entry_t entry;         /**< Aggregates an entry of the scan **/
+	void (*kernel)(const struct kbatch *, const struct kedges *,
+		       struct pinfo *);/**< Aggregates a batch, or NULL **/
+	struct pinfo *last;    /**< Node found by the last tdu_node() **/
+	char *pbuf;            /**< Scratch path of tdu_node() **/
+	size_t pbufsize;       /**< Size of pbuf **/
 };
 
 /* Walk a directory tree */
-int32_t walk();
+int32_t tdu_walk(struct tdu_ctx *);
+
+/* Walk a directory tree with several threads */
+int32_t tdu_pwalk(struct tdu_ctx *);
+
+/* Record the first failure of a scan */
+void tdu_fail(struct tdu_ctx *, int);
+
+/* Select the entry call back for the features of a scan */
+entry_t entry_select(const struct tdu_ctx *);
+
+/* Binary tree comparison routine */
+int tdu_cmp(const void *, const void *);
+
+/* Find or create the tree node an entry is aggregated under */
+struct pinfo *tdu_node(struct tdu_ctx *, const char *, int, int);
+
+/* Add the counters of a node aggregated elsewhere into a context */
+void tdu_merge(struct tdu_ctx *, const struct pinfo *);
+
+/* Add the counters of a node into another of the same path */
+void tdu_node_add(struct pinfo *, const struct pinfo *);
+
+/* Release every node of a tree */
+void tdu_nodes_free(void **);
+
+/* Check if the entries of a scan need to be passed to tdu_observe() */
+int tdu_observing(const struct tdu_ctx *);
+
+/* Pass an entry to what sees every entry, whatever its depth */
+void tdu_observe(struct tdu_ctx *, const char *, const struct stat *, int,
+		 int);
+
+/* Account an entry to the file system it is on */
+void mount_account(struct tdu_ctx *, const char *, const struct stat *,
+		   int);
+
+/* Account an entry to a tree node */
+void tdu_account(struct tdu_ctx *, struct pinfo *, mode_t, uint64_t, time_t,
+		 int);
+
+/* Whether an entry counts as old */
+int tdu_is_old(const struct tdu_ctx *, const char *, const struct stat *, int);
 
 #ifdef __cplusplus
 }                               /* extern "C" */
@@ -0,0 +1,1276 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file watch.c
+ * Routines to keep a scanned tree current from change events.
+ *
+ * Every entry found by the scan is recorded with the size and access
+ * time it was accounted with. A change event for a path re-examines
+ * only that path: its old contribution is taken off its tree node and
+ * the new one added, a new directory is read and an entry that has
+ * gone is forgotten along with anything below it. Handling an event is
+ * idempotent, so events raised while the scan was running are safe.
+ *
+ * Each recorded entry is linked under its recorded directory, so an
+ * entry that has gone takes only its own subtree with it.
+ *
+ * fanotify filesystem wide marks are used where permitted, otherwise
+ * every directory of the tree is watched with inotify. When the event
+ * queue overflows, every recorded entry is looked at again, as a write
+ * to a file whose event was lost leaves no other trace. Only the
+ * directories whose modification time changed or that raised events
+ * while the queue filled are read again for new entries.
+ *
+ * Access time only changes are not watched, the access time of an
+ * entry is refreshed whenever the entry otherwise changes.
+ *
+ * \ingroup watch
+ * \{
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <dirent.h>
+#include <search.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+#if HAVE_SYS_FANOTIFY_H
+#include <sys/fanotify.h>
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "walk.h"
+#include "watch.h"
+#include "agent.h"
+
+#define WATCH_BUF      (64 * 1024)
+
+#if HAVE_SYS_INOTIFY_H
+#define WATCH_MASK     (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB |    \
+			IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO |     \
+			IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#endif
+
+#if HAVE_SYS_FANOTIFY_H && defined(FAN_REPORT_DFID_NAME)
+#define HAVE_FANOTIFY_FID 1
+#define FANOTIFY_MASK  (FAN_CREATE | FAN_DELETE | FAN_MODIFY | FAN_ATTRIB | \
+			FAN_CLOSE_WRITE | FAN_MOVED_FROM | FAN_MOVED_TO |  \
+			FAN_ONDIR)
+#endif
+
+/**
+ * A recorded entry.
+ **/
+struct wfile {
+	char *path;            /**< Full path of the entry **/
+	uint64_t hash;         /**< Hash of the path **/
+	int64_t size;          /**< Accounted size in bytes **/
+	time_t atime;          /**< Accounted access time **/
+	time_t mtime;          /**< Modification time **/
+	time_t seen;           /**< When the entry was last looked at **/
+	mode_t mode;           /**< File type and mode **/
+	int wd;                /**< inotify watch of a directory **/
+	uint32_t gen;          /**< Last update with events in a directory **/
+	struct pinfo *node;    /**< Tree node the entry is accounted to **/
+	struct wfile *next;    /**< Next entry in the hash chain **/
+	struct wfile *up;      /**< Recorded directory holding the entry **/
+	struct wfile *child;   /**< First recorded entry of a directory **/
+	struct wfile *sibling; /**< Next entry of the same directory **/
+	struct wfile *prev;    /**< Previous entry of the same directory **/
+};
+
+/**
+ * Change watching state.
+ **/
+struct watch {
+	int fd;                /**< inotify or fanotify descriptor **/
+	int fan;               /**< Using fanotify **/
+	int mntfd;             /**< Top level directory, for file handles **/
+	int overflow;          /**< Events were lost **/
+	int error;             /**< errno of the first change not followed **/
+	uint32_t gen;          /**< Number of updates **/
+	dev_t dev;             /**< Device of the top level path **/
+	size_t n;              /**< Number of recorded entries **/
+	size_t nbuckets;       /**< Number of hash buckets **/
+	struct wfile **buckets;/**< Hash buckets **/
+	struct wfile *orphans; /**< Entries whose directory is not recorded **/
+	size_t nwds;           /**< Size of the wds array **/
+	struct wfile **wds;    /**< Directories by inotify watch **/
+};
+
+/* Internal functions */
+static uint64_t       hash(const char *);
+static struct wfile  *lookup(struct watch *, const char *);
+static struct wfile  *insert(struct tdu_ctx *, const char *,
+			     const struct stat *, struct pinfo *);
+static void           unlink_rec(struct watch *, struct wfile *);
+static void           attach(struct watch *, struct wfile *);
+static void           detach(struct watch *, struct wfile *);
+static void           adopt(struct watch *);
+static void           forget(struct tdu_ctx *, struct wfile *, int);
+static struct pinfo  *drop(struct tdu_ctx *, struct wfile *);
+static void           refresh(struct tdu_ctx *, const char *, int);
+static void           scan_dir(struct tdu_ctx *, const char *);
+static int64_t        reconcile(struct tdu_ctx *);
+static uint32_t       age(time_t, time_t);
+static int32_t        list(struct watch *, char ***, size_t *, const char *);
+static void           add_wd(struct tdu_ctx *, struct wfile *);
+static int            parent(const char *, char *);
+static int            inside(struct tdu_ctx *, const char *);
+static int            level(struct tdu_ctx *, const char *);
+static int64_t        apply(struct tdu_ctx *, const char *, const char *, int,
+			    char [2][PATH_MAX]);
+static int64_t        read_inotify(struct tdu_ctx *, char *, ssize_t);
+#if HAVE_FANOTIFY_FID
+static int64_t        read_fanotify(struct tdu_ctx *, char *, ssize_t);
+#endif
+
+/**
+ * Start watching a context for changes.
+ *
+ * This must be called before the context is scanned, the scan then
+ * records every entry it finds.
+ *
+ * \param[in] ctx  The scan context.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+int32_t
+tdu_watch(struct tdu_ctx *ctx)
+{
+	struct watch *w = NULL;
+	struct stat sb = {0};
+
+	if (ctx == NULL || ctx->watch != NULL || ctx->where != NULL ||
+	    (ctx->opts.flags & (TDU_F_TREE|TDU_F_MOUNTS|TDU_F_TYPES))) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+	if (lstat(ctx->opts.path, &sb) != 0) {
+		return(EXIT_FAILURE);
+	}
+
+	if ((w = calloc(1, sizeof(struct watch))) == NULL) {
+		return(EXIT_FAILURE);
+	}
+	w->fd = -1;
+	w->mntfd = -1;
+	w->dev = sb.st_dev;
+	w->nbuckets = 1024;
+	if ((w->buckets = calloc(w->nbuckets,
+				 sizeof(struct wfile *))) == NULL) {
+		free(w);
+		return(EXIT_FAILURE);
+	}
+
+#if HAVE_FANOTIFY_FID
+	w->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+			      FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY);
+	if (w->fd >= 0 &&
+	    (fanotify_mark(w->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+			   FANOTIFY_MASK, AT_FDCWD, ctx->opts.path) != 0 ||
+	     (w->mntfd = open(ctx->opts.path, O_RDONLY | O_DIRECTORY)) < 0)) {
+		close(w->fd);
+		w->fd = -1;
+	}
+	w->fan = (w->fd >= 0);
+#endif /* HAVE_FANOTIFY_FID */
+
+#if HAVE_SYS_INOTIFY_H
+	if (w->fd < 0) {
+		w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	}
+#endif /* HAVE_SYS_INOTIFY_H */
+
+	if (w->fd < 0) {
+		free(w->buckets);
+		free(w);
+		errno = ENOTSUP;
+		return(EXIT_FAILURE);
+	}
+
+	ctx->watch = w;
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Descriptor that becomes readable when there are change events.
+ *
+ * \param[in] ctx  The scan context.
+ *
+ * \retval fd  The descriptor to poll.
+ * \retval -1  If the context is not being watched.
+ **/
+int
+tdu_watch_fd(const struct tdu_ctx *ctx)
+{
+
+	return(ctx->watch != NULL ? ctx->watch->fd : -1);
+}
+
+/**
+ * Apply any pending change events to the aggregated results.
+ *
+ * The changes there was memory for are applied even when another
+ * could not be, which is reported as ENOMEM.
+ *
+ * \param[in] ctx  The scan context.
+ *
+ * \retval n   The number of entries that were re-examined.
+ * \retval -1  If there was an error, errno is set.
+ **/
+int64_t
+tdu_watch_update(struct tdu_ctx *ctx)
+{
+	ssize_t len = 0;
+	int64_t n = 0;
+	char *buf = NULL;
+	struct watch *w = ctx->watch;
+
+	if (w == NULL) {
+		errno = EINVAL;
+		return(-1);
+	}
+
+	if ((buf = malloc(WATCH_BUF)) == NULL) {
+		return(-1);
+	}
+	++w->gen;
+	adopt(w);
+	while ((len = read(w->fd, buf, WATCH_BUF)) > 0) {
+#if HAVE_FANOTIFY_FID
+		if (w->fan) {
+			n += read_fanotify(ctx, buf, len);
+			continue;
+		}
+#endif /* HAVE_FANOTIFY_FID */
+		n += read_inotify(ctx, buf, len);
+	}
+	free(buf);
+
+	if (len < 0 && errno != EAGAIN && errno != EINTR) {
+		return(-1);
+	}
+
+	if (w->overflow) {
+		w->overflow = 0;
+		n += reconcile(ctx);
+	}
+
+	/* The results no longer follow every change */
+	if (w->error != 0) {
+		errno = w->error;
+		w->error = 0;
+		return(-1);
+	}
+
+	/* A collector follows the changes as the scan did */
+	if (n > 0 && ctx->agent != NULL) {
+		agent_flush(ctx);
+	}
+
+	return(n);
+}
+
+/**
+ * Move the access time window of a watched context forward.
+ *
+ * The window is otherwise fixed when the context is created, so a
+ * file that goes unread while it is watched would never turn old.
+ * Every recorded entry that turns old or changes access age bucket
+ * between the time of the scan and \p now is accounted again.
+ *
+ * \param[in] ctx  The scan context.
+ * \param[in] now  The time the results are reported at.
+ *
+ * \retval n   The number of entries that were accounted again.
+ * \retval -1  If the context is not being watched, errno is set.
+ **/
+int64_t
+tdu_watch_age(struct tdu_ctx *ctx, time_t now)
+{
+	size_t i = 0;
+	int64_t n = 0;
+	int ages = (ctx->opts.flags & TDU_F_AGES) != 0;
+	time_t then = ctx->now;
+	time_t old = ctx->opts.atime;
+	time_t cut = now - (time_t)ctx->opts.atime_days * SECONDS_IN_DAY;
+	struct wfile *rec = NULL;
+	struct watch *w = ctx->watch;
+
+	if (w == NULL) {
+		errno = EINVAL;
+		return(-1);
+	}
+	if (now <= then) {
+		return(0);
+	}
+
+	for (i = 0; i < w->nbuckets; ++i) {
+		for (rec = w->buckets[i]; rec != NULL; rec = rec->next) {
+			if ((rec->atime < old) == (rec->atime < cut) &&
+			    (!ages || age(rec->atime, then) ==
+				      age(rec->atime, now))) {
+				continue;
+			}
+			tdu_account(ctx, rec->node, rec->mode, rec->size,
+				    rec->atime, -1);
+			ctx->now = now;
+			ctx->opts.atime = cut;
+			tdu_account(ctx, rec->node, rec->mode, rec->size,
+				    rec->atime, 1);
+			ctx->now = then;
+			ctx->opts.atime = old;
+			++n;
+		}
+	}
+	ctx->now = now;
+	ctx->opts.atime = cut;
+
+	if (n > 0 && ctx->agent != NULL) {
+		agent_flush(ctx);
+	}
+
+	return(n);
+}
+
+/**
+ * Record an entry found by a scan.
+ *
+ * \param[in] ctx    The scan context.
+ * \param[in] fpath  Name of the entry.
+ * \param[in] sb     Stat buffer of the entry.
+ * \param[in] n      Tree node the entry was accounted to.
+ **/
+void
+watch_record(struct tdu_ctx *ctx, const char *fpath, const struct stat *sb,
+	     struct pinfo *n)
+{
+	struct wfile *rec = NULL;
+
+	/* A change event may have beaten the scan to the entry */
+	if ((rec = lookup(ctx->watch, fpath)) != NULL) {
+		forget(ctx, rec, 0);
+	}
+
+	if (insert(ctx, fpath, sb, n) == NULL) {
+		tdu_fail(ctx, ENOMEM);
+	}
+}
+
+/**
+ * Forget every recorded entry.
+ *
+ * \param[in] ctx  The scan context.
+ **/
+void
+watch_clear(struct tdu_ctx *ctx)
+{
+	size_t i = 0;
+	struct wfile *rec = NULL;
+	struct wfile *next = NULL;
+	struct watch *w = ctx->watch;
+
+	if (w == NULL) {
+		return;
+	}
+
+	for (i = 0; i < w->nbuckets; ++i) {
+		for (rec = w->buckets[i]; rec != NULL; rec = next) {
+			next = rec->next;
+			free(rec->path);
+			free(rec);
+		}
+		w->buckets[i] = NULL;
+	}
+	memset(w->wds, 0, w->nwds * sizeof(struct wfile *));
+	w->orphans = NULL;
+	w->n = 0;
+}
+
+/**
+ * Stop watching and release the watch state.
+ *
+ * \param[in] ctx  The scan context.
+ **/
+void
+watch_free(struct tdu_ctx *ctx)
+{
+	struct watch *w = ctx->watch;
+
+	if (w == NULL) {
+		return;
+	}
+
+	watch_clear(ctx);
+	close(w->fd);
+	if (w->mntfd >= 0) {
+		close(w->mntfd);
+	}
+	free(w->buckets);
+	free(w->wds);
+	free(w);
+	ctx->watch = NULL;
+}
+
+/**
+ * Hash a path (FNV-1a).
+ *
+ * \param[in] s  The path.
+ *
+ * \retval h  The hash.
+ **/
+static uint64_t
+hash(const char *s)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (*s != '\0') {
+		h ^= (unsigned char)*s++;
+		h *= 0x100000001b3ULL;
+	}
+
+	return(h);
+}
+
+/**
+ * Find a recorded entry.
+ *
+ * \param[in] w     The watch state.
+ * \param[in] path  Full path of the entry.
+ *
+ * \retval rec   The recorded entry.
+ * \retval NULL  If the entry is not recorded.
+ **/
+static struct wfile *
+lookup(struct watch *w, const char *path)
+{
+	uint64_t h = hash(path);
+	struct wfile *rec = NULL;
+
+	for (rec = w->buckets[h % w->nbuckets]; rec != NULL; rec = rec->next) {
+		if (rec->hash == h && strcmp(rec->path, path) == 0) {
+			return(rec);
+		}
+	}
+
+	return(NULL);
+}
+
+/**
+ * Record a new entry.
+ *
+ * \param[in] ctx   The scan context.
+ * \param[in] path  Full path of the entry.
+ * \param[in] sb    Stat buffer of the entry.
+ * \param[in] n     Tree node the entry is accounted to.
+ *
+ * \retval rec   The recorded entry.
+ * \retval NULL  If there was no memory.
+ **/
+static struct wfile *
+insert(struct tdu_ctx *ctx, const char *path, const struct stat *sb,
+       struct pinfo *n)
+{
+	size_t i = 0;
+	size_t nb = 0;
+	struct wfile *rec = NULL;
+	struct wfile *next = NULL;
+	struct wfile **buckets = NULL;
+	struct watch *w = ctx->watch;
+
+	/* Keep the chains short, or longer ones without memory */
+	if (w->n >= w->nbuckets &&
+	    (buckets = calloc(w->nbuckets * 2,
+			      sizeof(struct wfile *))) != NULL) {
+		nb = w->nbuckets * 2;
+		for (i = 0; i < w->nbuckets; ++i) {
+			for (rec = w->buckets[i]; rec != NULL; rec = next) {
+				next = rec->next;
+				rec->next = buckets[rec->hash % nb];
+				buckets[rec->hash % nb] = rec;
+			}
+		}
+		free(w->buckets);
+		w->buckets = buckets;
+		w->nbuckets = nb;
+	}
+
+	if ((rec = calloc(1, sizeof(struct wfile))) == NULL ||
+	    (rec->path = strdup(path)) == NULL) {
+		free(rec);
+		return(NULL);
+	}
+	rec->hash = hash(path);
+	rec->size = sb->st_size;
+	rec->atime = sb->st_atime;
+	rec->mtime = sb->st_mtime;
+	rec->seen = time(NULL);
+	rec->mode = sb->st_mode;
+	rec->wd = -1;
+	rec->node = n;
+	rec->next = w->buckets[rec->hash % w->nbuckets];
+	w->buckets[rec->hash % w->nbuckets] = rec;
+	++w->n;
+	attach(w, rec);
+
+	if (S_ISDIR(sb->st_mode)) {
+		add_wd(ctx, rec);
+	}
+
+	return(rec);
+}
+
+/**
+ * Unlink a recorded entry from its hash chain.
+ *
+ * \param[in] w    The watch state.
+ * \param[in] rec  The entry.
+ **/
+static void
+unlink_rec(struct watch *w, struct wfile *rec)
+{
+	struct wfile **p = NULL;
+
+	for (p = &w->buckets[rec->hash % w->nbuckets]; *p != NULL;
+	     p = &(*p)->next) {
+		if (*p == rec) {
+			*p = rec->next;
+			--w->n;
+			return;
+		}
+	}
+}
+
+/**
+ * Link an entry under its recorded directory.
+ *
+ * An entry whose directory is not recorded, as the top level path or
+ * an entry a parallel scan found before its directory, is kept with
+ * the orphans until adopt() finds its directory.
+ *
+ * \param[in] w    The watch state.
+ * \param[in] rec  The entry.
+ **/
+static void
+attach(struct watch *w, struct wfile *rec)
+{
+	struct wfile **head = NULL;
+	char dir[PATH_MAX];
+
+	rec->up = NULL;
+	if (parent(rec->path, dir)) {
+		rec->up = lookup(w, dir);
+	}
+	head = rec->up != NULL ? &rec->up->child : &w->orphans;
+	rec->prev = NULL;
+	rec->sibling = *head;
+	if (*head != NULL) {
+		(*head)->prev = rec;
+	}
+	*head = rec;
+}
+
+/**
+ * Unlink an entry from its directory.
+ *
+ * \param[in] w    The watch state.
+ * \param[in] rec  The entry.
+ **/
+static void
+detach(struct watch *w, struct wfile *rec)
+{
+
+	if (rec->prev != NULL) {
+		rec->prev->sibling = rec->sibling;
+	} else if (rec->up != NULL) {
+		rec->up->child = rec->sibling;
+	} else {
+		w->orphans = rec->sibling;
+	}
+	if (rec->sibling != NULL) {
+		rec->sibling->prev = rec->prev;
+	}
+	rec->up = NULL;
+	rec->prev = NULL;
+	rec->sibling = NULL;
+}
+
+/**
+ * Link the orphans whose directory has since been recorded.
+ *
+ * \param[in] w  The watch state.
+ **/
+static void
+adopt(struct watch *w)
+{
+	struct wfile *p = NULL;
+	struct wfile *next = NULL;
+	char dir[PATH_MAX];
+
+	for (p = w->orphans; p != NULL; p = next) {
+		next = p->sibling;
+		if (parent(p->path, dir) && lookup(w, dir) != NULL) {
+			detach(w, p);
+			attach(w, p);
+		}
+	}
+}
+
+/**
+ * Forget a recorded entry, taking it off its tree node.
+ *
+ * When a directory is forgotten along with everything below it, the
+ * tree nodes the directory and its subdirectories aggregated are
+ * removed too, as a scan would no longer find them.
+ *
+ * \param[in] ctx   The scan context.
+ * \param[in] rec   The entry.
+ * \param[in] deep  Also forget everything recorded below a directory.
+ **/
+static void
+forget(struct tdu_ctx *ctx, struct wfile *rec, int deep)
+{
+	int last = 0;
+	struct wfile *p = rec;
+	struct wfile *up = NULL;
+	struct pinfo *node = NULL;
+
+	if (!deep) {
+		drop(ctx, rec);
+		return;
+	}
+
+	/*
+	 * Drop the entries deepest first, so a node is only removed once
+	 * everything accounted to it has been taken off.
+	 */
+	do {
+		while (p->child != NULL) {
+			p = p->child;
+		}
+		up = p->up;
+		last = (p == rec);
+		if ((node = drop(ctx, p)) != NULL) {
+			ctx->last = NULL;
+			tdelete(node, &ctx->root, tdu_cmp);
+			free(node->path);
+			free(node);
+		}
+		p = up;
+	} while (!last);
+}
+
+/**
+ * Drop a single recorded entry, taking it off its tree node.
+ *
+ * \param[in] ctx   The scan context.
+ * \param[in] rec   The entry.
+ *
+ * \retval node  The tree node, if the entry was the directory it
+ *               aggregates.
+ * \retval NULL  Otherwise.
+ **/
+static struct pinfo *
+drop(struct tdu_ctx *ctx, struct wfile *rec)
+{
+	struct wfile *p = NULL;
+	struct wfile *next = NULL;
+	struct pinfo *node = NULL;
+	struct watch *w = ctx->watch;
+
+	tdu_account(ctx, rec->node, rec->mode, rec->size, rec->atime, -1);
+	if (S_ISDIR(rec->mode) && strcmp(rec->node->path, rec->path) == 0) {
+		node = rec->node;
+	}
+
+	detach(w, rec);
+
+#if HAVE_SYS_INOTIFY_H
+	if (rec->wd >= 0) {
+		if (!w->fan) {
+			inotify_rm_watch(w->fd, rec->wd);
+		}
+		w->wds[rec->wd] = NULL;
+	}
+#endif /* HAVE_SYS_INOTIFY_H */
+
+	/* Entries still recorded below wait for the directory to return */
+	unlink_rec(w, rec);
+	for (p = rec->child; p != NULL; p = next) {
+		next = p->sibling;
+		attach(w, p);
+	}
+	free(rec->path);
+	free(rec);
+
+	return(node);
+}
+
+/**
+ * Re-examine a path that may have changed.
+ *
+ * \param[in] ctx     The scan context.
+ * \param[in] path    Full path of the entry.
+ * \param[in] rescan  Read a directory again if it was modified.
+ **/
+static void
+refresh(struct tdu_ctx *ctx, const char *path, int rescan)
+{
+	int modified = 0;
+	struct stat sb = {0};
+	struct pinfo *n = NULL;
+	struct wfile *rec = NULL;
+	struct watch *w = ctx->watch;
+
+	rec = lookup(w, path);
+
+	if (lstat(path, &sb) != 0 || sb.st_dev != w->dev) {
+		if (rec != NULL) {
+			forget(ctx, rec, 1);
+		}
+		return;
+	}
+
+	/* Replaced by an entry of another type */
+	if (rec != NULL && (rec->mode & S_IFMT) != (sb.st_mode & S_IFMT)) {
+		forget(ctx, rec, 1);
+		rec = NULL;
+	}
+
+	if (rec == NULL) {
+		if (!inside(ctx, path)) {
+			return;
+		}
+		if ((n = tdu_node(ctx, path, S_ISDIR(sb.st_mode) ? FTW_D : FTW_F,
+				  level(ctx, path))) == NULL ||
+		    insert(ctx, path, &sb, n) == NULL) {
+			w->error = ENOMEM;
+			return;
+		}
+		tdu_account(ctx, n, sb.st_mode, sb.st_size, sb.st_atime, 1);
+		if (S_ISDIR(sb.st_mode)) {
+			scan_dir(ctx, path);
+		}
+		return;
+	}
+
+	tdu_account(ctx, rec->node, rec->mode, rec->size, rec->atime, -1);
+	tdu_account(ctx, rec->node, sb.st_mode, sb.st_size, sb.st_atime, 1);
+	/* Changes within the second it was last looked at are invisible */
+	modified = (rec->mtime != sb.st_mtime || sb.st_mtime >= rec->seen);
+	rec->size = sb.st_size;
+	rec->atime = sb.st_atime;
+	rec->mtime = sb.st_mtime;
+	rec->seen = time(NULL);
+
+	if (rescan && modified && S_ISDIR(sb.st_mode)) {
+		scan_dir(ctx, path);
+	}
+}
+
+/**
+ * Record any entries of a directory that are not yet recorded.
+ *
+ * \param[in] ctx   The scan context.
+ * \param[in] path  Full path of the directory.
+ **/
+static void
+scan_dir(struct tdu_ctx *ctx, const char *path)
+{
+	DIR *dp = NULL;
+	struct dirent *de = NULL;
+	char child[PATH_MAX];
+
+	if ((dp = opendir(path)) == NULL) {
+		return;
+	}
+
+	while ((de = readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0) {
+			continue;
+		}
+		if (snprintf(child, sizeof(child), "%s/%s", path,
+			     de->d_name) >= (int)sizeof(child)) {
+			continue;
+		}
+		if (lookup(ctx->watch, child) == NULL) {
+			refresh(ctx, child, 0);
+		}
+	}
+
+	closedir(dp);
+}
+
+/**
+ * Re-examine the recorded entries after events were lost.
+ *
+ * Every recorded entry is looked at again, which takes no reads of the
+ * directories. A directory is only read again for new entries when its
+ * modification time changed or it raised events in this update, as
+ * only entries created or renamed into it change it.
+ *
+ * \param[in] ctx   The scan context.
+ *
+ * \retval n  The number of entries that were re-examined.
+ **/
+static int64_t
+reconcile(struct tdu_ctx *ctx)
+{
+	int full = 0;
+	int active = 0;
+	size_t i = 0;
+	size_t j = 0;
+	size_t n = 0;
+	size_t m = 0;
+	int64_t count = 0;
+	time_t mtime = 0;
+	time_t seen = 0;
+	char **dirs = NULL;
+	char **paths = NULL;
+	struct wfile *p = NULL;
+	struct wfile *rec = NULL;
+	struct watch *w = ctx->watch;
+
+	/* Directories are listed before anything below them */
+	for (rec = w->orphans; rec != NULL && !full; rec = rec->sibling) {
+		full = S_ISDIR(rec->mode) ? list(w, &dirs, &n, rec->path) :
+			list(w, &paths, &m, rec->path);
+	}
+	for (i = 0; i < n && !full; ++i) {
+		if ((rec = lookup(w, dirs[i])) == NULL) {
+			continue;
+		}
+		for (p = rec->child; p != NULL && !full; p = p->sibling) {
+			if (S_ISDIR(p->mode)) {
+				full = list(w, &dirs, &n, p->path);
+			}
+		}
+	}
+
+	for (j = 0; j < m; ++j) {
+		refresh(ctx, paths[j], 0);
+		free(paths[j]);
+	}
+	free(paths);
+	paths = NULL;
+	count += m;
+
+	for (i = 0; i < n; ++i) {
+		/* Gone along with a directory above it */
+		if ((rec = lookup(w, dirs[i])) == NULL) {
+			free(dirs[i]);
+			continue;
+		}
+		mtime = rec->mtime;
+		seen = rec->seen;
+		active = (rec->gen == w->gen);
+		refresh(ctx, dirs[i], 0);
+		++count;
+
+		if ((rec = lookup(w, dirs[i])) == NULL ||
+		    !S_ISDIR(rec->mode)) {
+			free(dirs[i]);
+			continue;
+		}
+		active = active || rec->mtime != mtime || mtime >= seen;
+
+		/* Directories below are looked at in their own turn */
+		m = 0;
+		for (p = rec->child; p != NULL; p = p->sibling) {
+			if (!S_ISDIR(p->mode) &&
+			    list(w, &paths, &m, p->path)) {
+				break;
+			}
+		}
+		for (j = 0; j < m; ++j) {
+			refresh(ctx, paths[j], 0);
+			free(paths[j]);
+		}
+		free(paths);
+		paths = NULL;
+		count += m;
+
+		if (active) {
+			scan_dir(ctx, dirs[i]);
+		}
+		free(dirs[i]);
+	}
+	free(dirs);
+
+	return(count);
+}
+
+/**
+ * Access age histogram bucket of an entry.
+ *
+ * \param[in] atime  Access time of the entry.
+ * \param[in] now    Time the age is taken at.
+ *
+ * \retval bucket  The access age bucket.
+ **/
+static uint32_t
+age(time_t atime, time_t now)
+{
+
+	return(tdu_age_bucket(atime < now ?
+			      (now - atime) / SECONDS_IN_DAY : 0));
+}
+
+/**
+ * Append a copy of a path to a list.
+ *
+ * \param[in]     w     The watch state.
+ * \param[in,out] list  The list, grown in steps of 1024.
+ * \param[in,out] n     Number of paths in the list.
+ * \param[in]     path  The path.
+ *
+ * \retval 0 If the path was added.
+ * \retval 1 If there was no memory, the watch error is set.
+ **/
+static int32_t
+list(struct watch *w, char ***list, size_t *n, const char *path)
+{
+	char *s = NULL;
+	char **p = NULL;
+
+	if (*n % 1024 == 0) {
+		if ((p = realloc(*list, (*n + 1024) * sizeof(char *))) == NULL) {
+			w->error = ENOMEM;
+			return(EXIT_FAILURE);
+		}
+		*list = p;
+	}
+	if ((s = strdup(path)) == NULL) {
+		w->error = ENOMEM;
+		return(EXIT_FAILURE);
+	}
+	(*list)[(*n)++] = s;
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Watch a recorded directory with inotify.
+ *
+ * \param[in] ctx  The scan context.
+ * \param[in] rec  The directory.
+ **/
+static void
+add_wd(struct tdu_ctx *ctx, struct wfile *rec)
+{
+#if HAVE_SYS_INOTIFY_H
+	size_t n = 0;
+	struct wfile **wds = NULL;
+	struct watch *w = ctx->watch;
+
+	if (w->fan) {
+		return;
+	}
+
+	if ((rec->wd = inotify_add_watch(w->fd, rec->path, WATCH_MASK)) < 0) {
+		/* Typically out of watches, pick up what we can */
+		return;
+	}
+
+	if ((size_t)rec->wd >= w->nwds) {
+		n = (rec->wd + 1) * 2;
+		if ((wds = realloc(w->wds, n * sizeof(struct wfile *))) == NULL) {
+			inotify_rm_watch(w->fd, rec->wd);
+			rec->wd = -1;
+			return;
+		}
+		w->wds = wds;
+		memset(w->wds + w->nwds, 0,
+		       (n - w->nwds) * sizeof(struct wfile *));
+		w->nwds = n;
+	}
+	w->wds[rec->wd] = rec;
+#endif /* HAVE_SYS_INOTIFY_H */
+}
+
+/**
+ * Parent directory of a path.
+ *
+ * \param[in]  path  The path.
+ * \param[out] dir   The parent, at least PATH_MAX bytes.
+ *
+ * \retval 1 If the path has a parent.
+ * \retval 0 Otherwise.
+ **/
+static int
+parent(const char *path, char *dir)
+{
+	const char *p = strrchr(path, '/');
+
+	/* An entry of the root directory */
+	if (p == path && path[1] != '\0') {
+		strcpy(dir, "/");
+		return(1);
+	}
+	if (p == NULL || p == path || (size_t)(p - path) >= PATH_MAX) {
+		return(0);
+	}
+
+	memcpy(dir, path, p - path);
+	dir[p - path] = '\0';
+
+	return(1);
+}
+
+/**
+ * Check a path lies within the top level path.
+ *
+ * \param[in] ctx   The scan context.
+ * \param[in] path  The path.
+ *
+ * \retval 1 If the path is within the top level path.
+ * \retval 0 Otherwise.
+ **/
+static int
+inside(struct tdu_ctx *ctx, const char *path)
+{
+
+	return(strncmp(path, ctx->opts.path, ctx->plen) == 0 &&
+	       (path[ctx->plen] == '\0' || path[ctx->plen] == '/'));
+}
+
+/**
+ * Level of an entry below the top level path.
+ *
+ * \param[in] ctx    The scan context.
+ * \param[in] path   The entry.
+ *
+ * \retval n  The level.
+ **/
+static int
+level(struct tdu_ctx *ctx, const char *path)
+{
+	int n = 0;
+
+	for (path += ctx->plen; *path != '\0'; ++path) {
+		if (*path == '/') {
+			++n;
+		}
+	}
+
+	return(n);
+}
+
+/**
+ * Apply a single change event.
+ *
+ * Events come in runs for the same entry, so an entry is only looked
+ * at once for each run. When the entries of a directory change, so
+ * may the size of the directory itself.
+ *
+ * \param[in] ctx      The scan context.
+ * \param[in] dir      The directory the event was raised in.
+ * \param[in] name     The entry within it, NULL for the directory.
+ * \param[in] entries  The entries of the directory changed.
+ * \param[in] seen     The entry and directory last looked at.
+ *
+ * \retval n  The number of entries that were re-examined.
+ **/
+static int64_t
+apply(struct tdu_ctx *ctx, const char *dir, const char *name, int entries,
+      char seen[2][PATH_MAX])
+{
+	int64_t n = 0;
+	struct wfile *rec = NULL;
+	char path[PATH_MAX];
+
+	/* Where events were raised, events may have been lost */
+	if ((rec = lookup(ctx->watch, dir)) != NULL) {
+		rec->gen = ctx->watch->gen;
+	}
+
+	if (name == NULL) {
+		snprintf(path, sizeof(path), "%s", dir);
+	} else if (snprintf(path, sizeof(path), "%s/%s", dir, name) >=
+		   (int)sizeof(path)) {
+		return(0);
+	}
+
+	if (strcmp(path, seen[0]) != 0) {
+		strcpy(seen[0], path);
+		refresh(ctx, path, 0);
+		++n;
+	}
+
+	if (entries && name != NULL && strcmp(dir, seen[1]) != 0) {
+		strcpy(seen[1], dir);
+		refresh(ctx, dir, 0);
+		++n;
+	}
+
+	return(n);
+}
+
+/**
+ * Apply a buffer of inotify events.
+ *
+ * \param[in] ctx  The scan context.
+ * \param[in] buf  The events.
+ * \param[in] len  Length of the events.
+ *
+ * \retval n  The number of entries that were re-examined.
+ **/
+static int64_t
+read_inotify(struct tdu_ctx *ctx, char *buf, ssize_t len)
+{
+	int64_t n = 0;
+#if HAVE_SYS_INOTIFY_H
+	char *p = NULL;
+	struct inotify_event *ev = NULL;
+	struct watch *w = ctx->watch;
+	char seen[2][PATH_MAX] = {"", ""};
+
+	for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+		ev = (struct inotify_event *)p;
+		if (ev->mask & IN_Q_OVERFLOW) {
+			w->overflow = 1;
+			continue;
+		}
+		if (ev->mask & IN_IGNORED || ev->wd < 0 ||
+		    (size_t)ev->wd >= w->nwds || w->wds[ev->wd] == NULL) {
+			continue;
+		}
+
+		n += apply(ctx, w->wds[ev->wd]->path,
+			   ev->len > 0 ? ev->name : NULL,
+			   ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+				       IN_MOVED_TO), seen);
+	}
+#endif /* HAVE_SYS_INOTIFY_H */
+
+	return(n);
+}
+
+#if HAVE_FANOTIFY_FID
+/**
+ * Apply a buffer of fanotify events.
+ *
+ * Each event carries a handle of the directory and the name of the
+ * entry within it.
+ *
+ * \param[in] ctx  The scan context.
+ * \param[in] buf  The events.
+ * \param[in] len  Length of the events.
+ *
+ * \retval n  The number of entries that were re-examined.
+ **/
+static int64_t
+read_fanotify(struct tdu_ctx *ctx, char *buf, ssize_t len)
+{
+	int fd = -1;
+	int64_t n = 0;
+	ssize_t dlen = 0;
+	char *name = NULL;
+	struct fanotify_event_metadata *m = NULL;
+	struct fanotify_event_info_fid *fid = NULL;
+	struct file_handle *fh = NULL;
+	struct watch *w = ctx->watch;
+	char proc[64];
+	char dir[PATH_MAX];
+	char seen[2][PATH_MAX] = {"", ""};
+
+	for (m = (struct fanotify_event_metadata *)buf; FAN_EVENT_OK(m, len);
+	     m = FAN_EVENT_NEXT(m, len)) {
+		if (m->mask & FAN_Q_OVERFLOW) {
+			w->overflow = 1;
+			continue;
+		}
+
+		fid = (struct fanotify_event_info_fid *)(m + 1);
+		if ((char *)fid >= (char *)m + m->event_len ||
+		    fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+			continue;
+		}
+		fh = (struct file_handle *)fid->handle;
+		name = (char *)fh->f_handle + fh->handle_bytes;
+
+		/* The directory may already be gone */
+		if ((fd = open_by_handle_at(w->mntfd, fh, O_PATH)) < 0) {
+			continue;
+		}
+		snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+		dlen = readlink(proc, dir, sizeof(dir) - 1);
+		close(fd);
+		if (dlen <= 0) {
+			continue;
+		}
+		dir[dlen] = '\0';
+
+		/* Events for the rest of the file system are dropped */
+		if (!inside(ctx, dir)) {
+			continue;
+		}
+
+		n += apply(ctx, dir, strcmp(name, ".") != 0 ? name : NULL,
+			   m->mask & (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM |
+				      FAN_MOVED_TO), seen);
+	}
+
+	return(n);
+}
+#endif /* HAVE_FANOTIFY_FID */
+
+/**
+ * \}
+ **/
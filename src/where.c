@@ -0,0 +1,1258 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Timothy Brown
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file where.c
+ * Routines to compile and test the expressions selecting old entries.
+ *
+ * An expression such as
+ *
+ *     size > 1G and mtime > 180 days and uid in {1000, 1001}
+ *         and not under "/home/scratch"
+ *
+ * is parsed once into a tree, whose constant parts are folded away,
+ * and the tree is then laid out as a branching program: each
+ * instruction is a single test of an entry, fused with its operands,
+ * and names the instruction to go to when the test holds and when it
+ * does not. And, or and not are only jumps between the tests, so an
+ * entry is decided after the fewest tests, with no stack to keep.
+ *
+ * Name patterns that are a literal with '*' at either end are matched
+ * by comparing bytes, the others by fnmatch(3).
+ *
+ * \ingroup where
+ * \{
+ **/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <err.h>
+#include <fnmatch.h>
+#include <grp.h>
+#include <pwd.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gettext.h"
+#include "defs.h"
+#include "tdu.h"
+#include "walk.h"
+#include "where.h"
+
+#define W_TRUE          -1          /**< The entry matches **/
+#define W_FALSE         -2          /**< The entry does not match **/
+
+/**
+ * Fields of an entry, times being ages in seconds.
+ **/
+enum field { F_SIZE, F_ATIME, F_MTIME, F_CTIME, F_UID, F_GID, F_NLINK,
+	     F_PERM, F_DEPTH, F_NFIELD };
+
+/**
+ * Relations between numbers.
+ **/
+enum rel { R_LT, R_LE, R_GT, R_GE, R_EQ, R_NE };
+
+/**
+ * Tests of an instruction.
+ **/
+enum op {
+	OP_CMP,                /**< Field and number **/
+	OP_CMPF,               /**< Field and field **/
+	OP_IN,                 /**< Field in a set of numbers **/
+	OP_TYPE,               /**< File type **/
+	OP_NAME,               /**< Last component against a pattern **/
+	OP_PATH                /**< Path against a pattern **/
+};
+
+/**
+ * How a pattern is matched.
+ **/
+enum glob { G_EXACT, G_PREFIX, G_SUFFIX, G_INNER, G_FNMATCH };
+
+/**
+ * An instruction.
+ **/
+struct insn {
+	uint8_t op;            /**< Test (enum op) **/
+	uint8_t rel;           /**< Relation (enum rel) **/
+	uint8_t a;             /**< Field tested **/
+	uint8_t b;             /**< Field compared to, or how to match **/
+	int32_t t;             /**< Next when the test holds **/
+	int32_t f;             /**< Next when it does not **/
+	int64_t imm;           /**< Number, file type, set or pattern size **/
+	const void *p;         /**< Set or pattern **/
+};
+
+/**
+ * A compiled expression.
+ **/
+struct where {
+	struct insn *code;     /**< The instructions **/
+	int32_t n;             /**< Number of instructions **/
+	int32_t start;         /**< First instruction, or the result **/
+	void **own;            /**< Sets and patterns **/
+	size_t nown;           /**< Number of sets and patterns **/
+};
+
+/**
+ * Kinds of expression tree nodes.
+ **/
+enum kind { E_CONST, E_TEST, E_NOT, E_AND, E_OR };
+
+/**
+ * An expression tree node.
+ **/
+struct expr {
+	enum kind kind;        /**< Kind of node **/
+	int value;             /**< Value of E_CONST **/
+	struct insn test;      /**< Test of E_TEST **/
+	struct expr *l;        /**< Operand **/
+	struct expr *r;        /**< Right operand of E_AND and E_OR **/
+};
+
+/**
+ * Tokens.
+ **/
+enum token { T_END, T_IDENT, T_NUM, T_STR, T_LP, T_RP, T_LB, T_RB,
+	     T_COMMA, T_REL, T_MATCH, T_NMATCH, T_AND, T_OR, T_NOT };
+
+/**
+ * Parser state.
+ **/
+struct parser {
+	const char *s;         /**< The expression **/
+	const char *p;         /**< Next character **/
+	const char *tok;       /**< Current token **/
+	size_t len;            /**< Its length **/
+	enum token type;       /**< Its type **/
+	enum rel rel;          /**< Relation of T_REL **/
+	struct expr **nodes;   /**< Every tree node **/
+	size_t nnodes;         /**< Number of tree nodes **/
+	struct where *w;       /**< Program being built **/
+	int failed;            /**< An error was reported **/
+	int nomem;             /**< There was no memory **/
+};
+
+/**
+ * Names of the fields.
+ **/
+static const char *fields[F_NFIELD] = {
+	"size", "atime", "mtime", "ctime", "uid", "gid", "nlink", "perm",
+	"depth"
+};
+
+/**
+ * Units of numbers.
+ **/
+static const struct {
+	const char *name;      /**< Name **/
+	int64_t scale;         /**< Multiplier **/
+} units[] = {
+	{"k", kB}, {"K", kB}, {"kB", kB}, {"KB", kB}, {"KiB", kB},
+	{"M", MB}, {"MB", MB}, {"MiB", MB},
+	{"G", GB}, {"GB", GB}, {"GiB", GB},
+	{"T", TB}, {"TB", TB}, {"TiB", TB},
+	{"P", PB}, {"PB", PB}, {"PiB", PB},
+	{"s", 1}, {"sec", 1}, {"second", 1}, {"seconds", 1},
+	{"min", 60}, {"minute", 60}, {"minutes", 60},
+	{"h", 3600}, {"hour", 3600}, {"hours", 3600},
+	{"d", SECONDS_IN_DAY}, {"day", SECONDS_IN_DAY},
+	{"days", SECONDS_IN_DAY},
+	{"w", 7 * SECONDS_IN_DAY}, {"week", 7 * SECONDS_IN_DAY},
+	{"weeks", 7 * SECONDS_IN_DAY},
+	{"y", 365 * SECONDS_IN_DAY}, {"year", 365 * SECONDS_IN_DAY},
+	{"years", 365 * SECONDS_IN_DAY}
+};
+
+/* Internal functions */
+static inline int64_t value(int, const struct stat *, int, time_t);
+static inline int  relate(int64_t, int, int64_t);
+static inline int  test(const struct insn *, const char *,
+			const struct stat *, int, time_t);
+static int         glob(const struct insn *, const char *);
+static void        next(struct parser *);
+static int         is(const struct parser *, const char *);
+static int         fail(struct parser *, const char *, ...);
+static void        *nomem(struct parser *);
+static struct expr *mk(struct parser *, enum kind);
+static struct expr *mk_not(struct parser *, struct expr *);
+static struct expr *mk_bin(struct parser *, enum kind, struct expr *,
+			   struct expr *);
+static struct expr *parse_or(struct parser *);
+static struct expr *parse_and(struct parser *);
+static struct expr *parse_unary(struct parser *);
+static struct expr *parse_primary(struct parser *);
+static struct expr *parse_match(struct parser *, int);
+static struct expr *parse_set(struct parser *, int);
+static int         operand(struct parser *, int *, int64_t *);
+static int         number(struct parser *, int64_t *);
+static char        *string(struct parser *);
+static void        pattern(struct insn *, char *);
+static void        *own(struct parser *, void *);
+static int32_t     emit(struct parser *, const struct expr *, int32_t,
+			int32_t);
+static int         i64cmp(const void *, const void *);
+
+/**
+ * Count the entries matching an expression as old in following scans.
+ *
+ * The expression replaces the access time window, see tdu(1) for its
+ * syntax. Errors in it are reported with their column.
+ *
+ * \param[in] ctx   The scan context, not watching for changes.
+ * \param[in] expr  The expression.
+ *
+ * \retval 0 If there were no errors.
+ * \retval 1 If an error was encounted, errno is set.
+ **/
+int32_t
+tdu_where(struct tdu_ctx *ctx, const char *expr)
+{
+	struct where *w = NULL;
+
+	if (ctx == NULL || expr == NULL || ctx->watch != NULL) {
+		errno = EINVAL;
+		return(EXIT_FAILURE);
+	}
+	if ((w = where_compile(expr)) == NULL) {
+		return(EXIT_FAILURE);
+	}
+
+	if (ctx->opts.verbose) {
+		warnx(_("the expression compiled to %d tests"), w->n);
+	}
+	where_free(ctx->where);
+	ctx->where = w;
+
+	return(EXIT_SUCCESS);
+}
+
+/**
+ * Compile an expression.
+ *
+ * Errors are reported with their column.
+ *
+ * \param[in] s  The expression.
+ *
+ * \retval w     The compiled expression.
+ * \retval NULL  If the expression is not valid, errno is set to
+ *               EINVAL, or to ENOMEM if there was no memory.
+ **/
+struct where *
+where_compile(const char *s)
+{
+	size_t i = 0;
+	struct parser ps = {0};
+	struct expr *e = NULL;
+
+	ps.s = ps.p = s;
+	if ((ps.w = calloc(1, sizeof(struct where))) == NULL) {
+		errno = ENOMEM;
+		return(NULL);
+	}
+	next(&ps);
+
+	if ((e = parse_or(&ps)) != NULL && (ps.type != T_END || ps.failed)) {
+		fail(&ps, _("unexpected %.*s"), (int)ps.len, ps.tok);
+		e = NULL;
+	}
+	if (e != NULL) {
+		ps.w->start = emit(&ps, e, W_TRUE, W_FALSE);
+	}
+	if (ps.nomem) {
+		e = NULL;
+	}
+
+	for (i = 0; i < ps.nnodes; ++i) {
+		free(ps.nodes[i]);
+	}
+	free(ps.nodes);
+
+	if (e == NULL) {
+		where_free(ps.w);
+		errno = ps.nomem ? ENOMEM : EINVAL;
+		return(NULL);
+	}
+
+	return(ps.w);
+}
+
+/**
+ * Test an entry against a compiled expression.
+ *
+ * \param[in] w      The compiled expression.
+ * \param[in] fpath  Name of the entry.
+ * \param[in] sb     Stat buffer of the entry.
+ * \param[in] level  Level of the entry below the top level path.
+ * \param[in] now    Time the ages are from.
+ *
+ * \retval 1 If the entry matches.
+ * \retval 0 Otherwise.
+ **/
+int
+where_match(const struct where *w, const char *fpath, const struct stat *sb,
+	    int level, time_t now)
+{
+	int32_t pc = w->start;
+	const struct insn *i = NULL;
+
+	while (pc >= 0) {
+		i = &w->code[pc];
+		pc = test(i, fpath, sb, level, now) ? i->t : i->f;
+	}
+
+	return(pc == W_TRUE);
+}
+
+/**
+ * Release a compiled expression.
+ *
+ * \param[in] w  The compiled expression, or NULL.
+ **/
+void
+where_free(struct where *w)
+{
+	size_t i = 0;
+
+	if (w == NULL) {
+		return;
+	}
+	for (i = 0; i < w->nown; ++i) {
+		free(w->own[i]);
+	}
+	free(w->own);
+	free(w->code);
+	free(w);
+}
+
+/**
+ * A field of an entry.
+ **/
+static inline int64_t
+value(int field, const struct stat *sb, int level, time_t now)
+{
+
+	switch (field) {
+		case F_SIZE:
+			return(sb->st_size);
+		case F_ATIME:
+			return((int64_t)now - sb->st_atime);
+		case F_MTIME:
+			return((int64_t)now - sb->st_mtime);
+		case F_CTIME:
+			return((int64_t)now - sb->st_ctime);
+		case F_UID:
+			return(sb->st_uid);
+		case F_GID:
+			return(sb->st_gid);
+		case F_NLINK:
+			return(sb->st_nlink);
+		case F_PERM:
+			return(sb->st_mode & 07777);
+	}
+
+	return(level);
+}
+
+/**
+ * Whether two numbers are in a relation.
+ **/
+static inline int
+relate(int64_t x, int rel, int64_t y)
+{
+
+	switch (rel) {
+		case R_LT:
+			return(x < y);
+		case R_LE:
+			return(x <= y);
+		case R_GT:
+			return(x > y);
+		case R_GE:
+			return(x >= y);
+		case R_EQ:
+			return(x == y);
+	}
+
+	return(x != y);
+}
+
+/**
+ * Run the test of an instruction on an entry.
+ **/
+static inline int
+test(const struct insn *i, const char *fpath, const struct stat *sb,
+     int level, time_t now)
+{
+	int64_t x = 0;
+	const char *s = NULL;
+
+	switch (i->op) {
+		case OP_CMP:
+			return(relate(value(i->a, sb, level, now), i->rel,
+				      i->imm));
+		case OP_CMPF:
+			return(relate(value(i->a, sb, level, now), i->rel,
+				      value(i->b, sb, level, now)));
+		case OP_IN:
+			x = value(i->a, sb, level, now);
+			return(bsearch(&x, i->p, i->imm, sizeof(int64_t),
+				       i64cmp) != NULL);
+		case OP_TYPE:
+			return((int64_t)(sb->st_mode & S_IFMT) == i->imm);
+		case OP_NAME:
+			s = strrchr(fpath, '/');
+			return(glob(i, s != NULL && s[1] != '\0' ? s + 1 : fpath));
+	}
+
+	return(glob(i, fpath));
+}
+
+/**
+ * Match a name against the pattern of an instruction.
+ **/
+static int
+glob(const struct insn *i, const char *s)
+{
+	size_t len = 0;
+
+	if (i->b == G_FNMATCH) {
+		return(fnmatch(i->p, s, 0) == 0);
+	}
+	if (i->b == G_INNER) {
+		return(strstr(s, i->p) != NULL);
+	}
+
+	len = strlen(s);
+	switch (i->b) {
+		case G_EXACT:
+			return(len == (size_t)i->imm &&
+			       memcmp(s, i->p, len) == 0);
+		case G_PREFIX:
+			return(len >= (size_t)i->imm &&
+			       memcmp(s, i->p, i->imm) == 0);
+	}
+
+	return(len >= (size_t)i->imm &&
+	       memcmp(s + len - i->imm, i->p, i->imm) == 0);
+}
+
+/**
+ * Read the next token.
+ **/
+static void
+next(struct parser *ps)
+{
+	const char *p = ps->p;
+	char q = '\0';
+
+	while (isspace((unsigned char)*p)) {
+		++p;
+	}
+	ps->tok = p;
+	ps->type = T_REL;
+
+	if (*p == '\0') {
+		ps->type = T_END;
+	} else if (isalpha((unsigned char)*p) || *p == '_') {
+		while (isalnum((unsigned char)*p) || *p == '_') {
+			++p;
+		}
+		ps->type = T_IDENT;
+	} else if (isdigit((unsigned char)*p)) {
+		while (isdigit((unsigned char)*p) || *p == '.') {
+			++p;
+		}
+		ps->type = T_NUM;
+	} else if (*p == '"' || *p == '\'') {
+		q = *p++;
+		while (*p != '\0' && *p != q) {
+			++p;
+		}
+		p += *p == q;
+		ps->type = T_STR;
+	} else if (p[0] == '<' && p[1] == '=') {
+		ps->rel = R_LE, p += 2;
+	} else if (p[0] == '>' && p[1] == '=') {
+		ps->rel = R_GE, p += 2;
+	} else if (p[0] == '=' && p[1] == '=') {
+		ps->rel = R_EQ, p += 2;
+	} else if (p[0] == '!' && p[1] == '=') {
+		ps->rel = R_NE, p += 2;
+	} else if (p[0] == '!' && p[1] == '~') {
+		ps->type = T_NMATCH, p += 2;
+	} else if (p[0] == '&' && p[1] == '&') {
+		ps->type = T_AND, p += 2;
+	} else if (p[0] == '|' && p[1] == '|') {
+		ps->type = T_OR, p += 2;
+	} else {
+		switch (*p++) {
+			case '<':
+				ps->rel = R_LT;
+				break;
+			case '>':
+				ps->rel = R_GT;
+				break;
+			case '=':
+				ps->rel = R_EQ;
+				break;
+			case '~':
+				ps->type = T_MATCH;
+				break;
+			case '!':
+				ps->type = T_NOT;
+				break;
+			case '(':
+				ps->type = T_LP;
+				break;
+			case ')':
+				ps->type = T_RP;
+				break;
+			case '{':
+				ps->type = T_LB;
+				break;
+			case '}':
+				ps->type = T_RB;
+				break;
+			case ',':
+				ps->type = T_COMMA;
+				break;
+			default:
+				ps->type = T_END;
+				ps->failed = -1;
+				break;
+		}
+	}
+	ps->len = p - ps->tok;
+	ps->p = p;
+}
+
+/**
+ * Whether the current token is an identifier.
+ **/
+static int
+is(const struct parser *ps, const char *word)
+{
+
+	return(ps->type == T_IDENT && strlen(word) == ps->len &&
+	       strncmp(ps->tok, word, ps->len) == 0);
+}
+
+/**
+ * Report an error at the current token.
+ *
+ * \retval 0 Always.
+ **/
+static int
+fail(struct parser *ps, const char *fmt, ...)
+{
+	va_list ap;
+	char msg[256];
+
+	if (ps->failed > 0) {
+		return(0);
+	}
+	if (ps->failed < 0) {
+		snprintf(msg, sizeof(msg), _("unexpected %c"), *ps->tok);
+	} else {
+		va_start(ap, fmt);
+		vsnprintf(msg, sizeof(msg), fmt, ap);
+		va_end(ap);
+	}
+	ps->failed = 1;
+	warnx(_("invalid expression at column %zu: %s"),
+	      (size_t)(ps->tok - ps->s) + 1, msg);
+
+	return(0);
+}
+
+/**
+ * Note there was no memory, ending the parse without a message.
+ *
+ * \retval NULL  Always.
+ **/
+static void *
+nomem(struct parser *ps)
+{
+
+	ps->nomem = 1;
+	ps->failed = 1;
+
+	return(NULL);
+}
+
+/**
+ * Create a tree node.
+ **/
+static struct expr *
+mk(struct parser *ps, enum kind kind)
+{
+	struct expr *e = NULL;
+	struct expr **nodes = NULL;
+
+	if (ps->nnodes % 64 == 0) {
+		if ((nodes = realloc(ps->nodes, (ps->nnodes + 64) *
+				     sizeof(struct expr *))) == NULL) {
+			return(nomem(ps));
+		}
+		ps->nodes = nodes;
+	}
+	if ((e = calloc(1, sizeof(struct expr))) == NULL) {
+		return(nomem(ps));
+	}
+	ps->nodes[ps->nnodes++] = e;
+	e->kind = kind;
+
+	return(e);
+}
+
+/**
+ * Create a negation, folding constants.
+ **/
+static struct expr *
+mk_not(struct parser *ps, struct expr *l)
+{
+	struct expr *e = NULL;
+
+	if (l->kind == E_NOT) {
+		return(l->l);
+	}
+	if ((e = mk(ps, l->kind == E_CONST ? E_CONST : E_NOT)) == NULL) {
+		return(NULL);
+	}
+	e->value = !l->value;
+	e->l = l;
+
+	return(e);
+}
+
+/**
+ * Create a conjunction or disjunction, folding constants.
+ *
+ * Tests have no side effects, so one decided by a constant is dropped.
+ **/
+static struct expr *
+mk_bin(struct parser *ps, enum kind kind, struct expr *l, struct expr *r)
+{
+	struct expr *e = NULL;
+	int absorb = kind == E_OR;
+
+	if (l->kind == E_CONST) {
+		return(l->value == absorb ? l : r);
+	}
+	if (r->kind == E_CONST) {
+		return(r->value == absorb ? r : l);
+	}
+	if ((e = mk(ps, kind)) == NULL) {
+		return(NULL);
+	}
+	e->l = l;
+	e->r = r;
+
+	return(e);
+}
+
+/**
+ * or := and { ("or" | "||") and }
+ **/
+static struct expr *
+parse_or(struct parser *ps)
+{
+	struct expr *l = NULL;
+	struct expr *r = NULL;
+
+	if ((l = parse_and(ps)) == NULL) {
+		return(NULL);
+	}
+	while (is(ps, "or") || ps->type == T_OR) {
+		next(ps);
+		if ((r = parse_and(ps)) == NULL) {
+			return(NULL);
+		}
+		if ((l = mk_bin(ps, E_OR, l, r)) == NULL) {
+			return(NULL);
+		}
+	}
+
+	return(l);
+}
+
+/**
+ * and := unary { ("and" | "&&") unary }
+ **/
+static struct expr *
+parse_and(struct parser *ps)
+{
+	struct expr *l = NULL;
+	struct expr *r = NULL;
+
+	if ((l = parse_unary(ps)) == NULL) {
+		return(NULL);
+	}
+	while (is(ps, "and") || ps->type == T_AND) {
+		next(ps);
+		if ((r = parse_unary(ps)) == NULL) {
+			return(NULL);
+		}
+		if ((l = mk_bin(ps, E_AND, l, r)) == NULL) {
+			return(NULL);
+		}
+	}
+
+	return(l);
+}
+
+/**
+ * unary := ("not" | "!") unary | primary
+ **/
+static struct expr *
+parse_unary(struct parser *ps)
+{
+	struct expr *l = NULL;
+
+	if (is(ps, "not") || ps->type == T_NOT) {
+		next(ps);
+		if ((l = parse_unary(ps)) == NULL) {
+			return(NULL);
+		}
+		return(mk_not(ps, l));
+	}
+
+	return(parse_primary(ps));
+}
+
+/**
+ * primary := "(" or ")" | "true" | "false" | "file" | "dir" | "link"
+ *          | ("name" | "path") match | "under" string
+ *          | operand relation operand | operand "in" set
+ **/
+static struct expr *
+parse_primary(struct parser *ps)
+{
+	int a = F_NFIELD;
+	int b = F_NFIELD;
+	int rel = 0;
+	int64_t x = 0;
+	int64_t y = 0;
+	struct expr *e = NULL;
+	static const int flip[] = { R_GT, R_GE, R_LT, R_LE, R_EQ, R_NE };
+
+	if (ps->type == T_LP) {
+		next(ps);
+		if ((e = parse_or(ps)) == NULL) {
+			return(NULL);
+		}
+		if (ps->type != T_RP) {
+			fail(ps, _("expected )"));
+			return(NULL);
+		}
+		next(ps);
+		return(e);
+	}
+	if (is(ps, "true") || is(ps, "false")) {
+		if ((e = mk(ps, E_CONST)) == NULL) {
+			return(NULL);
+		}
+		e->value = is(ps, "true");
+		next(ps);
+		return(e);
+	}
+	if (is(ps, "file") || is(ps, "dir") || is(ps, "link")) {
+		if ((e = mk(ps, E_TEST)) == NULL) {
+			return(NULL);
+		}
+		e->test.op = OP_TYPE;
+		e->test.imm = is(ps, "file") ? S_IFREG :
+			is(ps, "dir") ? S_IFDIR : S_IFLNK;
+		next(ps);
+		return(e);
+	}
+	if (is(ps, "name") || is(ps, "path")) {
+		return(parse_match(ps, is(ps, "name") ? OP_NAME : OP_PATH));
+	}
+	if (is(ps, "under")) {
+		return(parse_match(ps, -1));
+	}
+
+	if (!operand(ps, &a, &x)) {
+		return(NULL);
+	}
+	if (is(ps, "in")) {
+		if (a == F_NFIELD) {
+			fail(ps, _("expected a field before in"));
+			return(NULL);
+		}
+		return(parse_set(ps, a));
+	}
+	if (ps->type != T_REL) {
+		fail(ps, _("expected a comparison"));
+		return(NULL);
+	}
+	rel = ps->rel;
+	next(ps);
+	if (!operand(ps, &b, &y)) {
+		return(NULL);
+	}
+
+	/* Keep a field on the left, or decide now without one */
+	if (a == F_NFIELD && b == F_NFIELD) {
+		if ((e = mk(ps, E_CONST)) == NULL) {
+			return(NULL);
+		}
+		e->value = relate(x, rel, y);
+		return(e);
+	}
+	if ((e = mk(ps, E_TEST)) == NULL) {
+		return(NULL);
+	}
+	if (a == F_NFIELD) {
+		a = b, b = F_NFIELD, y = x, rel = flip[rel];
+	}
+	e->test.op = b == F_NFIELD ? OP_CMP : OP_CMPF;
+	e->test.rel = rel;
+	e->test.a = a;
+	e->test.b = b;
+	e->test.imm = y;
+
+	return(e);
+}
+
+/**
+ * Parse the pattern of a name, a path or "under".
+ *
+ * \param[in] ps  The parser.
+ * \param[in] op  OP_NAME, OP_PATH or -1 for "under".
+ **/
+static struct expr *
+parse_match(struct parser *ps, int op)
+{
+	int neg = 0;
+	int glob = 1;
+	size_t len = 0;
+	char *p = NULL;
+	char *pat = NULL;
+	struct expr *e = NULL;
+
+	next(ps);
+	if (op >= 0) {
+		if (ps->type == T_REL && (ps->rel == R_EQ || ps->rel == R_NE)) {
+			neg = ps->rel == R_NE;
+			glob = 0;
+		} else if (ps->type == T_MATCH || ps->type == T_NMATCH) {
+			neg = ps->type == T_NMATCH;
+		} else {
+			fail(ps, _("expected ~, !~, == or !="));
+			return(NULL);
+		}
+		next(ps);
+	}
+	if ((pat = string(ps)) == NULL) {
+		return(NULL);
+	}
+
+	/* Below a directory is a path matching it followed by more */
+	if (op < 0) {
+		len = strlen(pat);
+		while (len > 1 && pat[len - 1] == '/') {
+			--len;
+		}
+		if ((p = realloc(pat, len + 3)) == NULL) {
+			free(pat);
+			return(nomem(ps));
+		}
+		pat = p;
+		memcpy(pat + len, "/*", 3);
+		op = OP_PATH;
+	}
+	if (own(ps, pat) == NULL) {
+		free(pat);
+		return(NULL);
+	}
+
+	if ((e = mk(ps, E_TEST)) == NULL) {
+		return(NULL);
+	}
+	e->test.op = op;
+	e->test.b = G_EXACT;
+	e->test.imm = strlen(pat);
+	e->test.p = pat;
+	if (glob) {
+		pattern(&e->test, pat);
+	}
+
+	/* "*" matches every name */
+	if (e->test.b == G_INNER && e->test.imm == 0) {
+		e->kind = E_CONST;
+		e->value = 1;
+	}
+
+	return(neg ? mk_not(ps, e) : e);
+}
+
+/**
+ * set := "{" member { "," member } "}"
+ *
+ * A member is a number or, of uid and gid, a user or group name.
+ **/
+static struct expr *
+parse_set(struct parser *ps, int field)
+{
+	size_t i = 0;
+	size_t n = 0;
+	size_t k = 0;
+	int q = 0;
+	int64_t x = 0;
+	int64_t *p = NULL;
+	int64_t *set = NULL;
+	char *s = NULL;
+	struct passwd *pw = NULL;
+	struct group *gr = NULL;
+	struct expr *e = NULL;
+
+	next(ps);
+	if (ps->type != T_LB) {
+		fail(ps, _("expected {"));
+		return(NULL);
+	}
+	do {
+		next(ps);
+		if ((field == F_UID || field == F_GID) &&
+		    (ps->type == T_IDENT || ps->type == T_STR)) {
+			q = ps->type == T_STR;
+			if (q && (ps->len < 2 ||
+				  ps->tok[ps->len - 1] != ps->tok[0])) {
+				fail(ps, _("expected a quoted string"));
+				free(set);
+				return(NULL);
+			}
+			if ((s = strndup(ps->tok + q,
+					 ps->len - 2 * q)) == NULL) {
+				free(set);
+				return(nomem(ps));
+			}
+			pw = field == F_UID ? getpwnam(s) : NULL;
+			gr = field == F_GID ? getgrnam(s) : NULL;
+			free(s);
+			if (pw == NULL && gr == NULL) {
+				fail(ps, field == F_UID ? _("unknown user") :
+				     _("unknown group"));
+				free(set);
+				return(NULL);
+			}
+			x = pw != NULL ? (int64_t)pw->pw_uid :
+				(int64_t)gr->gr_gid;
+			next(ps);
+		} else if (!number(ps, &x)) {
+			free(set);
+			return(NULL);
+		}
+		if (n % 16 == 0) {
+			if ((p = realloc(set, (n + 16) *
+					 sizeof(int64_t))) == NULL) {
+				free(set);
+				return(nomem(ps));
+			}
+			set = p;
+		}
+		set[n++] = x;
+	} while (ps->type == T_COMMA);
+	if (own(ps, set) == NULL) {
+		free(set);
+		return(NULL);
+	}
+	if (ps->type != T_RB) {
+		fail(ps, _("expected , or }"));
+		return(NULL);
+	}
+	next(ps);
+
+	/* Sorted without repeats for a binary search */
+	qsort(set, n, sizeof(int64_t), i64cmp);
+	for (i = 1, k = 1; i < n; ++i) {
+		if (set[i] != set[k - 1]) {
+			set[k++] = set[i];
+		}
+	}
+
+	if ((e = mk(ps, E_TEST)) == NULL) {
+		return(NULL);
+	}
+	e->test.op = OP_IN;
+	e->test.a = field;
+	e->test.imm = k;
+	e->test.p = set;
+
+	return(e);
+}
+
+/**
+ * operand := field | number
+ *
+ * \param[in]  ps     The parser.
+ * \param[out] field  The field, or F_NFIELD for a number.
+ * \param[out] x      The number.
+ *
+ * \retval 1 If an operand was read.
+ * \retval 0 If not, the error is reported.
+ **/
+static int
+operand(struct parser *ps, int *field, int64_t *x)
+{
+	int i = 0;
+
+	if (ps->type == T_NUM) {
+		*field = F_NFIELD;
+		return(number(ps, x));
+	}
+	for (i = 0; i < F_NFIELD; ++i) {
+		if (is(ps, fields[i])) {
+			*field = i;
+			next(ps);
+			return(1);
+		}
+	}
+
+	return(fail(ps, ps->type == T_IDENT ? _("unknown field %.*s") :
+		    _("expected a field or a number"), (int)ps->len, ps->tok));
+}
+
+/**
+ * number := digits [ "." digits ] [ unit ]
+ *
+ * \retval 1 If a number was read.
+ * \retval 0 If not, the error is reported.
+ **/
+static int
+number(struct parser *ps, int64_t *x)
+{
+	size_t i = 0;
+	size_t len = ps->len;
+	int real = 0;
+	double d = 0.0;
+	double v = 0.0;
+	char *end = NULL;
+	const char *tok = ps->tok;
+
+	if (ps->type != T_NUM) {
+		return(fail(ps, _("expected a number")));
+	}
+	errno = 0;
+	d = strtod(tok, &end);
+	if (end != tok + len || errno == ERANGE) {
+		return(fail(ps, _("invalid number %.*s"), (int)len, tok));
+	}
+	v = d;
+	real = memchr(tok, '.', len) != NULL;
+	if (!real) {
+		*x = strtoll(tok, NULL, 10);
+		if (errno == ERANGE) {
+			return(fail(ps, _("invalid number %.*s"), (int)len, tok));
+		}
+	}
+	next(ps);
+
+	for (i = 0; ps->type == T_IDENT && i < sizeof(units) / sizeof(units[0]);
+	     ++i) {
+		if (is(ps, units[i].name)) {
+			v = d * (double)units[i].scale;
+			real = 1;
+			next(ps);
+			break;
+		}
+	}
+
+	/* A number that does not fit would wrap around and match anything */
+	if (v >= 9223372036854775808.0 || v <= -9223372036854775808.0) {
+		ps->tok = tok;
+		return(fail(ps, _("invalid number %.*s"), (int)len, tok));
+	}
+	if (real) {
+		*x = (int64_t)v;
+	}
+
+	return(1);
+}
+
+/**
+ * string := '"' chars '"' | "'" chars "'"
+ *
+ * \retval s     The string, to be freed.
+ * \retval NULL  If there is none, the error is reported, or if there
+ *               was no memory.
+ **/
+static char *
+string(struct parser *ps)
+{
+	char *s = NULL;
+
+	if (ps->type != T_STR || ps->len < 2 ||
+	    ps->tok[ps->len - 1] != ps->tok[0]) {
+		fail(ps, _("expected a quoted string"));
+		return(NULL);
+	}
+	if ((s = strndup(ps->tok + 1, ps->len - 2)) == NULL) {
+		return(nomem(ps));
+	}
+	next(ps);
+
+	return(s);
+}
+
+/**
+ * Find how to match a pattern, keeping only its literal part.
+ **/
+static void
+pattern(struct insn *i, char *pat)
+{
+	size_t len = strlen(pat);
+	size_t lead = 0;
+	size_t trail = 0;
+
+	i->b = G_FNMATCH;
+	if (strpbrk(pat, "?[\\") != NULL) {
+		return;
+	}
+	while (lead < len && pat[lead] == '*') {
+		++lead;
+	}
+	while (trail < len - lead && pat[len - 1 - trail] == '*') {
+		++trail;
+	}
+	if (memchr(pat + lead, '*', len - lead - trail) != NULL) {
+		return;
+	}
+
+	i->b = lead > 0 && trail > 0 ? G_INNER : lead > 0 ? G_SUFFIX :
+		trail > 0 ? G_PREFIX : G_EXACT;
+	if (lead == len) {
+		i->b = G_INNER;
+	}
+	memmove(pat, pat + lead, len - lead - trail);
+	pat[len - lead - trail] = '\0';
+	i->imm = len - lead - trail;
+}
+
+/**
+ * Keep an allocation for as long as the program.
+ *
+ * \retval p     The allocation.
+ * \retval NULL  If there was no memory, it is not kept.
+ **/
+static void *
+own(struct parser *ps, void *p)
+{
+	struct where *w = ps->w;
+	void **own = NULL;
+
+	if (w->nown % 16 == 0) {
+		if ((own = realloc(w->own, (w->nown + 16) *
+				   sizeof(void *))) == NULL) {
+			return(nomem(ps));
+		}
+		w->own = own;
+	}
+	w->own[w->nown++] = p;
+
+	return(p);
+}
+
+/**
+ * Lay out a tree as instructions.
+ *
+ * \param[in,out] ps  The parser, with the program.
+ * \param[in]     e   The tree.
+ * \param[in]     t   Where to go when the tree holds.
+ * \param[in]     f   Where to go when it does not.
+ *
+ * \retval pc  The first instruction of the tree, or its result. If
+ *             there was no memory the program is left short.
+ **/
+static int32_t
+emit(struct parser *ps, const struct expr *e, int32_t t, int32_t f)
+{
+	struct where *w = ps->w;
+	struct insn *code = NULL;
+
+	switch (e->kind) {
+		case E_CONST:
+			return(e->value ? t : f);
+		case E_NOT:
+			return(emit(ps, e->l, f, t));
+		case E_AND:
+			return(emit(ps, e->l, emit(ps, e->r, t, f), f));
+		case E_OR:
+			return(emit(ps, e->l, t, emit(ps, e->r, t, f)));
+		case E_TEST:
+			break;
+	}
+
+	if (w->n % 16 == 0) {
+		if ((code = realloc(w->code, (w->n + 16) *
+				    sizeof(struct insn))) == NULL) {
+			nomem(ps);
+			return(f);
+		}
+		w->code = code;
+	}
+	w->code[w->n] = e->test;
+	w->code[w->n].t = t;
+	w->code[w->n].f = f;
+
+	return(w->n++);
+}
+
+/**
+ * Compare two numbers.
+ **/
+static int
+i64cmp(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+
+	return((x > y) - (x < y));
+}
+
+/**
+ * \}
+ **/